@@ -8,6 +8,7 @@
 #include "mymath.h"
 #include "tutorials.h"
 #include "texture.h"
+#include "uploadring.h"
 
 using namespace std;
 
@@ -34,7 +35,7 @@ int Rasterizer::InitDevice()
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-	glfwWindowHint(GLFW_SAMPLES, 8);
+	glfwWindowHint(GLFW_SAMPLES, 0); // the anti-aliasing is done in the HDR target of PostProcess, the window gets only the tone mapped result
 	glfwWindowHint(GLFW_RESIZABLE, GL_TRUE);
 	glfwWindowHint(GLFW_DOUBLEBUFFER, GL_TRUE);
 
@@ -67,33 +68,51 @@ int Rasterizer::InitDevice()
 	check_gl(glad_glGetError());
 
 	glEnable(GL_MULTISAMPLE);
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS); // filter across cube map face edges, mostly visible on the blurry env map levels
 
 	// map from the range of NDC coordinates <-1.0, 1.0>^2 to <0, width> x <0, height>
 	glViewport(0, 0, width_, height_);
 	// GL_LOWER_LEFT (OpenGL) or GL_UPPER_LEFT (DirectX, Windows) and GL_NEGATIVE_ONE_TO_ONE or GL_ZERO_TO_ONE
 	glClipControl(GL_LOWER_LEFT, GL_NEGATIVE_ONE_TO_ONE);
 
+	//staging memory for all texture uploads, decoding threads write directly into it
+	upload_ring_ = new UploadRing(upload_ring_size_);
+
 	return S_OK;
 }
 
 //2. load obj and scene
 int Rasterizer::LoadSceneAndObject(const char* fileName) {
-	const int surfaces_count = LoadOBJ(fileName, surfaces_, materials_);
-	no_triangles_ = 0;
+	LoadOBJ(fileName, surfaces_, materials_);
+	if (ao_settings_.no_rays > 0) {
+		BakeVertexAO(surfaces_, ao_settings_);
+	}
+
+	int no_triangles = 0;
+	Vertex * vertices = BuildVertices(surfaces_, no_triangles);
+	no_triangles_ = no_triangles;
+
+	UploadScene(vertices);
+
+	delete[] vertices;
+	return S_OK;
+}
+
+//flattens all surfaces into one triangle soup, no GL calls so it can run on a worker thread
+Vertex * Rasterizer::BuildVertices(std::vector<Surface *> & surfaces, int & no_triangles) {
+	no_triangles = 0;
 
-	for (Surface* surface : surfaces_)
+	for (Surface* surface : surfaces)
 	{
-		no_triangles_ += surface->no_triangles();
+		no_triangles += surface->no_triangles();
 	}
 
 	//Inicializase bufferů
-	const int numOfVertices = no_triangles_ * 3;
+	const int numOfVertices = no_triangles * 3;
 	Vertex* vertices = new Vertex[numOfVertices];
 
-	const int vertex_stride = sizeof(Vertex);
-
 	int k = 0;
-	for (Surface* surface : surfaces_)
+	for (Surface* surface : surfaces)
 	{
 		for (int i = 0; i < surface->no_triangles(); i++)
 		{
@@ -102,13 +121,19 @@ int Rasterizer::LoadSceneAndObject(const char* fileName) {
 			{
 				Vertex v = triangle.vertex(j);
 				v.material_index = surface->get_material()->materialIndex;
-				Material * tmp = surface->get_material();
 				vertices[k] = v;
 				k++;
 			}
 		}
 	}
 
+	return vertices;
+}
+
+void Rasterizer::UploadScene(Vertex * vertices) {
+	const int numOfVertices = no_triangles_ * 3;
+	const int vertex_stride = sizeof(Vertex);
+
 	glGenVertexArrays(1, &vao_);
 	glBindVertexArray(vao_);
 
@@ -135,8 +160,47 @@ int Rasterizer::LoadSceneAndObject(const char* fileName) {
 	glVertexAttribIPointer(5, 1, GL_INT, vertex_stride, (void*)(offsetof(Vertex, material_index)));
 	glEnableVertexAttribArray(5);
 
-	delete[] vertices;
-	return S_OK;
+	glBindVertexArray(0);
+
+	//the vertex colors hold the bent normals, pbr.vert passes them on instead of the plain normals
+	if ((ao_settings_.no_rays > 0) && !obtainMVN) {
+		glUseProgram(shader_program_);
+		SetInt(shader_program_, 1, "ao_baked");
+	}
+
+	//the shadow cascades are fitted to the scene bounds, the material textures are streamed in once their geometry is visible
+	scene_bounds_ = AABB();
+	material_bounds_.clear();
+	for (int i = 0; i < numOfVertices; i++) {
+		scene_bounds_.Merge(vertices[i].position);
+
+		const int m = vertices[i].material_index;
+		if (m >= int(material_bounds_.size())) material_bounds_.resize(m + 1);
+		material_bounds_[m].Merge(vertices[i].position);
+	}
+
+	//BuildVertices stores the surfaces one after another
+	draw_ranges_.clear();
+	GLint first = 0;
+	for (Surface * surface : surfaces_) {
+		DrawRange range{ first, surface->no_triangles() * 3, AABB() };
+		for (int i = first; i < first + range.count; i++) {
+			range.bounds.Merge(vertices[i].position);
+		}
+		if (range.count > 0) {
+			draw_ranges_.push_back(range);
+		}
+		first += range.count;
+	}
+
+	//new geometry, none of the cached shadow maps is valid
+	InvalidateShadowMaps();
+}
+
+void Rasterizer::InvalidateShadowMaps() {
+	for (int i = 0; i < MAX_SHADOW_CASCADES; i++) {
+		shadow_cache_valid_[i] = false;
+	}
 }
 
 //3. shaders
@@ -145,175 +209,369 @@ void Rasterizer::InitBuffers(std::string shader) {
 		obtainMVN = true;
 	else obtainMVN = false;
 
-	//vertex shader
-	GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-	const char * vertex_shader_source = LoadShader((shader + ".vert").c_str());
-	glShaderSource(vertex_shader, 1, &vertex_shader_source, nullptr);
-	glCompileShader(vertex_shader);
-	SAFE_DELETE_ARRAY(vertex_shader_source);
-	CheckShader(vertex_shader);
-
-	GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-	const char * fragment_shader_source = LoadShader((shader + ".frag").c_str());
-	glShaderSource(fragment_shader, 1, &fragment_shader_source, nullptr);
-	glCompileShader(fragment_shader);
-	SAFE_DELETE_ARRAY(fragment_shader_source);
-	CheckShader(fragment_shader);
-
-	shader_program_ = glCreateProgram();
-	glAttachShader(shader_program_, vertex_shader);
-	glAttachShader(shader_program_, fragment_shader);
-	glLinkProgram(shader_program_);
+	deferred_ = (shader == "deferred");
+	if (deferred_) {
+		//geometry pass into the G-buffer with the forward vertex shader, lighting in a single fullscreen pass
+		shader_program_ = CreateProgram({ CompileShader(GL_VERTEX_SHADER, "pbr.vert"), CompileShader(GL_FRAGMENT_SHADER, "gbuffer.frag") });
+		lighting_program_ = CreateProgram({ CompileShader(GL_VERTEX_SHADER, "deferred.vert"), CompileShader(GL_FRAGMENT_SHADER, "deferred.frag") });
+		InitGBuffer();
+	}
+	else {
+		shader_program_ = CreateProgram({ CompileShader(GL_VERTEX_SHADER, (shader + ".vert").c_str()),
+			CompileShader(GL_FRAGMENT_SHADER, (shader + ".frag").c_str()) });
+	}
 	glUseProgram(shader_program_);
 
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LESS);
+
+	//light list and its clusters
+	if (shader == "pbr" || shader == "pbr_shadow" || deferred_) {
+		clustered_lights_ = new ClusteredLights();
+		clustered_lights_->Init();
+	}
 }
 
-//4. materials
-int Rasterizer::InitMaterials() {
-#pragma pack( push, 1 ) // 1 B alignment
-	struct GLMaterial
-	{
-		Color3f diffuse; // 3 * 4 B
-		GLbyte pad0[4]; // + 4 B = 16 B
-		GLuint64 tex_diffuse_handle{ 0 }; // 1 * 8 B
-		GLbyte pad1[8]; // + 8 B = 16 B
-		Color3f rma; // 3 * 4 B
-		GLbyte pad2[4]; // + 4 B = 16 B
-		GLuint64 tex_rma_handle{ 0 }; // 1 * 8 B
-		GLbyte pad3[8]; // + 8 B = 16 B
-		Color3f normal; // 3 * 4 B
-		GLbyte pad4[4]; // + 4 B = 16 B
-		GLuint64 tex_normal_handle{ 0 }; // 1 * 8 B
-		GLbyte pad5[8]; // + 8 B = 16 B
-	};
-#pragma pack( pop )
-
-	GLMaterial * gl_materials = new GLMaterial[materials_.size()];
-
-	int m = 0;
-	for (const auto & material : materials_) {
-
-		Texture3u * tex_diffuse = material->texture(Material::kDiffuseMapSlot);
-		if (tex_diffuse) {
-			GLuint id = 0;
-			CreateBindlessTexture(id, gl_materials[m].tex_diffuse_handle, tex_diffuse->width(), tex_diffuse->height(), tex_diffuse->data());
-			Color3f color = Color3f({ 1, 1, 1 }); //barva pod texturami
-			gl_materials[m].diffuse = material->diffuse_; // white diffuse color
-		}
-		else {
-			GLuint id = 0;
-			GLubyte data[] = { 255, 255, 255, 255 };
-			CreateBindlessTexture(id, gl_materials[m].tex_diffuse_handle, 1, 1, data); // white texture
-			gl_materials[m].diffuse = material->diffuse_;
-		}
+//G-buffer of the deferred path, 16 B per pixel
+void Rasterizer::InitGBuffer() {
+	//octahedral view space normal, albedo, roughness, metalness and IOR, depth
+	const GLenum formats[4] = { GL_RG16_SNORM, GL_RGBA8, GL_RGBA8, GL_DEPTH_COMPONENT32F };
+
+	glGenTextures(4, tex_gbuffer_);
+	for (int i = 0; i < 4; i++) {
+		glBindTexture(GL_TEXTURE_2D, tex_gbuffer_[i]);
+		glTexStorage2D(GL_TEXTURE_2D, 1, formats[i], width_, height_);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &fbo_gbuffer_);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo_gbuffer_);
+	const GLenum draw_buffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+	for (int i = 0; i < 3; i++) {
+		glFramebufferTexture(GL_FRAMEBUFFER, draw_buffers[i], tex_gbuffer_[i], 0);
+	}
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, tex_gbuffer_[3], 0);
+	glDrawBuffers(3, draw_buffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("G-buffer is not complete.\n");
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-		//Přidat vlastnosti - ior, roughness, metalicness
-		gl_materials[m].rma = Color3f({ material->roughness_, material->metallicness, material->ior });
+	//the fullscreen triangle is generated from gl_VertexID, but core profile still needs a VAO bound
+	glGenVertexArrays(1, &vao_fullscreen_);
+}
 
-		//bump mapa
-		Texture3u * tex_normal = material->texture(Material::kNormalMapSlot);
-		if (tex_normal) {
-			GLuint id = 0;
-			CreateBindlessTexture(id, gl_materials[m].tex_normal_handle, tex_normal->width(), tex_normal->height(), tex_normal->data());
-		}
+void Rasterizer::SetAntiAliasing(const int msaa_samples) {
+	msaa_samples_ = std::max(msaa_samples, 1);
+}
 
-		//Texture3u * rma = material->texture(Material::kRMAMapSlot);
-		//if (rma) {
-		//	GLuint id = 0;
-		//	CreateBindlessTexture(id, gl_materials[m].tex_rma_handle, rma->width(), rma->height(), rma->data());
-		//}
-		//else {
-		//	GLuint id = 0;
-		//	GLubyte data[] = { 255, 255, 255, 255 };
-		//	CreateBindlessTexture(id, gl_materials[m].tex_rma_handle, 1, 1, data); // white texture
-		//}
+void Rasterizer::SetFrameBudget(const float budget_ms) {
+	frame_budget_ = budget_ms;
+}
 
-		m++;
-	}
+void Rasterizer::SetTextureBudget(const GLsizeiptr bytes) {
+	vram_budget_ = bytes;
+}
+
+void Rasterizer::SetAmbientOcclusion(const int no_rays) {
+	ao_settings_.no_rays = std::max(no_rays, 0);
+}
+
+void Rasterizer::SetExposure(const float exposure) {
+	exposure_ = exposure;
+	if (post_) post_->SetExposure(exposure_);
+}
 
-	GLuint ssbo_materials = 0;
-	glGenBuffers(1, &ssbo_materials);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_materials);
-	const GLsizeiptr gl_materials_size = sizeof(GLMaterial) * materials_.size();
-	glBufferData(GL_SHADER_STORAGE_BUFFER, gl_materials_size, gl_materials, GL_STATIC_DRAW);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ssbo_materials);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+void Rasterizer::AddPointLights(const int count, const float relative_radius) {
+	if (!clustered_lights_) {
+		printf("Point lights need the pbr, pbr_shadow or deferred shader, %d lights ignored.\n", count);
+		return;
+	}
+	no_pending_lights_ += count;
+	pending_lights_radius_ = relative_radius;
+}
 
-	SAFE_DELETE_ARRAY(gl_materials);
+//4. materials
+int Rasterizer::InitMaterials() {
+	//only the shared default textures are created here, the material textures are streamed in by RenderFrame once visible
+	material_table_ = new MaterialTable(vram_budget_, upload_ring_);
+	material_table_->Init(materials_, compressed_textures_, compress_textures_);
+	compressed_textures_.clear(); // the table keeps the blocks it needs
 
 	return S_OK;
 }
 
+void Rasterizer::CompressMaterialTextures(const std::vector<Material *> & materials, CompressedTextures & compressed) {
+	for (const auto & material : materials) {
+		const std::pair<char, TextureUsage> slots[] = {
+			{ Material::kDiffuseMapSlot, TextureUsage::kAlbedo },
+			{ Material::kNormalMapSlot, TextureUsage::kNormal },
+			{ Material::kRoughnessMapSlot, TextureUsage::kScalar } };
+
+		for (const auto & slot : slots) {
+			Texture3u * texture = material->texture(slot.first);
+			if (texture && (compressed.find(texture) == compressed.end())) {
+				compressed[texture] = std::make_shared<CompressedImage>(CompressTexture(*texture, slot.second));
+			}
+		}
+	}
+}
 
+//the irradiance map is projected onto 9 SH coefficients, the shaders evaluate them instead of sampling a texture
 void Rasterizer::InitIrradianceMap(const char * path) {
-	Texture3f* bitmap = new Texture3f(path);
+	Texture3f irradiance(path);
+	UploadIrradianceSH(ProjectSH9(irradiance));
+}
 
-	glGenTextures(1, &irradianceMap);
-	glBindTexture(GL_TEXTURE_2D, irradianceMap);
+void Rasterizer::UploadIrradianceSH(const SphericalHarmonics9 & sh) {
+	//std140 - every coefficient takes a whole vec4
+	GLfloat data[9][4] = { { 0 } };
+	for (int i = 0; i < 9; i++) {
+		for (int c = 0; c < 3; c++) {
+			data[i][c] = sh.coefficients[i].data[c];
+		}
+	}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, bitmap->width(), bitmap->height(), 0, GL_RGB, GL_FLOAT, bitmap->data());
+	if (!ubo_irradiance_sh_) {
+		glGenBuffers(1, &ubo_irradiance_sh_);
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_irradiance_sh_);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(data), data, GL_STATIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 1, ubo_irradiance_sh_);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
 
-	genMipMap();
+//std140 layout of the ShadowCascades block in pbr_shadow.frag (matrices are row_major there)
+struct ShadowCascadesBlock {
+	GLfloat mlp[MAX_SHADOW_CASCADES][16];
+	GLfloat splits[MAX_SHADOW_CASCADES];
+	GLint count;
+	GLint pad[3];
+};
+
+void Rasterizer::UpdateShadowCascades(const Matrix4x4 & model) {
+	//cascades are fitted in world space, the light is treated as directional (towards the scene center)
+	const AABB bounds = scene_bounds_.Transformed(model);
+	no_active_cascades_ = BuildShadowCascades(camera_.viewMatrix, camera_.fov_y(), camera_.aspect_ratio(),
+		camera_.z_near_, camera_.z_far_, light_position - bounds.center(), bounds,
+		no_shadow_cascades_, shadow_width_, shadow_cascades_, shadow_split_lambda_);
+
+	//the shaders work with model space positions
+	ShadowCascadesBlock data = {};
+	for (int i = 0; i < no_active_cascades_; i++) {
+		Matrix4x4 mlp = shadow_cascades_[i].light_projection * model;
+		memcpy(data.mlp[i], mlp.data(), sizeof(data.mlp[i]));
+		data.splits[i] = shadow_cascades_[i].split_far;
+	}
+	data.count = no_active_cascades_;
+
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_shadow_cascades_);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(data), &data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 void Rasterizer::InitEnvMaps(std::vector<const char*> paths) {
 
 	glGenTextures(1, &envMap);
-	glBindTexture(GL_TEXTURE_2D, envMap);
+	envMap_levels = int(paths.size());
+	envMap_levels_uploaded = 0;
 
 	int roughness = 0;
 	for (auto path : paths) {
-		Texture3f* bitmap = new Texture3f(path);
-		glTexImage2D(GL_TEXTURE_2D, roughness, GL_RGB32F, bitmap->width(), bitmap->height(), 0, GL_RGB, GL_FLOAT, bitmap->data());
+		UploadEnvMap(*DecodeStagedCube(*upload_ring_, path, env_packing_), roughness);
+		upload_ring_->Retire();
 		roughness++;
 	}
-	genMipMap();
-	SetInt(shader_program_, roughness, "envMap_roughness");
+}
+
+//uploads one roughness level as the mip level of the same index, the prefiltered levels are never regenerated
+void Rasterizer::UploadEnvMap(StagedImage & bitmap, const int level) {
+	GLenum internal_format, format, type;
+	FloatPackingFormat(bitmap.packing, internal_format, format, type);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, envMap);
+
+	if (envMap_levels_uploaded == 0) {
+		//the levels may arrive in any order, the first one determines the size of the whole chain
+		envMap_size = bitmap.width << level;
+		glTexStorage2D(GL_TEXTURE_CUBE_MAP, envMap_levels, internal_format, envMap_size, envMap_size);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	}
+
+	if (bitmap.width == std::max(1, envMap_size >> level)) {
+		bitmap.Upload(*upload_ring_, GL_TEXTURE_CUBE_MAP, level, format, type);
+	}
+	else {
+		printf("Env map level %d has %d px instead of %d px, skipped.\n", level, bitmap.width, std::max(1, envMap_size >> level));
+		upload_ring_->Cancel(bitmap.staging);
+	}
+
+	if (++envMap_levels_uploaded == envMap_levels && !deferred_) { // the lighting pass sets it every frame
+		SetInt(shader_program_, envMap_levels - 1, "envMap_max_lod");
+	}
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
 }
 
 void Rasterizer::InitGGXIntegrMap(const char * path) {
-	Texture3f* bitmap = new Texture3f(path);
+	UploadGGXIntegrMap(*DecodeStaged(*upload_ring_, path, brdf_packing_));
+}
 
+void Rasterizer::UploadGGXIntegrMap(StagedImage & bitmap) {
 	glGenTextures(1, &brdfMap);
 	glBindTexture(GL_TEXTURE_2D, brdfMap);
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, bitmap->width(), bitmap->height(), 0, GL_RGB, GL_FLOAT, bitmap->data());
+	GLenum internal_format, format, type;
+	FloatPackingFormat(bitmap.packing, internal_format, format, type);
+	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, bitmap.width, bitmap.height, 0, format, type, nullptr);
+	bitmap.Upload(*upload_ring_, GL_TEXTURE_2D, 0, format, type);
 
 	genMipMap();
 }
 
+AssetLoader * Rasterizer::Loader() {
+	if (!loader_) {
+		loader_ = new AssetLoader();
+		load_start_ = glfwGetTime();
+	}
+	return loader_;
+}
+
+void Rasterizer::LoadSceneAndObjectAsync(const char * fileName) {
+	std::string file_name = fileName;
+
+	Loader()->Submit([this, file_name] {
+		// worker thread: parse OBJ + MTL, decode material textures and flatten the triangles
+		auto surfaces = std::make_shared<std::vector<Surface *>>();
+		auto materials = std::make_shared<std::vector<Material *>>();
+		LoadOBJ(file_name.c_str(), *surfaces, *materials);
+
+		if (ao_settings_.no_rays > 0) {
+			BakeVertexAO(*surfaces, ao_settings_);
+		}
+
+		int no_triangles = 0;
+		std::shared_ptr<Vertex> vertices(BuildVertices(*surfaces, no_triangles), std::default_delete<Vertex[]>());
+
+		// block compression is by far the slowest part, keep it off the render thread
+		auto compressed = std::make_shared<CompressedTextures>();
+		if (compress_textures_) {
+			CompressMaterialTextures(*materials, *compressed);
+		}
+
+		return AssetLoader::UploadTask([this, surfaces, materials, vertices, no_triangles, compressed] {
+			// GL thread
+			surfaces_ = *surfaces;
+			materials_ = *materials;
+			no_triangles_ = no_triangles;
+			compressed_textures_ = *compressed;
+			UploadScene(vertices.get());
+			InitMaterials();
+		});
+	});
+}
+
+void Rasterizer::InitIrradianceMapAsync(const char * path) {
+	std::string file_name = path;
+
+	Loader()->Submit([this, file_name] {
+		//the projection runs on the worker too, only 9 coefficients are left for the GL thread
+		const SphericalHarmonics9 sh = ProjectSH9(Texture3f(file_name));
+		return AssetLoader::UploadTask([this, sh] { UploadIrradianceSH(sh); });
+	});
+}
+
+void Rasterizer::InitEnvMapsAsync(std::vector<const char*> paths) {
+	glGenTextures(1, &envMap);
+	envMap_levels = int(paths.size());
+	envMap_levels_uploaded = 0;
+
+	//every roughness level is decoded in parallel, the order of uploads does not matter
+	for (int level = 0; level < envMap_levels; level++) {
+		std::string file_name = paths[level];
+
+		Loader()->Submit([this, file_name, level] {
+			std::shared_ptr<StagedImage> bitmap = DecodeStagedCube(*upload_ring_, file_name, env_packing_);
+			return AssetLoader::UploadTask([this, bitmap, level] { UploadEnvMap(*bitmap, level); });
+		});
+	}
+}
+
+void Rasterizer::InitGGXIntegrMapAsync(const char * path) {
+	std::string file_name = path;
+
+	Loader()->Submit([this, file_name] {
+		std::shared_ptr<StagedImage> bitmap = DecodeStaged(*upload_ring_, file_name, brdf_packing_);
+		return AssetLoader::UploadTask([this, bitmap] { UploadGGXIntegrMap(*bitmap); });
+	});
+}
+
 
 //5. renderování frejmu
 //PDF 1 - stránka 79 !!!
 int Rasterizer::RenderFrame(bool rotate, bool includeShadows) {
-	glBindVertexArray(vao_);
 
 	int loc;
-	loc = glGetUniformLocation(shader_program_, "irradianceMap");
-	glUniform1i(loc, 0);
 	loc = glGetUniformLocation(shader_program_, "envMap");
 	glUniform1i(loc, 1);
 	loc = glGetUniformLocation(shader_program_, "brdfMap");
 	glUniform1i(loc, 2);
 
-	glActiveTexture(GL_TEXTURE0 + 0);
-	glBindTexture(GL_TEXTURE_2D, irradianceMap);
-	glActiveTexture(GL_TEXTURE0 + 1);
-	glBindTexture(GL_TEXTURE_2D, envMap);
-	glActiveTexture(GL_TEXTURE0 + 2);
-	glBindTexture(GL_TEXTURE_2D, brdfMap);
-	
-	if (includeShadows) {
-		glActiveTexture(GL_TEXTURE3);
-		glBindTexture(GL_TEXTURE_2D, tex_shadow_map_);
+	if (includeShadows && !deferred_) {
 		SetSampler(shader_program_, 3, "shadow_map");
+		SetSampler(shader_program_, 4, "shadow_moments");
 	}
 	
+	//HDR target and the compute post stack, the G-buffer of the deferred path is never multisampled
+	const bool taa = (msaa_samples_ == 1);
+	post_ = new PostProcess();
+	post_->Init(width_, height_, deferred_ ? 1 : msaa_samples_, taa);
+	post_->SetToneMapping(!obtainMVN); // normal_shader writes colors, not radiance
+	post_->SetExposure(exposure_);
+	camera_.set_jitter(taa);
+
+	//render resolution follows the GPU time of the frames
+	if (frame_budget_ > 0.0f) {
+		dynamic_resolution_ = new DynamicResolution(frame_budget_);
+		dynamic_resolution_->Init();
+	}
+	Matrix4x4 previous_mvp; // without the jitter
+	bool previous_mvp_valid = false;
+
 	float speedOfRotation = deg2rad(45);
+	long long no_frames = 0;
+	double last_frame_time = glfwGetTime();
+	const double start_time = last_frame_time;
 	while (!glfwWindowShouldClose(window_))
 	{
+		//recycle staging memory the GPU has already consumed
+		upload_ring_->Retire();
+
+		//finish assets decoded by the loader threads, the scene is drawn as soon as it arrives
+		if (loader_) {
+			glUseProgram(shader_program_);
+			loader_->Upload(uploads_per_frame_);
+			if (loader_->done()) {
+				printf("\nAll assets loaded in %0.2f s.\n", glfwGetTime() - load_start_);
+				SAFE_DELETE(loader_);
+			}
+		}
+
+		//the maps may be (re)created by the loader, so bind them every frame
+		glActiveTexture(GL_TEXTURE0 + 1);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, envMap);
+		glActiveTexture(GL_TEXTURE0 + 2);
+		glBindTexture(GL_TEXTURE_2D, brdfMap);
+
+		if (includeShadows) {
+			glActiveTexture(GL_TEXTURE3);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, tex_shadow_map_);
+			glActiveTexture(GL_TEXTURE4);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, tex_shadow_moments_);
+		}
 
 		//Poloha modelu v 4x4 matici
 		//PDF 1 - stránka 9
@@ -334,37 +592,99 @@ int Rasterizer::RenderFrame(bool rotate, bool includeShadows) {
 		const GLint viewFrom = glGetUniformLocation(shader_program_, "viewFrom");
 		glUniform3fv(viewFrom, 1, camera_.view_from_.data);
 
+		//the whole frame is timed, the camera renders at the scaled size into the corner of the full size targets
+		if (dynamic_resolution_) {
+			dynamic_resolution_->BeginFrame();
+			camera_.width_ = std::max(1, int(width_ * dynamic_resolution_->scale() + 0.5f));
+			camera_.height_ = std::max(1, int(height_ * dynamic_resolution_->scale() + 0.5f));
+		}
+		post_->SetRenderSize(camera_.width_, camera_.height_);
+
 		//Moving camera and light from user inputs
 		move();
 		camera_.Update();
-
-		Matrix4x4 mlp = camera_.BuildMLPMatrix(light_position);
-		mlp = mlp * model;
+		Pick(model);
 
 		if (includeShadows) {
-			// --- first pass ---
-			// set the shadow shader program and the viewport to match the size of the depth map
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-			// set up the light source through the MLP matrix
-			glUseProgram(shadow_program_);
-			glViewport(0, 0, shadow_width_, shadow_height_);
-			glBindFramebuffer(GL_FRAMEBUFFER, fbo_shadow_map_);
-			glClear(GL_DEPTH_BUFFER_BIT);
-
-			SetMatrix4x4(shadow_program_, mlp.data(), "mlp");
-
-			// draw the scene
-			glBindVertexArray(vao_);
-			glDrawArrays(GL_TRIANGLES, 0, no_triangles_ * 3);
-			glBindVertexArray(0);
+			// light frusta follow the camera, so they are refitted every frame
+			UpdateShadowCascades(model);
+
+			// a layer has to be redrawn only if its MLP matrix differs from the one it was drawn with,
+			// the matrix changes with the light, the model matrix and (thanks to the snapping) only on whole texel camera moves
+			Matrix4x4 mlp[MAX_SHADOW_CASCADES];
+			bool dirty[MAX_SHADOW_CASCADES];
+			int no_dirty = 0;
+			for (int i = 0; i < no_active_cascades_; i++) {
+				mlp[i] = shadow_cascades_[i].light_projection * model;
+				dirty[i] = !(shadow_cache_valid_[i] && mlp[i] == shadow_cached_mlp_[i]);
+				no_dirty += dirty[i];
+			}
+			shadow_layers_active_ += no_active_cascades_;
+
+			if (no_dirty > 0) {
+				// EVSM renders the moments into a color layer, the depth layer is still used for the depth test
+				const bool evsm = (shadow_filter_ == ShadowFilter::kEVSM);
+				const GLuint program = evsm ? shadow_evsm_program_ : shadow_program_;
+
+				// --- first pass ---
+				// set the shadow shader program and the viewport to match the size of the depth map
+				glUseProgram(program);
+				glViewport(0, 0, shadow_width_, shadow_height_);
+				glBindFramebuffer(GL_FRAMEBUFFER, evsm ? fbo_shadow_moments_ : fbo_shadow_map_);
+
+				// moments of the far plane, i.e. lit
+				const GLfloat far_moments[4] = { expf(evsm_exponents_[0]), expf(2.0f * evsm_exponents_[0]),
+					-expf(-evsm_exponents_[1]), expf(-2.0f * evsm_exponents_[1]) };
+
+				// one layer of the array per cascade
+				for (int i = 0; i < no_active_cascades_; i++) {
+					if (!dirty[i]) continue;
+
+					glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, tex_shadow_map_, 0, i);
+					if (evsm) {
+						glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex_shadow_moments_, 0, i);
+						glClearBufferfv(GL_COLOR, 0, far_moments);
+					}
+					glClear(GL_DEPTH_BUFFER_BIT);
+
+					// set up the light source through the MLP matrix
+					SetMatrix4x4(program, mlp[i].data(), "mlp");
+
+					// draw the casters inside the light frustum, a layer cleared before the geometry arrives stays invalid
+					if (vao_) {
+						shadow_triangles_drawn_ += DrawShadowCasters(mlp[i]);
+
+						shadow_cached_mlp_[i] = mlp[i];
+						shadow_cache_valid_[i] = true;
+					}
+				}
+				if (vao_) {
+					shadow_layers_drawn_ += no_dirty;
+				}
+
+				if (evsm) {
+					BlurShadowMoments(dirty);
+				}
+
+				// set back the main shader program and the viewport
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+				glViewport(0, 0, camera_.width_, camera_.height_);
+				glUseProgram(shader_program_);
+			}
 
-			// set back the main shader program and the viewport
-			glBindFramebuffer(GL_FRAMEBUFFER, 0);
-			glViewport(0, 0, camera_.width_, camera_.height_);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-			glUseProgram(shader_program_);
+			if (!deferred_) {
+				SetShadowUniforms(shader_program_);
+			}
 		}
 
+		//geometry pass of the deferred path, the forward shaders write directly to the HDR target
+		if (deferred_) {
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo_gbuffer_);
+		}
+		else {
+			post_->Begin();
+		}
+		glViewport(0, 0, camera_.width_, camera_.height_);
 
 		//barva pozadí - background color
 		glClearColor(0.f, 0.f, 0.f, 1.0f); // state setting function
@@ -373,28 +693,150 @@ int Rasterizer::RenderFrame(bool rotate, bool includeShadows) {
 		Matrix4x4 mvp = camera_.projectionMatrix * camera_.viewMatrix * model;
 		SetMatrix4x4(shader_program_, mvp.data(), "mvp");
 
+		//residency of the material textures follows the view frustum
+		if (material_table_) {
+			std::vector<bool> visible(material_bounds_.size());
+			for (size_t m = 0; m < material_bounds_.size(); m++) {
+				visible[m] = !material_bounds_[m].OutsideFrustum(mvp);
+			}
+			material_table_->Update(visible);
+		}
+
+		//motion of the whole scene since the last frame, the view and model matrices are rigid
+		if (taa) {
+			const Matrix4x4 unjittered_mvp = camera_.unjitteredProjectionMatrix * camera_.viewMatrix * model;
+			const Matrix4x4 inverse_mvp = Matrix4x4::EuclideanInverse(model) * Matrix4x4::EuclideanInverse(camera_.viewMatrix) * camera_.InverseProjection();
+			post_->SetReprojection((previous_mvp_valid ? previous_mvp : unjittered_mvp) * inverse_mvp,
+				deferred_ ? tex_gbuffer_[3] : post_->depth_texture());
+			previous_mvp = unjittered_mvp;
+			previous_mvp_valid = true;
+		}
+
 		if (obtainMVN) {
 			Matrix4x4 mvn = model * camera_.viewMatrix;
 			SetMatrix4x4(shader_program_, mvn.data(), "mvn");
 		}
 
-		if (includeShadows) {
-			mlp = camera_.BuildMLPMatrix(light_position);
-			mlp = mlp * model;
-			SetMatrix4x4(shader_program_, mlp.data(), "mlp");
+		//lights move every frame, so they are binned every frame
+		const double frame_time = glfwGetTime();
+		if (clustered_lights_) {
+			if (no_pending_lights_ > 0 && !scene_bounds_.empty()) {
+				const Vector3 extent = scene_bounds_.extent();
+				const float size = std::max(extent.x, std::max(extent.y, extent.z));
+				clustered_lights_->AddRandomLights(no_pending_lights_, scene_bounds_, pending_lights_radius_ * size);
+				printf("\n%d point lights\n", int(clustered_lights_->lights().size()));
+				no_pending_lights_ = 0;
+			}
+
+			clustered_lights_->Animate(float(frame_time - last_frame_time), scene_bounds_);
+			clustered_lights_->Update(camera_.viewMatrix, model, camera_.fov_y(), camera_.aspect_ratio(),
+				camera_.z_near_, camera_.z_far_, camera_.width_, camera_.height_);
+
+			Matrix4x4 mv = camera_.viewMatrix * model;
+			SetMatrix4x4(shader_program_, mv.data(), "mv");
 		}
+		last_frame_time = frame_time;
 
-		glBindVertexArray(vao_);
-		glDrawArrays(GL_TRIANGLES, 0, no_triangles_ * 3);
-		glBindVertexArray(0);
+		//the scene may still be loading
+		if (vao_) {
+			glBindVertexArray(vao_);
+			glDrawArrays(GL_TRIANGLES, 0, no_triangles_ * 3);
+			glBindVertexArray(0);
+		}
+
+		//lighting pass, every pixel is shaded exactly once regardless of the overdraw
+		if (deferred_) {
+			post_->Begin();
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+			glDisable(GL_DEPTH_TEST);
+			glUseProgram(lighting_program_);
+
+			const char * gbuffer_names[4] = { "gbuffer_normal", "gbuffer_albedo", "gbuffer_material", "gbuffer_depth" };
+			for (int i = 0; i < 4; i++) {
+				glActiveTexture(GL_TEXTURE6 + i);
+				glBindTexture(GL_TEXTURE_2D, tex_gbuffer_[i]);
+				SetSampler(lighting_program_, 6 + i, gbuffer_names[i]);
+			}
+			SetSampler(lighting_program_, 1, "envMap");
+			SetSampler(lighting_program_, 2, "brdfMap");
+			SetInt(lighting_program_, std::max(envMap_levels - 1, 0), "envMap_max_lod");
+
+			//inverse projection and the view -> model space transform
+			const float tan_y = tanf(camera_.fov_y() * 0.5f);
+			glUniform4f(glGetUniformLocation(lighting_program_, "frustum"), tan_y * camera_.aspect_ratio(), tan_y, camera_.z_near_, camera_.z_far_);
+			glUniform2f(glGetUniformLocation(lighting_program_, "render_size"), float(camera_.width_), float(camera_.height_));
+			Matrix4x4 mv = camera_.viewMatrix * model;
+			SetMatrix4x4(lighting_program_, mv.data(), "mv");
+			glUniform3fv(glGetUniformLocation(lighting_program_, "lightPos"), 1, light_position.data);
+
+			SetInt(lighting_program_, includeShadows ? 1 : 0, "shadows_enabled");
+			if (includeShadows) {
+				SetSampler(lighting_program_, 3, "shadow_map");
+				SetSampler(lighting_program_, 4, "shadow_moments");
+				SetShadowUniforms(lighting_program_);
+			}
+
+			glBindVertexArray(vao_fullscreen_);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			glBindVertexArray(0);
+
+			glEnable(GL_DEPTH_TEST);
+			glUseProgram(shader_program_);
+		}
+
+		//bloom, exposure, tone mapping and gamma into the default framebuffer
+		post_->End();
+
+		if (dynamic_resolution_) {
+			dynamic_resolution_->EndFrame();
+		}
 
 		glfwSwapBuffers(window_);
 		glfwPollEvents();
+		no_frames++;
+	}
+
+	if (no_frames > 0) {
+		printf("\nAverage frame time (%s): %0.2f ms\n", deferred_ ? "deferred" : "forward",
+			1000.0 * (glfwGetTime() - start_time) / no_frames);
+	}
+
+	if (dynamic_resolution_) {
+		printf("GPU frame time: %0.2f ms of %0.2f ms, resolution scale %0.3f\n", dynamic_resolution_->gpu_time(), frame_budget_,
+			dynamic_resolution_->scale());
+	}
+
+	if (material_table_) {
+		printf("Material textures: %d of %d resident (%0.1f of %0.1f MB), %lld uploads, %lld evictions\n",
+			material_table_->no_resident(), material_table_->no_textures(), material_table_->resident_bytes() / 1048576.0,
+			vram_budget_ / 1048576.0, material_table_->no_uploads(), material_table_->no_evictions());
 	}
 
+	if (includeShadows && no_frames > 0) {
+		printf("\nShadow cascades drawn: %lld of %lld (%0.1f %%)\n", shadow_layers_drawn_, shadow_layers_active_,
+			100.0 * shadow_layers_drawn_ / double((std::max)(shadow_layers_active_, 1LL)));
+		printf("Shadow casters: %0.1f %% of the triangles per drawn cascade, %0.2f times the triangles of the scene per frame\n",
+			100.0 * shadow_triangles_drawn_ / (double((std::max)(shadow_layers_drawn_, 1LL)) * (std::max)(no_triangles_, 1)),
+			shadow_triangles_drawn_ / (double(no_frames) * (std::max)(no_triangles_, 1)));
+	}
+
+	SAFE_DELETE(loader_); // joins the decoding threads
+	SAFE_DELETE(upload_ring_);
+	SAFE_DELETE(clustered_lights_);
+	SAFE_DELETE(post_);
+	SAFE_DELETE(dynamic_resolution_);
+	SAFE_DELETE(material_table_);
+
 	glDeleteVertexArrays(1, &vao_);
 	glDeleteBuffers(1, &vbo_);
 
+	if (deferred_) {
+		glDeleteProgram(lighting_program_);
+		glDeleteFramebuffers(1, &fbo_gbuffer_);
+		glDeleteTextures(4, tex_gbuffer_);
+		glDeleteVertexArrays(1, &vao_fullscreen_);
+	}
+
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LESS);
 
@@ -408,24 +850,33 @@ int Rasterizer::RenderFrame(bool rotate, bool includeShadows) {
 //PDF 129 - 142
 int Rasterizer::InitShadowDepthBuffer()
 {
-	glGenTextures(1, &tex_shadow_map_); // texture to hold the depth values from the light's perspective
-	glBindTexture(GL_TEXTURE_2D, tex_shadow_map_);
-	// GL_DEPTH_COMPONENT ... each element is a single depth value. The GL converts it to floating point, multiplies by the signed scale
-	// factor GL_DEPTH_SCALE, adds the signed bias GL_DEPTH_BIAS, and clamps to the range [0, 1] – this will be important later
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, shadow_width_, shadow_height_, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	glGenTextures(1, &tex_shadow_map_); // texture array to hold the depth values from the light's perspective, one layer per cascade
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tex_shadow_map_);
+	// each element is a single depth value. The GL converts it to floating point and clamps to the range [0, 1] – this will be important later
+	glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT24, shadow_width_, shadow_height_, no_shadow_cascades_);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
 	const float color[] = { 1.0f, 1.0f, 1.0f, 1.0f }; // areas outside the light's frustum will be lit
-	glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, color);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, color);
+	// sampler2DArrayShadow - the comparison is done by the sampler, with linear filtering every fetch is a 2x2 PCF
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 	glGenFramebuffers(1, &fbo_shadow_map_); // new frame buffer
 	glBindFramebuffer(GL_FRAMEBUFFER, fbo_shadow_map_);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex_shadow_map_, 0); // attach the texture as depth
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, tex_shadow_map_, 0, 0); // attach the first layer as depth, RenderFrame switches the layers
 	glDrawBuffer(GL_NONE); // we dont need any color buffer during the first pass
 	glBindFramebuffer(GL_FRAMEBUFFER, 0); // bind the default framebuffer back
 
+	// cascade matrices and splits, refitted every frame
+	glGenBuffers(1, &ubo_shadow_cascades_);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_shadow_cascades_);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(ShadowCascadesBlock), nullptr, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 2, ubo_shadow_cascades_);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
 	GLuint shadow_vertex = glCreateShader(GL_VERTEX_SHADER);
 	const char * vertex_shader_source = LoadShader("shadow_map.vert");
 	glShaderSource(shadow_vertex, 1, &vertex_shader_source, nullptr);
@@ -446,10 +897,123 @@ int Rasterizer::InitShadowDepthBuffer()
 	glLinkProgram(shadow_program_);
 	glUseProgram(shadow_program_);
 
+	//EVSM - filterable moments with mipmaps, RGBA16F keeps the bandwidth of the blur and the lookups low
+	glGenTextures(1, &tex_shadow_moments_);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tex_shadow_moments_);
+	glTexStorage3D(GL_TEXTURE_2D_ARRAY, MipLevels(shadow_width_, shadow_height_), GL_RGBA16F, shadow_width_, shadow_height_, no_shadow_cascades_);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	//intermediate result of the separable blur
+	glGenTextures(1, &tex_shadow_blur_);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tex_shadow_blur_);
+	glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA16F, shadow_width_, shadow_height_, no_shadow_cascades_);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	glGenFramebuffers(1, &fbo_shadow_moments_);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo_shadow_moments_);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, tex_shadow_map_, 0, 0);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex_shadow_moments_, 0, 0);
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	shadow_evsm_program_ = CreateProgram({ CompileShader(GL_VERTEX_SHADER, "shadow_map.vert"), CompileShader(GL_FRAGMENT_SHADER, "shadow_evsm.frag") });
+	glUseProgram(shadow_evsm_program_);
+	glUniform2fv(glGetUniformLocation(shadow_evsm_program_, "evsm_exponents"), 1, evsm_exponents_);
+
+	shadow_blur_program_ = CreateProgram({ CompileShader(GL_COMPUTE_SHADER, "evsm_blur.comp") });
+	glUseProgram(shadow_blur_program_);
+	SetSampler(shadow_blur_program_, 5, "source");
+
 	glUseProgram(shader_program_);
 	return 1;
 }
 
+//draws the surfaces whose bounds overlap the light frustum of a cascade, neighbouring ranges are merged into one
+//the depth range of a cascade covers the whole scene, so the casters in front of the frustum are not lost
+int Rasterizer::DrawShadowCasters(const Matrix4x4 & mlp) {
+	shadow_first_.clear();
+	shadow_count_.clear();
+	int no_triangles = 0;
+
+	for (const DrawRange & range : draw_ranges_) {
+		if (range.bounds.OutsideFrustum(mlp)) continue;
+
+		if (!shadow_first_.empty() && shadow_first_.back() + shadow_count_.back() == range.first) {
+			shadow_count_.back() += range.count;
+		}
+		else {
+			shadow_first_.push_back(range.first);
+			shadow_count_.push_back(range.count);
+		}
+		no_triangles += range.count / 3;
+	}
+
+	if (!shadow_first_.empty()) {
+		glBindVertexArray(vao_);
+		glMultiDrawArrays(GL_TRIANGLES, shadow_first_.data(), shadow_count_.data(), GLsizei(shadow_first_.size()));
+		glBindVertexArray(0);
+	}
+
+	return no_triangles;
+}
+
+//separable gaussian blur of the freshly rendered EVSM layers followed by the mipmaps
+void Rasterizer::BlurShadowMoments(const bool * layers) {
+	glUseProgram(shadow_blur_program_);
+	SetInt(shadow_blur_program_, shadow_blur_radius_, "radius");
+	const GLint direction = glGetUniformLocation(shadow_blur_program_, "direction");
+	const GLuint groups_x = (shadow_width_ + 7) / 8;
+	const GLuint groups_y = (shadow_height_ + 7) / 8;
+
+	glActiveTexture(GL_TEXTURE5);
+	for (int i = 0; i < no_active_cascades_; i++) {
+		if (!layers[i]) continue;
+
+		SetInt(shadow_blur_program_, i, "layer");
+
+		// horizontal pass, moments -> blur
+		glBindTexture(GL_TEXTURE_2D_ARRAY, tex_shadow_moments_);
+		glBindImageTexture(0, tex_shadow_blur_, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+		glUniform2i(direction, 1, 0);
+		glDispatchCompute(groups_x, groups_y, 1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+		// vertical pass, blur -> moments
+		glBindTexture(GL_TEXTURE_2D_ARRAY, tex_shadow_blur_);
+		glBindImageTexture(0, tex_shadow_moments_, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+		glUniform2i(direction, 0, 1);
+		glDispatchCompute(groups_x, groups_y, 1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+	}
+
+	// the prefiltered levels allow wide penumbrae at the cost of a single lookup
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tex_shadow_moments_);
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+//the shadow filter may be changed at runtime, expects the program to be bound
+void Rasterizer::SetShadowUniforms(const GLuint program) {
+	SetInt(program, int(shadow_filter_), "shadow_filter");
+	SetInt(program, shadow_taps_, "shadow_taps");
+	glUniform1f(glGetUniformLocation(program, "shadow_radius"), shadow_filter_radius_);
+	glUniform2fv(glGetUniformLocation(program, "evsm_exponents"), 1, evsm_exponents_);
+}
+
+void Rasterizer::SetShadowFilter(const ShadowFilter filter, const int no_taps, const float radius) {
+	//PCF and EVSM render into different textures
+	if ((filter == ShadowFilter::kEVSM) != (shadow_filter_ == ShadowFilter::kEVSM)) {
+		InvalidateShadowMaps();
+	}
+	shadow_filter_ = filter;
+	shadow_taps_ = std::min(std::max(no_taps, 1), 32); // size of the Poisson disk in the shader
+	shadow_filter_radius_ = radius;
+}
+
 
 
 void Rasterizer::move() {
@@ -502,15 +1066,61 @@ void Rasterizer::move() {
 		camera_.view_from_.y -= 0.2;
 	}
 
+	//F cycles the shadow filters, + and - on the keypad double or halve the number of taps
+	const int shadow_keys[3] = { GLFW_KEY_F, GLFW_KEY_KP_ADD, GLFW_KEY_KP_SUBTRACT };
+	for (int i = 0; i < 3; i++) {
+		const bool down = glfwGetKey(window_, shadow_keys[i]) > 0;
+		if (down && !shadow_keys_down_[i]) {
+			if (i == 0)
+				SetShadowFilter(ShadowFilter((int(shadow_filter_) + 1) % 4), shadow_taps_, shadow_filter_radius_);
+			else
+				SetShadowFilter(shadow_filter_, (i == 1) ? shadow_taps_ * 2 : shadow_taps_ / 2, shadow_filter_radius_);
+			printf("\nShadow filter %d, %d taps\n", int(shadow_filter_), shadow_taps_);
+		}
+		shadow_keys_down_[i] = down;
+	}
+
 	printf("\rCamera: %f, %f, %f ... Light: %f, %f, %f ", camera_.view_from_.x, camera_.view_from_.y, camera_.view_from_.z, light_position.x, light_position.y, light_position.z);
 
 }
 
+void Rasterizer::Pick(const Matrix4x4 & model) {
+	const bool down = glfwGetMouseButton(window_, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+	const bool clicked = down && !pick_button_down_;
+	pick_button_down_ = down;
+	if (!clicked || surfaces_.empty()) {
+		return;
+	}
+
+	if (!pick_caster_) {
+		pick_bvh_ = std::make_unique<BVH>();
+		pick_bvh_->Build(surfaces_);
+		pick_caster_ = std::make_unique<RayCaster>(*pick_bvh_, surfaces_);
+	}
+
+	//the cursor is in window coordinates, the camera may render at a lower resolution
+	double cursor_x, cursor_y;
+	int window_width, window_height;
+	glfwGetCursorPos(window_, &cursor_x, &cursor_y);
+	glfwGetWindowSize(window_, &window_width, &window_height);
+	const float x = float(cursor_x) * camera_.width_ / std::max(window_width, 1);
+	const float y = float(cursor_y) * camera_.height_ / std::max(window_height, 1);
+
+	RayHit hit;
+	if (pick_caster_->Intersect(TransformRay(Matrix4x4::EuclideanInverse(model), CameraRay(camera_, x, y)), hit)) {
+		printf("\nPicked surface %d (%s), triangle %d, material %s, distance %0.2f\n", hit.surface,
+			surfaces_[hit.surface]->get_name().c_str(), hit.triangle, hit.material ? hit.material->name().c_str() : "none", hit.t);
+	}
+	else {
+		printf("\nPicked nothing\n");
+	}
+}
+
 void Rasterizer::genMipMap() {
 	glGenerateMipmap(GL_TEXTURE_2D);
 
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
@@ -2,6 +2,21 @@
 
 #include "surface.h"
 #include "camera.h"
+#include "texture.h"
+#include "assetloader.h"
+#include "uploadring.h"
+#include "texcompress.h"
+#include "iblbaker.h"
+#include "shadowcascades.h"
+#include "clusteredlights.h"
+#include "postprocess.h"
+#include "dynamicresolution.h"
+#include "materialtable.h"
+#include "raycaster.h"
+#include "aobaker.h"
+
+//Shadow lookup quality, the values match shadow_filter in pbr_shadow.frag
+enum class ShadowFilter { kBilinear = 0, kPoisson = 1, kRotatedPoisson = 2, kEVSM = 3 };
 
 class Rasterizer
 {
@@ -14,25 +29,63 @@ public:
 	int LoadSceneAndObject(const char * fileName);
 	void InitBuffers(std::string shader);
 	int InitMaterials();
+	void SetTextureBudget(const GLsizeiptr bytes); // VRAM for the material textures, call before the scene is loaded
+	void SetAmbientOcclusion(const int no_rays); // rays per vertex of the AO baked on load (0 = off), call before the scene is loaded
 	void InitIrradianceMap(const char * path);
 	void InitEnvMaps(std::vector<const char*> paths);
 	void InitGGXIntegrMap(const char * path);
 	int RenderFrame(bool rotate, bool includeShadows);
 
+	//Asynchronous variants - files are decoded on worker threads and uploaded from RenderFrame
+	void LoadSceneAndObjectAsync(const char * fileName);
+	void InitIrradianceMapAsync(const char * path);
+	void InitEnvMapsAsync(std::vector<const char*> paths);
+	void InitGGXIntegrMapAsync(const char * path);
+
 	//Shadow mapping
 	int InitShadowDepthBuffer();
+	void SetShadowFilter(const ShadowFilter filter, const int no_taps, const float radius = 1.5f);
+	void InvalidateShadowMaps(); // forces all cascades to be redrawn, call after changing the geometry
+
+	//Clustered point lights (pbr, pbr_shadow and deferred shaders), spawned inside the scene once it is loaded, call after InitBuffers
+	void AddPointLights(const int count, const float relative_radius = 0.05f);
+
+	//HDR post processing, the targets are created by RenderFrame
+	void SetAntiAliasing(const int msaa_samples); // 1 = TAA with a jittered projection (default), > 1 = MSAA
+	void SetExposure(const float exposure);
+	void SetFrameBudget(const float budget_ms); // GPU time the dynamic resolution aims at, 0 = always full resolution
 
 	void move();
 
 	void genMipMap();
 
 private: 
+	//GL part of the loading, always called from the thread owning the context
+	static Vertex * BuildVertices(std::vector<Surface *> & surfaces, int & no_triangles);
+	void UploadScene(Vertex * vertices);
+	void UploadIrradianceSH(const SphericalHarmonics9 & sh);
+	void UpdateShadowCascades(const Matrix4x4 & model);
+	void BlurShadowMoments(const bool * layers);
+	int DrawShadowCasters(const Matrix4x4 & mlp); // returns the number of triangles drawn
+	void SetShadowUniforms(const GLuint program);
+	void InitGBuffer();
+	void UploadEnvMap(StagedImage & bitmap, const int level);
+	void UploadGGXIntegrMap(StagedImage & bitmap);
+	AssetLoader * Loader();
+	void Pick(const Matrix4x4 & model); // prints the surface under the cursor on a left click
+
+	//Block compression of the material textures, no GL calls so it can run on a worker thread
+	typedef std::map<Texture3u *, std::shared_ptr<CompressedImage>> CompressedTextures;
+	static void CompressMaterialTextures(const std::vector<Material *> & materials, CompressedTextures & compressed);
+
+
 	bool obtainMVN;
 	int width_;
 	int height_;
 	Camera camera_;
 	GLFWwindow* window_;
-	int no_triangles_;
+	int no_triangles_{ 0 };
+	AABB scene_bounds_; // model space bounds of all vertices
 	std::vector<Surface *> surfaces_;
 	std::vector<Material *> materials_;
 
@@ -43,16 +96,101 @@ private:
 	GLuint shader_program_;
 
 	//Irradiance
-	GLuint irradianceMap{ 0 };
+	GLuint ubo_irradiance_sh_{ 0 }; // SH9 irradiance, uniform block binding 1
 	GLuint brdfMap{ 0 };
 	GLuint envMap{ 0 };
+	int envMap_levels{ 0 };
+	int envMap_size{ 0 }; // face size of the first level
+	int envMap_levels_uploaded{ 0 };
+	FloatPacking env_packing_{ FloatPacking::kRGB9E5 }; // all levels are prefiltered offline
+	FloatPacking brdf_packing_{ FloatPacking::kRG16F }; // the LUT has only two channels (scale, bias)
+
+	//Clustered forward shading
+	ClusteredLights * clustered_lights_{ nullptr };
+	int no_pending_lights_{ 0 };
+	float pending_lights_radius_{ 0.05f }; // relative to the largest extent of the scene
+
+	//Deferred shading, InitBuffers("deferred")
+	bool deferred_{ false };
+	GLuint lighting_program_{ 0 }; // fullscreen pass of deferred.frag
+	GLuint fbo_gbuffer_{ 0 };
+	GLuint tex_gbuffer_[4]{}; // normal, albedo, roughness + metalness + IOR, depth
+	GLuint vao_fullscreen_{ 0 }; // empty, the triangle is generated in deferred.vert
+
+	//HDR target and the compute post stack (bloom, exposure, ACES, gamma)
+	PostProcess * post_{ nullptr };
+	int msaa_samples_{ 1 }; // samples of the forward HDR target, 1 = TAA
+	float exposure_{ 1.0f };
+
+	//Dynamic resolution
+	DynamicResolution * dynamic_resolution_{ nullptr };
+	float frame_budget_{ 0.0f }; // ms, 0 = dynamic resolution off
+
+	//Ambient occlusion and bent normals baked into the vertex colors, see BakeVertexAO
+	AmbientOcclusionSettings ao_settings_{ 0 }; // no_rays = 0 - not baked
+
+	//Mouse picking against a BVH of the model space triangles, built on the first click
+	std::unique_ptr<BVH> pick_bvh_;
+	std::unique_ptr<RayCaster> pick_caster_; // refers to *pick_bvh_, declared after it so that it is destroyed first
+	bool pick_button_down_{ false };
+
+	//Asynchronous loading
+	AssetLoader * loader_{ nullptr };
+	double load_start_{ 0.0 };
+	int uploads_per_frame_{ 2 }; // keeps the frame time bounded while assets are streaming in
+
+	//Texture streaming through pixel buffer objects
+	UploadRing * upload_ring_{ nullptr };
+	GLsizeiptr upload_ring_size_{ GLsizeiptr(64) << 20 }; // fits all prefiltered env maps in flight at once
+
+	//Material textures
+	bool compress_textures_{ true }; // BC7 albedo, BC5 normals, BC4 roughness
+	CompressedTextures compressed_textures_; // handed over to the material table
+	MaterialTable * material_table_{ nullptr };
+	GLsizeiptr vram_budget_{ GLsizeiptr(512) << 20 };
+	std::vector<AABB> material_bounds_; // model space bounds of the triangles of each material
 
 	//Shadow mapping
-	int shadow_width_{ 1024 }; // shadow map resolution
+	int shadow_width_{ 512 }; // resolution of a single cascade, 4 x 512^2 texels cost the same fill as the former single 1024^2 map
 	int shadow_height_{ shadow_width_ };
+	int no_shadow_cascades_{ MAX_SHADOW_CASCADES };
+	float shadow_split_lambda_{ 0.8f }; // 1 = logarithmic splits, 0 = uniform splits
+	ShadowCascade shadow_cascades_[MAX_SHADOW_CASCADES];
+	int no_active_cascades_{ 0 }; // 0 while the scene is not loaded or not visible
 	GLuint fbo_shadow_map_{ 0 }; // shadow mapping FBO
-	GLuint tex_shadow_map_{ 0 }; // shadow map texture
+	GLuint tex_shadow_map_{ 0 }; // shadow map texture array, one layer per cascade
+	GLuint ubo_shadow_cascades_{ 0 }; // light matrices and split depths, uniform block binding 2
 	GLuint shadow_program_{ 0 }; // collection of shadow mapping shaders
+	ShadowFilter shadow_filter_{ ShadowFilter::kRotatedPoisson };
+	int shadow_taps_{ 16 }; // hardware PCF taps per fragment, 1 - 32
+	float shadow_filter_radius_{ 1.5f }; // texels
+	bool shadow_keys_down_[3]{ false, false, false }; // F, +, - on the keypad, changes are applied on press only
+
+	//Exponential variance shadow maps (ShadowFilter::kEVSM)
+	GLuint tex_shadow_moments_{ 0 }; // RGBA16F array with mipmaps, one layer per cascade
+	GLuint tex_shadow_blur_{ 0 }; // horizontally blurred moments
+	GLuint fbo_shadow_moments_{ 0 };
+	GLuint shadow_evsm_program_{ 0 };
+	GLuint shadow_blur_program_{ 0 }; // separable gaussian blur (compute)
+	GLfloat evsm_exponents_[2]{ 5.0f, 5.0f }; // positive and negative warp, half floats overflow above 5.54
+	int shadow_blur_radius_{ 2 }; // texels
+
+	//Shadow map caching, a cascade is redrawn only when its MLP matrix changes
+	Matrix4x4 shadow_cached_mlp_[MAX_SHADOW_CASCADES]; // matrices the layers were drawn with
+	bool shadow_cache_valid_[MAX_SHADOW_CASCADES]{};
+	long long shadow_layers_drawn_{ 0 };
+	long long shadow_layers_active_{ 0 }; // sum of no_active_cascades_ over the frames
+	long long shadow_triangles_drawn_{ 0 };
+
+	//Vertices of every surface in the vertex buffer, the shadow pass culls them against the light frustum of each cascade
+	struct DrawRange {
+		GLint first;
+		GLsizei count;
+		AABB bounds; // model space
+	};
+	std::vector<DrawRange> draw_ranges_;
+	std::vector<GLint> shadow_first_; // visible ranges of the layer being drawn, glMultiDrawArrays
+	std::vector<GLsizei> shadow_count_;
 
 };
 
@@ -0,0 +1,129 @@
+#ifndef AABB_H_
+#define AABB_H_
+
+#include "vector3.h"
+#include "matrix4x4.h"
+#include <cfloat>
+
+/*! \struct AABB
+\brief Axis aligned bounding box.
+
+An empty box has lower > upper, so the first Merge sets both corners.
+
+AABB bounds;
+for ( int i = 0; i < no_vertices; ++i ) bounds.Merge( vertices[i].position );
+*/
+struct AABB
+{
+	Vector3 lower{ Vector3( FLT_MAX, FLT_MAX, FLT_MAX ) }; /*!< Minimum corner. */
+	Vector3 upper{ Vector3( -FLT_MAX, -FLT_MAX, -FLT_MAX ) }; /*!< Maximum corner. */
+
+	bool empty() const
+	{
+		return ( lower.x > upper.x ) || ( lower.y > upper.y ) || ( lower.z > upper.z );
+	}
+
+	//! Grows the box to contain the point \a p.
+	void Merge( const Vector3 & p )
+	{
+		lower = Vector3( ( std::min )( lower.x, p.x ), ( std::min )( lower.y, p.y ), ( std::min )( lower.z, p.z ) );
+		upper = Vector3( ( std::max )( upper.x, p.x ), ( std::max )( upper.y, p.y ), ( std::max )( upper.z, p.z ) );
+	}
+
+	//! Grows the box to contain the box \a b, an empty \a b changes nothing.
+	void Merge( const AABB & b )
+	{
+		if ( !b.empty() )
+		{
+			Merge( b.lower );
+			Merge( b.upper );
+		}
+	}
+
+	Vector3 center() const
+	{
+		return ( lower + upper ) * 0.5f;
+	}
+
+	Vector3 extent() const
+	{
+		return upper - lower;
+	}
+
+	//! Surface area, 0 for an empty box.
+	float area() const
+	{
+		if ( empty() )
+		{
+			return 0.0f;
+		}
+
+		const Vector3 e = extent();
+
+		return 2.0f * ( e.x * e.y + e.y * e.z + e.z * e.x );
+	}
+
+	//! One of the eight corners, bits 0, 1 and 2 of \a i select the upper x, y and z coordinate.
+	Vector3 corner( const int i ) const
+	{
+		return Vector3( ( i & 1 ) ? upper.x : lower.x, ( i & 2 ) ? upper.y : lower.y, ( i & 4 ) ? upper.z : lower.z );
+	}
+
+	//! Bounds of the box transformed by the affine matrix \a m.
+	AABB Transformed( const Matrix4x4 & m ) const
+	{
+		AABB b;
+
+		if ( !empty() )
+		{
+			for ( int i = 0; i < 8; ++i )
+			{
+				const Vector3 p = corner( i );
+				b.Merge( Vector3(
+					m.get( 0, 0 ) * p.x + m.get( 0, 1 ) * p.y + m.get( 0, 2 ) * p.z + m.get( 0, 3 ),
+					m.get( 1, 0 ) * p.x + m.get( 1, 1 ) * p.y + m.get( 1, 2 ) * p.z + m.get( 1, 3 ),
+					m.get( 2, 0 ) * p.x + m.get( 2, 1 ) * p.y + m.get( 2, 2 ) * p.z + m.get( 2, 3 ) ) );
+			}
+		}
+
+		return b;
+	}
+
+	//! True if the box lies completely outside one of the six clip planes of \a clip (e.g. the model -> clip space mvp).
+	bool OutsideFrustum( const Matrix4x4 & clip ) const
+	{
+		if ( empty() )
+		{
+			return true;
+		}
+
+		int outside[6] = { 0, 0, 0, 0, 0, 0 }; // corners behind the -x, +x, -y, +y, -z and +z planes
+		for ( int i = 0; i < 8; ++i )
+		{
+			const Vector3 p = corner( i );
+			float c[4];
+			for ( int r = 0; r < 4; ++r )
+			{
+				c[r] = clip.get( r, 0 ) * p.x + clip.get( r, 1 ) * p.y + clip.get( r, 2 ) * p.z + clip.get( r, 3 );
+			}
+
+			for ( int a = 0; a < 3; ++a )
+			{
+				outside[2 * a] += ( c[a] < -c[3] );
+				outside[2 * a + 1] += ( c[a] > c[3] );
+			}
+		}
+
+		for ( int k = 0; k < 6; ++k )
+		{
+			if ( outside[k] == 8 )
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
+
+#endif
@@ -0,0 +1,353 @@
+#include "pch.h"
+#include "aobaker.h"
+#include "utils.h"
+#include "mymath.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+// ray origins are pushed off the surface by this fraction of the scene diagonal
+static const float kRayEpsilon = 1e-4f;
+
+// empty texels around the charts filled by BakeTextureAO
+static const int kDilation = 4;
+
+// surface points handed to a single job of the pool
+static const int kBatchSize = 64;
+
+// point on the surface whose visibility is baked
+struct OcclusionSample
+{
+	Vector3 position;
+	Vector3 normal; // unit
+	int target; // index of the result, also seeds the rays
+};
+
+// uniform number from <0, 1) that depends only on the seed (the lowbias32 integer hash)
+static float Hash( unsigned int x )
+{
+	x ^= x >> 16;
+	x *= 0x7FEB352Du;
+	x ^= x >> 15;
+	x *= 0x846CA68Bu;
+	x ^= x >> 16;
+
+	return ( x >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+// bent normal scaled by the visibility of the hemisphere above the sample
+static Vector3 BentNormal( const RayCaster & caster, const OcclusionSample & sample, const int no_packets,
+	const float epsilon, const float max_distance )
+{
+	Vector3 t, b;
+	Basis( sample.normal, t, b );
+
+	// Hammersley points shifted by a random offset of the sample (Cranley-Patterson rotation), the neighbouring
+	// samples then see the same stratified set differently, which turns banding into fine noise
+	const int no_rays = no_packets * RAY_PACKET_SIZE;
+	const float offset_u = Hash( 2 * static_cast<unsigned int>( sample.target ) );
+	const float offset_v = Hash( 2 * static_cast<unsigned int>( sample.target ) + 1 );
+
+	// geometry touching the sample (walls meeting the floor) would block even the rays leaving it
+	Ray ray;
+	ray.origin = sample.position + sample.normal * epsilon;
+	ray.t_near = epsilon;
+	ray.t_far = max_distance;
+
+	Vector3 bent_normal;
+	int no_visible = 0;
+	for ( int p = 0; p < no_packets; ++p )
+	{
+		RayPacket packet;
+		for ( int lane = 0; lane < RAY_PACKET_SIZE; ++lane )
+		{
+			const int i = p * RAY_PACKET_SIZE + lane;
+			float u = ( i + 0.5f ) / no_rays + offset_u;
+			float v = RadicalInverse( i ) + offset_v;
+			u -= floorf( u );
+			v -= floorf( v );
+
+			// cosine distributed direction
+			const float r = sqrtf( u );
+			const float phi = 2.0f * float( M_PI ) * v;
+			ray.direction = t * ( r * cosf( phi ) ) + b * ( r * sinf( phi ) ) + sample.normal * sqrtf( ( std::max )( 0.0f, 1.0f - u ) );
+			packet.Add( ray );
+		}
+
+		bool occluded[RAY_PACKET_SIZE];
+		caster.Occluded( packet, occluded );
+		for ( int lane = 0; lane < RAY_PACKET_SIZE; ++lane )
+		{
+			if ( !occluded[lane] )
+			{
+				bent_normal += Vector3( packet.direction_x[lane], packet.direction_y[lane], packet.direction_z[lane] );
+				++no_visible;
+			}
+		}
+	}
+
+	if ( no_visible == 0 )
+	{
+		return Vector3();
+	}
+
+	bent_normal.Normalize();
+
+	return bent_normal * ( float( no_visible ) / no_rays );
+}
+
+// bakes all samples in parallel, the result of a sample is stored at its index
+static std::vector<Vector3> BakeSamples( const std::vector<Surface *> & surfaces, const std::vector<OcclusionSample> & samples,
+	const AmbientOcclusionSettings & settings, ThreadPool & pool )
+{
+	BVH bvh;
+	bvh.Build( surfaces, BVH::BuildMethod::kBinnedSAH, pool );
+	const RayCaster caster( bvh, surfaces );
+
+	const AABB bounds = bvh.bounds();
+	const float diagonal = ( bounds.upper - bounds.lower ).L2Norm();
+	const int no_packets = ( std::max )( 1, ( settings.no_rays + RAY_PACKET_SIZE - 1 ) / RAY_PACKET_SIZE );
+	const int no_samples = static_cast<int>( samples.size() );
+
+	std::vector<Vector3> results( samples.size() );
+	pool.ParallelFor( 0, ( no_samples + kBatchSize - 1 ) / kBatchSize, [&]( const int batch )
+	{
+		const int end = ( std::min )( no_samples, ( batch + 1 ) * kBatchSize );
+		for ( int i = batch * kBatchSize; i < end; ++i )
+		{
+			results[i] = BentNormal( caster, samples[i], no_packets, kRayEpsilon * diagonal, settings.max_distance * diagonal );
+		}
+	} );
+
+	return results;
+}
+
+void BakeVertexAO( std::vector<Surface *> & surfaces, const AmbientOcclusionSettings & settings, ThreadPool & pool )
+{
+	const auto t0 = std::chrono::high_resolution_clock::now();
+
+	// every corner of every triangle, the triangles do not share vertices
+	struct Corner
+	{
+		float key[6]; // position and normal
+		int surface;
+		int index; // triangle * 3 + corner
+	};
+
+	std::vector<Corner> corners;
+	for ( int s = 0; s < int( surfaces.size() ); ++s )
+	{
+		for ( int i = 0; i < surfaces[s]->no_triangles(); ++i )
+		{
+			Triangle & triangle = surfaces[s]->get_triangle( i );
+			for ( int j = 0; j < 3; ++j )
+			{
+				const Vertex vertex = triangle.vertex( j );
+				const Corner corner = { { vertex.position.x, vertex.position.y, vertex.position.z,
+					vertex.normal.x, vertex.normal.y, vertex.normal.z }, s, i * 3 + j };
+				corners.push_back( corner );
+			}
+		}
+	}
+
+	// welds the corners with bitwise equal positions and normals, they share the rays
+	std::vector<int> order( corners.size() );
+	for ( size_t i = 0; i < order.size(); ++i )
+	{
+		order[i] = static_cast<int>( i );
+	}
+	std::sort( order.begin(), order.end(), [&corners]( const int a, const int b )
+	{
+		return memcmp( corners[a].key, corners[b].key, sizeof( corners[a].key ) ) < 0;
+	} );
+
+	std::vector<OcclusionSample> samples;
+	std::vector<int> groups( corners.size() );
+	for ( size_t i = 0; i < order.size(); ++i )
+	{
+		const Corner & corner = corners[order[i]];
+		if ( ( i == 0 ) || ( memcmp( corner.key, corners[order[i - 1]].key, sizeof( corner.key ) ) != 0 ) )
+		{
+			OcclusionSample sample;
+			sample.position = Vector3( corner.key );
+			sample.normal = Vector3( corner.key + 3 );
+			sample.target = static_cast<int>( samples.size() );
+			if ( sample.normal.Normalize() == 0.0f )
+			{
+				sample.normal = Vector3( 0.0f, 0.0f, 1.0f );
+			}
+			samples.push_back( sample );
+		}
+		groups[order[i]] = static_cast<int>( samples.size() ) - 1;
+	}
+
+	const std::vector<Vector3> results = BakeSamples( surfaces, samples, settings, pool );
+
+	// the corners are still in the order of the triangles
+	for ( size_t i = 0; i < corners.size(); i += 3 )
+	{
+		Surface * surface = surfaces[corners[i].surface];
+		Triangle & triangle = surface->get_triangle( corners[i].index / 3 );
+		Vertex vertices[3] = { triangle.vertex( 0 ), triangle.vertex( 1 ), triangle.vertex( 2 ) };
+		for ( int j = 0; j < 3; ++j )
+		{
+			vertices[j].color = results[groups[i + j]];
+		}
+		triangle = Triangle( vertices[0], vertices[1], vertices[2], surface );
+	}
+
+	const double seconds = std::chrono::duration<double>( std::chrono::high_resolution_clock::now() - t0 ).count();
+	printf( "Ambient occlusion of %d vertices (%d unique) baked in %s.\n", int( corners.size() ), int( samples.size() ),
+		TimeToString( seconds ).c_str() );
+}
+
+Texture3f BakeTextureAO( const std::vector<Surface *> & surfaces, const int width, const int height,
+	const AmbientOcclusionSettings & settings, ThreadPool & pool )
+{
+	const auto t0 = std::chrono::high_resolution_clock::now();
+
+	// texel centers covered by the triangles in the texture space, v = 1 is the top row
+	std::vector<OcclusionSample> samples;
+	std::vector<int> texels; // of the samples
+	for ( Surface * surface : surfaces )
+	{
+		for ( int i = 0; i < surface->no_triangles(); ++i )
+		{
+			Triangle & triangle = surface->get_triangle( i );
+			const Vertex vertices[3] = { triangle.vertex( 0 ), triangle.vertex( 1 ), triangle.vertex( 2 ) };
+
+			float x[3], y[3];
+			for ( int j = 0; j < 3; ++j )
+			{
+				x[j] = vertices[j].texture_coords[0].u * width;
+				y[j] = ( 1.0f - vertices[j].texture_coords[0].v ) * height;
+			}
+
+			const float area = ( x[1] - x[0] ) * ( y[2] - y[0] ) - ( x[2] - x[0] ) * ( y[1] - y[0] );
+			Vector3 geometric_normal = ( vertices[1].position - vertices[0].position ).CrossProduct( vertices[2].position - vertices[0].position );
+			if ( geometric_normal.Normalize() == 0.0f )
+			{
+				continue;
+			}
+
+			const auto add = [&]( const int tx, const int ty, const float w1, const float w2 )
+			{
+				const float w0 = 1.0f - w1 - w2;
+				OcclusionSample sample;
+				sample.position = vertices[0].position * w0 + vertices[1].position * w1 + vertices[2].position * w2;
+				sample.normal = vertices[0].normal * w0 + vertices[1].normal * w1 + vertices[2].normal * w2;
+				if ( sample.normal.Normalize() == 0.0f )
+				{
+					sample.normal = geometric_normal;
+				}
+				sample.target = static_cast<int>( samples.size() );
+				samples.push_back( sample );
+
+				// tiled coordinates wrap around like the repeat addressing of the material textures
+				texels.push_back( ( ( tx % width + width ) % width ) + ( ( ty % height + height ) % height ) * width );
+			};
+
+			const int x_begin = static_cast<int>( ceilf( ( std::min )( { x[0], x[1], x[2] } ) - 0.5f ) );
+			const int x_end = static_cast<int>( floorf( ( std::max )( { x[0], x[1], x[2] } ) - 0.5f ) );
+			const int y_begin = static_cast<int>( ceilf( ( std::min )( { y[0], y[1], y[2] } ) - 0.5f ) );
+			const int y_end = static_cast<int>( floorf( ( std::max )( { y[0], y[1], y[2] } ) - 0.5f ) );
+			const size_t no_samples = samples.size();
+
+			if ( area != 0.0f )
+			{
+				for ( int ty = y_begin; ty <= y_end; ++ty )
+				{
+					for ( int tx = x_begin; tx <= x_end; ++tx )
+					{
+						const float px = tx + 0.5f;
+						const float py = ty + 0.5f;
+						const float w1 = ( ( px - x[0] ) * ( y[2] - y[0] ) - ( x[2] - x[0] ) * ( py - y[0] ) ) / area;
+						const float w2 = ( ( x[1] - x[0] ) * ( py - y[0] ) - ( px - x[0] ) * ( y[1] - y[0] ) ) / area;
+						if ( ( w1 >= 0.0f ) && ( w2 >= 0.0f ) && ( w1 + w2 <= 1.0f ) )
+						{
+							add( tx, ty, w1, w2 );
+						}
+					}
+				}
+			}
+
+			// triangles smaller than a texel still contribute to the texel of their centroid
+			if ( samples.size() == no_samples )
+			{
+				add( static_cast<int>( floorf( ( x[0] + x[1] + x[2] ) / 3.0f ) ),
+					static_cast<int>( floorf( ( y[0] + y[1] + y[2] ) / 3.0f ) ), 1.0f / 3.0f, 1.0f / 3.0f );
+			}
+		}
+	}
+
+	const std::vector<Vector3> results = BakeSamples( surfaces, samples, settings, pool );
+
+	std::vector<float> sum( size_t( width ) * height, 0.0f );
+	std::vector<int> count( size_t( width ) * height, 0 );
+	for ( size_t i = 0; i < samples.size(); ++i )
+	{
+		sum[texels[i]] += results[i].L2Norm();
+		++count[texels[i]];
+	}
+
+	for ( size_t i = 0; i < sum.size(); ++i )
+	{
+		if ( count[i] > 0 )
+		{
+			sum[i] /= count[i];
+			count[i] = 1;
+		}
+	}
+
+	// every pass extends the charts by one texel with the mean of the covered neighbours
+	for ( int pass = 0; pass < kDilation; ++pass )
+	{
+		const std::vector<int> covered = count;
+		for ( int y = 0; y < height; ++y )
+		{
+			for ( int x = 0; x < width; ++x )
+			{
+				const size_t i = x + size_t( y ) * width;
+				if ( covered[i] > 0 )
+				{
+					continue;
+				}
+
+				float value = 0.0f;
+				int no_neighbours = 0;
+				for ( int ny = ( std::max )( 0, y - 1 ); ny <= ( std::min )( height - 1, y + 1 ); ++ny )
+				{
+					for ( int nx = ( std::max )( 0, x - 1 ); nx <= ( std::min )( width - 1, x + 1 ); ++nx )
+					{
+						const size_t j = nx + size_t( ny ) * width;
+						if ( covered[j] > 0 )
+						{
+							value += sum[j];
+							++no_neighbours;
+						}
+					}
+				}
+
+				if ( no_neighbours > 0 )
+				{
+					sum[i] = value / no_neighbours;
+					count[i] = 1;
+				}
+			}
+		}
+	}
+
+	// texels not reached by the dilation are never sampled, they stay unoccluded
+	Texture3f texture( width, height );
+	for ( size_t i = 0; i < sum.size(); ++i )
+	{
+		const float visibility = ( count[i] > 0 ) ? sum[i] : 1.0f;
+		texture.data()[i] = Color3f( { visibility, visibility, visibility } );
+	}
+
+	const double seconds = std::chrono::duration<double>( std::chrono::high_resolution_clock::now() - t0 ).count();
+	printf( "Ambient occlusion texture %d x %d px (%d samples) baked in %s.\n", width, height, int( samples.size() ),
+		TimeToString( seconds ).c_str() );
+
+	return texture;
+}
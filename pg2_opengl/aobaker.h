@@ -0,0 +1,43 @@
+#ifndef AO_BAKER_H_
+#define AO_BAKER_H_
+
+#include "raycaster.h"
+#include "texture.h"
+
+/*! \struct AmbientOcclusionSettings
+\brief Parameters of the ambient occlusion bakers.
+*/
+struct AmbientOcclusionSettings
+{
+	int no_rays{ 64 }; /*!< Cosine distributed rays per vertex or texel, rounded up to whole packets. */
+	float max_distance{ 0.05f }; /*!< Length of the rays relative to the diagonal of the scene bounds, farther geometry does not occlude. */
+};
+
+/*! \fn void BakeVertexAO( std::vector<Surface *> & surfaces, const AmbientOcclusionSettings & settings, ThreadPool & pool )
+\brief Bakes the ambient visibility and the bent normal of every vertex into Vertex::color.
+
+The color becomes the bent normal (the mean unoccluded direction, model space) scaled by the visibility,
+i.e. the fraction of the cosine weighted hemisphere not blocked within settings.max_distance. Its length is
+the occlusion term and its direction replaces the normal in the irradiance lookup of pbr.vert.
+Vertices sharing the position and the normal are baked once, so the triangles of a smooth mesh stay continuous.
+The rays are cast in packets through a BVH over \a surfaces, vertices are distributed over the threads of \a pool.
+
+BakeVertexAO( surfaces ); // before the vertices are flattened into the vertex buffer
+*/
+void BakeVertexAO( std::vector<Surface *> & surfaces, const AmbientOcclusionSettings & settings = AmbientOcclusionSettings(),
+	ThreadPool & pool = ThreadPool::Default() );
+
+/*! \fn Texture3f BakeTextureAO( const std::vector<Surface *> & surfaces, const int width, const int height, const AmbientOcclusionSettings & settings, ThreadPool & pool )
+\brief Bakes the ambient visibility into a texture over the first texture coordinates of the surfaces.
+
+Every texel covered by a triangle casts rays from the corresponding surface point, texels shared by several
+triangles (tiled or mirrored coordinates) get the average. The covered area is then dilated into the empty
+texels by a few px, so bilinear filtering does not bleed the background in at the chart borders. The top row
+of the texture corresponds to v = 1 like in the material textures, all channels hold the same value.
+
+BakeTextureAO( surfaces, 1024, 1024 ).Save( "avenger_ao.exr" );
+*/
+Texture3f BakeTextureAO( const std::vector<Surface *> & surfaces, const int width, const int height,
+	const AmbientOcclusionSettings & settings = AmbientOcclusionSettings(), ThreadPool & pool = ThreadPool::Default() );
+
+#endif
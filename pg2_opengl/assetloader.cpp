@@ -0,0 +1,67 @@
+#include "pch.h"
+#include "assetloader.h"
+
+static int DefaultDecodeThreads()
+{
+	return ( std::max )( 1, int( std::thread::hardware_concurrency() ) - 1 );
+}
+
+AssetLoader::AssetLoader( const int no_threads ) : pool_( ( no_threads < 1 ) ? DefaultDecodeThreads() : no_threads )
+{
+}
+
+void AssetLoader::Submit( DecodeJob job )
+{
+	++pending_;
+
+	pool_.Enqueue( [this, job] {
+		UploadTask upload = job();
+
+		std::unique_lock<std::mutex> lock( mutex_ );
+		uploads_.push_back( upload ? upload : [] {} );
+	} );
+}
+
+int AssetLoader::Upload( const int max_tasks )
+{
+	int executed = 0;
+
+	while ( ( max_tasks < 1 ) || ( executed < max_tasks ) )
+	{
+		UploadTask upload;
+
+		{
+			std::unique_lock<std::mutex> lock( mutex_ );
+
+			if ( uploads_.empty() )
+			{
+				break;
+			}
+
+			upload = std::move( uploads_.front() );
+			uploads_.pop_front();
+		}
+
+		upload();
+		--pending_;
+		++executed;
+	}
+
+	return executed;
+}
+
+void AssetLoader::Finish()
+{
+	while ( !done() )
+	{
+		if ( Upload() == 0 )
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+bool AssetLoader::done() const
+{
+	return pending_ == 0;
+}
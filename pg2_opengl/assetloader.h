@@ -0,0 +1,57 @@
+#ifndef ASSET_LOADER_H_
+#define ASSET_LOADER_H_
+
+#include "threadpool.h"
+
+/*! \class AssetLoader
+\brief Two stage asset pipeline: decode on worker threads, upload on the GL thread.
+
+A submitted job runs on a worker thread (file IO, image decoding, OBJ parsing, ...) and returns
+an upload task. Upload tasks are queued and executed only by the thread owning the GL context
+when it calls Upload(), typically once per frame, so the window stays responsive while the
+assets are still being decoded.
+
+AssetLoader loader;
+loader.Submit( [] {
+	auto bitmap = std::make_shared<Texture3f>( "../../data/map.exr" ); // worker thread
+	return [bitmap] { glTexImage2D( ..., bitmap->data() ); }; // GL thread
+} );
+while ( !loader.done() ) loader.Upload();
+*/
+class AssetLoader
+{
+public:
+	using UploadTask = std::function<void()>;
+	using DecodeJob = std::function<UploadTask()>;
+
+	//! Starts the decoding workers.
+	/*!
+	\param no_threads number of worker threads, values < 1 leave one hardware thread for the GL thread.
+	*/
+	explicit AssetLoader( const int no_threads = 0 );
+
+	//! Schedules \a job on a worker thread, its result will be executed by Upload().
+	void Submit( DecodeJob job );
+
+	//! Executes pending upload tasks on the calling thread.
+	/*!
+	\param max_tasks maximal number of tasks to execute, values < 1 mean all pending tasks.
+	\return Number of executed upload tasks.
+	*/
+	int Upload( const int max_tasks = 0 );
+
+	//! Blocks until every submitted job is decoded and uploaded (must be called from the GL thread).
+	void Finish();
+
+	//! True when there is nothing left to decode or upload.
+	bool done() const;
+
+private:
+	mutable std::mutex mutex_;
+	std::deque<UploadTask> uploads_; /*!< Decoded assets waiting for the GL thread. */
+	std::atomic<int> pending_{ 0 }; /*!< Submitted jobs whose upload task has not been executed yet. */
+
+	ThreadPool pool_; /*!< Declared last so that the workers are joined before the queue is destroyed. */
+};
+
+#endif
@@ -0,0 +1,583 @@
+#include "pch.h"
+#include "bvh.h"
+#include "mymath.h"
+#include <algorithm>
+#include <chrono>
+
+// subtrees with more triangles are built in parallel
+static const int kParallelSubtree = 4096;
+
+// nodes with more triangles are also binned in parallel, chunk by chunk
+static const int kParallelBinning = 1 << 16;
+static const int kBinningChunk = 1 << 14;
+
+struct SAHBin
+{
+	AABB bounds;
+	int count{ 0 };
+};
+
+// the same expression for the binning and the partitioning, so both agree on every centroid
+static int CentroidBin( const float centroid, const float lower, const float scale )
+{
+	return ( std::min )( BVH::kBins - 1, int( ( centroid - lower ) * scale ) );
+}
+
+// spreads the lower 10 bits of x so that there are two zero bits between them
+static unsigned int ExpandBits( unsigned int x )
+{
+	x = ( x * 0x00010001u ) & 0xFF0000FFu;
+	x = ( x * 0x00000101u ) & 0x0F00F00Fu;
+	x = ( x * 0x00000011u ) & 0xC30C30C3u;
+	x = ( x * 0x00000005u ) & 0x49249249u;
+
+	return x;
+}
+
+// 30 bit Morton code of a point in the unit cube
+static unsigned int MortonCode( const Vector3 & p )
+{
+	const unsigned int x = static_cast<unsigned int>( clamp( p.x * 1024.0f, 0.0f, 1023.0f ) );
+	const unsigned int y = static_cast<unsigned int>( clamp( p.y * 1024.0f, 0.0f, 1023.0f ) );
+	const unsigned int z = static_cast<unsigned int>( clamp( p.z * 1024.0f, 0.0f, 1023.0f ) );
+
+	return ( ExpandBits( x ) << 2 ) | ( ExpandBits( y ) << 1 ) | ExpandBits( z );
+}
+
+static void SetBounds( BVHNode & node, const AABB & bounds )
+{
+	for ( int a = 0; a < 3; ++a )
+	{
+		node.lower[a] = bounds.lower.data[a];
+		node.upper[a] = bounds.upper.data[a];
+	}
+}
+
+static AABB NodeBounds( const BVHNode & node )
+{
+	AABB bounds;
+	bounds.lower = Vector3( node.lower[0], node.lower[1], node.lower[2] );
+	bounds.upper = Vector3( node.upper[0], node.upper[1], node.upper[2] );
+
+	return bounds;
+}
+
+void BVH::Build( const std::vector<Surface *> & surfaces, const BuildMethod method, ThreadPool & pool )
+{
+	const auto t0 = std::chrono::high_resolution_clock::now();
+
+	pool_ = &pool;
+	method_ = method;
+
+	vertices_.clear();
+	triangles_.clear();
+	sources_.clear();
+
+	for ( int s = 0; s < static_cast<int>( surfaces.size() ); ++s )
+	{
+		Surface * surface = surfaces[s];
+
+		for ( int i = 0; i < surface->no_triangles(); ++i )
+		{
+			Triangle & triangle = surface->get_triangle( i );
+			const unsigned int first = static_cast<unsigned int>( vertices_.size() );
+
+			for ( int j = 0; j < 3; ++j )
+			{
+				const Vector3 p = triangle.vertex( j ).position;
+				vertices_.push_back( { p.x, p.y, p.z } );
+			}
+			triangles_.push_back( { first, first + 1, first + 2 } );
+			sources_.push_back( { s, i } );
+		}
+	}
+
+	const int no_triangles = static_cast<int>( triangles_.size() );
+
+	primitive_info_.resize( no_triangles );
+	primitives_.resize( no_triangles );
+	pool_->ParallelFor( 0, ( no_triangles + kBinningChunk - 1 ) / kBinningChunk, [&]( const int chunk )
+	{
+		const int end = ( std::min )( no_triangles, ( chunk + 1 ) * kBinningChunk );
+		for ( int i = chunk * kBinningChunk; i < end; ++i )
+		{
+			const Triangle3ui & t = triangles_[i];
+			Primitive & primitive = primitive_info_[i];
+			primitive.bounds = AABB();
+			primitive.bounds.Merge( vertices_[t.v0] );
+			primitive.bounds.Merge( vertices_[t.v1] );
+			primitive.bounds.Merge( vertices_[t.v2] );
+			primitive.centroid = primitive.bounds.center();
+			primitives_[i] = i;
+		}
+	} );
+
+	nodes_.clear();
+	wide_nodes_.clear();
+
+	if ( no_triangles > 0 )
+	{
+		nodes_.resize( size_t( no_triangles ) * 2 - 1 );
+		no_nodes_ = 1;
+
+		if ( method_ == BuildMethod::kLBVH )
+		{
+			AABB centroid_bounds;
+			for ( const Primitive & primitive : primitive_info_ )
+			{
+				centroid_bounds.Merge( primitive.centroid );
+			}
+			const Vector3 extent = centroid_bounds.extent();
+			const Vector3 scale = Vector3( extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+				extent.y > 0.0f ? 1.0f / extent.y : 0.0f, extent.z > 0.0f ? 1.0f / extent.z : 0.0f );
+
+			std::vector<std::pair<unsigned int, int>> keys( no_triangles );
+			pool_->ParallelFor( 0, ( no_triangles + kBinningChunk - 1 ) / kBinningChunk, [&]( const int chunk )
+			{
+				const int end = ( std::min )( no_triangles, ( chunk + 1 ) * kBinningChunk );
+				for ( int i = chunk * kBinningChunk; i < end; ++i )
+				{
+					const Vector3 p = primitive_info_[i].centroid - centroid_bounds.lower;
+					keys[i] = { MortonCode( Vector3( p.x * scale.x, p.y * scale.y, p.z * scale.z ) ), i };
+				}
+			} );
+			std::sort( keys.begin(), keys.end() );
+
+			std::vector<unsigned int> codes( no_triangles );
+			for ( int i = 0; i < no_triangles; ++i )
+			{
+				codes[i] = keys[i].first;
+				primitives_[i] = keys[i].second;
+			}
+
+			BuildLBVH( 0, 0, no_triangles, codes );
+		}
+		else
+		{
+			BuildSAH( 0, 0, no_triangles );
+		}
+
+		nodes_.resize( no_nodes_ );
+	}
+
+	primitive_info_.clear();
+	primitive_info_.shrink_to_fit();
+
+	const auto t1 = std::chrono::high_resolution_clock::now();
+
+	if ( !nodes_.empty() )
+	{
+		if ( nodes_[0].leaf() )
+		{
+			// a single leaf, the wide root gets it as its only child
+			BVH8Node root;
+			for ( int i = 0; i < BVH_WIDTH; ++i )
+			{
+				root.lower_x[i] = root.lower_y[i] = root.lower_z[i] = FLT_MAX;
+				root.upper_x[i] = root.upper_y[i] = root.upper_z[i] = -FLT_MAX;
+				root.child[i] = 0;
+				root.count[i] = -1;
+			}
+			root.lower_x[0] = nodes_[0].lower[0];
+			root.lower_y[0] = nodes_[0].lower[1];
+			root.lower_z[0] = nodes_[0].lower[2];
+			root.upper_x[0] = nodes_[0].upper[0];
+			root.upper_y[0] = nodes_[0].upper[1];
+			root.upper_z[0] = nodes_[0].upper[2];
+			root.count[0] = nodes_[0].count;
+			wide_nodes_.push_back( root );
+		}
+		else
+		{
+			Collapse( 0 );
+		}
+	}
+
+	const auto t2 = std::chrono::high_resolution_clock::now();
+	build_time_ = std::chrono::duration<double, std::milli>( t1 - t0 ).count();
+	collapse_time_ = std::chrono::duration<double, std::milli>( t2 - t1 ).count();
+}
+
+void BVH::BuildSAH( const int node, const int begin, const int end )
+{
+	const int count = end - begin;
+	const int no_chunks = ( count > kParallelBinning ) ? ( count + kBinningChunk - 1 ) / kBinningChunk : 1;
+
+	// bounds of the triangles and of their centroids
+	std::vector<AABB> chunk_bounds( size_t( no_chunks ) * 2 );
+	auto bound = [&]( const int chunk )
+	{
+		const int first = begin + chunk * kBinningChunk;
+		const int last = ( no_chunks == 1 ) ? end : ( std::min )( end, first + kBinningChunk );
+		for ( int i = first; i < last; ++i )
+		{
+			const Primitive & primitive = primitive_info_[primitives_[i]];
+			chunk_bounds[chunk * 2].Merge( primitive.bounds );
+			chunk_bounds[chunk * 2 + 1].Merge( primitive.centroid );
+		}
+	};
+
+	if ( no_chunks > 1 )
+	{
+		pool_->ParallelFor( 0, no_chunks, bound );
+	}
+	else
+	{
+		bound( 0 );
+	}
+
+	AABB bounds, centroid_bounds;
+	for ( int chunk = 0; chunk < no_chunks; ++chunk )
+	{
+		bounds.Merge( chunk_bounds[chunk * 2] );
+		centroid_bounds.Merge( chunk_bounds[chunk * 2 + 1] );
+	}
+	SetBounds( nodes_[node], bounds );
+
+	if ( count <= kMinLeafSize )
+	{
+		MakeLeaf( node, begin, end );
+		return;
+	}
+
+	// bin the centroids along all three axes
+	const Vector3 extent = centroid_bounds.extent();
+	float bin_scale[3];
+	for ( int a = 0; a < 3; ++a )
+	{
+		bin_scale[a] = ( extent.data[a] > 0.0f ) ? kBins / extent.data[a] : 0.0f;
+	}
+	std::vector<SAHBin> chunk_bins( size_t( no_chunks ) * 3 * kBins );
+	auto bin = [&]( const int chunk )
+	{
+		SAHBin * bins = &chunk_bins[size_t( chunk ) * 3 * kBins];
+		const int first = begin + chunk * kBinningChunk;
+		const int last = ( no_chunks == 1 ) ? end : ( std::min )( end, first + kBinningChunk );
+		for ( int i = first; i < last; ++i )
+		{
+			const Primitive & primitive = primitive_info_[primitives_[i]];
+			for ( int a = 0; a < 3; ++a )
+			{
+				if ( extent.data[a] > 0.0f )
+				{
+					const int b = CentroidBin( primitive.centroid.data[a], centroid_bounds.lower.data[a], bin_scale[a] );
+					bins[a * kBins + b].bounds.Merge( primitive.bounds );
+					++bins[a * kBins + b].count;
+				}
+			}
+		}
+	};
+
+	if ( no_chunks > 1 )
+	{
+		pool_->ParallelFor( 0, no_chunks, bin );
+	}
+	else
+	{
+		bin( 0 );
+	}
+
+	SAHBin bins[3][kBins];
+	for ( int chunk = 0; chunk < no_chunks; ++chunk )
+	{
+		for ( int a = 0; a < 3; ++a )
+		{
+			for ( int b = 0; b < kBins; ++b )
+			{
+				const SAHBin & chunk_bin = chunk_bins[( size_t( chunk ) * 3 + a ) * kBins + b];
+				bins[a][b].bounds.Merge( chunk_bin.bounds );
+				bins[a][b].count += chunk_bin.count;
+			}
+		}
+	}
+
+	// sweep, cost = 1 + ( A_left * N_left + A_right * N_right ) / A
+	float best_cost = FLT_MAX;
+	int best_axis = -1;
+	int best_split = 0;
+	for ( int a = 0; a < 3; ++a )
+	{
+		if ( extent.data[a] <= 0.0f )
+		{
+			continue;
+		}
+
+		float right_cost[kBins];
+		AABB right;
+		int right_count = 0;
+		for ( int b = kBins - 1; b > 0; --b )
+		{
+			right.Merge( bins[a][b].bounds );
+			right_count += bins[a][b].count;
+			right_cost[b] = right.area() * right_count;
+		}
+
+		AABB left;
+		int left_count = 0;
+		for ( int b = 0; b < kBins - 1; ++b )
+		{
+			left.Merge( bins[a][b].bounds );
+			left_count += bins[a][b].count;
+			const float cost = left.area() * left_count + right_cost[b + 1];
+			if ( left_count > 0 && left_count < count && cost < best_cost )
+			{
+				best_cost = cost;
+				best_axis = a;
+				best_split = b + 1;
+			}
+		}
+	}
+	best_cost = 1.0f + best_cost / ( std::max )( bounds.area(), FLT_MIN );
+
+	int mid = begin + count / 2;
+	if ( best_axis >= 0 )
+	{
+		if ( best_cost >= count && count <= kMaxLeafSize )
+		{
+			MakeLeaf( node, begin, end );
+			return;
+		}
+
+		const float lower = centroid_bounds.lower.data[best_axis];
+		const float scale = bin_scale[best_axis];
+		mid = int( std::partition( primitives_.begin() + begin, primitives_.begin() + end, [&]( const int i )
+		{
+			return CentroidBin( primitive_info_[i].centroid.data[best_axis], lower, scale ) < best_split;
+		} ) - primitives_.begin() );
+
+		if ( mid == begin || mid == end )
+		{
+			mid = begin + count / 2;
+		}
+	}
+	else if ( count <= kMaxLeafSize )
+	{
+		MakeLeaf( node, begin, end );
+		return; // all centroids coincide
+	}
+
+	const int left = AllocateNodes();
+	nodes_[node].offset = left;
+	nodes_[node].count = 0;
+
+	if ( count > kParallelSubtree )
+	{
+		pool_->ParallelFor( 0, 2, [&]( const int i )
+		{
+			( i == 0 ) ? BuildSAH( left, begin, mid ) : BuildSAH( left + 1, mid, end );
+		} );
+	}
+	else
+	{
+		BuildSAH( left, begin, mid );
+		BuildSAH( left + 1, mid, end );
+	}
+}
+
+void BVH::BuildLBVH( const int node, const int begin, const int end, const std::vector<unsigned int> & codes )
+{
+	const int count = end - begin;
+
+	if ( count <= kMinLeafSize )
+	{
+		MakeLeaf( node, begin, end );
+		return;
+	}
+
+	// the first triangle with the highest differing bit set, the middle if all codes are equal
+	int mid = begin + count / 2;
+	const unsigned int difference = codes[begin] ^ codes[end - 1];
+	if ( difference != 0 )
+	{
+		int bit = 29;
+		while ( !( ( difference >> bit ) & 1 ) )
+		{
+			--bit;
+		}
+		mid = int( std::partition_point( codes.begin() + begin, codes.begin() + end, [bit]( const unsigned int code )
+		{
+			return !( ( code >> bit ) & 1 );
+		} ) - codes.begin() );
+	}
+
+	const int left = AllocateNodes();
+	nodes_[node].offset = left;
+	nodes_[node].count = 0;
+
+	if ( count > kParallelSubtree )
+	{
+		pool_->ParallelFor( 0, 2, [&]( const int i )
+		{
+			( i == 0 ) ? BuildLBVH( left, begin, mid, codes ) : BuildLBVH( left + 1, mid, end, codes );
+		} );
+	}
+	else
+	{
+		BuildLBVH( left, begin, mid, codes );
+		BuildLBVH( left + 1, mid, end, codes );
+	}
+
+	// bottom-up bounds
+	AABB bounds = NodeBounds( nodes_[left] );
+	bounds.Merge( NodeBounds( nodes_[left + 1] ) );
+	SetBounds( nodes_[node], bounds );
+}
+
+void BVH::MakeLeaf( const int node, const int begin, const int end )
+{
+	AABB bounds;
+	for ( int i = begin; i < end; ++i )
+	{
+		bounds.Merge( primitive_info_[primitives_[i]].bounds );
+	}
+
+	SetBounds( nodes_[node], bounds );
+	nodes_[node].offset = begin;
+	nodes_[node].count = end - begin;
+}
+
+int BVH::AllocateNodes()
+{
+	return no_nodes_.fetch_add( 2 );
+}
+
+int BVH::Collapse( const int node )
+{
+	const int index = static_cast<int>( wide_nodes_.size() );
+	wide_nodes_.emplace_back();
+
+	// open the child with the largest surface area until all slots are used
+	int children[BVH_WIDTH] = { nodes_[node].offset, nodes_[node].offset + 1 };
+	int no_children = 2;
+	while ( no_children < BVH_WIDTH )
+	{
+		int largest = -1;
+		float largest_area = -1.0f;
+		for ( int i = 0; i < no_children; ++i )
+		{
+			const BVHNode & child = nodes_[children[i]];
+			const float area = NodeBounds( child ).area();
+			if ( !child.leaf() && area > largest_area )
+			{
+				largest = i;
+				largest_area = area;
+			}
+		}
+
+		if ( largest < 0 )
+		{
+			break;
+		}
+
+		const int opened = children[largest];
+		children[largest] = nodes_[opened].offset;
+		children[no_children++] = nodes_[opened].offset + 1;
+	}
+
+	BVH8Node wide;
+	for ( int i = 0; i < BVH_WIDTH; ++i )
+	{
+		if ( i < no_children )
+		{
+			const BVHNode & child = nodes_[children[i]];
+			wide.lower_x[i] = child.lower[0];
+			wide.lower_y[i] = child.lower[1];
+			wide.lower_z[i] = child.lower[2];
+			wide.upper_x[i] = child.upper[0];
+			wide.upper_y[i] = child.upper[1];
+			wide.upper_z[i] = child.upper[2];
+			wide.count[i] = child.count;
+			wide.child[i] = child.leaf() ? child.offset : Collapse( children[i] );
+		}
+		else
+		{
+			wide.lower_x[i] = wide.lower_y[i] = wide.lower_z[i] = FLT_MAX;
+			wide.upper_x[i] = wide.upper_y[i] = wide.upper_z[i] = -FLT_MAX;
+			wide.child[i] = 0;
+			wide.count[i] = -1;
+		}
+	}
+	wide_nodes_[index] = wide; // the recursion may have moved the array
+
+	return index;
+}
+
+void BVH::Report() const
+{
+	int no_leaves = 0;
+	int max_leaf = 0;
+	for ( const BVHNode & node : nodes_ )
+	{
+		if ( node.leaf() )
+		{
+			++no_leaves;
+			max_leaf = ( std::max )( max_leaf, node.count );
+		}
+	}
+
+	printf( "BVH (%s): %d triangles, %d nodes, %d leaves (%0.2f triangles on average, %d at most), SAH cost %0.2f\n",
+		( method_ == BuildMethod::kLBVH ) ? "LBVH" : "binned SAH", static_cast<int>( triangles_.size() ),
+		static_cast<int>( nodes_.size() ), no_leaves, triangles_.size() / double( ( std::max )( no_leaves, 1 ) ), max_leaf, sah_cost() );
+	printf( "  built in %0.1f ms on %d threads, %d wide nodes collapsed in %0.1f ms, %0.1f MB\n",
+		build_time_, pool_ ? pool_->no_threads() : 0, static_cast<int>( wide_nodes_.size() ), collapse_time_,
+		memory_size() / ( 1024.0 * 1024.0 ) );
+}
+
+const std::vector<BVHNode> & BVH::nodes() const
+{
+	return nodes_;
+}
+
+const std::vector<BVH8Node> & BVH::wide_nodes() const
+{
+	return wide_nodes_;
+}
+
+const std::vector<int> & BVH::primitives() const
+{
+	return primitives_;
+}
+
+const std::vector<Vertex3f> & BVH::vertices() const
+{
+	return vertices_;
+}
+
+const std::vector<Triangle3ui> & BVH::triangles() const
+{
+	return triangles_;
+}
+
+void BVH::source( const int triangle, int & surface, int & surface_triangle ) const
+{
+	surface = sources_[triangle].first;
+	surface_triangle = sources_[triangle].second;
+}
+
+AABB BVH::bounds() const
+{
+	return nodes_.empty() ? AABB() : NodeBounds( nodes_[0] );
+}
+
+float BVH::sah_cost() const
+{
+	const float root_area = bounds().area();
+	if ( root_area <= 0.0f )
+	{
+		return 0.0f;
+	}
+
+	double cost = 0.0;
+	for ( const BVHNode & node : nodes_ )
+	{
+		cost += NodeBounds( node ).area() * ( node.leaf() ? node.count : 1 );
+	}
+
+	return float( cost / root_area );
+}
+
+size_t BVH::memory_size() const
+{
+	return nodes_.size() * sizeof( BVHNode ) + wide_nodes_.size() * sizeof( BVH8Node ) + primitives_.size() * sizeof( int ) +
+		vertices_.size() * sizeof( Vertex3f ) + triangles_.size() * sizeof( Triangle3ui ) + sources_.size() * sizeof( sources_[0] );
+}
@@ -0,0 +1,134 @@
+#ifndef BVH_H_
+#define BVH_H_
+
+#include "aabb.h"
+#include "structs.h"
+#include "surface.h"
+#include "threadpool.h"
+
+/*! \struct BVHNode
+\brief 32 B node of the binary BVH, the two children of an inner node are stored next to each other.
+*/
+struct BVHNode
+{
+	float lower[3]; /*!< Minimum corner of the node bounds. */
+	int offset; /*!< Inner node: index of the left child (the right one follows), leaf: first item in BVH::primitives. */
+	float upper[3]; /*!< Maximum corner of the node bounds. */
+	int count; /*!< Number of triangles of a leaf, 0 for inner nodes. */
+
+	bool leaf() const
+	{
+		return count > 0;
+	}
+};
+
+/*! \def BVH_WIDTH
+\brief Branching factor of the wide BVH, one child per lane of an AVX register.
+*/
+#define BVH_WIDTH 8
+
+/*! \struct BVH8Node
+\brief Node of the wide BVH with the child bounds stored as separate arrays (SoA) for SIMD slab tests.
+
+Unused slots have empty bounds (lower > upper), so they never pass the slab test.
+*/
+struct BVH8Node
+{
+	float lower_x[BVH_WIDTH];
+	float upper_x[BVH_WIDTH];
+	float lower_y[BVH_WIDTH];
+	float upper_y[BVH_WIDTH];
+	float lower_z[BVH_WIDTH];
+	float upper_z[BVH_WIDTH];
+	int child[BVH_WIDTH]; /*!< Inner child: index of the wide node, leaf: first item in BVH::primitives. */
+	int count[BVH_WIDTH]; /*!< Number of triangles of a leaf child, 0 for an inner child, -1 for an unused slot. */
+};
+
+/*! \class BVH
+\brief Bounding volume hierarchy over the triangles of all surfaces of a scene.
+
+The triangles are flattened into an indexed mesh (Vertex3f and Triangle3ui, the layout Embree expects).
+The binary tree is built either top-down with the surface area heuristic evaluated on kBins centroid bins
+(both the binning of large nodes and the subtrees run in parallel), or as an LBVH by splitting the triangles
+sorted along the Morton curve of their centroids, which is several times faster to build but gives a worse tree.
+The binary tree is then collapsed into the wide BVH8Node tree for SIMD traversal.
+
+BVH bvh;
+bvh.Build( surfaces ); // or bvh.Build( surfaces, BVH::BuildMethod::kLBVH )
+bvh.Report();
+*/
+class BVH
+{
+public:
+	enum class BuildMethod : char
+	{
+		kBinnedSAH = 0, /*!< Top-down, surface area heuristic on centroid bins. */
+		kLBVH = 1, /*!< Linear BVH, splits on the highest differing bit of the 30 bit Morton codes. */
+	};
+
+	//! Number of centroid bins of the SAH builder.
+	static const int kBins = 16;
+
+	//! Leaves of the SAH builder do not get larger than this, LBVH leaves are split down to kMinLeafSize.
+	static const int kMaxLeafSize = 8;
+	static const int kMinLeafSize = 2;
+
+	//! Flattens the triangles of \a surfaces and builds both trees, the surfaces may be deleted afterwards.
+	void Build( const std::vector<Surface *> & surfaces, const BuildMethod method = BuildMethod::kBinnedSAH,
+		ThreadPool & pool = ThreadPool::Default() );
+
+	//! Prints the build time, the node statistics, the SAH cost and the memory footprint.
+	void Report() const;
+
+	const std::vector<BVHNode> & nodes() const;
+	const std::vector<BVH8Node> & wide_nodes() const;
+
+	//! Triangle indices in the order referenced by the leaves.
+	const std::vector<int> & primitives() const;
+
+	const std::vector<Vertex3f> & vertices() const;
+	const std::vector<Triangle3ui> & triangles() const;
+
+	//! Source of a flattened triangle, the index of its surface and its index within the surface.
+	void source( const int triangle, int & surface, int & surface_triangle ) const;
+
+	//! Bounds of the whole scene.
+	AABB bounds() const;
+
+	//! Expected cost of a random ray (SAH with unit costs of a node visit and a triangle test).
+	float sah_cost() const;
+
+	//! Memory of the trees, the primitive references and the mesh (B).
+	size_t memory_size() const;
+
+private:
+	struct Primitive
+	{
+		AABB bounds;
+		Vector3 centroid;
+	};
+
+	void BuildSAH( const int node, const int begin, const int end );
+	void BuildLBVH( const int node, const int begin, const int end, const std::vector<unsigned int> & codes );
+	void MakeLeaf( const int node, const int begin, const int end );
+	int AllocateNodes();
+	int Collapse( const int node );
+
+	ThreadPool * pool_{ nullptr };
+	BuildMethod method_{ BuildMethod::kBinnedSAH };
+
+	std::vector<Vertex3f> vertices_;
+	std::vector<Triangle3ui> triangles_;
+	std::vector<std::pair<int, int>> sources_; /*!< Surface and triangle within the surface. */
+
+	std::vector<Primitive> primitive_info_; /*!< Build only. */
+	std::vector<int> primitives_;
+	std::vector<BVHNode> nodes_;
+	std::atomic<int> no_nodes_{ 0 };
+	std::vector<BVH8Node> wide_nodes_;
+
+	double build_time_{ 0.0 }; /*!< Binary tree (ms). */
+	double collapse_time_{ 0.0 }; /*!< Wide tree (ms). */
+};
+
+#endif
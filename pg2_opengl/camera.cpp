@@ -13,6 +13,19 @@ Camera::Camera(const int width, const int height, const float fov_y,
 	Update();
 }
 
+//radical inverse of the index in the given base, <0, 1)
+static float Halton(int index, const int base)
+{
+	float f = 1.0f;
+	float r = 0.0f;
+	while (index > 0) {
+		f /= base;
+		r += f * (index % base);
+		index /= base;
+	}
+	return r;
+}
+
 Vector3 Camera::view_from() const
 {
 	return view_from_;
@@ -28,6 +41,16 @@ float Camera::focal_length() const
 	return f_y_;
 }
 
+float Camera::fov_y() const
+{
+	return fov_y_;
+}
+
+float Camera::aspect_ratio() const
+{
+	return width_ / (float)height_;
+}
+
 void Camera::set_fov_y(const float fov_y)
 {
 	assert(fov_y > 0.0);
@@ -51,8 +74,8 @@ Matrix4x4 Camera::BuildMLPMatrix(Vector3 lightPosition) {
 	VM.EuclideanInverse();
 
 	//pdf page 20 a dl
-	float n = 1.0f;
-	float f = 1000.0f;
+	float n = z_near_;
+	float f = z_far_;
 	float aspectRatio = width_ / (float)height_;
 
 	//orig: 2* n * tanf(...)
@@ -90,8 +113,8 @@ void Camera::Update()
 	viewMatrix.EuclideanInverse();
 
 	//pdf page 20 a dl
-	float n = 1.0f;
-	float f = 1000.0f;
+	float n = z_near_;
+	float f = z_far_;
 	float aspectRatio = width_ / (float)height_;
 
 	//orig: 2* n * tanf(...)
@@ -107,6 +130,46 @@ void Camera::Update()
 	projectionMatrix.set(2, 2, a);
 	projectionMatrix.set(2, 3, b);
 	projectionMatrix.set(3, 2, -1);
+	projectionMatrix.set(3, 3, 0); // clip w = view depth, the matrix starts as identity
+	projectionMatrix.set(0, 2, 0);
+	projectionMatrix.set(1, 2, 0);
+	unjitteredProjectionMatrix = projectionMatrix;
+
+	//16 subpixel positions, the TAA accumulates them over the frames
+	if (jitter_) {
+		jitter_index_ = jitter_index_ % 16 + 1;
+		jitter_x_ = Halton(jitter_index_, 2) - 0.5f;
+		jitter_y_ = Halton(jitter_index_, 3) - 0.5f;
+	}
+	else {
+		jitter_x_ = 0.0f;
+		jitter_y_ = 0.0f;
+	}
+
+	//clip w = -z, so the NDC offset goes to the third column
+	projectionMatrix.set(0, 2, -2.0f * jitter_x_ / width_);
+	projectionMatrix.set(1, 2, -2.0f * jitter_y_ / height_);
+}
+
+void Camera::set_jitter(const bool enabled)
+{
+	jitter_ = enabled;
+}
+
+Matrix4x4 Camera::InverseProjection() const
+{
+	const float a = unjitteredProjectionMatrix.get(2, 2);
+	const float b = unjitteredProjectionMatrix.get(2, 3);
+
+	Matrix4x4 inverse;
+	inverse.set(0, 0, 1.0f / unjitteredProjectionMatrix.get(0, 0));
+	inverse.set(1, 1, 1.0f / unjitteredProjectionMatrix.get(1, 1));
+	inverse.set(2, 2, 0);
+	inverse.set(2, 3, -1);
+	inverse.set(3, 2, 1.0f / b);
+	inverse.set(3, 3, a / b);
+
+	return inverse;
 }
 
 void Camera::MoveForward(const float dt)
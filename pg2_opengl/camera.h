@@ -23,6 +23,8 @@ public:
 	Vector3 view_from() const;
 	Matrix3x3 M_c_w() const;
 	float focal_length() const;
+	float fov_y() const;
+	float aspect_ratio() const;
 
 	void set_fov_y(const float fov_y);
 
@@ -30,17 +32,26 @@ public:
 
 	void Update();
 
+	//Temporal anti-aliasing, every Update shifts the projection by a subpixel offset of the Halton (2, 3) sequence
+	void set_jitter(const bool enabled);
+	Matrix4x4 InverseProjection() const; // inverse of unjitteredProjectionMatrix
+
 	void MoveForward(const float dt);
 
 
 	Matrix4x4 viewMatrix;
 	Matrix4x4 projectionMatrix;
+	Matrix4x4 unjitteredProjectionMatrix; // for the motion vectors
 	Matrix4x4 MLP;
 
 	int width_{ 640 }; // image width (px)
 	int height_{ 480 };  // image height (px)
+	float z_near_{ 1.0f }; // near clipping plane distance
+	float z_far_{ 1000.0f }; // far clipping plane distance
 	Vector3 view_from_; // ray origin or eye or O
 	Vector3 view_at_; // target T
+	float jitter_x_{ 0.0f }; // subpixel offset of the current projection (px)
+	float jitter_y_{ 0.0f };
 
 private:
 	float fov_y_{ 0.785f }; // vertical field of view (rad)
@@ -51,6 +62,9 @@ private:
 	float f_y_{ 1.0f }; // focal lenght (px)
 
 	Matrix3x3 M_c_w_; // transformation matrix from CS -> WS	
+
+	bool jitter_{ false };
+	int jitter_index_{ 0 }; // 1 - 16
 };
 
 #endif
@@ -0,0 +1,70 @@
+// clustered point lights, see ClusteredLights
+#define MAX_LIGHTS_PER_CLUSTER 128
+
+struct PointLight {
+	vec4 position_radius; // view space position, range
+	vec4 color;
+};
+
+layout (std430, binding = 3) readonly buffer Lights {
+	PointLight lights[];
+};
+
+layout (std430, binding = 4) readonly buffer ClusterLightCounts {
+	uint cluster_light_count[];
+};
+
+layout (std430, binding = 5) readonly buffer ClusterLightIndices {
+	uint cluster_light_indices[];
+};
+
+layout (std140, binding = 3) uniform Clusters {
+	uvec4 cluster_grid; // x, y, z, number of lights
+	vec4 cluster_params; // tile width (px), tile height (px), slice scale, slice bias
+	vec4 cluster_frustum; // tan of the half fov in x and y, near, far
+};
+
+uint ClusterIndex(vec2 frag_coord, float depth)
+{
+	uvec2 tile = min(uvec2(frag_coord / cluster_params.xy), cluster_grid.xy - 1u);
+	uint slice = uint(clamp(log(depth) * cluster_params.z - cluster_params.w, 0.0, float(cluster_grid.z - 1u)));
+	return tile.x + cluster_grid.x * (tile.y + cluster_grid.y * slice);
+}
+
+// Cook-Torrance GGX direct light of the point lights overlapping the cluster of the pixel (everything in view space), needs pbr_common.glsl
+vec3 ClusteredLighting(vec2 frag_coord, vec3 position_vs, vec3 n_vs, vec3 albedo, float roughness, float metalness, vec3 F0)
+{
+	vec3 Lo = vec3(0.0);
+	if (cluster_grid.w == 0u) {
+		return Lo;
+	}
+
+	vec3 v_vs = normalize(-position_vs);
+	float NV = max(dot(n_vs, v_vs), 1e-4);
+	uint cluster = ClusterIndex(frag_coord, -position_vs.z);
+	uint count = cluster_light_count[cluster];
+
+	for (uint i = 0u; i < count; ++i) {
+		PointLight point_light = lights[cluster_light_indices[cluster * MAX_LIGHTS_PER_CLUSTER + i]];
+		vec3 to_light = point_light.position_radius.xyz - position_vs;
+		float d2 = dot(to_light, to_light);
+		float r2 = point_light.position_radius.w * point_light.position_radius.w;
+		if (d2 >= r2) continue;
+
+		vec3 l_vs = to_light * inversesqrt(d2);
+		vec3 h_vs = normalize(l_vs + v_vs);
+		float NL = max(dot(n_vs, l_vs), 0.0);
+
+		// inverse square falloff windowed to zero at the range of the light
+		float window = 1.0 - (d2 / r2) * (d2 / r2);
+		vec3 radiance = point_light.color.rgb * (window * window / (d2 + 1.0));
+
+		vec3 F_l = F0 + (1.0 - F0) * pow(1.0 - max(dot(h_vs, v_vs), 0.0), 5.0);
+		vec3 kD_l = (vec3(1.0) - F_l) * (1.0 - metalness);
+		vec3 specular = DistributionGGX(n_vs, h_vs, roughness) * GeometrySmith(n_vs, v_vs, l_vs, roughness) * F_l / (4.0 * NV * max(NL, 1e-4));
+
+		Lo += (kD_l * albedo / PI + specular) * radiance * NL;
+	}
+
+	return Lo;
+}
@@ -0,0 +1,190 @@
+#include "pch.h"
+#include "clusteredlights.h"
+#include "glutils.h"
+#include "utils.h"
+
+// std430 layouts of the buffers in light_clusters.comp and pbr.frag
+struct GLPointLight
+{
+	GLfloat position_radius[4]; // view space
+	GLfloat color[4];
+};
+
+// std140 layout of the Clusters block
+struct GLClusters
+{
+	GLuint grid[4]; // x, y, z, number of lights
+	GLfloat params[4]; // tile width (px), tile height (px), slice scale, slice bias
+	GLfloat frustum[4]; // tan of the half fov in x and y, near, far
+};
+
+ClusteredLights::ClusteredLights( const int grid_x, const int grid_y, const int grid_z ) :
+	grid_x_( grid_x ), grid_y_( grid_y ), grid_z_( grid_z )
+{
+}
+
+ClusteredLights::~ClusteredLights()
+{
+	if ( program_ )
+	{
+		glDeleteProgram( program_ );
+		GLuint buffers[] = { ssbo_lights_, ssbo_counts_, ssbo_indices_, ubo_clusters_ };
+		glDeleteBuffers( 4, buffers );
+	}
+}
+
+void ClusteredLights::Init()
+{
+	const GLsizeiptr no_clusters = GLsizeiptr( this->no_clusters() );
+
+	glGenBuffers( 1, &ssbo_counts_ );
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, ssbo_counts_ );
+	glBufferData( GL_SHADER_STORAGE_BUFFER, no_clusters * sizeof( GLuint ), nullptr, GL_DYNAMIC_DRAW );
+	const GLuint zero = 0;
+	glClearBufferData( GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero ); // no lights until the first Update
+	glBindBufferBase( GL_SHADER_STORAGE_BUFFER, 4, ssbo_counts_ );
+
+	glGenBuffers( 1, &ssbo_indices_ );
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, ssbo_indices_ );
+	glBufferData( GL_SHADER_STORAGE_BUFFER, no_clusters * MAX_LIGHTS_PER_CLUSTER * sizeof( GLuint ), nullptr, GL_DYNAMIC_DRAW );
+	glBindBufferBase( GL_SHADER_STORAGE_BUFFER, 5, ssbo_indices_ );
+
+	// grows with the number of lights, see Update
+	glGenBuffers( 1, &ssbo_lights_ );
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, ssbo_lights_ );
+	lights_capacity_ = sizeof( GLPointLight );
+	glBufferData( GL_SHADER_STORAGE_BUFFER, lights_capacity_, nullptr, GL_DYNAMIC_DRAW );
+	glBindBufferBase( GL_SHADER_STORAGE_BUFFER, 3, ssbo_lights_ );
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, 0 );
+
+	GLClusters clusters = {};
+	clusters.grid[0] = grid_x_;
+	clusters.grid[1] = grid_y_;
+	clusters.grid[2] = grid_z_;
+	glGenBuffers( 1, &ubo_clusters_ );
+	glBindBuffer( GL_UNIFORM_BUFFER, ubo_clusters_ );
+	glBufferData( GL_UNIFORM_BUFFER, sizeof( clusters ), &clusters, GL_DYNAMIC_DRAW );
+	glBindBufferBase( GL_UNIFORM_BUFFER, 3, ubo_clusters_ );
+	glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+
+	program_ = CreateProgram( { CompileShader( GL_COMPUTE_SHADER, "light_clusters.comp" ) } );
+}
+
+void ClusteredLights::AddRandomLights( const int count, const AABB & bounds, const float radius )
+{
+	const Vector3 extent = bounds.extent();
+	const float speed = 0.1f * ( std::max )( extent.x, ( std::max )( extent.y, extent.z ) ); // crosses the scene in about ten seconds
+
+	for ( int i = 0; i < count; ++i )
+	{
+		PointLight light;
+		light.position = bounds.lower + Vector3( Random() * extent.x, Random() * extent.y, Random() * extent.z );
+		light.radius = radius * Random( 0.5f, 1.5f );
+
+		// saturated random hue, the intensity is scaled so that the light is visible over its whole range
+		Vector3 color = Vector3( Random(), Random(), Random() );
+		color /= ( std::max )( color.x, ( std::max )( color.y, ( std::max )( color.z, 1e-3f ) ) );
+		light.color = color * ( 0.5f * light.radius * light.radius );
+
+		light.velocity = Vector3( Random( -1.0f, 1.0f ), Random( -1.0f, 1.0f ), Random( -1.0f, 1.0f ) ) * speed;
+
+		lights_.push_back( light );
+	}
+}
+
+void ClusteredLights::Animate( const float dt, const AABB & bounds )
+{
+	for ( PointLight & light : lights_ )
+	{
+		light.position += light.velocity * dt;
+
+		for ( int a = 0; a < 3; ++a )
+		{
+			if ( ( light.position.data[a] < bounds.lower.data[a] && light.velocity.data[a] < 0.0f ) ||
+				( light.position.data[a] > bounds.upper.data[a] && light.velocity.data[a] > 0.0f ) )
+			{
+				light.velocity.data[a] = -light.velocity.data[a];
+			}
+		}
+	}
+}
+
+void ClusteredLights::Update( const Matrix4x4 & view, const Matrix4x4 & model, const float fov_y, const float aspect,
+	const float z_near, const float z_far, const int width, const int height )
+{
+	const int no_lights = static_cast<int>( lights_.size() );
+
+	// lights are transformed on the CPU, the fragment shader then works in view space without any matrix
+	if ( no_lights > 0 )
+	{
+		const Matrix4x4 model_view = view * model;
+		std::vector<GLPointLight> gl_lights( no_lights );
+
+		for ( int i = 0; i < no_lights; ++i )
+		{
+			const PointLight & light = lights_[i];
+			for ( int r = 0; r < 3; ++r )
+			{
+				gl_lights[i].position_radius[r] = model_view.get( r, 0 ) * light.position.x + model_view.get( r, 1 ) * light.position.y +
+					model_view.get( r, 2 ) * light.position.z + model_view.get( r, 3 );
+				gl_lights[i].color[r] = light.color.data[r];
+			}
+			gl_lights[i].position_radius[3] = light.radius;
+			gl_lights[i].color[3] = 0.0f;
+		}
+
+		const GLsizeiptr size = no_lights * sizeof( GLPointLight );
+		glBindBuffer( GL_SHADER_STORAGE_BUFFER, ssbo_lights_ );
+		if ( size > lights_capacity_ )
+		{
+			lights_capacity_ = size;
+			glBufferData( GL_SHADER_STORAGE_BUFFER, lights_capacity_, gl_lights.data(), GL_DYNAMIC_DRAW );
+		}
+		else
+		{
+			glBufferSubData( GL_SHADER_STORAGE_BUFFER, 0, size, gl_lights.data() );
+		}
+		glBindBuffer( GL_SHADER_STORAGE_BUFFER, 0 );
+	}
+
+	// slice = log( depth ) * scale - bias, i.e. slices of equal ratio of their far and near depths
+	const float log_ratio = logf( z_far / z_near );
+	GLClusters clusters;
+	clusters.grid[0] = grid_x_;
+	clusters.grid[1] = grid_y_;
+	clusters.grid[2] = grid_z_;
+	clusters.grid[3] = no_lights;
+	clusters.params[0] = width / float( grid_x_ );
+	clusters.params[1] = height / float( grid_y_ );
+	clusters.params[2] = grid_z_ / log_ratio;
+	clusters.params[3] = grid_z_ * logf( z_near ) / log_ratio;
+	clusters.frustum[1] = tanf( fov_y * 0.5f );
+	clusters.frustum[0] = clusters.frustum[1] * aspect;
+	clusters.frustum[2] = z_near;
+	clusters.frustum[3] = z_far;
+
+	glBindBuffer( GL_UNIFORM_BUFFER, ubo_clusters_ );
+	glBufferSubData( GL_UNIFORM_BUFFER, 0, sizeof( clusters ), &clusters );
+	glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+
+	if ( no_lights > 0 )
+	{
+		// one invocation per cluster
+		GLint program = 0;
+		glGetIntegerv( GL_CURRENT_PROGRAM, &program );
+		glUseProgram( program_ );
+		glDispatchCompute( ( no_clusters() + 63 ) / 64, 1, 1 );
+		glMemoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT );
+		glUseProgram( program );
+	}
+}
+
+std::vector<PointLight> & ClusteredLights::lights()
+{
+	return lights_;
+}
+
+int ClusteredLights::no_clusters() const
+{
+	return grid_x_ * grid_y_ * grid_z_;
+}
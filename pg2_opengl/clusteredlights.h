@@ -0,0 +1,81 @@
+#ifndef CLUSTERED_LIGHTS_H_
+#define CLUSTERED_LIGHTS_H_
+
+#include "aabb.h"
+
+/*! \def MAX_LIGHTS_PER_CLUSTER
+\brief Capacity of the light index list of a single cluster (must match light_clusters.comp and pbr.frag).
+*/
+#define MAX_LIGHTS_PER_CLUSTER 128
+
+/*! \struct PointLight
+\brief Point light with a finite range, the falloff is windowed to reach zero at \a radius.
+*/
+struct PointLight
+{
+	Vector3 position; /*!< Position in the model space of the scene. */
+	float radius{ 1.0f }; /*!< Range of the light. */
+	Vector3 color{ Vector3( 1.0f, 1.0f, 1.0f ) }; /*!< Radiant intensity (linear RGB). */
+	Vector3 velocity; /*!< Used by Animate only. */
+};
+
+/*! \class ClusteredLights
+\brief Light list in a shader storage buffer binned into view space clusters every frame.
+
+The view frustum is divided into a grid of screen tiles and exponentially spaced depth slices.
+A compute pass (light_clusters.comp) tests every light sphere against every cluster box and writes
+the indices of the overlapping lights, so the fragment shader loops only over the lights of its cluster.
+
+Bindings: lights SSBO 3, cluster light counts SSBO 4, cluster light indices SSBO 5, Clusters UBO 3.
+
+ClusteredLights lights; // GL thread
+lights.Init();
+lights.AddRandomLights( 256, scene_bounds, 5.0f );
+lights.Update( view, model, fov_y, aspect, z_near, z_far, width, height ); // every frame before drawing
+*/
+class ClusteredLights
+{
+public:
+	ClusteredLights( const int grid_x = 16, const int grid_y = 9, const int grid_z = 24 );
+	~ClusteredLights();
+
+	ClusteredLights( const ClusteredLights & ) = delete;
+	ClusteredLights & operator=( const ClusteredLights & ) = delete;
+
+	//! Creates the buffers and compiles the binning shader (GL thread).
+	void Init();
+
+	//! Adds \a count lights with random colors and velocities uniformly distributed in \a bounds.
+	void AddRandomLights( const int count, const AABB & bounds, const float radius );
+
+	//! Moves the lights along their velocities, they bounce off the faces of \a bounds.
+	void Animate( const float dt, const AABB & bounds );
+
+	//! Uploads the lights in view space and bins them into the clusters (GL thread).
+	/*!
+	\param view world -> view space matrix of the camera.
+	\param model model -> world matrix of the scene the lights belong to.
+	*/
+	void Update( const Matrix4x4 & view, const Matrix4x4 & model, const float fov_y, const float aspect,
+		const float z_near, const float z_far, const int width, const int height );
+
+	std::vector<PointLight> & lights();
+
+	int no_clusters() const;
+
+private:
+	std::vector<PointLight> lights_;
+
+	int grid_x_;
+	int grid_y_;
+	int grid_z_;
+
+	GLuint ssbo_lights_{ 0 };
+	GLsizeiptr lights_capacity_{ 0 }; // bytes
+	GLuint ssbo_counts_{ 0 };
+	GLuint ssbo_indices_{ 0 };
+	GLuint ubo_clusters_{ 0 };
+	GLuint program_{ 0 };
+};
+
+#endif
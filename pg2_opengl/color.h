@@ -26,7 +26,7 @@ PNG uchar, RGB(A), sRGB
 	kSRGB,
 };*/
 
-#define FAST_INTERP
+//#define FAST_INTERP // Texture::texel returns the nearest pixel instead of the bilinear interpolation
 constexpr auto GAMMA = 2.4f;
 
 template <int N, class T>
@@ -259,6 +259,8 @@ public:
 		return srgb;
 	}
 
+	typedef T value_type;
+
 	std::array<T, N> data;
 	static const int channels = N;
 	//static const ColorSpaces colorSpace = ColorSpaces::kLinearRGB; // default color space
@@ -0,0 +1,76 @@
+#version 450 core
+#extension GL_ARB_bindless_texture : require
+#extension GL_ARB_gpu_shader_int64 : require
+// lighting pass of the deferred path - IBL, clustered point lights and shadows of the G-buffer pixels
+
+// ### G-buffer, see gbuffer.frag
+uniform sampler2D gbuffer_normal;
+uniform sampler2D gbuffer_albedo;
+uniform sampler2D gbuffer_material;
+uniform sampler2D gbuffer_depth;
+
+uniform vec4 frustum; // tan of the half fov in x and y, near, far
+uniform vec2 render_size; // viewport, smaller than the G-buffer with the dynamic resolution
+uniform mat4 mv; // Model View (rigid), the IBL and the cascades work in model space like in the forward shaders
+uniform vec3 lightPos; // the sun of the forward shaders
+uniform int shadows_enabled;
+
+#include "pbr_common.glsl"
+#include "clustered_lights.glsl"
+#include "shadow.glsl"
+
+out vec4 FragColor;
+
+vec3 OctahedralDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0) {
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	}
+	return normalize(n);
+}
+
+void main( void )
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(gbuffer_depth, pixel, 0).r;
+	if (depth >= 1.0) {
+		FragColor = vec4(0.0, 0.0, 0.0, 1.0); // background
+		return;
+	}
+
+	//view space position from the depth, inverse of Camera::projectionMatrix
+	vec2 ndc = gl_FragCoord.xy / render_size * 2.0 - 1.0;
+	float z_ndc = depth * 2.0 - 1.0;
+	float view_depth = 2.0 * frustum.z * frustum.w / ((frustum.w + frustum.z) - z_ndc * (frustum.w - frustum.z));
+	vec3 position_vs = vec3(ndc * frustum.xy * view_depth, -view_depth);
+
+	vec3 n_vs = OctahedralDecode(texelFetch(gbuffer_normal, pixel, 0).xy);
+	vec4 albedo_ao = texelFetch(gbuffer_albedo, pixel, 0);
+	vec3 albedo = albedo_ao.rgb;
+	float ao = albedo_ao.a;
+	vec3 rma = texelFetch(gbuffer_material, pixel, 0).rgb;
+	float roughness = rma.r;
+	float metalness = rma.g;
+	float IOR = 1.0 + 2.0 * rma.b;
+
+	//view -> model space
+	mat3 R_t = transpose(mat3(mv));
+	vec3 position = R_t * (position_vs - mv[3].xyz);
+	vec3 n = normalize(R_t * n_vs);
+	vec3 W0 = normalize(R_t * -position_vs);
+	vec3 L = normalize(lightPos - position);
+
+	//IBL of the Cook-Torrance model, the G-buffer has no room for the bent normal
+	vec3 Lo = PBRLighting(n, W0, L, n, ao, albedo, roughness, metalness, IOR);
+	if (shadows_enabled != 0) {
+		Lo *= Shadow(position, view_depth);
+	}
+
+	//Direct light of the clustered point lights
+	Lo += ClusteredLighting(gl_FragCoord.xy, position_vs, n_vs, albedo, roughness, metalness, FresnelF0(IOR));
+
+	//linear radiance, exposure, tone mapping and gamma are applied once per pixel by PostProcess
+
+	FragColor = vec4(Lo, 1.0f);
+}
@@ -0,0 +1,8 @@
+#version 450 core
+// fullscreen triangle for the lighting pass, no vertex attributes (an empty VAO is bound)
+
+void main( void )
+{
+	vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2); // (0, 0), (2, 0), (0, 2)
+	gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,71 @@
+#include "pch.h"
+#include "dynamicresolution.h"
+
+DynamicResolution::DynamicResolution( const float budget_ms, const float min_scale ) :
+	budget_( budget_ms ), min_scale_( min_scale )
+{
+}
+
+DynamicResolution::~DynamicResolution()
+{
+	if ( queries_[0] )
+	{
+		glDeleteQueries( kQueries, queries_ );
+	}
+}
+
+void DynamicResolution::Init()
+{
+	glGenQueries( kQueries, queries_ );
+}
+
+void DynamicResolution::BeginFrame()
+{
+	const int i = int( frame_ % kQueries );
+	query_scales_[i] = scale_;
+	glBeginQuery( GL_TIME_ELAPSED, queries_[i] );
+}
+
+void DynamicResolution::EndFrame()
+{
+	glEndQuery( GL_TIME_ELAPSED );
+	++frame_;
+
+	// the query issued kQueries - 1 frames ago, the next BeginFrame reuses it
+	if ( frame_ < kQueries )
+	{
+		return;
+	}
+
+	const int i = int( frame_ % kQueries );
+	GLint available = 0;
+	glGetQueryObjectiv( queries_[i], GL_QUERY_RESULT_AVAILABLE, &available );
+	if ( !available )
+	{
+		return;
+	}
+
+	GLuint64 elapsed = 0; // ns
+	glGetQueryObjectui64v( queries_[i], GL_QUERY_RESULT, &elapsed );
+	const float time = float( elapsed * 1e-6 );
+	gpu_time_ = ( gpu_time_ > 0.0f ) ? ( 0.9f * gpu_time_ + 0.1f * time ) : time;
+
+	// react only outside of <0.8, 1> of the budget, aim at 0.9; the raw time goes with the scale it was measured at
+	if ( time > budget_ || time < 0.8f * budget_ )
+	{
+		float scale = query_scales_[i] * sqrtf( 0.9f * budget_ / ( std::max )( time, 1e-3f ) );
+		scale = ( std::max )( 0.9f * scale_, ( std::min )( 1.1f * scale_, scale ) ); // at most 10 % per frame
+		scale = floorf( scale * 32.0f + 0.5f ) / 32.0f;
+		scale_ = ( std::max )( min_scale_, ( std::min )( 1.0f, scale ) );
+	}
+}
+
+float DynamicResolution::scale() const
+{
+	return scale_;
+}
+
+float DynamicResolution::gpu_time() const
+{
+	return gpu_time_;
+}
@@ -0,0 +1,54 @@
+#ifndef DYNAMIC_RESOLUTION_H_
+#define DYNAMIC_RESOLUTION_H_
+
+/*! \class DynamicResolution
+\brief Scale of the render resolution driven by the GPU frame time.
+
+Every frame is enclosed in a GL_TIME_ELAPSED query. The queries are read a few frames later, so the CPU never waits
+for the GPU. The cost of a frame is assumed to be proportional to the number of pixels, the scale of the measured
+frame is therefore corrected by the square root of the ratio of the budget and the measured time. The scale
+changes in steps of 1/32 and only when the time leaves a band below the budget, so it does not oscillate.
+
+DynamicResolution resolution( 16.7f ); // GL thread
+resolution.Init();
+resolution.BeginFrame();
+// draw at resolution.scale() * full size
+resolution.EndFrame();
+*/
+class DynamicResolution
+{
+public:
+	DynamicResolution( const float budget_ms, const float min_scale = 0.5f );
+	~DynamicResolution();
+
+	DynamicResolution( const DynamicResolution & ) = delete;
+	DynamicResolution & operator=( const DynamicResolution & ) = delete;
+
+	//! Creates the timer queries (GL thread).
+	void Init();
+
+	void BeginFrame();
+
+	//! Reads the oldest finished query and updates the scale.
+	void EndFrame();
+
+	//! Linear scale of the render resolution <min_scale, 1>.
+	float scale() const;
+
+	//! Smoothed GPU time of a frame (ms).
+	float gpu_time() const;
+
+private:
+	static const int kQueries = 4; // frames in flight
+
+	GLuint queries_[kQueries]{};
+	float query_scales_[kQueries]{}; // scale each query was measured with
+	long long frame_{ 0 };
+
+	float budget_; // ms
+	float min_scale_;
+	float scale_{ 1.0f };
+	float gpu_time_{ 0.0f };
+};
+
+#endif
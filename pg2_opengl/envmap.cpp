@@ -0,0 +1,80 @@
+#include "pch.h"
+#include "envmap.h"
+#include "threadpool.h"
+#include "mymath.h"
+
+Vector3 CubeTexelDirection( const int face, const int x, const int y, const int size )
+{
+	const float s = 2.0f * ( x + 0.5f ) / size - 1.0f;
+	const float t = 2.0f * ( y + 0.5f ) / size - 1.0f;
+
+	// inverse of the face selection in the GL specification (table 8.19)
+	switch ( face )
+	{
+	case 0: return Vector3( 1.0f, -t, -s ); // +X
+	case 1: return Vector3( -1.0f, -t, s ); // -X
+	case 2: return Vector3( s, 1.0f, t ); // +Y
+	case 3: return Vector3( s, -1.0f, -t ); // -Y
+	case 4: return Vector3( s, -t, 1.0f ); // +Z
+	default: return Vector3( -s, -t, -1.0f ); // -Z
+	}
+}
+
+Vector3 EquirectangularDirection( const float u, const float v )
+{
+	const float phi = ( u - 0.5f ) * 2.0f * float( M_PI );
+	const float theta = ( v - 0.5f ) * float( M_PI );
+
+	return Vector3( cosf( theta ) * cosf( phi ), sinf( theta ), cosf( theta ) * sinf( phi ) );
+}
+
+Color3f SampleEquirectangular( const Color3f * src, const int width, const int height, const Vector3 & direction )
+{
+	const float length = direction.L2Norm();
+	const float u = atan2f( direction.z, direction.x ) * float( 0.5 * M_1_PI ) + 0.5f;
+	const float v = asinf( clamp( direction.y / length, -1.0f, 1.0f ) ) * float( M_1_PI ) + 0.5f;
+
+	const float x = u * width - 0.5f;
+	const float y = v * height - 0.5f;
+	const int x0 = int( floorf( x ) );
+	const int y0 = int( floorf( y ) );
+	const float fx = x - x0;
+	const float fy = y - y0;
+
+	Color3f result( { 0, 0, 0 } );
+
+	for ( int j = 0; j < 2; ++j )
+	{
+		const int row = ( std::min )( ( std::max )( y0 + j, 0 ), height - 1 );
+		const float wy = ( j == 0 ) ? 1.0f - fy : fy;
+
+		for ( int i = 0; i < 2; ++i )
+		{
+			const int column = ( ( x0 + i ) % width + width ) % width;
+			const float w = wy * ( ( i == 0 ) ? 1.0f - fx : fx );
+			const Color3f & texel = src[size_t( column ) + size_t( row ) * size_t( width )];
+
+			for ( int c = 0; c < 3; ++c )
+			{
+				result.data[c] += w * texel.data[c];
+			}
+		}
+	}
+
+	return result;
+}
+
+void EquirectangularToCube( const Color3f * src, const int width, const int height, const int face_size, Color3f * dst )
+{
+	ThreadPool::Default().ParallelFor( 0, 6 * face_size, [&]( const int row )
+	{
+		const int face = row / face_size;
+		const int y = row % face_size;
+		Color3f * pixels = dst + size_t( row ) * size_t( face_size );
+
+		for ( int x = 0; x < face_size; ++x )
+		{
+			pixels[x] = SampleEquirectangular( src, width, height, CubeTexelDirection( face, x, y, face_size ) );
+		}
+	} );
+}
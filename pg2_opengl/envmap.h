@@ -0,0 +1,31 @@
+#ifndef ENV_MAP_H_
+#define ENV_MAP_H_
+
+#include "texture.h"
+#include "vector3.h"
+
+/*! \fn Vector3 CubeTexelDirection( const int face, const int x, const int y, const int size )
+\brief Direction (not normalized) through the center of texel ( x, y ) of a cube map face.
+
+Faces follow the GL_TEXTURE_CUBE_MAP_POSITIVE_X + face order, row y = 0 is the first row in memory.
+*/
+Vector3 CubeTexelDirection( const int face, const int x, const int y, const int size );
+
+/*! \fn Vector3 EquirectangularDirection( const float u, const float v )
+\brief Inverse of the latitude-longitude mapping used by the IBL maps, u = atan2( z, x ) / 2pi + 0.5, v = asin( y ) / pi + 0.5.
+*/
+Vector3 EquirectangularDirection( const float u, const float v );
+
+/*! \fn Color3f SampleEquirectangular( const Color3f * src, const int width, const int height, const Vector3 & direction )
+\brief Bilinear lookup of a latitude-longitude map, wraps in longitude and clamps in latitude.
+*/
+Color3f SampleEquirectangular( const Color3f * src, const int width, const int height, const Vector3 & direction );
+
+/*! \fn void EquirectangularToCube( const Color3f * src, const int width, const int height, const int face_size, Color3f * dst )
+\brief Resamples a latitude-longitude map into six cube map faces, rows are distributed over the default thread pool.
+
+\param dst face_size * face_size * 6 pixels, faces stored one after another.
+*/
+void EquirectangularToCube( const Color3f * src, const int width, const int height, const int face_size, Color3f * dst );
+
+#endif
@@ -0,0 +1,44 @@
+#version 450 core
+#extension GL_ARB_bindless_texture : require
+#extension GL_ARB_gpu_shader_int64 : require
+// geometry pass of the deferred path, writes the surface attributes for deferred.frag
+
+// ### Input from vertex shader (pbr.vert)
+in vec2 texcoord;	//texcoord
+flat in int material_index;
+in vec4 bent_normal_ao;
+in vec3 normal_vs;
+
+#include "pbr_common.glsl"
+
+// ### G-buffer
+layout (location = 0) out vec2 gbuffer_normal; // octahedral view space normal (RG16_SNORM)
+layout (location = 1) out vec4 gbuffer_albedo; // RGBA8, ambient visibility in alpha
+layout (location = 2) out vec3 gbuffer_material; // roughness, metalness, (IOR - 1) / 2 (RGBA8)
+
+// unit vector -> point of the octahedron unfolded into <-1, 1>^2
+vec2 OctahedralEncode(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 e = n.xy;
+	if (n.z < 0.0) {
+		e = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	}
+	return e;
+}
+
+void main( void )
+{
+	Material material = materials[material_index];
+
+	vec3 albedo = material.diffuse.rgb * texture(sampler2D(material.tex_diffuse), texcoord).rgb;
+
+	float roughness = material.rma.r;
+	if (material.tex_rma != 0) {
+		roughness *= texture(sampler2D(material.tex_rma), texcoord).r;
+	}
+
+	gbuffer_normal = OctahedralEncode(normalize(normal_vs));
+	gbuffer_albedo = vec4(albedo, bent_normal_ao.w); // the bent normal does not fit, the lighting pass uses the normal
+	gbuffer_material = vec3(roughness, material.rma.g, (material.rma.b - 1.0) * 0.5); // Material::shading_ior is in <1, 3>
+}
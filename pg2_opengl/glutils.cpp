@@ -1,5 +1,9 @@
 ﻿#include "pch.h"
 #include "glutils.h"
+#include "uploadring.h"
+#include "texcompress.h"
+#include "tutorials.h"
+#include "utils.h"
 #include "../../libs/glad/include/glad/glad.h" // TOTO JE debilovina na c++ fakt :D, ne prostě to nejde normálně includnout
 #include "../../libs/glad/include/glad/glad.h"
 
@@ -58,7 +62,16 @@ void SetInt(const GLuint program, GLint value, const char* sampler_name)
 	}
 }
 
-void CreateBindlessTexture(GLuint & texture, GLuint64 & handle, const int width, const int height, const GLvoid * data)
+int MipLevels(const int width, const int height)
+{
+	int levels = 1;
+	for (int size = (std::max)(width, height); size > 1; size >>= 1) {
+		++levels;
+	}
+	return levels;
+}
+
+void CreateBindlessTexture(GLuint & texture, GLuint64 & handle, const int width, const int height, const GLvoid * data, UploadRing * ring)
 {
 	//PDF 1 - stránka 87 !!!
 	glGenTextures(1, &texture);
@@ -66,12 +79,143 @@ void CreateBindlessTexture(GLuint & texture, GLuint64 & handle, const int width,
 	// set the texture wrapping/filtering options
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	// copy data from the host buffer
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
+	// immutable storage for the whole mip chain, the driver does not have to validate (or reallocate) it later
+	glTexStorage2D(GL_TEXTURE_2D, MipLevels(width, height), GL_RGB8, width, height);
+	if (ring) {
+		// stream the texels through the pixel buffer ring, the driver does not have to copy them synchronously
+		ring->Upload(GL_TEXTURE_2D, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, data, size_t(width) * size_t(height) * 3);
+	}
+	else {
+		// copy data from the host buffer, the BGR rows are tightly packed
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, data);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	}
 	glGenerateMipmap(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, 0); // unbind the newly created texture from the target
 	handle = glGetTextureHandleARB(texture); // produces a handle representing the texture in a shader function
 	glMakeTextureHandleResidentARB(handle);
-}
\ No newline at end of file
+}
+
+//GL description of the float packings from texture.h
+void FloatPackingFormat(const FloatPacking packing, GLenum & internal_format, GLenum & format, GLenum & type)
+{
+	switch (packing) {
+	case FloatPacking::kRGB16F: internal_format = GL_RGB16F; format = GL_RGB; type = GL_HALF_FLOAT; break;
+	case FloatPacking::kRG16F: internal_format = GL_RG16F; format = GL_RG; type = GL_HALF_FLOAT; break;
+	case FloatPacking::kRGB9E5: internal_format = GL_RGB9_E5; format = GL_RGB; type = GL_UNSIGNED_INT_5_9_9_9_REV; break;
+	default: internal_format = GL_RGB32F; format = GL_RGB; type = GL_FLOAT; break;
+	}
+}
+
+void CreateBindlessTexture(GLuint & texture, GLuint64 & handle, const CompressedImage & image, UploadRing * ring)
+{
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexStorage2D(GL_TEXTURE_2D, image.no_levels(), image.internal_format, image.width, image.height);
+	// the mip chain was built (and compressed) on the CPU, the driver cannot generate mipmaps of a compressed format
+	for (int level = 0; level < image.no_levels(); ++level) {
+		const std::vector<BYTE> & blocks = image.levels[level];
+		if (ring) {
+			ring->UploadCompressed(GL_TEXTURE_2D, level, image.level_width(level), image.level_height(level), image.internal_format, blocks.data(), blocks.size());
+		}
+		else {
+			glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, image.level_width(level), image.level_height(level), image.internal_format, GLsizei(blocks.size()), blocks.data());
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	handle = glGetTextureHandleARB(texture);
+	glMakeTextureHandleResidentARB(handle);
+}
+
+void SetFloat(const GLuint program, GLfloat value, const char * name)
+{
+	const GLint location = glGetUniformLocation(program, name);
+	if (location == -1)
+	{
+		printf("Float '%s' not found in active shader.\n", name);
+	}
+	else
+	{
+		glUniform1f(location, value);
+	}
+}
+
+//replaces the lines #include "file" with the contents of the file (relative to the working directory like LoadShader)
+static std::string ExpandIncludes(const char * file_name, const int depth = 0)
+{
+	char * source = LoadShader(file_name);
+	if (!source) {
+		return std::string();
+	}
+
+	std::string expanded;
+	const char * line = source;
+	while (*line) {
+		const char * end = strchr(line, '\n');
+		const size_t length = end ? size_t(end - line) + 1 : strlen(line);
+		std::string text(line, length);
+
+		const size_t directive = text.find("#include");
+		const size_t open = text.find('"');
+		const size_t close = (open != std::string::npos) ? text.find('"', open + 1) : std::string::npos;
+		if (directive != std::string::npos && text.find_first_not_of(" \t") == directive && close != std::string::npos && depth < 8) {
+			expanded += ExpandIncludes(text.substr(open + 1, close - open - 1).c_str(), depth + 1);
+			expanded += "\n";
+		}
+		else {
+			expanded += text;
+		}
+
+		line += length;
+	}
+
+	SAFE_DELETE_ARRAY(source);
+	return expanded;
+}
+
+GLuint CompileShader(const GLenum type, const char * file_name)
+{
+	GLuint shader = glCreateShader(type);
+	const std::string source = ExpandIncludes(file_name);
+	const char * shader_source = source.c_str();
+	glShaderSource(shader, 1, &shader_source, nullptr);
+	glCompileShader(shader);
+
+	if (CheckShader(shader) != GL_TRUE) {
+		printf("(%s)\n", file_name);
+	}
+
+	return shader;
+}
+
+GLuint CreateProgram(const std::vector<GLuint> & shaders)
+{
+	GLuint program = glCreateProgram();
+	for (GLuint shader : shaders) {
+		glAttachShader(program, shader);
+	}
+	glLinkProgram(program);
+
+	GLint status = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE) {
+		char info_log[1024] = { 0 };
+		glGetProgramInfoLog(program, sizeof(info_log), nullptr, info_log);
+		printf("Program linking FAILED.\nError log: %s\n", info_log);
+	}
+
+	//the program keeps the compiled code
+	for (GLuint shader : shaders) {
+		glDetachShader(program, shader);
+		glDeleteShader(shader);
+	}
+
+	return program;
+}
@@ -1,9 +1,19 @@
 #ifndef GL_UTILS_H_
 #define GL_UTILS_H_
 
+class UploadRing;
+struct CompressedImage;
+enum class FloatPacking : char;
+
 void SetMatrix4x4( const GLuint program, const GLfloat * data, const char * matrix_name );
-void CreateBindlessTexture(GLuint & texture, GLuint64 & handle, const int width, const int height, const GLvoid * data);
+void CreateBindlessTexture(GLuint & texture, GLuint64 & handle, const int width, const int height, const GLvoid * data, UploadRing * ring = nullptr);
+int MipLevels(const int width, const int height);
+void CreateBindlessTexture(GLuint & texture, GLuint64 & handle, const CompressedImage & image, UploadRing * ring = nullptr);
+void FloatPackingFormat(const FloatPacking packing, GLenum & internal_format, GLenum & format, GLenum & type);
 void SetSampler(const GLuint program, GLenum texture_unit, const char* sampler_name);
 void SetInt(const GLuint program, GLint value, const char* sampler_name);
 void SetVector3(const GLuint program, const GLfloat * data, const char * matrix_name);
+void SetFloat(const GLuint program, GLfloat value, const char * name);
+GLuint CompileShader(const GLenum type, const char * file_name); // supports #include "file.glsl"
+GLuint CreateProgram(const std::vector<GLuint> & shaders); // links and deletes the shaders
 #endif
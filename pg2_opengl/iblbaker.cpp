@@ -0,0 +1,513 @@
+#include "pch.h"
+#include "iblbaker.h"
+#include "envmap.h"
+#include "threadpool.h"
+#include "mymath.h"
+#include "utils.h"
+#include "simd.h"
+#include <chrono>
+
+/* SphericalHarmonics9 */
+
+void SphericalHarmonics9::Basis( const Vector3 & n, float y[9] )
+{
+	y[0] = 0.282095f;
+	y[1] = 0.488603f * n.y;
+	y[2] = 0.488603f * n.z;
+	y[3] = 0.488603f * n.x;
+	y[4] = 1.092548f * n.x * n.y;
+	y[5] = 1.092548f * n.y * n.z;
+	y[6] = 0.315392f * ( 3.0f * n.z * n.z - 1.0f );
+	y[7] = 1.092548f * n.x * n.z;
+	y[8] = 0.546274f * ( n.x * n.x - n.y * n.y );
+}
+
+Color3f SphericalHarmonics9::Evaluate( const Vector3 & n ) const
+{
+	float y[9];
+	Basis( n, y );
+
+	Color3f result( { 0, 0, 0 } );
+
+	for ( int i = 0; i < 9; ++i )
+	{
+		for ( int c = 0; c < 3; ++c )
+		{
+			result.data[c] += coefficients[i].data[c] * y[i];
+		}
+	}
+
+	return result;
+}
+
+void SphericalHarmonics9::ConvolveCosine()
+{
+	// convolution with the clamped cosine (A_l = pi, 2pi/3, pi/4 for l = 0, 1, 2) divided by pi
+	const float band_scale[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+
+	for ( int i = 0; i < 9; ++i )
+	{
+		for ( int c = 0; c < 3; ++c )
+		{
+			coefficients[i].data[c] *= band_scale[i];
+		}
+	}
+}
+
+SphericalHarmonics9 ProjectSH9( const Texture3f & environment )
+{
+	const int width = environment.width();
+	const int height = environment.height();
+
+	// partial sums per row are reduced in a fixed order, the result does not depend on scheduling
+	std::vector<SphericalHarmonics9> rows( height );
+
+	ThreadPool::Default().ParallelFor( 0, height, [&]( const int y )
+	{
+		SphericalHarmonics9 & row = rows[y]; // value-initialised by the vector
+
+		const float v = ( y + 0.5f ) / height;
+		// solid angle of a texel shrinks with the cosine of the latitude
+		const float d_omega = ( 2.0f * float( M_PI ) / width ) * ( float( M_PI ) / height ) * cosf( ( v - 0.5f ) * float( M_PI ) );
+		const Color3f * texels = environment.data() + size_t( y ) * size_t( width );
+
+		for ( int x = 0; x < width; ++x )
+		{
+			float basis[9];
+			SphericalHarmonics9::Basis( EquirectangularDirection( ( x + 0.5f ) / width, v ), basis );
+
+			for ( int i = 0; i < 9; ++i )
+			{
+				for ( int c = 0; c < 3; ++c )
+				{
+					row.coefficients[i].data[c] += texels[x].data[c] * basis[i] * d_omega;
+				}
+			}
+		}
+	} );
+
+	SphericalHarmonics9 sh{};
+
+	for ( const auto & row : rows )
+	{
+		for ( int i = 0; i < 9; ++i )
+		{
+			for ( int c = 0; c < 3; ++c )
+			{
+				sh.coefficients[i].data[c] += row.coefficients[i].data[c];
+			}
+		}
+	}
+
+	return sh;
+}
+
+SphericalHarmonics9 ProjectIrradianceSH9( const Texture3f & environment )
+{
+	SphericalHarmonics9 sh = ProjectSH9( environment );
+	sh.ConvolveCosine();
+
+	return sh;
+}
+
+Texture3f BakeIrradianceMap( const SphericalHarmonics9 & sh, const int width, const int height )
+{
+	Texture3f irradiance( width, height );
+
+	ThreadPool::Default().ParallelFor( 0, height, [&]( const int y )
+	{
+		Color3f * texels = irradiance.data() + size_t( y ) * size_t( width );
+
+		for ( int x = 0; x < width; ++x )
+		{
+			texels[x] = sh.Evaluate( EquirectangularDirection( ( x + 0.5f ) / width, ( y + 0.5f ) / height ) );
+		}
+	} );
+
+	return irradiance;
+}
+
+/* Prefiltered environment maps */
+
+/* Cube map version of the source with a box filtered mip chain, looked up with the lod derived from the sample pdf */
+class CubeMipChain
+{
+public:
+	CubeMipChain( const Texture3f & environment )
+	{
+		int size = ( std::max )( 1, environment.width() / 4 );
+
+		levels_.emplace_back( size_t( size ) * size_t( size ) * 6 );
+		sizes_.push_back( size );
+		EquirectangularToCube( environment.data(), environment.width(), environment.height(), size, levels_.back().data() );
+
+		while ( size > 1 )
+		{
+			const std::vector<Color3f> & src = levels_.back();
+			const int src_size = size;
+			size /= 2;
+
+			std::vector<Color3f> dst( size_t( size ) * size_t( size ) * 6 );
+
+			ThreadPool::Default().ParallelFor( 0, 6 * size, [&]( const int row )
+			{
+				const int face = row / size;
+				const int y = row % size;
+
+				for ( int x = 0; x < size; ++x )
+				{
+					Color3f & texel = dst[( size_t( face ) * size + y ) * size + x];
+
+					for ( int c = 0; c < 3; ++c )
+					{
+						float sum = 0.0f;
+
+						for ( int j = 0; j < 2; ++j )
+						{
+							for ( int i = 0; i < 2; ++i )
+							{
+								sum += src[( size_t( face ) * src_size + 2 * y + j ) * src_size + 2 * x + i].data[c];
+							}
+						}
+
+						texel.data[c] = 0.25f * sum;
+					}
+				}
+			} );
+
+			levels_.push_back( std::move( dst ) );
+			sizes_.push_back( size );
+		}
+	}
+
+	int base_size() const
+	{
+		return sizes_[0];
+	}
+
+	//! Trilinear lookup, \a lod is clamped to the available levels.
+	void Sample( const float dx, const float dy, const float dz, const float lod, float rgb[3] ) const
+	{
+		const float max_lod = float( levels_.size() - 1 );
+		const float l = ( lod < 0.0f ) ? 0.0f : ( ( lod > max_lod ) ? max_lod : lod );
+		const int l0 = int( l );
+		const int l1 = ( std::min )( l0 + 1, int( levels_.size() ) - 1 );
+		const float t = l - l0;
+
+		float c0[3], c1[3];
+		SampleLevel( l0, dx, dy, dz, c0 );
+		SampleLevel( l1, dx, dy, dz, c1 );
+
+		for ( int c = 0; c < 3; ++c )
+		{
+			rgb[c] = c0[c] + ( c1[c] - c0[c] ) * t;
+		}
+	}
+
+private:
+	void SampleLevel( const int level, const float dx, const float dy, const float dz, float rgb[3] ) const
+	{
+		// face selection of the GL specification
+		const float ax = fabsf( dx ), ay = fabsf( dy ), az = fabsf( dz );
+		int face;
+		float sc, tc, ma;
+
+		if ( ( ax >= ay ) && ( ax >= az ) )
+		{
+			ma = ax; tc = -dy;
+			if ( dx > 0 ) { face = 0; sc = -dz; } else { face = 1; sc = dz; }
+		}
+		else if ( ay >= az )
+		{
+			ma = ay; sc = dx;
+			if ( dy > 0 ) { face = 2; tc = dz; } else { face = 3; tc = -dz; }
+		}
+		else
+		{
+			ma = az; tc = -dy;
+			if ( dz > 0 ) { face = 4; sc = dx; } else { face = 5; sc = -dx; }
+		}
+
+		const int size = sizes_[level];
+		const float x = ( sc / ma + 1.0f ) * 0.5f * size - 0.5f;
+		const float y = ( tc / ma + 1.0f ) * 0.5f * size - 0.5f;
+		const int x0 = int( floorf( x ) );
+		const int y0 = int( floorf( y ) );
+		const float fx = x - x0;
+		const float fy = y - y0;
+		const Color3f * texels = levels_[level].data() + size_t( face ) * size * size;
+
+		rgb[0] = rgb[1] = rgb[2] = 0.0f;
+
+		for ( int j = 0; j < 2; ++j )
+		{
+			const int row = ( std::min )( ( std::max )( y0 + j, 0 ), size - 1 ); // clamped at the face edges
+			const float wy = ( j == 0 ) ? 1.0f - fy : fy;
+
+			for ( int i = 0; i < 2; ++i )
+			{
+				const int column = ( std::min )( ( std::max )( x0 + i, 0 ), size - 1 );
+				const float w = wy * ( ( i == 0 ) ? 1.0f - fx : fx );
+				const Color3f & texel = texels[size_t( row ) * size + column];
+
+				rgb[0] += w * texel.data[0];
+				rgb[1] += w * texel.data[1];
+				rgb[2] += w * texel.data[2];
+			}
+		}
+	}
+
+	std::vector<std::vector<Color3f>> levels_;
+	std::vector<int> sizes_;
+};
+
+// GGX half vector sample around +z, alpha = roughness^2 as in the shaders
+static Vector3 SampleGGX( const float alpha, const float xi1, const float xi2 )
+{
+	const float phi = 2.0f * float( M_PI ) * xi2;
+	const float cos_theta = sqrtf( ( 1.0f - xi1 ) / ( 1.0f + ( sqr( alpha ) - 1.0f ) * xi1 ) );
+	const float sin_theta = sqrtf( ( std::max )( 0.0f, 1.0f - sqr( cos_theta ) ) );
+
+	return Vector3( sin_theta * cosf( phi ), sin_theta * sinf( phi ), cos_theta );
+}
+
+static float DistributionGGX( const float n_dot_h, const float alpha )
+{
+	const float a2 = sqr( alpha );
+	const float denom = sqr( n_dot_h ) * ( a2 - 1.0f ) + 1.0f;
+
+	return a2 / ( float( M_PI ) * sqr( denom ) );
+}
+
+/* Light directions of one roughness level in the tangent space of n = v = r, stored as SoA padded to a multiple of 4 */
+struct PrefilterSamples
+{
+	std::vector<float> x, y, z, weight, lod;
+	float total_weight{ 0.0f };
+};
+
+static PrefilterSamples GeneratePrefilterSamples( const float roughness, const int no_samples, const int source_size )
+{
+	const float alpha = ( std::max )( sqr( roughness ), 1e-4f );
+	const float texel_solid_angle = 4.0f * float( M_PI ) / ( 6.0f * sqr( float( source_size ) ) );
+
+	PrefilterSamples samples;
+
+	for ( int i = 0; i < no_samples; ++i )
+	{
+		// Hammersley set, the maps are the same on every run
+		const Vector3 h = SampleGGX( alpha, ( i + 0.5f ) / no_samples, RadicalInverse( i ) );
+		const Vector3 l = Vector3( 0, 0, -1 ) + 2.0f * h.z * h; // reflect( -v, h ) with v = ( 0, 0, 1 )
+
+		if ( l.z <= 0.0f )
+		{
+			continue;
+		}
+
+		// pdf of l is D * ( n.h ) / ( 4 * ( v.h ) ) = D / 4 for n = v
+		const float pdf = DistributionGGX( h.z, alpha ) * 0.25f;
+		const float sample_solid_angle = 1.0f / ( no_samples * pdf + 1e-4f );
+
+		samples.x.push_back( l.x );
+		samples.y.push_back( l.y );
+		samples.z.push_back( l.z );
+		samples.weight.push_back( l.z );
+		samples.lod.push_back( ( std::max )( 0.0f, 0.5f * log2f( sample_solid_angle / texel_solid_angle ) + 1.0f ) );
+		samples.total_weight += l.z;
+	}
+
+	while ( samples.x.size() % 4 )
+	{
+		samples.x.push_back( 0.0f );
+		samples.y.push_back( 0.0f );
+		samples.z.push_back( 1.0f );
+		samples.weight.push_back( 0.0f );
+		samples.lod.push_back( 0.0f );
+	}
+
+	return samples;
+}
+
+static Color3f Prefilter( const CubeMipChain & source, const PrefilterSamples & samples, const Vector3 & n )
+{
+	// tangent frame of n
+	const Vector3 up = ( fabsf( n.z ) < 0.999f ) ? Vector3( 0, 0, 1 ) : Vector3( 1, 0, 0 );
+	Vector3 t = up.CrossProduct( n );
+	t.Normalize();
+	const Vector3 b = n.CrossProduct( t );
+
+	const __m128 tx = _mm_set1_ps( t.x ), ty = _mm_set1_ps( t.y ), tz = _mm_set1_ps( t.z );
+	const __m128 bx = _mm_set1_ps( b.x ), by = _mm_set1_ps( b.y ), bz = _mm_set1_ps( b.z );
+	const __m128 nx = _mm_set1_ps( n.x ), ny = _mm_set1_ps( n.y ), nz = _mm_set1_ps( n.z );
+
+	float sum[3] = { 0, 0, 0 };
+	alignas( 16 ) float dx[4], dy[4], dz[4];
+
+	for ( size_t i = 0; i < samples.x.size(); i += 4 )
+	{
+		const __m128 lx = _mm_loadu_ps( &samples.x[i] );
+		const __m128 ly = _mm_loadu_ps( &samples.y[i] );
+		const __m128 lz = _mm_loadu_ps( &samples.z[i] );
+
+		// world = t * l.x + b * l.y + n * l.z for four samples at once
+		_mm_store_ps( dx, _mm_add_ps( _mm_add_ps( _mm_mul_ps( tx, lx ), _mm_mul_ps( bx, ly ) ), _mm_mul_ps( nx, lz ) ) );
+		_mm_store_ps( dy, _mm_add_ps( _mm_add_ps( _mm_mul_ps( ty, lx ), _mm_mul_ps( by, ly ) ), _mm_mul_ps( ny, lz ) ) );
+		_mm_store_ps( dz, _mm_add_ps( _mm_add_ps( _mm_mul_ps( tz, lx ), _mm_mul_ps( bz, ly ) ), _mm_mul_ps( nz, lz ) ) );
+
+		for ( int k = 0; k < 4; ++k )
+		{
+			const float weight = samples.weight[i + k];
+
+			if ( weight > 0.0f )
+			{
+				float rgb[3];
+				source.Sample( dx[k], dy[k], dz[k], samples.lod[i + k], rgb );
+
+				sum[0] += rgb[0] * weight;
+				sum[1] += rgb[1] * weight;
+				sum[2] += rgb[2] * weight;
+			}
+		}
+	}
+
+	const float norm = ( samples.total_weight > 0.0f ) ? 1.0f / samples.total_weight : 0.0f;
+
+	return Color3f( { sum[0] * norm, sum[1] * norm, sum[2] * norm } );
+}
+
+std::vector<Texture3f> BakePrefilteredEnvMaps( const Texture3f & environment, const int no_levels, const int width, const int no_samples )
+{
+	const CubeMipChain source( environment );
+	std::vector<Texture3f> levels;
+	levels.reserve( no_levels );
+
+	for ( int level = 0; level < no_levels; ++level )
+	{
+		const int level_width = ( std::max )( 2, width >> level );
+		const int level_height = level_width / 2;
+		const float roughness = ( no_levels > 1 ) ? float( level ) / ( no_levels - 1 ) : 0.0f;
+
+		levels.emplace_back( level_width, level_height );
+		Texture3f & target = levels.back();
+
+		if ( level == 0 )
+		{
+			// a mirror reflection, only resample the source
+			ThreadPool::Default().ParallelFor( 0, level_height, [&]( const int y )
+			{
+				for ( int x = 0; x < level_width; ++x )
+				{
+					target.data()[size_t( y ) * level_width + x] = SampleEquirectangular( environment.data(), environment.width(), environment.height(),
+						EquirectangularDirection( ( x + 0.5f ) / level_width, ( y + 0.5f ) / level_height ) );
+				}
+			} );
+
+			continue;
+		}
+
+		const PrefilterSamples samples = GeneratePrefilterSamples( roughness, no_samples, source.base_size() );
+
+		ThreadPool::Default().ParallelFor( 0, level_height, [&]( const int y )
+		{
+			for ( int x = 0; x < level_width; ++x )
+			{
+				target.data()[size_t( y ) * level_width + x] = Prefilter( source, samples,
+					EquirectangularDirection( ( x + 0.5f ) / level_width, ( y + 0.5f ) / level_height ) );
+			}
+		} );
+	}
+
+	return levels;
+}
+
+/* BRDF integration map */
+
+Texture3f BakeBRDFIntegrationMap( const int size, const int no_samples )
+{
+	Texture3f lut( size, size );
+
+	ThreadPool::Default().ParallelFor( 0, size, [&]( const int y )
+	{
+		const float roughness = ( y + 0.5f ) / size;
+		const float alpha = sqr( roughness );
+		const float k = sqr( roughness ) * 0.5f; // Schlick-GGX geometry term remapped for IBL
+
+		for ( int x = 0; x < size; ++x )
+		{
+			const float n_dot_v = ( x + 0.5f ) / size;
+			const Vector3 v( sqrtf( 1.0f - sqr( n_dot_v ) ), 0.0f, n_dot_v );
+
+			float scale = 0.0f;
+			float bias = 0.0f;
+
+			for ( int i = 0; i < no_samples; ++i )
+			{
+				const Vector3 h = SampleGGX( alpha, ( i + 0.5f ) / no_samples, RadicalInverse( i ) );
+				const float v_dot_h = v.DotProduct( h );
+				const Vector3 l = 2.0f * v_dot_h * h - v;
+
+				const float n_dot_l = l.z;
+				const float n_dot_h = h.z;
+
+				if ( n_dot_l > 0.0f )
+				{
+					const float g = ( n_dot_v / ( n_dot_v * ( 1.0f - k ) + k ) ) * ( n_dot_l / ( n_dot_l * ( 1.0f - k ) + k ) );
+					const float g_vis = g * ( std::max )( v_dot_h, 0.0f ) / ( n_dot_h * n_dot_v );
+					const float fc = powf( 1.0f - ( std::max )( v_dot_h, 0.0f ), 5.0f );
+
+					scale += ( 1.0f - fc ) * g_vis;
+					bias += fc * g_vis;
+				}
+			}
+
+			lut.data()[size_t( y ) * size + x] = Color3f( { scale / no_samples, bias / no_samples, 0.0f } );
+		}
+	} );
+
+	return lut;
+}
+
+/* Tool */
+
+int BakeIBL( const std::string & environment_file, const std::string & output_prefix, const int no_levels )
+{
+	Texture3f environment( environment_file );
+
+	if ( environment.width() == 0 )
+	{
+		return -1;
+	}
+
+	printf( "Baking IBL maps from '%s' on %d threads.\n", environment_file.c_str(), ThreadPool::Default().no_threads() );
+
+	auto t0 = std::chrono::high_resolution_clock::now();
+	auto lap = [&t0]( const char * what )
+	{
+		const auto t1 = std::chrono::high_resolution_clock::now();
+		printf( "%s baked in %s.\n", what, TimeToString( std::chrono::duration<double>( t1 - t0 ).count() ).c_str() );
+		t0 = t1;
+	};
+
+	const SphericalHarmonics9 sh = ProjectIrradianceSH9( environment );
+	lap( "SH9 irradiance" );
+	BakeIrradianceMap( sh, 256, 128 ).Save( output_prefix + "_irradiance_map.exr" );
+
+	const std::vector<Texture3f> levels = BakePrefilteredEnvMaps( environment, no_levels, environment.width() );
+	lap( "Prefiltered env maps" );
+
+	for ( int level = 0; level < int( levels.size() ); ++level )
+	{
+		char name[64] = { 0 };
+		const int roughness = ( no_levels > 1 ) ? ( level * 1000 ) / ( no_levels - 1 ) : 0;
+		sprintf( name, "_prefiltered_env_map_%03d_%d.exr", ( std::min )( roughness, 999 ), levels[level].width() );
+		levels[level].Save( output_prefix + name );
+	}
+
+	// the LUT does not depend on the environment, it goes next to the other maps under the name the renderer loads
+	const size_t separator = output_prefix.find_last_of( "/\\" );
+	const std::string directory = ( separator == std::string::npos ) ? std::string() : output_prefix.substr( 0, separator + 1 );
+	BakeBRDFIntegrationMap( 128 ).Save( directory + "brdf_integration_map_ct_ggx.exr" );
+	lap( "BRDF integration map" );
+
+	return 0;
+}
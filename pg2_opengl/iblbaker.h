@@ -0,0 +1,73 @@
+#ifndef IBL_BAKER_H_
+#define IBL_BAKER_H_
+
+#include "texture.h"
+#include "vector3.h"
+
+/*! \struct SphericalHarmonics9
+\brief Irradiance environment as the first nine real spherical harmonics (bands 0 to 2) per color channel.
+
+The coefficients already contain the convolution with the clamped cosine lobe divided by pi,
+so Evaluate( n ) returns the same value as a lookup into a baked irradiance map, i.e. E( n ) / pi.
+
+SphericalHarmonics9 sh = ProjectIrradianceSH9( Texture3f( "environment.exr" ) );
+Color3f irradiance = sh.Evaluate( normal );
+*/
+struct SphericalHarmonics9
+{
+	Color3f coefficients[9]; /*!< Ordered as ( l, m ) = ( 0, 0 ), ( 1, -1 ), ( 1, 0 ), ( 1, 1 ), ( 2, -2 ), ..., ( 2, 2 ). */
+
+	//! Irradiance (over pi) for the unit normal \a n.
+	Color3f Evaluate( const Vector3 & n ) const;
+
+	//! Values of the nine basis functions in the direction \a n (unit vector).
+	static void Basis( const Vector3 & n, float y[9] );
+
+	//! Turns projected radiance into irradiance over pi (multiplies the bands by A_l / pi).
+	void ConvolveCosine();
+};
+
+/*! \fn SphericalHarmonics9 ProjectSH9( const Texture3f & map )
+\brief Projects an equirectangular map onto SH9 as it is.
+
+Every texel is weighted by its solid angle, rows are distributed over the default thread pool.
+Use it directly for maps that already contain irradiance (they are smooth enough for three bands).
+*/
+SphericalHarmonics9 ProjectSH9( const Texture3f & map );
+
+/*! \fn SphericalHarmonics9 ProjectIrradianceSH9( const Texture3f & environment )
+\brief Projects an equirectangular radiance map onto SH9 and convolves it with the cosine lobe.
+*/
+SphericalHarmonics9 ProjectIrradianceSH9( const Texture3f & environment );
+
+/*! \fn Texture3f BakeIrradianceMap( const SphericalHarmonics9 & sh, const int width, const int height )
+\brief Evaluates \a sh over an equirectangular map, a replacement of the externally baked irradiance maps.
+*/
+Texture3f BakeIrradianceMap( const SphericalHarmonics9 & sh, const int width, const int height );
+
+/*! \fn std::vector<Texture3f> BakePrefilteredEnvMaps( const Texture3f & environment, const int no_levels, const int width, const int no_samples )
+\brief GGX prefiltered equirectangular maps, level l has roughness l / ( no_levels - 1 ) and width >> l px.
+
+The lobe is importance sampled (split sum approximation with n = v = r). Samples form a Hammersley set
+generated once per level and shared by all texels, each sample fetches a mip level of a cube map version of the
+source matching its solid angle (filtered importance sampling), so a few hundred samples are noise free.
+The four samples of a batch are rotated into the texel frame with SSE.
+
+\param width width of the first level (px), heights are width / 2.
+*/
+std::vector<Texture3f> BakePrefilteredEnvMaps( const Texture3f & environment, const int no_levels, const int width, const int no_samples = 256 );
+
+/*! \fn Texture3f BakeBRDFIntegrationMap( const int size, const int no_samples )
+\brief Split sum BRDF LUT of the Cook-Torrance GGX model, u = n.v, v = roughness, stores ( scale, bias, 0 ) of F0.
+*/
+Texture3f BakeBRDFIntegrationMap( const int size, const int no_samples = 1024 );
+
+/*! \fn int BakeIBL( const std::string & environment_file, const std::string & output_prefix, const int no_levels )
+\brief Bakes and saves all IBL inputs of the PBR shaders from a single equirectangular HDR image.
+
+Produces <prefix>_irradiance_map.exr, <prefix>_prefiltered_env_map_<roughness * 1000>_<width>.exr
+for every level and brdf_integration_map_ct_ggx.exr in the directory of the prefix.
+*/
+int BakeIBL( const std::string & environment_file, const std::string & output_prefix, const int no_levels = 7 );
+
+#endif
@@ -1,5 +1,6 @@
 #include "pch.h"
 #include "material.h"
+#include <algorithm>
 
 const char Material::kDiffuseMapSlot = 0;
 const char Material::kSpecularMapSlot = 1;
@@ -162,6 +163,16 @@ float Material::roughness( const Coord2f * tex_coord ) const
 	return roughness_;
 }
 
+float Material::shading_ior() const
+{
+	if ( ior <= 0.0f )
+	{
+		return 1.0f; // unknown, no reflection at normal incidence like the original shaders
+	}
+
+	return ( std::min )( ( std::max )( ior, 1.0f ), 3.0f );
+}
+
 Color3f Material::emission( const Coord2f * tex_coord ) const
 {
 	return emission_;
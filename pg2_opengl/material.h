@@ -108,6 +108,13 @@ public:
 	Color3f bump( const Coord2f * tex_coord = nullptr ) const;
 	float roughness( const Coord2f * tex_coord = nullptr ) const;
 
+	//! Index of refraction of the PBR shading (F0 of the Fresnel term).
+	/*!
+	Shared by the GPU shaders (rma.b of the material table), SoftRasterizer and PathTracer.
+	eturn  ior clamped to <1, 3>, the range stored in the G-buffer, or 1 if the .mtl has no Ni ( ior <= 0).
+	*/
+	float shading_ior() const;
+
 	Color3f emission( const Coord2f * tex_coord = nullptr ) const;
 
 public:
@@ -0,0 +1,309 @@
+#include "pch.h"
+#include "materialtable.h"
+#include "glutils.h"
+
+// std430 layout of the Materials block in pbr_common.glsl
+#pragma pack( push, 1 ) // 1 B alignment
+struct GLMaterial
+{
+	Color3f diffuse; // 3 * 4 B
+	GLbyte pad0[4]; // + 4 B = 16 B
+	GLuint64 tex_diffuse_handle{ 0 }; // 1 * 8 B
+	GLbyte pad1[8]; // + 8 B = 16 B
+	Color3f rma; // 3 * 4 B
+	GLbyte pad2[4]; // + 4 B = 16 B
+	GLuint64 tex_rma_handle{ 0 }; // 1 * 8 B, 0 = constant roughness
+	GLbyte pad3[8]; // + 8 B = 16 B
+	Color3f normal; // 3 * 4 B
+	GLbyte pad4[4]; // + 4 B = 16 B
+	GLuint64 tex_normal_handle{ 0 }; // 1 * 8 B
+	GLbyte pad5[8]; // + 8 B = 16 B
+};
+#pragma pack( pop )
+
+MaterialTable::MaterialTable( const GLsizeiptr vram_budget, UploadRing * ring ) : ring_( ring ), budget_( vram_budget )
+{
+}
+
+MaterialTable::~MaterialTable()
+{
+	for ( int t = 0; t < static_cast<int>( textures_.size() ); ++t )
+	{
+		if ( textures_[t].handle )
+		{
+			Evict( t );
+		}
+	}
+
+	if ( ssbo_ )
+	{
+		for ( int i = 0; i < 2; ++i )
+		{
+			glMakeTextureHandleNonResidentARB( default_handles_[i] );
+		}
+		glDeleteTextures( 2, default_textures_ );
+		glDeleteBuffers( 1, &ssbo_ );
+	}
+}
+
+void MaterialTable::Init( const std::vector<Material *> & materials,
+	const std::map<Texture3u *, std::shared_ptr<CompressedImage>> & compressed, const bool compress )
+{
+	materials_ = materials;
+	compress_ = compress;
+
+	// the only textures created up front, they stay resident
+	const GLubyte white[] = { 255, 255, 255 };
+	const GLubyte flat_normal[] = { 255, 128, 128 }; // BGR of ( 0, 0, 1 )
+	CreateBindlessTexture( default_textures_[0], default_handles_[0], 1, 1, white );
+	CreateBindlessTexture( default_textures_[1], default_handles_[1], 1, 1, flat_normal );
+
+	const int no_materials = static_cast<int>( materials_.size() );
+	material_textures_.assign( no_materials, { -1, -1, -1 } );
+	dirty_.assign( no_materials, false );
+
+	for ( int m = 0; m < no_materials; ++m )
+	{
+		const Material * material = materials_[m];
+		material_textures_[m][0] = AddTexture( material->texture( Material::kDiffuseMapSlot ), TextureUsage::kAlbedo, m );
+		material_textures_[m][1] = AddTexture( material->texture( Material::kRoughnessMapSlot ), TextureUsage::kScalar, m );
+		material_textures_[m][2] = AddTexture( material->texture( Material::kNormalMapSlot ), TextureUsage::kNormal, m );
+	}
+
+	for ( auto & record : textures_ )
+	{
+		auto image = compressed.find( record.texture );
+		if ( compress_ && ( image != compressed.end() ) )
+		{
+			record.compressed = image->second;
+		}
+
+		// block sizes of the prepared mip chain, otherwise RGB8 (stored as RGBA8) with a full mip chain
+		if ( record.compressed )
+		{
+			for ( const auto & level : record.compressed->levels )
+			{
+				record.bytes += GLsizeiptr( level.size() );
+			}
+		}
+		else
+		{
+			record.bytes = GLsizeiptr( record.texture->width() ) * record.texture->height() * 4 * 4 / 3;
+		}
+	}
+
+	glGenBuffers( 1, &ssbo_ );
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, ssbo_ );
+	glBufferData( GL_SHADER_STORAGE_BUFFER, ( std::max )( no_materials, 1 ) * sizeof( GLMaterial ), nullptr, GL_DYNAMIC_DRAW );
+	glBindBufferBase( GL_SHADER_STORAGE_BUFFER, 0, ssbo_ );
+	for ( int m = 0; m < no_materials; ++m )
+	{
+		WriteMaterial( m );
+	}
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, 0 );
+}
+
+int MaterialTable::AddTexture( Texture3u * texture, const TextureUsage usage, const int material )
+{
+	if ( !texture )
+	{
+		return -1;
+	}
+
+	auto found = texture_index_.find( texture );
+	int t;
+	if ( found != texture_index_.end() )
+	{
+		t = found->second;
+	}
+	else
+	{
+		t = static_cast<int>( textures_.size() );
+		textures_.emplace_back();
+		textures_[t].texture = texture;
+		textures_[t].usage = usage;
+		texture_index_[texture] = t;
+	}
+	textures_[t].users.push_back( material );
+
+	return t;
+}
+
+void MaterialTable::Update( const std::vector<bool> & visible )
+{
+	++frame_;
+
+	// textures of the visible materials, the missing ones in the order of the materials
+	std::vector<int> requests;
+	const int no_materials = static_cast<int>( ( std::min )( visible.size(), materials_.size() ) );
+	for ( int m = 0; m < no_materials; ++m )
+	{
+		if ( !visible[m] ) continue;
+
+		for ( const int t : material_textures_[m] )
+		{
+			if ( t < 0 ) continue;
+
+			TextureRecord & record = textures_[t];
+			record.last_used = frame_;
+			if ( !record.handle && ( record.requested != frame_ ) )
+			{
+				record.requested = frame_;
+				requests.push_back( t );
+			}
+		}
+	}
+
+	// the uploads are spread over several frames, a texture that does not fit does not block the smaller ones
+	int no_uploads = 0;
+	for ( const int t : requests )
+	{
+		if ( no_uploads == uploads_per_frame_ ) break;
+
+		if ( MakeRoom( textures_[t].bytes ) )
+		{
+			Upload( t );
+			++no_uploads;
+		}
+	}
+
+	bool bound = false;
+	for ( int m = 0; m < static_cast<int>( dirty_.size() ); ++m )
+	{
+		if ( !dirty_[m] ) continue;
+
+		if ( !bound )
+		{
+			glBindBuffer( GL_SHADER_STORAGE_BUFFER, ssbo_ );
+			bound = true;
+		}
+		WriteMaterial( m );
+	}
+	if ( bound )
+	{
+		glBindBuffer( GL_SHADER_STORAGE_BUFFER, 0 );
+	}
+}
+
+bool MaterialTable::MakeRoom( const GLsizeiptr bytes )
+{
+	while ( resident_bytes_ + bytes > budget_ )
+	{
+		// least recently used texture the GPU no longer reads
+		int lru = -1;
+		for ( int t = 0; t < static_cast<int>( textures_.size() ); ++t )
+		{
+			const TextureRecord & record = textures_[t];
+			if ( record.handle && ( record.last_used < frame_ - kFramesInFlight ) &&
+				( ( lru < 0 ) || ( record.last_used < textures_[lru].last_used ) ) )
+			{
+				lru = t;
+			}
+		}
+
+		if ( lru < 0 )
+		{
+			return false; // everything resident is still in use
+		}
+		Evict( lru );
+	}
+
+	return true;
+}
+
+void MaterialTable::Upload( const int t )
+{
+	TextureRecord & record = textures_[t];
+
+	if ( compress_ )
+	{
+		if ( !record.compressed )
+		{
+			// nothing was compressed in advance, the real size (smaller than the RGB8 estimate) is known only now
+			record.compressed = std::make_shared<CompressedImage>( CompressTexture( *record.texture, record.usage ) );
+			record.bytes = 0;
+			for ( const auto & level : record.compressed->levels )
+			{
+				record.bytes += GLsizeiptr( level.size() );
+			}
+		}
+		CreateBindlessTexture( record.id, record.handle, *record.compressed, ring_ ); // also makes the handle resident
+	}
+	else
+	{
+		CreateBindlessTexture( record.id, record.handle, record.texture->width(), record.texture->height(), record.texture->data(), ring_ );
+	}
+
+	resident_bytes_ += record.bytes;
+	++no_resident_;
+	++no_uploads_;
+
+	for ( const int m : record.users )
+	{
+		dirty_[m] = true;
+	}
+}
+
+void MaterialTable::Evict( const int t )
+{
+	TextureRecord & record = textures_[t];
+
+	glMakeTextureHandleNonResidentARB( record.handle );
+	glDeleteTextures( 1, &record.id );
+	record.handle = 0;
+	record.id = 0;
+
+	resident_bytes_ -= record.bytes;
+	--no_resident_;
+	++no_evictions_;
+
+	for ( const int m : record.users )
+	{
+		dirty_[m] = true;
+	}
+}
+
+// expects the SSBO to be bound
+void MaterialTable::WriteMaterial( const int m )
+{
+	const Material * material = materials_[m];
+	const std::array<int, kSlots> & textures = material_textures_[m];
+
+	GLMaterial gl_material;
+	gl_material.diffuse = material->diffuse_;
+	gl_material.rma = Color3f( { material->roughness_, material->metallicness, material->shading_ior() } );
+	gl_material.normal = Color3f( { 1.0f, 1.0f, 1.0f } );
+
+	// missing or not yet resident textures fall back to the shared defaults
+	gl_material.tex_diffuse_handle = ( textures[0] >= 0 && textures_[textures[0]].handle ) ? textures_[textures[0]].handle : default_handles_[0];
+	gl_material.tex_rma_handle = ( textures[1] >= 0 ) ? textures_[textures[1]].handle : 0;
+	gl_material.tex_normal_handle = ( textures[2] >= 0 && textures_[textures[2]].handle ) ? textures_[textures[2]].handle : default_handles_[1];
+
+	glBufferSubData( GL_SHADER_STORAGE_BUFFER, GLintptr( m ) * sizeof( GLMaterial ), sizeof( GLMaterial ), &gl_material );
+	dirty_[m] = false;
+}
+
+int MaterialTable::no_textures() const
+{
+	return static_cast<int>( textures_.size() );
+}
+
+int MaterialTable::no_resident() const
+{
+	return no_resident_;
+}
+
+GLsizeiptr MaterialTable::resident_bytes() const
+{
+	return resident_bytes_;
+}
+
+long long MaterialTable::no_uploads() const
+{
+	return no_uploads_;
+}
+
+long long MaterialTable::no_evictions() const
+{
+	return no_evictions_;
+}
@@ -0,0 +1,100 @@
+#ifndef MATERIAL_TABLE_H_
+#define MATERIAL_TABLE_H_
+
+#include "material.h"
+#include "texcompress.h"
+#include <array>
+
+class UploadRing;
+
+/*! \class MaterialTable
+\brief Materials SSBO with bindless handles of textures streamed in and out of VRAM.
+
+All materials share three default textures (white albedo, flat normal and no roughness map),
+so a material without a map does not cost a texture object. The material textures are not created up front:
+every frame the caller passes the materials of the visible geometry, their missing textures are uploaded
+(a few per frame) and made resident, and the textures that were not used for a while are evicted whenever the
+resident set would exceed the VRAM budget. Until its texture arrives, a material points to the default one,
+so the shaders never sample a non-resident handle.
+
+Binding: Materials SSBO 0, see pbr_common.glsl.
+
+MaterialTable table( 512 << 20, ring ); // GL thread
+table.Init( materials, compressed, true );
+table.Update( visible ); // every frame before drawing
+*/
+class MaterialTable
+{
+public:
+	MaterialTable( const GLsizeiptr vram_budget, UploadRing * ring = nullptr );
+	~MaterialTable();
+
+	MaterialTable( const MaterialTable & ) = delete;
+	MaterialTable & operator=( const MaterialTable & ) = delete;
+
+	//! Creates the default textures and fills the SSBO, no material texture is resident yet (GL thread).
+	/*!
+	\param compressed block compressed images prepared in advance (see CompressTexture), the rest is compressed on demand.
+	\param compress false uploads the textures as RGB8.
+	*/
+	void Init( const std::vector<Material *> & materials,
+		const std::map<Texture3u *, std::shared_ptr<CompressedImage>> & compressed, const bool compress );
+
+	//! Streams the textures of the visible materials in and evicts the least recently used ones (GL thread, once per frame).
+	/*!
+	\param visible flags indexed by Material::materialIndex.
+	*/
+	void Update( const std::vector<bool> & visible );
+
+	int no_textures() const;
+	int no_resident() const;
+	GLsizeiptr resident_bytes() const;
+	long long no_uploads() const;
+	long long no_evictions() const;
+
+private:
+	struct TextureRecord
+	{
+		Texture3u * texture{ nullptr };
+		TextureUsage usage{ TextureUsage::kAlbedo };
+		std::shared_ptr<CompressedImage> compressed; // kept in RAM, the texture may be uploaded again after an eviction
+		GLsizeiptr bytes{ 0 };
+		GLuint id{ 0 };
+		GLuint64 handle{ 0 }; // 0 = not resident
+		long long last_used{ -1 }; // frame
+		long long requested{ -1 }; // frame
+		std::vector<int> users; // materials
+	};
+
+	int AddTexture( Texture3u * texture, const TextureUsage usage, const int material );
+	bool MakeRoom( const GLsizeiptr bytes );
+	void Upload( const int t );
+	void Evict( const int t );
+	void WriteMaterial( const int m );
+
+	static const int kSlots = 3; // albedo, roughness, normal
+	static const int kFramesInFlight = 3; // a texture is evicted only after the GPU finished all frames using it
+
+	std::vector<Material *> materials_;
+	std::vector<std::array<int, kSlots>> material_textures_; // record index or -1
+	std::vector<TextureRecord> textures_;
+	std::map<Texture3u *, int> texture_index_; // textures shared by several materials are uploaded only once
+	std::vector<bool> dirty_;
+	bool compress_{ true };
+
+	GLuint default_textures_[2]{}; // white, flat normal
+	GLuint64 default_handles_[2]{};
+
+	GLuint ssbo_{ 0 };
+	UploadRing * ring_;
+
+	GLsizeiptr budget_;
+	GLsizeiptr resident_bytes_{ 0 };
+	int no_resident_{ 0 };
+	int uploads_per_frame_{ 4 };
+	long long frame_{ 0 };
+	long long no_uploads_{ 0 };
+	long long no_evictions_{ 0 };
+};
+
+#endif
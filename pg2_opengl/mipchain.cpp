@@ -0,0 +1,420 @@
+#include "pch.h"
+#include "mipchain.h"
+#include "simd.h"
+#include "mymath.h"
+
+static const int kMaxTaps = 8;
+static const int kPadding = 2; // px added to both ends of the even and odd halves of a row, see ReduceLevel
+static const int kJobPixels = 1 << 14; // rows are handed to the threads in blocks of at least this many px
+
+/* Weights of the 2:1 reduction, tap k of the output px x covers the input px 2 x - 3 + k. Only the taps
+from first to first + count - 1 are nonzero. */
+struct MipKernel
+{
+	int first;
+	int count;
+	float weights[kMaxTaps];
+};
+
+// modified Bessel function of the first kind of order zero (power series)
+static double BesselI0( const double x )
+{
+	double sum = 1.0;
+	double term = 1.0;
+
+	for ( int k = 1; k < 32; ++k )
+	{
+		term *= sqr( x / ( 2.0 * k ) );
+		sum += term;
+	}
+
+	return sum;
+}
+
+static const MipKernel & Kernel( const MipFilter filter )
+{
+	static const MipKernel box = { 3, 2, { 0.0f, 0.0f, 0.0f, 0.5f, 0.5f } };
+
+	static const MipKernel kaiser = []
+	{
+		const double alpha = 4.0; // shape of the window, larger values trade sharpness for less ringing
+		const double radius = 2.0; // support of the window (px of the output level)
+
+		MipKernel kernel = { 0, kMaxTaps, {} };
+		double sum = 0.0;
+
+		for ( int k = 0; k < kMaxTaps; ++k )
+		{
+			const double t = 0.5 * ( k - 3.5 ); // distance of the input px center from the output px center
+			const double sinc = sin( M_PI * t ) / ( M_PI * t );
+			const double window = BesselI0( alpha * sqrt( 1.0 - sqr( t / radius ) ) ) / BesselI0( alpha );
+
+			kernel.weights[k] = float( sinc * window );
+			sum += sinc * window;
+		}
+
+		for ( float & weight : kernel.weights )
+		{
+			weight = float( weight / sum );
+		}
+
+		return kernel;
+	}();
+
+	return ( filter == MipFilter::kKaiser ) ? kaiser : box;
+}
+
+/* 8 bit sRGB <-> linear conversions. The encoding table is indexed by the exponent and the top 8 bits of the
+mantissa of the linear value from <2^-13, 1), an entry holds the sRGB code of the center of its interval. */
+struct SrgbTables
+{
+	static const unsigned int kFirstBits = ( 127 - 13 ) << 23; // 2^-13, the codes below are zero
+	static const int kMantissaShift = 23 - 8;
+
+	float to_linear[256];
+	unsigned char to_srgb[13 << 8];
+
+	static const SrgbTables & Get()
+	{
+		static const SrgbTables tables;
+
+		return tables;
+	}
+
+	unsigned char Encode( const float linear ) const
+	{
+		const float x = ( std::min )( ( std::max )( 1.0f / 8192.0f, linear ), 0.99999994f ); // NaN becomes zero
+		unsigned int bits;
+		memcpy( &bits, &x, sizeof( bits ) );
+
+		return to_srgb[( bits - kFirstBits ) >> kMantissaShift];
+	}
+
+private:
+	SrgbTables()
+	{
+		for ( int i = 0; i < 256; ++i )
+		{
+			to_linear[i] = Color3f::c_linear( i / 255.0f );
+		}
+
+		for ( int i = 0; i < ( 13 << 8 ); ++i )
+		{
+			const unsigned int bits = kFirstBits + ( ( unsigned int )( i ) << kMantissaShift ) + ( 1u << ( kMantissaShift - 1 ) );
+			float x;
+			memcpy( &x, &bits, sizeof( x ) );
+			to_srgb[i] = ( unsigned char )( Color3f::c_srgb( x ) * 255.0f + 0.5f );
+		}
+	}
+};
+
+/* linear values of one level, each channel is a separate plane */
+struct MipLevel
+{
+	int width{ 0 };
+	int height{ 0 };
+	std::vector<float> planes;
+
+	MipLevel() = default;
+
+	MipLevel( const int width, const int height ) : width( width ), height( height ), planes( size_t( width ) * size_t( height ) * 3 )
+	{
+	}
+
+	float * row( const int c, const int y )
+	{
+		return &planes[( size_t( c ) * height + y ) * width];
+	}
+};
+
+// dst[i] = sum of weights[k] * src[k][i], the vertical pass clamps the results at zero
+static void WeightedSumSSE2( const float * const * src, const float * weights, const int taps, const int count,
+	const bool clamp, float * dst )
+{
+	__m128 w[kMaxTaps];
+	for ( int k = 0; k < taps; ++k )
+	{
+		w[k] = _mm_set1_ps( weights[k] );
+	}
+	const __m128 lower = _mm_set1_ps( clamp ? 0.0f : -FLT_MAX );
+
+	int i = 0;
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		__m128 sum = _mm_mul_ps( w[0], _mm_loadu_ps( src[0] + i ) );
+		for ( int k = 1; k < taps; ++k )
+		{
+			sum = _mm_add_ps( sum, _mm_mul_ps( w[k], _mm_loadu_ps( src[k] + i ) ) );
+		}
+		_mm_storeu_ps( dst + i, _mm_max_ps( sum, lower ) );
+	}
+
+	for ( ; i < count; ++i )
+	{
+		float sum = weights[0] * src[0][i];
+		for ( int k = 1; k < taps; ++k )
+		{
+			sum += weights[k] * src[k][i];
+		}
+		dst[i] = ( clamp && !( sum > 0.0f ) ) ? 0.0f : sum;
+	}
+}
+
+SIMD_TARGET( "avx2,fma" )
+static void WeightedSumAVX2( const float * const * src, const float * weights, const int taps, const int count,
+	const bool clamp, float * dst )
+{
+	__m256 w[kMaxTaps];
+	for ( int k = 0; k < taps; ++k )
+	{
+		w[k] = _mm256_set1_ps( weights[k] );
+	}
+	const __m256 lower = _mm256_set1_ps( clamp ? 0.0f : -FLT_MAX );
+
+	int i = 0;
+	for ( ; i + 8 <= count; i += 8 )
+	{
+		__m256 sum = _mm256_mul_ps( w[0], _mm256_loadu_ps( src[0] + i ) );
+		for ( int k = 1; k < taps; ++k )
+		{
+			sum = _mm256_fmadd_ps( w[k], _mm256_loadu_ps( src[k] + i ), sum );
+		}
+		_mm256_storeu_ps( dst + i, _mm256_max_ps( sum, lower ) );
+	}
+
+	for ( ; i < count; ++i )
+	{
+		float sum = weights[0] * src[0][i];
+		for ( int k = 1; k < taps; ++k )
+		{
+			sum += weights[k] * src[k][i];
+		}
+		dst[i] = ( clamp && !( sum > 0.0f ) ) ? 0.0f : sum;
+	}
+}
+
+static void WeightedSum( const float * const * src, const float * weights, const int taps, const int count,
+	const bool clamp, float * dst )
+{
+	static const bool avx2 = CpuFeatures::Get().avx2 && CpuFeatures::Get().fma;
+
+	if ( avx2 )
+	{
+		WeightedSumAVX2( src, weights, taps, count, clamp, dst );
+	}
+	else
+	{
+		WeightedSumSSE2( src, weights, taps, count, clamp, dst );
+	}
+}
+
+// body( begin, end ) processes the rows from <begin, end), one block of rows per job
+template <class Body>
+static void ParallelRows( ThreadPool & pool, const int width, const int height, Body body )
+{
+	const int rows = ( std::max )( 1, kJobPixels / width );
+
+	pool.ParallelFor( 0, ( height + rows - 1 ) / rows, [&]( const int job )
+	{
+		body( job * rows, ( std::min )( height, ( job + 1 ) * rows ) );
+	} );
+}
+
+/* Fills the linear values of an input row split into the even and odd px, the kPadding px at both ends
+repeat the border px. texel( x, planes, i ) stores the 3 channels of the px x into planes[c][i]. */
+template <class Texel>
+static void SplitRow( const int width, const int half, Texel texel, float * const * even, float * const * odd )
+{
+	for ( int i = 0; i < half; ++i )
+	{
+		const int x = 2 * ( i - kPadding );
+		texel( ( std::min )( ( std::max )( x, 0 ), width - 1 ), even, i );
+		texel( ( std::min )( ( std::max )( x + 1, 0 ), width - 1 ), odd, i );
+	}
+}
+
+/* Filters the next level from the src_width x src_height input px. load_row( y, half, even, odd ) splits
+the input row y by SplitRow, store_row( y, channels ) receives the finished rows of the output level. Each block of output rows filters
+the input rows it covers horizontally first and keeps them until the vertical pass, so the intermediate
+rows stay in the cache (the Kaiser filter recomputes the few rows shared by neighbouring blocks). The rows
+are split into the even and odd px, so the horizontal taps become plain shifted arrays for WeightedSum. */
+template <class LoadRow, class StoreRow>
+static MipLevel ReduceLevel( const int src_width, const int src_height, const MipKernel & kernel, LoadRow load_row,
+	StoreRow store_row, ThreadPool & pool )
+{
+	MipLevel dst( ( std::max )( 1, src_width / 2 ), ( std::max )( 1, src_height / 2 ) );
+	const float * weights = kernel.weights + kernel.first;
+	const int half = dst.width + 2 * kPadding;
+
+	// input row of the tap k of the output row y ( or column, the same applies to the px )
+	auto input = [&]( const int y, const int k, const int size )
+	{
+		return ( std::min )( ( std::max )( 2 * y - 3 + kernel.first + k, 0 ), size - 1 );
+	};
+
+	ParallelRows( pool, src_width, dst.height, [&]( const int begin, const int end )
+	{
+		const int first_row = input( begin, 0, src_height );
+		const int no_rows = input( end - 1, kernel.count - 1, src_height ) - first_row + 1;
+		MipLevel horizontal( dst.width, no_rows ); // input rows first_row, first_row + 1, ... filtered horizontally
+
+		std::vector<float> scratch( size_t( half ) * 6 );
+		float * const even[3] = { &scratch[0], &scratch[half], &scratch[2 * size_t( half )] };
+		float * const odd[3] = { &scratch[3 * size_t( half )], &scratch[4 * size_t( half )], &scratch[5 * size_t( half )] };
+
+		for ( int r = 0; r < no_rows; ++r )
+		{
+			load_row( first_row + r, half, even, odd );
+
+			for ( int c = 0; c < 3; ++c )
+			{
+				// tap k reads the input px 2 x - 3 + k, i.e. odd[x + ( k - 4 ) / 2] or even[x + ( k - 3 ) / 2]
+				const float * taps[kMaxTaps];
+				for ( int k = 0; k < kernel.count; ++k )
+				{
+					const int tap = kernel.first + k;
+					taps[k] = ( tap & 1 ) ? even[c] + kPadding + ( tap - 3 ) / 2 : odd[c] + kPadding + ( tap - 4 ) / 2;
+				}
+
+				WeightedSum( taps, weights, kernel.count, dst.width, false, horizontal.row( c, r ) );
+			}
+		}
+
+		for ( int y = begin; y < end; ++y )
+		{
+			const float * channels[3];
+
+			for ( int c = 0; c < 3; ++c )
+			{
+				const float * taps[kMaxTaps];
+				for ( int k = 0; k < kernel.count; ++k )
+				{
+					taps[k] = horizontal.row( c, input( y, k, src_height ) - first_row );
+				}
+
+				WeightedSum( taps, weights, kernel.count, dst.width, true, dst.row( c, y ) );
+				channels[c] = dst.row( c, y );
+			}
+
+			store_row( y, channels );
+		}
+	} );
+
+	return dst;
+}
+
+/* decode( x, planes, i ) converts the texel x of a texture row to linear values like the texel of SplitRow,
+encode( channels, row, count ) converts the linear values back to the texels of a level */
+template <class T, FREE_IMAGE_TYPE F, class Decode, class Encode>
+static std::vector<Texture<T, F>> BuildLevels( const Texture<T, F> & texture, const MipFilter filter, Decode decode,
+	Encode encode, ThreadPool & pool )
+{
+	std::vector<Texture<T, F>> levels;
+	levels.push_back( texture );
+
+	const MipKernel & kernel = Kernel( filter );
+	MipLevel previous; // linear values of the previous level, the texture itself is decoded row by row
+
+	while ( levels.back().width() > 1 || levels.back().height() > 1 )
+	{
+		const Texture<T, F> & src = levels.back();
+		Texture<T, F> dst( ( std::max )( 1, src.width() / 2 ), ( std::max )( 1, src.height() / 2 ) );
+
+		auto store_row = [&]( const int y, const float * const * channels )
+		{
+			encode( channels, dst.data() + size_t( y ) * dst.width(), dst.width() );
+		};
+
+		if ( previous.planes.empty() )
+		{
+			previous = ReduceLevel( src.width(), src.height(), kernel, [&]( const int y, const int half, float * const * even, float * const * odd )
+			{
+				const T * row = src.data() + size_t( y ) * src.width();
+				SplitRow( src.width(), half, [&]( const int x, float * const * planes, const int i )
+				{
+					decode( row[x], planes, i );
+				}, even, odd );
+			}, store_row, pool );
+		}
+		else
+		{
+			previous = ReduceLevel( src.width(), src.height(), kernel, [&]( const int y, const int half, float * const * even, float * const * odd )
+			{
+				const float * row[3] = { previous.row( 0, y ), previous.row( 1, y ), previous.row( 2, y ) };
+				SplitRow( src.width(), half, [&]( const int x, float * const * planes, const int i )
+				{
+					for ( int c = 0; c < 3; ++c )
+					{
+						planes[c][i] = row[c][x];
+					}
+				}, even, odd );
+			}, store_row, pool );
+		}
+
+		levels.push_back( std::move( dst ) );
+	}
+
+	return levels;
+}
+
+std::vector<Texture3f> BuildMipChain( const Texture3f & texture, const MipFilter filter, ThreadPool & pool )
+{
+	return BuildLevels( texture, filter, []( const Color3f & texel, float * const * planes, const int i )
+	{
+		for ( int c = 0; c < 3; ++c )
+		{
+			planes[c][i] = texel.data[c];
+		}
+	}, []( const float * const * channels, Color3f * row, const int count )
+	{
+		for ( int x = 0; x < count; ++x )
+		{
+			row[x] = Color3f( { channels[0][x], channels[1][x], channels[2][x] } );
+		}
+	}, pool );
+}
+
+std::vector<Texture3u> BuildMipChain( const Texture3u & texture, const bool srgb, const MipFilter filter, ThreadPool & pool )
+{
+	const SrgbTables & tables = SrgbTables::Get();
+
+	float to_linear[256];
+	for ( int i = 0; i < 256; ++i )
+	{
+		to_linear[i] = srgb ? tables.to_linear[i] : i / 255.0f;
+	}
+
+	return BuildLevels( texture, filter, [&]( const Color3u & texel, float * const * planes, const int i )
+	{
+		for ( int c = 0; c < 3; ++c )
+		{
+			planes[c][i] = to_linear[texel.data[c]];
+		}
+	}, [&]( const float * const * channels, Color3u * row, const int count )
+	{
+		for ( int c = 0; c < 3; ++c )
+		{
+			const float * plane = channels[c];
+
+			if ( srgb )
+			{
+				for ( int x = 0; x < count; ++x )
+				{
+					row[x].data[c] = tables.Encode( plane[x] );
+				}
+			}
+			else
+			{
+				for ( int x = 0; x < count; ++x )
+				{
+					row[x].data[c] = ( unsigned char )( ( std::min )( plane[x], 1.0f ) * 255.0f + 0.5f ); // >= 0 after the vertical pass
+				}
+			}
+		}
+	}, pool );
+}
+
+const char * BuildMipChainIsa()
+{
+	return ( CpuFeatures::Get().avx2 && CpuFeatures::Get().fma ) ? "AVX2" : "SSE2";
+}
@@ -0,0 +1,45 @@
+#ifndef MIP_CHAIN_H_
+#define MIP_CHAIN_H_
+
+#include "texture.h"
+#include "threadpool.h"
+
+/*! \enum MipFilter
+\brief Reconstruction filter of the CPU mip chain generation.
+*/
+enum class MipFilter : char
+{
+	kBox = 0, /*!< Average of 2 x 2 px of the previous level, the same levels as glGenerateMipmap. */
+	kKaiser = 1, /*!< Kaiser windowed sinc over 8 x 8 px, sharper levels with less aliasing, may ring slightly at hard edges. */
+};
+
+/*! \fn std::vector<Texture3f> BuildMipChain( const Texture3f & texture, const MipFilter filter, ThreadPool & pool )
+\brief Builds all mip levels of a linear (HDR) texture, the first level is a copy of \a texture and the last one is 1 x 1 px.
+
+The filter is separable, every level is filtered along the rows and then along the columns. The rows are
+spread over the threads of \a pool and each row is filtered with AVX2 (or SSE2 when not supported). Odd sizes
+repeat their last row or column like MipMap::Downsample. Negative lobes of the Kaiser filter never produce
+negative radiance, the results are clamped at zero.
+
+MipMap3f environment( BuildMipChain( Texture3f( "lebombo.exr" ), MipFilter::kKaiser ) );
+*/
+std::vector<Texture3f> BuildMipChain( const Texture3f & texture, const MipFilter filter = MipFilter::kBox,
+	ThreadPool & pool = ThreadPool::Default() );
+
+/*! \fn std::vector<Texture3u> BuildMipChain( const Texture3u & texture, const bool srgb, const MipFilter filter, ThreadPool & pool )
+\brief Builds all mip levels of an 8 bit texture like the Texture3f variant.
+
+With \a srgb the texels are decoded to linear values before filtering and encoded back afterwards, so the
+levels keep the brightness of the original (averaging the sRGB values directly darkens the contrasty areas).
+Textures holding data rather than colors (normal, roughness and other maps) should pass false. Every level is
+filtered from the unquantized values of the previous one, so the rounding errors do not accumulate down the chain.
+
+MipMap3u albedo( BuildMipChain( Texture3u( "albedo.png" ) ) );
+*/
+std::vector<Texture3u> BuildMipChain( const Texture3u & texture, const bool srgb = true, const MipFilter filter = MipFilter::kBox,
+	ThreadPool & pool = ThreadPool::Default() );
+
+//! Instruction set used by the filters of BuildMipChain on this CPU.
+const char * BuildMipChainIsa();
+
+#endif
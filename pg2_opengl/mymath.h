@@ -52,6 +52,26 @@ inline Vector3 reflect( const Vector3 & v, const Vector3 & n )
 	return ( 2.0f*( v.DotProduct( n ) ) )*n - v;
 }
 
+// orthonormal basis around the unit vector n, t and b span the tangent plane
+inline void Basis( const Vector3 & n, Vector3 & t, Vector3 & b )
+{
+	t = ( ( fabsf( n.x ) > 0.5f ) ? Vector3( 0.0f, 1.0f, 0.0f ) : Vector3( 1.0f, 0.0f, 0.0f ) ).CrossProduct( n );
+	t.Normalize();
+	b = n.CrossProduct( t );
+}
+
+// Van der Corput sequence in base 2, the second coordinate of the Hammersley set
+inline float RadicalInverse( unsigned int i )
+{
+	i = ( i << 16u ) | ( i >> 16u );
+	i = ( ( i & 0x55555555u ) << 1u ) | ( ( i & 0xAAAAAAAAu ) >> 1u );
+	i = ( ( i & 0x33333333u ) << 2u ) | ( ( i & 0xCCCCCCCCu ) >> 2u );
+	i = ( ( i & 0x0F0F0F0Fu ) << 4u ) | ( ( i & 0xF0F0F0F0u ) >> 4u );
+	i = ( ( i & 0x00FF00FFu ) << 8u ) | ( ( i & 0xFF00FF00u ) >> 8u );
+
+	return ( i >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
 unsigned long long QuickHash( const BYTE * data, const size_t length, unsigned long long mix = 0 );
 
 #endif
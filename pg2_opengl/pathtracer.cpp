@@ -0,0 +1,486 @@
+#include "pch.h"
+#include "pathtracer.h"
+#include "envmap.h"
+#include "mymath.h"
+#include <algorithm>
+#include <cmath>
+
+// paths from this bounce on are terminated by Russian roulette
+static const int kRouletteDepth = 3;
+
+// the GGX lobe of smoother surfaces degenerates into a peak that cannot be sampled reliably
+static const float kMinRoughness = 0.03f;
+
+// PCG32 seeded by the pixel and the sample, so every path gets the same numbers no matter which thread traces it
+struct Rng
+{
+	unsigned long long state;
+
+	Rng( const unsigned int pixel, const unsigned int sample )
+	{
+		state = ( ( unsigned long long )( sample ) << 32 ) + pixel;
+		state = state * 6364136223846793005ull + 1442695040888963407ull;
+		Next();
+	}
+
+	unsigned int NextUInt()
+	{
+		const unsigned long long old = state;
+		state = old * 6364136223846793005ull + 1442695040888963407ull;
+		const unsigned int xorshifted = static_cast<unsigned int>( ( ( old >> 18u ) ^ old ) >> 27u );
+		const unsigned int rot = static_cast<unsigned int>( old >> 59u );
+
+		return ( xorshifted >> rot ) | ( xorshifted << ( ( 32 - rot ) & 31 ) );
+	}
+
+	//! Uniform number from <0, 1).
+	float Next()
+	{
+		return ( NextUInt() >> 8 ) * ( 1.0f / 16777216.0f );
+	}
+};
+
+// material and frame of a path vertex
+struct ShadingPoint
+{
+	Vector3 position;
+	Vector3 normal; // interpolated, on the side of the incoming ray
+	Vector3 geometric_normal; // on the side of the incoming ray
+	Color3f albedo;
+	float roughness;
+	float metalness;
+	float F0;
+};
+
+static float Luminance( const Color3f & c )
+{
+	return 0.2126f * c.data[0] + 0.7152f * c.data[1] + 0.0722f * c.data[2];
+}
+
+static float PowerHeuristic( const float pdf_a, const float pdf_b )
+{
+	return ( pdf_a * pdf_a ) / ( pdf_a * pdf_a + pdf_b * pdf_b );
+}
+
+static float Fresnel( const float F0, const float cos_theta )
+{
+	return F0 + ( 1.0f - F0 ) * powf( 1.0f - clamp( cos_theta, 0.0f, 1.0f ), 5.0f );
+}
+
+// the lobes of pbr_common.glsl
+static float DistributionGGX( const float n_h, const float roughness )
+{
+	const float a = roughness * roughness;
+	const float a2 = a * a;
+	const float denom = n_h * n_h * ( a2 - 1.0f ) + 1.0f;
+
+	return a2 / ( float( M_PI ) * denom * denom );
+}
+
+static float GeometrySchlickGGX( const float n_v, const float roughness )
+{
+	const float r = roughness + 1.0f;
+	const float k = ( r * r ) / 8.0f;
+
+	return n_v / ( n_v * ( 1.0f - k ) + k );
+}
+
+// probability of sampling the specular lobe instead of the diffuse one
+static float SpecularProbability( const ShadingPoint & p, const float n_v )
+{
+	const float specular = Fresnel( p.F0, n_v );
+	const float diffuse = ( 1.0f - specular * ( 1.0f - p.metalness ) ) * Luminance( p.albedo );
+
+	return clamp( specular / ( std::max )( specular + diffuse, 1e-6f ), 0.1f, 0.9f );
+}
+
+// Cook-Torrance BRDF of pbr.frag times the cosine of wi, and the pdf of sampling wi
+static Color3f EvaluateBRDF( const ShadingPoint & p, const Vector3 & wo, const Vector3 & wi, float & pdf )
+{
+	const float n_l = p.normal.DotProduct( wi );
+	const float n_v = ( std::max )( p.normal.DotProduct( wo ), 1e-4f );
+	pdf = 0.0f;
+	if ( n_l <= 0.0f || p.geometric_normal.DotProduct( wi ) <= 0.0f )
+	{
+		return Color3f( { 0, 0, 0 } );
+	}
+
+	Vector3 h = wo + wi;
+	h.Normalize();
+	const float n_h = ( std::max )( p.normal.DotProduct( h ), 0.0f );
+	const float h_v = ( std::max )( h.DotProduct( wo ), 1e-4f );
+
+	const float D = DistributionGGX( n_h, p.roughness );
+	const float G = GeometrySchlickGGX( n_v, p.roughness ) * GeometrySchlickGGX( n_l, p.roughness );
+	const float F = Fresnel( p.F0, h_v );
+	const float kD = 1.0f - F * ( 1.0f - p.metalness );
+	const float specular = D * G * F / ( 4.0f * n_v * n_l );
+
+	const float p_specular = SpecularProbability( p, n_v );
+	pdf = p_specular * D * n_h / ( 4.0f * h_v ) + ( 1.0f - p_specular ) * n_l * float( M_1_PI );
+
+	Color3f f;
+	for ( int c = 0; c < 3; ++c )
+	{
+		f.data[c] = ( kD * p.albedo.data[c] * float( M_1_PI ) + specular ) * n_l;
+	}
+
+	return f;
+}
+
+// samples either the GGX half vector distribution or the cosine lobe
+static Vector3 SampleBRDF( const ShadingPoint & p, const Vector3 & wo, const float r0, const float r1, const float r2 )
+{
+	Vector3 t, b;
+	Basis( p.normal, t, b );
+	const float phi = 2.0f * float( M_PI ) * r2;
+
+	if ( r0 < SpecularProbability( p, ( std::max )( p.normal.DotProduct( wo ), 1e-4f ) ) )
+	{
+		const float a = p.roughness * p.roughness;
+		const float cos_theta = sqrtf( ( 1.0f - r1 ) / ( 1.0f + ( a * a - 1.0f ) * r1 ) );
+		const float sin_theta = sqrtf( ( std::max )( 0.0f, 1.0f - cos_theta * cos_theta ) );
+		const Vector3 h = t * ( sin_theta * cosf( phi ) ) + b * ( sin_theta * sinf( phi ) ) + p.normal * cos_theta;
+
+		return h * ( 2.0f * wo.DotProduct( h ) ) - wo;
+	}
+
+	const float r = sqrtf( r1 );
+
+	return t * ( r * cosf( phi ) ) + b * ( r * sinf( phi ) ) + p.normal * sqrtf( ( std::max )( 0.0f, 1.0f - r1 ) );
+}
+
+// material and frame at the hit point, false if the surface has no material
+static bool Shade( const std::vector<Surface *> & surfaces, const RayCaster & caster, const RayHit & hit, const Ray & ray, ShadingPoint & point )
+{
+	Triangle & triangle = surfaces[hit.surface]->get_triangle( hit.triangle );
+	const Vertex v0 = triangle.vertex( 0 );
+	const Vertex v1 = triangle.vertex( 1 );
+	const Vertex v2 = triangle.vertex( 2 );
+	const float w0 = 1.0f - hit.u - hit.v;
+
+	point.position = ray.origin + ray.direction * hit.t;
+	point.geometric_normal = caster.GeometricNormal( hit );
+	if ( point.geometric_normal.DotProduct( ray.direction ) > 0.0f )
+	{
+		point.geometric_normal *= -1.0f;
+	}
+	point.normal = v0.normal * w0 + v1.normal * hit.u + v2.normal * hit.v;
+	if ( point.normal.Normalize() <= 0.0f )
+	{
+		point.normal = point.geometric_normal;
+	}
+	else if ( point.normal.DotProduct( point.geometric_normal ) < 0.0f )
+	{
+		point.normal *= -1.0f; // two-sided like the forward shaders
+	}
+
+	// the textures are addressed like in pbr.vert
+	const float u = v0.texture_coords[0].u * w0 + v1.texture_coords[0].u * hit.u + v2.texture_coords[0].u * hit.v;
+	const float v = 1.0f - ( v0.texture_coords[0].v * w0 + v1.texture_coords[0].v * hit.u + v2.texture_coords[0].v * hit.v );
+
+	const Material * material = hit.material;
+	if ( !material )
+	{
+		return false;
+	}
+
+	point.albedo = material->diffuse_;
+	const Texture3u * diffuse_map = material->texture( Material::kDiffuseMapSlot );
+	if ( diffuse_map )
+	{
+		point.albedo *= SampleRepeat( *diffuse_map, u, v );
+	}
+
+	point.roughness = material->roughness_;
+	const Texture3u * roughness_map = material->texture( Material::kRoughnessMapSlot );
+	if ( roughness_map )
+	{
+		point.roughness *= SampleRepeat( *roughness_map, u, v ).data[0];
+	}
+	point.roughness = clamp( point.roughness, kMinRoughness, 1.0f );
+	point.metalness = clamp( material->metallicness, 0.0f, 1.0f );
+
+	// the IOR of the real-time shaders (rma.b), 1 for unknown IORs
+	const float ior = material->shading_ior();
+	point.F0 = sqr( ( 1.0f - ior ) / ( 1.0f + ior ) );
+
+	return true;
+}
+
+PathTracer::PathTracer( const int width, const int height, ThreadPool & pool ) :
+	pool_( pool ), width_( width ), height_( height ), environment_( 1, 1 ), accumulator_( width, height ), color_buffer_( width, height )
+{
+	tiles_x_ = ( width + kTileSize - 1 ) / kTileSize;
+	tiles_y_ = ( height + kTileSize - 1 ) / kTileSize;
+	SetEnvironment( Texture3f( 1, 1 ) );
+}
+
+void PathTracer::SetScene( const std::vector<Surface *> & surfaces )
+{
+	caster_.reset();
+
+	surfaces_ = surfaces;
+	bvh_ = std::make_unique<BVH>();
+	bvh_->Build( surfaces_, BVH::BuildMethod::kBinnedSAH, pool_ );
+	caster_ = std::make_unique<RayCaster>( *bvh_, surfaces_ );
+
+	const AABB bounds = bvh_->bounds();
+	ray_epsilon_ = bounds.empty() ? 1e-4f : 1e-5f * ( bounds.upper - bounds.lower ).L2Norm();
+	no_samples_ = 0;
+}
+
+void PathTracer::SetEnvironment( Texture3f environment )
+{
+	environment_ = std::move( environment );
+
+	// texels weighted by their luminance and solid angle (the cosine of the latitude)
+	const int width = environment_.width();
+	const int height = environment_.height();
+	environment_columns_.assign( size_t( width + 1 ) * height, 0.0f );
+	environment_rows_.assign( size_t( height ) + 1, 0.0f );
+
+	pool_.ParallelFor( 0, height, [&]( const int y )
+	{
+		const float cos_latitude = cosf( ( ( y + 0.5f ) / height - 0.5f ) * float( M_PI ) );
+		float * cdf = &environment_columns_[size_t( width + 1 ) * y];
+		for ( int x = 0; x < width; ++x )
+		{
+			// a small floor keeps the pdf positive wherever the bilinear lookup may return radiance
+			cdf[x + 1] = cdf[x] + ( Luminance( environment_.pixel( x, y ) ) + 1e-4f ) * cos_latitude;
+		}
+	} );
+
+	for ( int y = 0; y < height; ++y )
+	{
+		environment_rows_[y + 1] = environment_rows_[y] + environment_columns_[size_t( width + 1 ) * y + width];
+	}
+	environment_integral_ = environment_rows_[height];
+	no_samples_ = 0;
+}
+
+void PathTracer::SetCamera( const Camera & camera, const Matrix4x4 & model )
+{
+	camera_ = camera;
+	world_to_model_ = Matrix4x4::EuclideanInverse( model );
+	no_samples_ = 0;
+}
+
+void PathTracer::Render( const int no_samples )
+{
+	if ( !caster_ || no_samples < 1 )
+	{
+		return;
+	}
+
+	pool_.ParallelFor( 0, tiles_x_ * tiles_y_, [&]( const int tile )
+	{
+		RenderTile( tile, no_samples );
+	} );
+	no_samples_ += no_samples;
+
+	// averages of all paths so far
+	const float scale = 1.0f / no_samples_;
+	const Color3f * sum = accumulator_.data();
+	Color3f * color = color_buffer_.data();
+	for ( size_t i = 0; i < size_t( width_ ) * height_; ++i )
+	{
+		color[i] = sum[i] * scale;
+	}
+}
+
+void PathTracer::RenderTile( const int tile, const int no_samples )
+{
+	const int x0 = ( tile % tiles_x_ ) * kTileSize;
+	const int y0 = ( tile / tiles_x_ ) * kTileSize;
+	const int x1 = ( std::min )( x0 + kTileSize, width_ );
+	const int y1 = ( std::min )( y0 + kTileSize, height_ );
+	Color3f * sum = accumulator_.data();
+
+	for ( int y = y0; y < y1; ++y )
+	{
+		for ( int x = x0; x < x1; ++x )
+		{
+			Color3f & pixel = sum[x + size_t( y ) * width_];
+			if ( no_samples_ == 0 )
+			{
+				pixel = Color3f( { 0, 0, 0 } );
+			}
+
+			for ( int s = no_samples_; s < no_samples_ + no_samples; ++s )
+			{
+				const Color3f radiance = Trace( x, y, s );
+
+				// a NaN or inf would never average out
+				if ( std::isfinite( radiance.data[0] + radiance.data[1] + radiance.data[2] ) )
+				{
+					pixel += radiance;
+				}
+			}
+		}
+	}
+}
+
+Color3f PathTracer::Trace( const int x, const int y, const int sample ) const
+{
+	Rng rng( static_cast<unsigned int>( x + y * width_ ), static_cast<unsigned int>( sample ) );
+	const float jitter_x = rng.Next();
+	const float jitter_y = rng.Next();
+	Ray ray = TransformRay( world_to_model_, CameraRay( camera_, x + jitter_x, y + jitter_y ) );
+
+	Color3f radiance( { 0, 0, 0 } );
+	Color3f throughput( { 1, 1, 1 } );
+	float brdf_pdf = 0.0f; // of the last bounce, 0 for the camera ray
+
+	for ( int depth = 0; depth <= max_depth_; ++depth )
+	{
+		RayHit hit;
+		if ( !caster_->Intersect( ray, hit ) )
+		{
+			// the environment seen directly or found by the BRDF sampling, weighted against the environment sampling
+			const float weight = ( brdf_pdf > 0.0f ) ? PowerHeuristic( brdf_pdf, EnvironmentPdf( ray.direction ) ) : 1.0f;
+			radiance += throughput * EnvironmentRadiance( ray.direction ) * weight;
+			break;
+		}
+
+		ShadingPoint point;
+		if ( depth == max_depth_ || !Shade( surfaces_, *caster_, hit, ray, point ) )
+		{
+			break;
+		}
+		Vector3 wo = ray.direction * -1.0f;
+		wo.Normalize();
+
+		// environment sampling
+		{
+			float env_pdf = 0.0f;
+			const Vector3 wi = SampleEnvironment( rng.Next(), rng.Next(), env_pdf );
+			float pdf = 0.0f;
+			const Color3f f = EvaluateBRDF( point, wo, wi, pdf );
+			if ( env_pdf > 0.0f && pdf > 0.0f )
+			{
+				Ray shadow_ray;
+				shadow_ray.origin = point.position + point.geometric_normal * ray_epsilon_;
+				shadow_ray.direction = wi;
+				if ( !caster_->Occluded( shadow_ray ) )
+				{
+					radiance += throughput * f * EnvironmentRadiance( wi ) * ( PowerHeuristic( env_pdf, pdf ) / env_pdf );
+				}
+			}
+		}
+
+		// BRDF sampling of the next direction
+		const float r0 = rng.Next();
+		const float r1 = rng.Next();
+		const float r2 = rng.Next();
+		Vector3 wi = SampleBRDF( point, wo, r0, r1, r2 );
+		wi.Normalize();
+		const Color3f f = EvaluateBRDF( point, wo, wi, brdf_pdf );
+		if ( brdf_pdf <= 0.0f )
+		{
+			break;
+		}
+		throughput *= f * ( 1.0f / brdf_pdf );
+
+		if ( depth >= kRouletteDepth )
+		{
+			const float survival = ( std::min )( ( std::max )( { throughput.data[0], throughput.data[1], throughput.data[2] } ), 0.95f );
+			if ( rng.Next() >= survival )
+			{
+				break;
+			}
+			throughput *= 1.0f / survival;
+		}
+
+		ray = Ray();
+		ray.origin = point.position + point.geometric_normal * ray_epsilon_;
+		ray.direction = wi;
+	}
+
+	return radiance;
+}
+
+Color3f PathTracer::EnvironmentRadiance( const Vector3 & direction ) const
+{
+	return SampleEquirectangular( environment_.data(), environment_.width(), environment_.height(), direction );
+}
+
+Vector3 PathTracer::SampleEnvironment( const float r1, const float r2, float & pdf ) const
+{
+	const int width = environment_.width();
+	const int height = environment_.height();
+
+	// the row, then the texel within the row, both by inverting their cumulative distributions
+	const float row_target = r1 * environment_integral_;
+	const int y = clamp( int( std::upper_bound( environment_rows_.begin() + 1, environment_rows_.end(), row_target ) -
+		environment_rows_.begin() ) - 1, 0, height - 1 );
+	const float row_weight = environment_rows_[y + 1] - environment_rows_[y];
+	const float row_fraction = ( row_weight > 0.0f ) ? ( row_target - environment_rows_[y] ) / row_weight : 0.5f;
+
+	const float * cdf = &environment_columns_[size_t( width + 1 ) * y];
+	const float column_target = r2 * cdf[width];
+	const int x = clamp( int( std::upper_bound( cdf + 1, cdf + width + 1, column_target ) - cdf ) - 1, 0, width - 1 );
+	const float texel_weight = cdf[x + 1] - cdf[x];
+	const float column_fraction = ( texel_weight > 0.0f ) ? ( column_target - cdf[x] ) / texel_weight : 0.5f;
+
+	// r1 and r2 are reused inside the texel
+	const float u = ( x + clamp( column_fraction, 0.0f, 1.0f ) ) / width;
+	const float v = ( y + clamp( row_fraction, 0.0f, 1.0f ) ) / height;
+	const Vector3 direction = EquirectangularDirection( u, v );
+	pdf = EnvironmentPdf( direction );
+
+	return direction;
+}
+
+float PathTracer::EnvironmentPdf( const Vector3 & direction ) const
+{
+	const int width = environment_.width();
+	const int height = environment_.height();
+	if ( environment_integral_ <= 0.0f )
+	{
+		return 0.0f;
+	}
+
+	// the mapping of SampleEquirectangular
+	const float length = direction.L2Norm();
+	const float u = atan2f( direction.z, direction.x ) * float( 0.5 * M_1_PI ) + 0.5f;
+	const float v = asinf( clamp( direction.y / length, -1.0f, 1.0f ) ) * float( M_1_PI ) + 0.5f;
+	const int x = clamp( int( u * width ), 0, width - 1 );
+	const int y = clamp( int( v * height ), 0, height - 1 );
+	const float cos_latitude = cosf( ( v - 0.5f ) * float( M_PI ) );
+	if ( cos_latitude <= 0.0f )
+	{
+		return 0.0f;
+	}
+
+	// the texel probability spread over its area in ( u, v ), then converted to the solid angle
+	const float * cdf = &environment_columns_[size_t( width + 1 ) * y];
+	const float probability = ( cdf[x + 1] - cdf[x] ) / environment_integral_;
+
+	return probability * width * height / ( 2.0f * float( M_PI * M_PI ) * cos_latitude );
+}
+
+const Texture3f & PathTracer::color_buffer() const
+{
+	return color_buffer_;
+}
+
+int PathTracer::no_samples() const
+{
+	return no_samples_;
+}
+
+void PathTracer::set_max_depth( const int max_depth )
+{
+	max_depth_ = ( std::max )( max_depth, 0 );
+}
+
+int PathTracer::width() const
+{
+	return width_;
+}
+
+int PathTracer::height() const
+{
+	return height_;
+}
@@ -0,0 +1,95 @@
+#ifndef PATH_TRACER_H_
+#define PATH_TRACER_H_
+
+#include "raycaster.h"
+#include "texture.h"
+
+/*! \class PathTracer
+\brief Unidirectional path tracer with the Cook-Torrance GGX model of pbr.frag, lit by an environment map.
+
+A reference for the real-time IBL approximation and a renderer of final frames on machines without a GPU.
+The scene is traced in model space like the forward shaders shade it, so the environment turns with the model.
+Every vertex of a path samples the environment (importance sampled by the luminance of its texels) and the BRDF
+(GGX half vectors or a cosine lobe), the two strategies are combined by multiple importance sampling.
+
+Each Render call adds samples to every pixel, the image is split into kTileSize x kTileSize px tiles handed out
+to the threads of the pool. The random numbers depend only on the pixel and the sample index, so the result does not
+depend on the number of threads.
+
+PathTracer tracer( 640, 480 );
+tracer.SetScene( surfaces );
+tracer.SetEnvironment( Texture3f( "lebombo.exr" ) );
+tracer.SetCamera( camera, model );
+for ( int i = 0; i < 64; ++i ) tracer.Render(); // progressive, color_buffer() is valid after every pass
+tracer.color_buffer().Save( "reference.exr" );
+*/
+class PathTracer
+{
+public:
+	//! Size of the screen tiles (px).
+	static const int kTileSize = 16;
+
+	PathTracer( const int width, const int height, ThreadPool & pool = ThreadPool::Default() );
+
+	PathTracer( const PathTracer & ) = delete;
+	PathTracer & operator=( const PathTracer & ) = delete;
+
+	//! Builds the acceleration structure, the surfaces and their materials must outlive the tracer.
+	void SetScene( const std::vector<Surface *> & surfaces );
+
+	//! Equirectangular radiance map, also builds the distribution its directions are sampled from.
+	void SetEnvironment( Texture3f environment );
+
+	//! Sets the view of the camera and the model matrix of the scene, the accumulated samples are discarded.
+	void SetCamera( const Camera & camera, const Matrix4x4 & model );
+
+	//! Adds \a no_samples paths to every pixel and updates color_buffer.
+	void Render( const int no_samples = 1 );
+
+	//! Average linear radiance of all paths traced so far (the top row first).
+	const Texture3f & color_buffer() const;
+
+	//! Number of paths per pixel accumulated in color_buffer.
+	int no_samples() const;
+
+	//! Paths are terminated after this many bounces, from the fourth bounce on they may end earlier by Russian roulette.
+	void set_max_depth( const int max_depth );
+
+	int width() const;
+	int height() const;
+
+private:
+	void RenderTile( const int tile, const int no_samples );
+	Color3f Trace( const int x, const int y, const int sample ) const;
+
+	Color3f EnvironmentRadiance( const Vector3 & direction ) const;
+	Vector3 SampleEnvironment( const float r1, const float r2, float & pdf ) const;
+	float EnvironmentPdf( const Vector3 & direction ) const;
+
+	ThreadPool & pool_;
+
+	int width_{ 0 };
+	int height_{ 0 };
+	int tiles_x_{ 0 };
+	int tiles_y_{ 0 };
+	int max_depth_{ 8 };
+
+	std::vector<Surface *> surfaces_;
+	std::unique_ptr<BVH> bvh_;
+	std::unique_ptr<RayCaster> caster_; /*!< Refers to *bvh_, declared after it so that it is destroyed first. */
+	float ray_epsilon_{ 1e-4f }; /*!< Offset of the secondary ray origins, relative to the scene size. */
+
+	Texture3f environment_;
+	std::vector<float> environment_rows_; /*!< Cumulative distribution of the rows, height + 1 values. */
+	std::vector<float> environment_columns_; /*!< Cumulative distribution of the texels of each row, ( width + 1 ) x height values. */
+	float environment_integral_{ 0.0f };
+
+	Camera camera_;
+	Matrix4x4 world_to_model_;
+
+	Texture3f accumulator_; /*!< Sum of the paths. */
+	Texture3f color_buffer_;
+	int no_samples_{ 0 };
+};
+
+#endif
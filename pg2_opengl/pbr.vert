@@ -1,6 +1,7 @@
 #version 450 core
 layout (location = 0) in vec4 in_position;
 layout (location = 1) in vec3 in_normal;
+layout (location = 2) in vec3 in_color; // bent normal * ambient visibility once baked, see BakeVertexAO
 layout (location = 3) in vec2 in_texcoord;
 layout (location = 4) in vec3 in_tangent;
 layout (location = 5) in int materialIdx;
@@ -9,14 +10,19 @@ out vec3 position; //position
 out vec2 texcoord;	//texcoord
 out vec3 normal;	//normal
 flat out int material_index;
+out vec4 bent_normal_ao; // model space bent normal, ambient visibility
 
 out vec3 light;
 out vec3 camPos;
+out vec3 position_vs; // view space, the clustered lights are shaded there
+out vec3 normal_vs;
 
 //input
 uniform mat4 mvp; // View Projection
+uniform mat4 mv; // Model View
 uniform vec3 lightPos;
 uniform vec3 viewFrom;
+uniform int ao_baked; // 0 = in_color is the color of the OBJ loader
 
 void main( void )
 {
@@ -31,6 +37,12 @@ void main( void )
 	normal = N;
 	material_index = materialIdx;
 
+	float ao = length(in_color);
+	bent_normal_ao = (ao_baked != 0 && ao > 0.0) ? vec4(in_color / ao, ao) : vec4(N, (ao_baked != 0) ? 0.0 : 1.0);
+
 	light = lightPos;
 	camPos = viewFrom;
+
+	position_vs = (mv * in_position).xyz;
+	normal_vs = mat3(mv) * N; // rigid transformation
 }
@@ -0,0 +1,115 @@
+// shared by the forward (pbr, pbr_shadow) and deferred (gbuffer, deferred) shaders, needs GL_ARB_bindless_texture and GL_ARB_gpu_shader_int64
+
+#define PI 3.14159265359
+
+struct Material {
+	vec3 diffuse; // (1,1,1) or albedo
+	uint64_t tex_diffuse; // albedo texture
+	vec3 rma; // (1,1,1) or (roughness, metalness, IOR), IOR = Material::shading_ior in <1, 3>
+	uint64_t tex_rma; // roughness texture (BC4, red channel) or 0
+	vec3 normal; // (1,1,1) or (0,0,1)
+	uint64_t tex_normal; // bump texture (BC5, z = sqrt(1 - x^2 - y^2))
+};
+
+// ### Maps of the image based lighting
+uniform samplerCube envMap; // prefiltered radiance, mip level = roughness * envMap_max_lod
+uniform sampler2D brdfMap;
+uniform int envMap_max_lod;
+
+layout (std430, binding = 0) readonly buffer Materials {
+	Material materials[];
+};
+
+// irradiance over pi as 9 SH coefficients (rgb, w unused), see SphericalHarmonics9
+layout (std140, binding = 1) uniform IrradianceSH {
+	vec4 sh[9];
+};
+
+// ambient occlusion of the reflected environment from the baked diffuse visibility [Lagarde and de Rousiers 2014]
+float SpecularOcclusion(float NdotV, float ao, float roughness)
+{
+	return clamp(pow(NdotV + ao, exp2(-16.0 * roughness - 1.0)) - 1.0 + ao, 0.0, 1.0);
+}
+
+vec3 IrradianceSH9(vec3 n)
+{
+	return sh[0].rgb * 0.282095
+		+ sh[1].rgb * (0.488603 * n.y)
+		+ sh[2].rgb * (0.488603 * n.z)
+		+ sh[3].rgb * (0.488603 * n.x)
+		+ sh[4].rgb * (1.092548 * n.x * n.y)
+		+ sh[5].rgb * (1.092548 * n.y * n.z)
+		+ sh[6].rgb * (0.315392 * (3.0 * n.z * n.z - 1.0))
+		+ sh[7].rgb * (1.092548 * n.x * n.z)
+		+ sh[8].rgb * (0.546274 * (n.x * n.x - n.y * n.y));
+}
+
+////////////////////////////////////
+// Functions from Learnopengl
+////////////////////////////////////
+float DistributionGGX(vec3 N, vec3 H, float roughness)
+{
+    float a = roughness*roughness;
+    float a2 = a*a;
+    float NdotH = max(dot(N, H), 0.0);
+    float NdotH2 = NdotH*NdotH;
+
+    float nom   = a2;
+    float denom = (NdotH2 * (a2 - 1.0) + 1.0);
+    denom = PI * denom * denom;
+
+    return nom / denom;
+}
+float GeometrySchlickGGX(float NdotV, float roughness)
+{
+    float r = (roughness + 1.0);
+    float k = (r*r) / 8.0;
+
+    float nom   = NdotV;
+    float denom = NdotV * (1.0 - k) + k;
+
+    return nom / denom;
+}
+float GeometrySmith(vec3 N, vec3 V, vec3 L, float roughness)
+{
+    float NdotV = max(dot(N, V), 0.0);
+    float NdotL = max(dot(N, L), 0.0);
+    float ggx2 = GeometrySchlickGGX(NdotV, roughness);
+    float ggx1 = GeometrySchlickGGX(NdotL, roughness);
+
+    return ggx1 * ggx2;
+}
+////////////////////////////////////
+////////////////////////////////////
+
+// F0 of a dielectric with the index of refraction IOR (rma.b of the material)
+vec3 FresnelF0(float IOR)
+{
+	return vec3(pow((1 - IOR) / (1 + IOR), 2.0));
+}
+
+// image based part of the Cook-Torrance GGX model, the Fresnel term uses the half vector of the eye and the sun,
+// n, W0 (to the eye) and L (to the sun) are unit model space vectors, the irradiance is looked up for n_ao (bent normal)
+vec3 PBRLighting(vec3 n, vec3 W0, vec3 L, vec3 n_ao, float ao, vec3 albedo, float roughness, float metalness, float IOR)
+{
+	vec3 Wi = reflect(-W0, n);
+	vec3 H = normalize(L + W0);
+	float cos0 = max(dot(n, W0), 0.0);
+
+	//fresnel
+	float HV = max(dot(H, W0), 0.0);
+	vec3 F0 = FresnelF0(IOR);
+	vec3 F = F0 + (1.0 - F0) * pow(1.0 - HV, 5.0);
+
+	vec3 kS = F;
+	vec3 kD = vec3(1.0) - kS * (1.0 - metalness);
+
+	//Irradiance (SH9), the roughness levels of the prefiltered environment are stored as mip levels
+	vec3 irradiance = max(IrradianceSH9(n_ao), vec3(0.0)) * ao;
+	vec3 env = textureLod(envMap, Wi, roughness * envMap_max_lod).rgb * SpecularOcclusion(cos0, ao, roughness);
+
+	//(s, b) = BRDFIntMap(N_V, a)
+	vec2 brdf = texture(brdfMap, vec2(cos0, roughness)).rg;
+
+	return kD * ((albedo/PI) * irradiance) + (kS * brdf.x + brdf.y) * env;
+}
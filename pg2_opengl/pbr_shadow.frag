@@ -2,85 +2,23 @@
 #extension GL_ARB_bindless_texture : require
 #extension GL_ARB_gpu_shader_int64 : require
 
-#define PI 3.14159265359
-
-
-// ### Maps
-uniform sampler2D irradianceMap;
-uniform sampler2D envMap;
-uniform sampler2D brdfMap;
-uniform sampler2D shadow_map;
-uniform int envMap_roughness;
-
 // ### Input from vertex shader
 in vec3 position; //position
 in vec3 normal;	//normal
 in vec2 texcoord;	//texcoord
 flat in int material_index;
+in vec4 bent_normal_ao;
 in vec3 light;
 in vec3 camPos;
-in vec3 position_lcs;
+in vec3 position_vs;
+in vec3 normal_vs;
 
 const vec3 lightColour = vec3(1, 1, 1);
 
-struct Material {
-	vec3 diffuse; // (1,1,1) or albedo
-	uint64_t tex_diffuse; // albedo texture
-	vec3 rma; // (1,1,1) or (roughness, metalness, 1)
-	uint64_t tex_rma; // rma texture
-	vec3 normal; // (1,1,1) or (0,0,1)
-	uint64_t tex_normal; // bump texture
-};
-
-layout (std430, binding = 0) readonly buffer Materials {
-	Material materials[];
-};
-
-////////////////////////////////////
-// Functions from Learnopengl
-////////////////////////////////////
-float DistributionGGX(vec3 N, vec3 H, float roughness)
-{
-    float a = roughness*roughness;
-    float a2 = a*a;
-    float NdotH = max(dot(N, H), 0.0);
-    float NdotH2 = NdotH*NdotH;
-
-    float nom   = a2;
-    float denom = (NdotH2 * (a2 - 1.0) + 1.0);
-    denom = PI * denom * denom;
-
-    return nom / denom;
-}
-float GeometrySchlickGGX(float NdotV, float roughness)
-{
-    float r = (roughness + 1.0);
-    float k = (r*r) / 8.0;
-
-    float nom   = NdotV;
-    float denom = NdotV * (1.0 - k) + k;
+#include "pbr_common.glsl"
+#include "clustered_lights.glsl"
+#include "shadow.glsl"
 
-    return nom / denom;
-}
-float GeometrySmith(vec3 N, vec3 V, vec3 L, float roughness)
-{
-    float NdotV = max(dot(N, V), 0.0);
-    float NdotL = max(dot(N, L), 0.0);
-    float ggx2 = GeometrySchlickGGX(NdotV, roughness);
-    float ggx1 = GeometrySchlickGGX(NdotL, roughness);
-
-    return ggx1 * ggx2;
-}
-const vec2 invAtan = vec2(0.1591, 0.3183);
-vec2 SampleSphericalMap(vec3 v)
-{
-    vec2 uv = vec2(atan(v.z, v.x), asin(v.y));
-    uv *= invAtan;
-    uv += 0.5;
-    return uv;
-}
-////////////////////////////////////
-////////////////////////////////////
 out vec4 FragColor;
 
 void main( void )
@@ -92,7 +30,10 @@ void main( void )
 	vec3 albedo = material.diffuse.rgb * texture(sampler2D(material.tex_diffuse), texcoord).rgb;
 
 	//Roughness, metallness and IOR
-	vec3 rma = vec3(material.rma.r, material.rma.g, 1);
+	vec3 rma = material.rma;
+	if (material.tex_rma != 0) {
+		rma.r *= texture(sampler2D(material.tex_rma), texcoord).r;
+	}
 	float roughness = rma.r;
 	float metalness = rma.g;
 	float IOR = rma.b;
@@ -100,59 +41,18 @@ void main( void )
 	//preparation
 	vec3 n = normalize(normal);  //NORMALIZE!! 
 	vec3 W0 = normalize(camPos - position); 
-	vec3 Wi = reflect(-W0, n);
-    vec3 L = normalize(light - position);
-    vec3 H = normalize(L + W0);
-	float cos0 = max(dot(n, W0), 0.0);
-
-	//fresnel
-    float HV = max(dot(H, W0), 0.0);
-    vec3 F0 = vec3(pow((1 - IOR) / (1 + IOR), 2.0)); //0.034 plastic +-
-    vec3 F  = F0 + (1.0 - F0) * pow(1.0 - HV, 5.0); 
+	vec3 L = normalize(light - position);
 
-    // Cook-Torrance brdf
-    float NDF = DistributionGGX(n, H, roughness);   
-    float G = GeometrySmith(n, W0, L, roughness);      
-	 
-    vec3 kS = F;
-    vec3 kD = vec3(1.0) - kS * (1.0 - metalness);
-
-	//Irradiance map, Enviromental maps and BRDF png map
-	vec2 uv = SampleSphericalMap(n);
-	vec3 irradiance = texture(irradianceMap, uv).rgb;
-
-	//PrefEnvMap(Wi, roughness)
-	uv = SampleSphericalMap(Wi);
-	vec3 env = texture(envMap, uv, roughness * envMap_roughness).rgb;
-
-	//(s, b) = BRDFIntMap(N_V, a)
-	uv = vec2(cos0, roughness);
-	vec2 brdf = texture(brdfMap, uv).rg;
+	//IBL of the Cook-Torrance model, the baked bent normal points to the unoccluded part of the hemisphere
+	vec3 Lo = PBRLighting(n, W0, L, normalize(bent_normal_ao.xyz), bent_normal_ao.w, albedo, roughness, metalness, IOR);
 
 	//Shadows computing
-	float bias = 0.001;
-	vec2 shadow_texel_size = 1.0f / textureSize( shadow_map, 0 ); // size of a single texel in tex coords
-	const int r = 2; // search radius, try different values
-	float shadow = 0.0f; // cumulative shadowing coefficient
-	for ( int y = -r; y <= r; ++y ) {
-		for ( int x = -r; x <= r; ++x ) {
-			vec2 a_tc = ( position_lcs.xy + vec2( 1.0f ) ) * 0.5f;
-			a_tc += vec2( x, y ) * shadow_texel_size;
-			float depth = texture( shadow_map, a_tc ).r;
-			depth = depth * 2.0f - 1.0f;
-			shadow += ( depth + bias >= position_lcs.z )? 1.0f : 0.25f ;
-		}
-	}
-	shadow *= ( 1.0f / ( ( 2 * r + 1 ) * ( 2 * r + 1 ) ) ); // compute mean shadowing value
-
+	Lo *= Shadow(position, 1.0 / gl_FragCoord.w); // gl_FragCoord.w = 1 / w_clip and w_clip is the view depth for our projection
 
-	//Final color - complete prb ibl shader
-	vec3 Lo = kD * ((albedo/PI) * irradiance) + (kS * brdf.x + brdf.y) * env;
-	Lo *= shadow;
+	//Direct light of the point lights overlapping the cluster of this fragment (view space), unshadowed like in deferred.frag
+	Lo += ClusteredLighting(gl_FragCoord.xy, position_vs, normalize(normal_vs), albedo, roughness, metalness, FresnelF0(IOR));
 
-	//Gamma correct - learnopengl
-    Lo = Lo / (Lo + vec3(1.0));
-    Lo = pow(Lo, vec3(1.0/2.2)); 
+	//linear radiance, exposure, tone mapping and gamma are applied once per pixel by PostProcess
 
 	//output color
 	FragColor = vec4(Lo, 1.0f);
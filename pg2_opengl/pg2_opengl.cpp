@@ -2,21 +2,312 @@
 #include "tutorials.h"
 #include "Rasterizer.h"
 #include "mymath.h"
+#include "iblbaker.h"
+#include "objloader.h"
+#include "softrasterizer.h"
+#include "raycaster.h"
+#include "pathtracer.h"
+#include "aobaker.h"
+#include "mipchain.h"
+#include <chrono>
 
-int main()
+//the LUT written by --bake, the shipped png when nothing has been baked yet
+static const char * BRDFIntegrationMapFile() {
+	static const char * baked = "../../data/brdf_integration_map_ct_ggx.exr";
+	FILE * file = fopen(baked, "rb");
+	if (file) {
+		fclose(file);
+		return baked;
+	}
+	return "../../data/brdf_integration_map_ct_ggx.png";
+}
+
+//camera of the avenger scene of the main function, model is the rotation of the first frame of Rasterizer::RenderFrame
+static Camera AvengerView(const int width, const int height, Matrix4x4 & model) {
+	const float angle = deg2rad(45.0f);
+	model = Matrix4x4();
+	model.set(0, 0, cosf(angle));
+	model.set(0, 1, -sinf(angle));
+	model.set(1, 0, sinf(angle));
+	model.set(1, 1, cosf(angle));
+
+	return Camera(width, height, deg2rad(45.0), Vector3(190, -103, 186), Vector3(0, 0, 30));
+}
+
+//renders the avenger scene of the main function on the CPU only, no window or GPU is needed
+static int RenderSoftware(const char * output, const int no_frames) {
+	std::vector<Surface *> surfaces;
+	std::vector<Material *> materials;
+	if (LoadOBJ("../../data/6887_allied_avenger_gi2.obj", surfaces, materials) < 0) {
+		return -1;
+	}
+
+	std::vector<Texture3f> prefiltered;
+	for (const char * path : { "../../data/lebombo_prefiltered_env_map_001_2048.exr",
+		"../../data/lebombo_prefiltered_env_map_010_1024.exr",
+		"../../data/lebombo_prefiltered_env_map_100_512.exr",
+		"../../data/lebombo_prefiltered_env_map_250_256.exr",
+		"../../data/lebombo_prefiltered_env_map_500_128.exr",
+		"../../data/lebombo_prefiltered_env_map_750_64.exr",
+		"../../data/lebombo_prefiltered_env_map_999_32.exr" }) {
+		prefiltered.push_back(Texture3f(path));
+	}
+
+	const int width = 640;
+	const int height = 480;
+	Matrix4x4 model;
+	const Camera camera = AvengerView(width, height, model);
+
+	SoftRasterizer renderer(width, height);
+	renderer.SetScene(surfaces);
+	renderer.SetEnvironment(ProjectSH9(Texture3f("../../data/lebombo_irradiance_map.exr")), std::move(prefiltered),
+		Texture3f(BRDFIntegrationMapFile()));
+	renderer.SetLight(Vector3(0, 1, 350)); //the light of the avenger scene in main
+
+	double total_ms = 0.0;
+	for (int i = 0; i < no_frames; i++) {
+		const auto t0 = std::chrono::high_resolution_clock::now();
+		renderer.Render(camera, model);
+		total_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+	}
+	const double average_ms = total_ms / (std::max)(no_frames, 1);
+	printf("Software frame %d x %d px: %0.2f ms on average (%0.1f MPix/s).\n", width, height, average_ms,
+		width * height / (average_ms * 1e3));
+	printf("Vertex transform (%s): %0.1f Mvertices/s per core.\n", TransformPositionsIsa(), MeasureTransformThroughput() * 1e-6);
+
+	renderer.color_buffer().Save(output);
+
+	for (Surface * surface : surfaces) delete surface;
+	for (Material * material : materials) delete material;
+
+	return 0;
+}
+
+//path traces the avenger scene of the main function, a noise free reference for the IBL approximation of the shaders
+static int RenderPathTraced(const char * output, const int no_samples) {
+	std::vector<Surface *> surfaces;
+	std::vector<Material *> materials;
+	if (LoadOBJ("../../data/6887_allied_avenger_gi2.obj", surfaces, materials) < 0) {
+		return -1;
+	}
+
+	const int width = 640;
+	const int height = 480;
+	Matrix4x4 model;
+	const Camera camera = AvengerView(width, height, model);
+
+	//the sharpest prefiltered level is the closest to the original environment
+	PathTracer tracer(width, height);
+	tracer.SetScene(surfaces);
+	tracer.SetEnvironment(Texture3f("../../data/lebombo_prefiltered_env_map_001_2048.exr"));
+	tracer.SetCamera(camera, model);
+
+	const auto t0 = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < no_samples; i++) {
+		tracer.Render();
+	}
+	const double total_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+	printf("Path traced frame %d x %d px, %d spp: %0.1f s (%0.2f Mpaths/s).\n", width, height, tracer.no_samples(),
+		total_ms * 1e-3, double(width) * height * tracer.no_samples() / (total_ms * 1e3));
+
+	tracer.color_buffer().Save(output);
+
+	for (Surface * surface : surfaces) delete surface;
+	for (Material * material : materials) delete material;
+
+	return 0;
+}
+
+//bakes the ambient occlusion of the avenger into a texture over its texture coordinates
+static int BakeAmbientOcclusion(const char * output, const int size) {
+	std::vector<Surface *> surfaces;
+	std::vector<Material *> materials;
+	if (LoadOBJ("../../data/6887_allied_avenger_gi2.obj", surfaces, materials) < 0) {
+		return -1;
+	}
+
+	AmbientOcclusionSettings settings;
+	settings.no_rays = 256;
+	BakeTextureAO(surfaces, size, size, settings).Save(output);
+
+	for (Surface * surface : surfaces) delete surface;
+	for (Material * material : materials) delete material;
+
+	return 0;
+}
+
+//builds the mip chains of an image with all the CPU filters and prints how fast they are generated
+static int ReportMipChain(const char * file_name) {
+	const Texture3f hdr(file_name);
+	const Texture3u ldr(file_name);
+	if (hdr.width() == 0 || ldr.width() == 0) {
+		return -1;
+	}
+
+	printf("Mip chains of %d x %d px (%s, %d threads):\n", ldr.width(), ldr.height(), BuildMipChainIsa(), ThreadPool::Default().no_threads());
+
+	auto measure = [&](const char * name, auto build) {
+		build(); //warm up, the first call also builds the filter and sRGB tables
+		const int repetitions = 8;
+		size_t no_levels = 0;
+		const auto t0 = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < repetitions; i++) {
+			no_levels = build();
+		}
+		const double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count() / repetitions;
+		printf("%-28s %2d levels, %7.2f ms (%0.1f MPix/s)\n", name, int(no_levels), ms, ldr.width() * double(ldr.height()) / (ms * 1e3));
+	};
+
+	measure("Texture3f box", [&] { return BuildMipChain(hdr).size(); });
+	measure("Texture3f Kaiser", [&] { return BuildMipChain(hdr, MipFilter::kKaiser).size(); });
+	measure("Texture3u sRGB box", [&] { return BuildMipChain(ldr).size(); });
+	measure("Texture3u sRGB Kaiser", [&] { return BuildMipChain(ldr, true, MipFilter::kKaiser).size(); });
+	measure("Texture3u linear box", [&] { return BuildMipChain(ldr, false).size(); });
+	measure("MipMap3u (scalar, 1 thread)", [&] { return size_t(MipMap3u(ldr).no_levels()); });
+
+	return 0;
+}
+
+//builds both BVH variants over the avenger, prints their statistics and the ray casting throughput
+static int ReportBVH() {
+	std::vector<Surface *> surfaces;
+	std::vector<Material *> materials;
+	if (LoadOBJ("../../data/6887_allied_avenger_gi2.obj", surfaces, materials) < 0) {
+		return -1;
+	}
+
+	//rays of the first frame of Rasterizer::RenderFrame, the BVH is in model space
+	const int width = 640;
+	const int height = 480;
+	Matrix4x4 model;
+	const Camera camera = AvengerView(width, height, model);
+	const Matrix4x4 world_to_model = Matrix4x4::EuclideanInverse(model);
+
+	std::vector<Ray> camera_rays;
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			camera_rays.push_back(TransformRay(world_to_model, CameraRay(camera, x + 0.5f, y + 0.5f)));
+		}
+	}
+
+	for (const BVH::BuildMethod method : { BVH::BuildMethod::kBinnedSAH, BVH::BuildMethod::kLBVH }) {
+		BVH bvh;
+		bvh.Build(surfaces, method);
+		bvh.Report();
+
+		RayCaster caster(bvh, surfaces);
+		caster.MeasureThroughput(camera_rays);
+	}
+
+	for (Surface * surface : surfaces) delete surface;
+	for (Material * material : materials) delete material;
+
+	return 0;
+}
+
+int main(int argc, char * argv[])
 {
 	printf( "PG2 OpenGL, (c)2019 Tomas Fabian\n\n" );
 
+	//pg2_opengl --bake environment.exr ../../data/name bakes all IBL maps instead of rendering
+	if (argc > 3 && strcmp(argv[1], "--bake") == 0) {
+		return BakeIBL(argv[2], argv[3]);
+	}
+
+	//pg2_opengl --bake-ao ao.exr [size] bakes the ambient occlusion of the scene into a texture
+	if (argc > 2 && strcmp(argv[1], "--bake-ao") == 0) {
+		return BakeAmbientOcclusion(argv[2], (argc > 3) ? (std::max)(atoi(argv[3]), 1) : 1024);
+	}
+
+	//pg2_opengl --bvh builds the ray tracing acceleration structures of the scene, prints their build time and size and how fast they are traversed
+	if (argc > 1 && strcmp(argv[1], "--bvh") == 0) {
+		return ReportBVH();
+	}
+
+	//pg2_opengl --mipmap [image] measures the CPU mip chain generation of the image
+	if (argc > 1 && strcmp(argv[1], "--mipmap") == 0) {
+		return ReportMipChain((argc > 2) ? argv[2] : "../../data/lebombo_prefiltered_env_map_001_2048.exr");
+	}
+
+	//pg2_opengl --software frame.exr [frames] renders with SoftRasterizer instead of OpenGL, the frame is linear radiance
+	if (argc > 2 && strcmp(argv[1], "--software") == 0) {
+		return RenderSoftware(argv[2], (argc > 3) ? atoi(argv[3]) : 1);
+	}
+
+	//pg2_opengl --pathtrace frame.exr [spp] renders a reference frame with PathTracer, the frame is linear radiance
+	if (argc > 2 && strcmp(argv[1], "--pathtrace") == 0) {
+		return RenderPathTraced(argv[2], (argc > 3) ? (std::max)(atoi(argv[3]), 1) : 64);
+	}
+
+	//pg2_opengl --shadow-filter bilinear|poisson|rotated|evsm [taps] selects the shadow quality (F and keypad +/- change it at runtime)
+	ShadowFilter shadow_filter = ShadowFilter::kRotatedPoisson;
+	int shadow_taps = 16;
+	if (argc > 2 && strcmp(argv[1], "--shadow-filter") == 0) {
+		if (strcmp(argv[2], "bilinear") == 0) shadow_filter = ShadowFilter::kBilinear;
+		else if (strcmp(argv[2], "poisson") == 0) shadow_filter = ShadowFilter::kPoisson;
+		else if (strcmp(argv[2], "evsm") == 0) shadow_filter = ShadowFilter::kEVSM;
+		if (argc > 3) shadow_taps = atoi(argv[3]);
+	}
+
+	//pg2_opengl ... --lights 256 adds moving point lights (forward and deferred shaders shade the same lights)
+	int no_point_lights = 0;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--lights") == 0) no_point_lights = atoi(argv[i + 1]);
+	}
+
+	//pg2_opengl ... --exposure 1.5 scales the radiance before the ACES tone mapping
+	float exposure = 1.0f;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--exposure") == 0) exposure = float(atof(argv[i + 1]));
+	}
+
+	//pg2_opengl ... --msaa 8 replaces the temporal anti-aliasing by multisampling (forward shaders only)
+	int msaa_samples = 1;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--msaa") == 0) msaa_samples = atoi(argv[i + 1]);
+	}
+
+	//pg2_opengl ... --frame-budget 8.3 lowers the render resolution when a frame takes longer on the GPU (off by default)
+	float frame_budget = 0.0f;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--frame-budget") == 0) frame_budget = float(atof(argv[i + 1]));
+	}
+
+	//pg2_opengl ... --texture-budget 256 limits the VRAM of the resident material textures (MB)
+	int texture_budget = 512;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--texture-budget") == 0) texture_budget = atoi(argv[i + 1]);
+	}
+
+	//pg2_opengl ... --ao 64 bakes the ambient occlusion and bent normals of the vertices while the scene loads (pbr and deferred shaders)
+	int ao_rays = 0;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--ao") == 0) ao_rays = atoi(argv[i + 1]);
+	}
+
+	//pg2_opengl ... --deferred renders through the G-buffer instead of the forward pbr_shadow shader,
+	//both shade the same IBL, shadows and point lights, so their frame times are comparable
+	bool use_deferred = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--deferred") == 0) use_deferred = true;
+	}
+
+	//the G-buffer is single sampled, multisampling would turn off the temporal anti-aliasing and give none at all
+	if (use_deferred && msaa_samples > 1) {
+		printf("--msaa cannot be combined with --deferred, the deferred path is anti-aliased temporally.\n");
+		return -1;
+	}
+
 	Rasterizer rasterizer;
 	enum model { avenger, piece };
-	enum shader { normal, pbr, shadow };
+	enum shader { normal, pbr, shadow, deferred };
 
 	bool includeEnvMap = true;
 	bool includeShadows = false;
 
 	//change model and shader here
 	model m = avenger;
-	shader s = shadow;
+	shader s = use_deferred ? deferred : shadow;
 	std::string shader = "normal_shader"; //default shader
 
 
@@ -32,6 +323,10 @@ int main()
 		includeShadows = true;
 		shader = "pbr_shadow";
 		break;
+	case deferred:
+		includeShadows = true; // shadows are looked up in the lighting pass
+		shader = "deferred";
+		break;
 	}
 
 
@@ -41,25 +336,30 @@ int main()
 		rasterizer = Rasterizer(640, 480, deg2rad(45.0), Vector3(190, -103, 186), Vector3(0, 0, 30), Vector3(0, 1, 350));
 		rasterizer.InitDevice();
 		rasterizer.InitBuffers(shader);
-		rasterizer.LoadSceneAndObject("../../data/6887_allied_avenger_gi2.obj");
+		rasterizer.SetAmbientOcclusion(ao_rays);
+		rasterizer.LoadSceneAndObjectAsync("../../data/6887_allied_avenger_gi2.obj");
 		break;
 	case piece:
 		rasterizer = Rasterizer(640, 480, deg2rad(45.0), Vector3(25.19, -2.99, 15.99), Vector3(0, 0, 0), Vector3(-380.004791, 387.605255, -115.599396)); //mine close up
 		rasterizer.InitDevice();
 		rasterizer.InitBuffers(shader);
-		rasterizer.LoadSceneAndObject("../../data/piece_02.obj");
+		rasterizer.SetAmbientOcclusion(ao_rays);
+		rasterizer.LoadSceneAndObjectAsync("../../data/piece_02.obj");
 		break;
 	}
 
+	//all assets are decoded on worker threads and uploaded by RenderFrame as they arrive,
+	//materials are initialized right after the scene upload
+
 	//BRDF map
-	rasterizer.InitGGXIntegrMap("../../data/brdf_integration_map_ct_ggx.png");
+	rasterizer.InitGGXIntegrMapAsync(BRDFIntegrationMapFile());
 	
 	//Irradiance
-	rasterizer.InitIrradianceMap("../../data/lebombo_irradiance_map.exr");
+	rasterizer.InitIrradianceMapAsync("../../data/lebombo_irradiance_map.exr");
 
 	//Enviromental map
 	if(includeEnvMap)
-		rasterizer.InitEnvMaps({"../../data/lebombo_prefiltered_env_map_001_2048.exr",
+		rasterizer.InitEnvMapsAsync({"../../data/lebombo_prefiltered_env_map_001_2048.exr",
 								"../../data/lebombo_prefiltered_env_map_010_1024.exr",
 								"../../data/lebombo_prefiltered_env_map_100_512.exr",
 								"../../data/lebombo_prefiltered_env_map_250_256.exr",
@@ -67,12 +367,20 @@ int main()
 								"../../data/lebombo_prefiltered_env_map_750_64.exr",
 								"../../data/lebombo_prefiltered_env_map_999_32.exr" });
 
-	//Shadows
-	if(includeShadows)
-		rasterizer.InitShadowDepthBuffer();
+	//Point lights
+	if (no_point_lights > 0)
+		rasterizer.AddPointLights(no_point_lights);
 
+	rasterizer.SetExposure(exposure);
+	rasterizer.SetAntiAliasing(msaa_samples);
+	rasterizer.SetFrameBudget(frame_budget);
+	rasterizer.SetTextureBudget(GLsizeiptr(texture_budget) << 20);
 
-	rasterizer.InitMaterials();
+	//Shadows
+	if (includeShadows) {
+		rasterizer.InitShadowDepthBuffer();
+		rasterizer.SetShadowFilter(shadow_filter, shadow_taps);
+	}
 
 	rasterizer.RenderFrame(false, includeShadows);
 
@@ -0,0 +1,276 @@
+#include "pch.h"
+#include "postprocess.h"
+#include "glutils.h"
+
+PostProcess::PostProcess( const int bloom_levels ) : bloom_levels_( bloom_levels )
+{
+}
+
+PostProcess::~PostProcess()
+{
+	if ( tone_map_program_ )
+	{
+		glDeleteProgram( downsample_program_ );
+		glDeleteProgram( upsample_program_ );
+		glDeleteProgram( tone_map_program_ );
+		glDeleteProgram( taa_program_ );
+
+		GLuint framebuffers[] = { fbo_msaa_, fbo_hdr_, fbo_ldr_ };
+		glDeleteFramebuffers( 3, framebuffers );
+		glDeleteRenderbuffers( 2, rbo_msaa_ );
+		GLuint textures[] = { tex_hdr_, tex_depth_, tex_bloom_, tex_ldr_, tex_history_[0], tex_history_[1] };
+		glDeleteTextures( 6, textures );
+	}
+}
+
+static GLuint CreateTexture2D( const GLenum internal_format, const int width, const int height, const int levels,
+	const GLint filter = GL_LINEAR )
+{
+	GLuint texture = 0;
+	glGenTextures( 1, &texture );
+	glBindTexture( GL_TEXTURE_2D, texture );
+	glTexStorage2D( GL_TEXTURE_2D, levels, internal_format, width, height );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, ( levels > 1 ) ? GL_LINEAR_MIPMAP_NEAREST : filter );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glBindTexture( GL_TEXTURE_2D, 0 );
+
+	return texture;
+}
+
+void PostProcess::Init( const int width, const int height, const int samples, const bool taa )
+{
+	width_ = width;
+	height_ = height;
+	samples_ = ( std::max )( samples, 1 );
+	taa_ = taa;
+	render_width_ = width_;
+	render_height_ = height_;
+
+	// resolved HDR image, also the render target if there is no MSAA, the depth is read by the TAA
+	tex_hdr_ = CreateTexture2D( GL_RGBA16F, width_, height_, 1 );
+	tex_depth_ = CreateTexture2D( GL_DEPTH24_STENCIL8, width_, height_, 1, GL_NEAREST );
+
+	glGenFramebuffers( 1, &fbo_hdr_ );
+	glBindFramebuffer( GL_FRAMEBUFFER, fbo_hdr_ );
+	glFramebufferTexture( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex_hdr_, 0 );
+	glFramebufferTexture( GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, tex_depth_, 0 );
+	if ( glCheckFramebufferStatus( GL_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE )
+	{
+		printf( "HDR framebuffer is not complete.\n" );
+	}
+
+	if ( samples_ > 1 )
+	{
+		glGenRenderbuffers( 2, rbo_msaa_ );
+		glBindRenderbuffer( GL_RENDERBUFFER, rbo_msaa_[0] );
+		glRenderbufferStorageMultisample( GL_RENDERBUFFER, samples_, GL_RGBA16F, width_, height_ );
+		glBindRenderbuffer( GL_RENDERBUFFER, rbo_msaa_[1] );
+		glRenderbufferStorageMultisample( GL_RENDERBUFFER, samples_, GL_DEPTH24_STENCIL8, width_, height_ );
+
+		glGenFramebuffers( 1, &fbo_msaa_ );
+		glBindFramebuffer( GL_FRAMEBUFFER, fbo_msaa_ );
+		glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo_msaa_[0] );
+		glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo_msaa_[1] );
+		if ( glCheckFramebufferStatus( GL_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE )
+		{
+			printf( "Multisampled HDR framebuffer is not complete.\n" );
+		}
+	}
+	glBindRenderbuffer( GL_RENDERBUFFER, 0 );
+
+	// the bloom chain starts at half resolution, every level halves it again
+	const int bloom_width = ( std::max )( width_ / 2, 1 );
+	const int bloom_height = ( std::max )( height_ / 2, 1 );
+	bloom_levels_ = ( std::max )( 1, ( std::min )( bloom_levels_, MipLevels( bloom_width, bloom_height ) ) );
+	tex_bloom_ = CreateTexture2D( GL_RGBA16F, bloom_width, bloom_height, bloom_levels_ );
+
+	if ( taa_ )
+	{
+		tex_history_[0] = CreateTexture2D( GL_RGBA16F, width_, height_, 1 );
+		tex_history_[1] = CreateTexture2D( GL_RGBA16F, width_, height_, 1 );
+	}
+
+	tex_ldr_ = CreateTexture2D( GL_RGBA8, width_, height_, 1 );
+	glGenFramebuffers( 1, &fbo_ldr_ );
+	glBindFramebuffer( GL_FRAMEBUFFER, fbo_ldr_ );
+	glFramebufferTexture( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex_ldr_, 0 );
+	glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+
+	GLint program = 0;
+	glGetIntegerv( GL_CURRENT_PROGRAM, &program );
+
+	downsample_program_ = CreateProgram( { CompileShader( GL_COMPUTE_SHADER, "bloom_downsample.comp" ) } );
+	glUseProgram( downsample_program_ );
+	SetSampler( downsample_program_, 10, "source" );
+
+	upsample_program_ = CreateProgram( { CompileShader( GL_COMPUTE_SHADER, "bloom_upsample.comp" ) } );
+	glUseProgram( upsample_program_ );
+	SetSampler( upsample_program_, 10, "source" );
+
+	tone_map_program_ = CreateProgram( { CompileShader( GL_COMPUTE_SHADER, "tone_map.comp" ) } );
+	glUseProgram( tone_map_program_ );
+	SetSampler( tone_map_program_, 10, "hdr" );
+	SetSampler( tone_map_program_, 11, "bloom" );
+
+	if ( taa_ )
+	{
+		taa_program_ = CreateProgram( { CompileShader( GL_COMPUTE_SHADER, "taa.comp" ) } );
+		glUseProgram( taa_program_ );
+		SetSampler( taa_program_, 10, "current" );
+		SetSampler( taa_program_, 11, "history" );
+		SetSampler( taa_program_, 12, "depth" );
+	}
+
+	glUseProgram( program );
+}
+
+void PostProcess::Begin()
+{
+	glBindFramebuffer( GL_FRAMEBUFFER, ( samples_ > 1 ) ? fbo_msaa_ : fbo_hdr_ );
+}
+
+void PostProcess::Dispatch( const int width, const int height )
+{
+	// 8x8 work groups, see the local size of the compute shaders
+	glDispatchCompute( ( width + 7 ) / 8, ( height + 7 ) / 8, 1 );
+}
+
+void PostProcess::ResolveTemporal()
+{
+	const GLuint history = tex_history_[history_index_ ^ 1];
+
+	glUseProgram( taa_program_ );
+	glActiveTexture( GL_TEXTURE10 );
+	glBindTexture( GL_TEXTURE_2D, tex_hdr_ );
+	glActiveTexture( GL_TEXTURE11 );
+	glBindTexture( GL_TEXTURE_2D, history );
+	glActiveTexture( GL_TEXTURE12 );
+	glBindTexture( GL_TEXTURE_2D, taa_depth_ ? taa_depth_ : tex_depth_ );
+
+	SetMatrix4x4( taa_program_, reprojection_.data(), "reprojection" );
+	SetFloat( taa_program_, taa_blend_, "blend" );
+	SetInt( taa_program_, history_valid_ ? 1 : 0, "history_valid" );
+	glUniform2i( glGetUniformLocation( taa_program_, "render_size" ), render_width_, render_height_ );
+	glBindImageTexture( 0, tex_history_[history_index_], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F );
+	Dispatch( width_, height_ );
+	glMemoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT );
+
+	history_valid_ = true;
+}
+
+void PostProcess::End()
+{
+	if ( samples_ > 1 )
+	{
+		glBindFramebuffer( GL_READ_FRAMEBUFFER, fbo_msaa_ );
+		glBindFramebuffer( GL_DRAW_FRAMEBUFFER, fbo_hdr_ );
+		glBlitFramebuffer( 0, 0, render_width_, render_height_, 0, 0, render_width_, render_height_, GL_COLOR_BUFFER_BIT, GL_NEAREST );
+	}
+	glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+
+	GLint program = 0;
+	glGetIntegerv( GL_CURRENT_PROGRAM, &program );
+
+	// the rest of the stack reads the accumulated image, the TAA upscales it to the full size
+	GLuint source = tex_hdr_;
+	GLfloat source_scale[2] = { render_width_ / GLfloat( width_ ), render_height_ / GLfloat( height_ ) };
+	if ( taa_ )
+	{
+		ResolveTemporal();
+		source = tex_history_[history_index_];
+		history_index_ ^= 1;
+		source_scale[0] = source_scale[1] = 1.0f;
+	}
+
+	glActiveTexture( GL_TEXTURE10 );
+	const bool bloom = tone_mapping_ && ( bloom_strength_ > 0.0f );
+
+	if ( bloom )
+	{
+		// downsample chain, the first step keeps only the radiance above the threshold
+		glUseProgram( downsample_program_ );
+		for ( int level = 0; level < bloom_levels_; ++level )
+		{
+			glBindTexture( GL_TEXTURE_2D, ( level == 0 ) ? source : tex_bloom_ );
+			SetInt( downsample_program_, ( level == 0 ) ? 0 : level - 1, "source_lod" );
+			SetFloat( downsample_program_, ( level == 0 ) ? bloom_threshold_ : -1.0f, "threshold" );
+			glUniform2f( glGetUniformLocation( downsample_program_, "source_scale" ), ( level == 0 ) ? source_scale[0] : 1.0f,
+				( level == 0 ) ? source_scale[1] : 1.0f );
+			glBindImageTexture( 0, tex_bloom_, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F );
+			Dispatch( ( std::max )( ( width_ / 2 ) >> level, 1 ), ( std::max )( ( height_ / 2 ) >> level, 1 ) );
+			glMemoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT );
+		}
+
+		// upsample chain, every level accumulates the blurred coarser one
+		glUseProgram( upsample_program_ );
+		glBindTexture( GL_TEXTURE_2D, tex_bloom_ );
+		for ( int level = bloom_levels_ - 2; level >= 0; --level )
+		{
+			SetInt( upsample_program_, level + 1, "source_lod" );
+			glBindImageTexture( 0, tex_bloom_, level, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA16F );
+			Dispatch( ( std::max )( ( width_ / 2 ) >> level, 1 ), ( std::max )( ( height_ / 2 ) >> level, 1 ) );
+			glMemoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT );
+		}
+	}
+
+	// exposure, ACES and gamma, once per pixel
+	glUseProgram( tone_map_program_ );
+	glBindTexture( GL_TEXTURE_2D, source );
+	glActiveTexture( GL_TEXTURE11 );
+	glBindTexture( GL_TEXTURE_2D, tex_bloom_ );
+	SetFloat( tone_map_program_, exposure_, "exposure" );
+	SetFloat( tone_map_program_, bloom ? bloom_strength_ : 0.0f, "bloom_strength" );
+	SetInt( tone_map_program_, tone_mapping_ ? 1 : 0, "tone_mapping" );
+	glUniform2fv( glGetUniformLocation( tone_map_program_, "source_scale" ), 1, source_scale );
+	glBindImageTexture( 0, tex_ldr_, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8 );
+	Dispatch( width_, height_ );
+	glMemoryBarrier( GL_FRAMEBUFFER_BARRIER_BIT );
+
+	glBindFramebuffer( GL_READ_FRAMEBUFFER, fbo_ldr_ );
+	glBindFramebuffer( GL_DRAW_FRAMEBUFFER, 0 );
+	glBlitFramebuffer( 0, 0, width_, height_, 0, 0, width_, height_, GL_COLOR_BUFFER_BIT, GL_NEAREST );
+	glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+
+	glActiveTexture( GL_TEXTURE0 );
+	glUseProgram( program );
+}
+
+void PostProcess::SetReprojection( const Matrix4x4 & current_to_previous, const GLuint depth_texture )
+{
+	reprojection_ = current_to_previous;
+	taa_depth_ = depth_texture;
+}
+
+void PostProcess::InvalidateHistory()
+{
+	history_valid_ = false;
+}
+
+GLuint PostProcess::depth_texture() const
+{
+	return tex_depth_;
+}
+
+void PostProcess::SetRenderSize( const int width, const int height )
+{
+	render_width_ = ( std::max )( 1, ( std::min )( width, width_ ) );
+	render_height_ = ( std::max )( 1, ( std::min )( height, height_ ) );
+}
+
+void PostProcess::SetExposure( const float exposure )
+{
+	exposure_ = exposure;
+}
+
+void PostProcess::SetBloom( const float strength, const float threshold )
+{
+	bloom_strength_ = strength;
+	bloom_threshold_ = threshold;
+}
+
+void PostProcess::SetToneMapping( const bool enabled )
+{
+	tone_mapping_ = enabled;
+}
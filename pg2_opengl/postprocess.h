@@ -0,0 +1,111 @@
+#ifndef POST_PROCESS_H_
+#define POST_PROCESS_H_
+
+#include "matrix4x4.h"
+
+/*! \class PostProcess
+\brief HDR render target followed by a compute post stack.
+
+The scene is rendered into an RGBA16F target (multisampled if requested) with linear radiance. End resolves it
+and runs the compute passes: temporal anti-aliasing (optional), bloom (thresholded downsample chain and tent filtered upsample chain), exposure,
+ACES filmic tone mapping and gamma. The LDR result is copied to the default framebuffer, so the tone mapping
+runs once per pixel instead of once per shaded fragment.
+
+With TAA the projection has to be jittered (Camera::set_jitter) and SetReprojection called every frame. The history
+is reprojected with the motion of a single rigid transformation (the whole scene shares the model matrix), taken
+from the depth of the closest pixel in the 3x3 neighborhood, and clamped to the color box of that neighborhood.
+
+Texture units 10 - 12 and image unit 0 are used by the passes.
+
+PostProcess post; // GL thread
+post.Init( width, height, 8 );
+post.Begin(); // draw the scene
+post.End(); // swap buffers
+*/
+class PostProcess
+{
+public:
+	PostProcess( const int bloom_levels = 5 );
+	~PostProcess();
+
+	PostProcess( const PostProcess & ) = delete;
+	PostProcess & operator=( const PostProcess & ) = delete;
+
+	//! Creates the render targets and compiles the compute shaders (GL thread).
+	/*!
+	\param samples number of MSAA samples of the HDR target, 1 renders directly into the resolved texture.
+	\param taa accumulates the jittered frames in a history buffer, should be used with a single sample.
+	*/
+	void Init( const int width, const int height, const int samples, const bool taa = false );
+
+	//! Binds the HDR framebuffer, the caller clears and draws into it.
+	void Begin();
+
+	//! Runs the post stack on the HDR image and leaves the result in the default framebuffer (bound on return).
+	void End();
+
+	//! Motion of this frame for the TAA.
+	/*!
+	\param current_to_previous current NDC (with depth) -> clip space of the previous frame, without the jitter.
+	\param depth_texture depth of the current frame, e.g. depth_texture() or the depth of a G-buffer.
+	*/
+	void SetReprojection( const Matrix4x4 & current_to_previous, const GLuint depth_texture );
+
+	//! The next frame does not blend with the history, e.g. after a cut.
+	void InvalidateHistory();
+
+	//! Depth attachment of the HDR framebuffer (only without MSAA).
+	GLuint depth_texture() const;
+
+	//! Dynamic resolution, the frame is drawn to the lower left \a width x \a height corner of the target and upscaled.
+	void SetRenderSize( const int width, const int height );
+
+	//! Linear scale of the radiance before the tone mapping.
+	void SetExposure( const float exposure );
+
+	//! \param strength weight of the blurred bright areas added to the image, \param threshold radiance where the bloom starts.
+	void SetBloom( const float strength, const float threshold );
+
+	//! Disables the bloom, exposure, tone mapping and gamma, e.g. for debug views that are not radiance.
+	void SetToneMapping( const bool enabled );
+
+private:
+	void Dispatch( const int width, const int height );
+	void ResolveTemporal();
+
+	int width_{ 0 };
+	int height_{ 0 };
+	int samples_{ 1 };
+	int render_width_{ 0 }; // part of the HDR target drawn this frame
+	int render_height_{ 0 };
+	int bloom_levels_;
+
+	float exposure_{ 1.0f };
+	float bloom_strength_{ 0.04f };
+	float bloom_threshold_{ 1.0f };
+	bool tone_mapping_{ true };
+
+	bool taa_{ false };
+	float taa_blend_{ 0.1f }; // weight of the current frame, about the last 10 frames contribute
+	Matrix4x4 reprojection_;
+	GLuint taa_depth_{ 0 };
+	GLuint tex_history_[2]{}; // ping-pong, the current result becomes the next history
+	int history_index_{ 0 }; // written this frame
+	bool history_valid_{ false };
+
+	GLuint fbo_msaa_{ 0 }; // only with samples > 1
+	GLuint rbo_msaa_[2]{}; // color, depth + stencil
+	GLuint fbo_hdr_{ 0 };
+	GLuint tex_hdr_{ 0 }; // resolved linear radiance
+	GLuint tex_depth_{ 0 };
+	GLuint tex_bloom_{ 0 }; // half resolution, one mip level per step of the chain
+	GLuint fbo_ldr_{ 0 };
+	GLuint tex_ldr_{ 0 }; // tone mapped RGBA8, copied to the default framebuffer
+
+	GLuint downsample_program_{ 0 };
+	GLuint upsample_program_{ 0 };
+	GLuint tone_map_program_{ 0 };
+	GLuint taa_program_{ 0 };
+};
+
+#endif
@@ -0,0 +1,812 @@
+#include "pch.h"
+#include "raycaster.h"
+#include "simd.h"
+#include "utils.h"
+#include "mymath.h"
+#include <chrono>
+
+// stack sizes of the traversals, the wide one pushes up to BVH_WIDTH children per level,
+// a subtree that does not fit any more is traversed by a nested call with a stack of its own
+static const int kWideStackSize = 512;
+static const int kPacketStackSize = 128;
+
+// rays per task of the parallel batch queries
+static const int kBatchSize = 64 * RAY_PACKET_SIZE;
+
+// triangles are enlarged by this much in barycentric coordinates, so that rays do not slip through shared edges
+static const float kBarycentricEpsilon = 1e-4f;
+
+// the exit distances of the slab tests are enlarged by a few ulps, otherwise the rounding may cull a box
+// that a ray only touches, e.g. at the shared boundary of two flat neighbours (robust traversal by Ize)
+static const float kSlabExitScale = 1.000001f;
+
+// offsets of the planes of an axis in BVH8Node, the near plane is the lower one for positive directions
+static const int kPlaneOffset[3] = { 0, 2 * BVH_WIDTH, 4 * BVH_WIDTH };
+
+struct TraversalRay
+{
+	float origin[3];
+	float direction[3];
+	float inv_direction[3];
+	float origin_inv[3]; // origin * inv_direction
+	int near_plane[3]; // offsets of the near and far planes of the child bounds, see kPlaneOffset
+	int far_plane[3];
+	float t_near;
+};
+
+struct TraversalPacket
+{
+	float origin[3][RAY_PACKET_SIZE];
+	float direction[3][RAY_PACKET_SIZE];
+	float inv_direction[3][RAY_PACKET_SIZE];
+	float t_near[RAY_PACKET_SIZE];
+	float t_far[RAY_PACKET_SIZE]; // shrinks with every closer hit
+	float u[RAY_PACKET_SIZE];
+	float v[RAY_PACKET_SIZE];
+	int record[RAY_PACKET_SIZE];
+};
+
+// tiny direction components are replaced so that the slab tests never see inf * 0
+static float SafeInverse( const float d )
+{
+	const float kEpsilon = 1e-12f;
+
+	return 1.0f / ( ( fabsf( d ) > kEpsilon ) ? d : ( ( d < 0.0f ) ? -kEpsilon : kEpsilon ) );
+}
+
+static TraversalRay MakeTraversalRay( const Ray & ray )
+{
+	TraversalRay r;
+	for ( int a = 0; a < 3; ++a )
+	{
+		r.origin[a] = ray.origin.data[a];
+		r.direction[a] = ray.direction.data[a];
+		r.inv_direction[a] = SafeInverse( ray.direction.data[a] );
+		r.origin_inv[a] = r.origin[a] * r.inv_direction[a];
+		r.near_plane[a] = kPlaneOffset[a] + ( ( r.inv_direction[a] < 0.0f ) ? BVH_WIDTH : 0 );
+		r.far_plane[a] = kPlaneOffset[a] + ( ( r.inv_direction[a] < 0.0f ) ? 0 : BVH_WIDTH );
+	}
+	r.t_near = ray.t_near;
+
+	return r;
+}
+
+static void MakeTraversalPacket( const RayPacket & packet, TraversalPacket & p )
+{
+	for ( int i = 0; i < RAY_PACKET_SIZE; ++i )
+	{
+		// unused lanes get a harmless ray that is never active
+		const bool used = i < packet.count;
+		p.origin[0][i] = used ? packet.origin_x[i] : 0.0f;
+		p.origin[1][i] = used ? packet.origin_y[i] : 0.0f;
+		p.origin[2][i] = used ? packet.origin_z[i] : 0.0f;
+		p.direction[0][i] = used ? packet.direction_x[i] : 1.0f;
+		p.direction[1][i] = used ? packet.direction_y[i] : 1.0f;
+		p.direction[2][i] = used ? packet.direction_z[i] : 1.0f;
+		for ( int a = 0; a < 3; ++a )
+		{
+			p.inv_direction[a][i] = SafeInverse( p.direction[a][i] );
+		}
+		p.t_near[i] = used ? packet.t_near[i] : 0.0f;
+		p.t_far[i] = used ? packet.t_far[i] : -1.0f;
+		p.u[i] = p.v[i] = 0.0f;
+		p.record[i] = -1;
+	}
+}
+
+// Moller-Trumbore, both sides of the triangle are hit
+static bool IntersectTriangle( const RayCaster::TriangleRecord & r, const TraversalRay & ray, float & t, float & u, float & v )
+{
+	const float * d = ray.direction;
+	const float pvec[3] = { d[1] * r.e2[2] - d[2] * r.e2[1], d[2] * r.e2[0] - d[0] * r.e2[2], d[0] * r.e2[1] - d[1] * r.e2[0] };
+	const float det = r.e1[0] * pvec[0] + r.e1[1] * pvec[1] + r.e1[2] * pvec[2];
+	if ( det == 0.0f )
+	{
+		return false;
+	}
+	const float inv_det = 1.0f / det;
+
+	const float tvec[3] = { ray.origin[0] - r.p0[0], ray.origin[1] - r.p0[1], ray.origin[2] - r.p0[2] };
+	const float hit_u = ( tvec[0] * pvec[0] + tvec[1] * pvec[1] + tvec[2] * pvec[2] ) * inv_det;
+	if ( hit_u < -kBarycentricEpsilon || hit_u > 1.0f + kBarycentricEpsilon )
+	{
+		return false;
+	}
+
+	const float qvec[3] = { tvec[1] * r.e1[2] - tvec[2] * r.e1[1], tvec[2] * r.e1[0] - tvec[0] * r.e1[2], tvec[0] * r.e1[1] - tvec[1] * r.e1[0] };
+	const float hit_v = ( d[0] * qvec[0] + d[1] * qvec[1] + d[2] * qvec[2] ) * inv_det;
+	if ( hit_v < -kBarycentricEpsilon || hit_u + hit_v > 1.0f + kBarycentricEpsilon )
+	{
+		return false;
+	}
+
+	const float hit_t = ( r.e2[0] * qvec[0] + r.e2[1] * qvec[1] + r.e2[2] * qvec[2] ) * inv_det;
+	if ( hit_t < ray.t_near || hit_t >= t )
+	{
+		return false;
+	}
+
+	t = hit_t;
+	u = hit_u;
+	v = hit_v;
+
+	return true;
+}
+
+/* Slab tests of all children of a wide node, return the mask of the children the ray enters before t_far
+and their entry distances. */
+
+static int SlabTestSSE2( const BVH8Node & node, const TraversalRay & ray, const float t_far, float * t_entry )
+{
+	const float * planes = node.lower_x;
+	int mask = 0;
+
+	for ( int h = 0; h < BVH_WIDTH; h += 4 )
+	{
+		__m128 t_min = _mm_set1_ps( ray.t_near );
+		__m128 t_max = _mm_set1_ps( t_far );
+		for ( int a = 0; a < 3; ++a )
+		{
+			const __m128 inv = _mm_set1_ps( ray.inv_direction[a] );
+			const __m128 origin_inv = _mm_set1_ps( ray.origin_inv[a] );
+			t_min = _mm_max_ps( t_min, _mm_sub_ps( _mm_mul_ps( _mm_loadu_ps( planes + ray.near_plane[a] + h ), inv ), origin_inv ) );
+			t_max = _mm_min_ps( t_max, _mm_sub_ps( _mm_mul_ps( _mm_loadu_ps( planes + ray.far_plane[a] + h ), inv ), origin_inv ) );
+		}
+		_mm_storeu_ps( t_entry + h, t_min );
+		mask |= _mm_movemask_ps( _mm_cmple_ps( t_min, _mm_mul_ps( t_max, _mm_set1_ps( kSlabExitScale ) ) ) ) << h;
+	}
+
+	return mask;
+}
+
+SIMD_TARGET( "avx2,fma" )
+static int SlabTestAVX2( const BVH8Node & node, const TraversalRay & ray, const float t_far, float * t_entry )
+{
+	const float * planes = node.lower_x;
+	__m256 t_min = _mm256_set1_ps( ray.t_near );
+	__m256 t_max = _mm256_set1_ps( t_far );
+
+	for ( int a = 0; a < 3; ++a )
+	{
+		const __m256 inv = _mm256_set1_ps( ray.inv_direction[a] );
+		const __m256 origin_inv = _mm256_set1_ps( ray.origin_inv[a] );
+		t_min = _mm256_max_ps( t_min, _mm256_fmsub_ps( _mm256_loadu_ps( planes + ray.near_plane[a] ), inv, origin_inv ) );
+		t_max = _mm256_min_ps( t_max, _mm256_fmsub_ps( _mm256_loadu_ps( planes + ray.far_plane[a] ), inv, origin_inv ) );
+	}
+	_mm256_storeu_ps( t_entry, t_min );
+
+	return _mm256_movemask_ps( _mm256_cmp_ps( t_min, _mm256_mul_ps( t_max, _mm256_set1_ps( kSlabExitScale ) ), _CMP_LE_OQ ) );
+}
+
+/* Packet versions, a single box or triangle against all active rays of a packet. The triangle test
+updates t_far, u, v and record of the hit lanes and returns their mask. */
+
+static __m128 Select( const __m128 mask, const __m128 a, const __m128 b )
+{
+	return _mm_or_ps( _mm_and_ps( mask, a ), _mm_andnot_ps( mask, b ) );
+}
+
+static int PacketSlabTestSSE2( const BVHNode & node, const TraversalPacket & p, const int active )
+{
+	int mask = 0;
+
+	for ( int h = 0; h < RAY_PACKET_SIZE; h += 4 )
+	{
+		__m128 t_min = _mm_loadu_ps( p.t_near + h );
+		__m128 t_max = _mm_loadu_ps( p.t_far + h );
+		for ( int a = 0; a < 3; ++a )
+		{
+			const __m128 origin = _mm_loadu_ps( p.origin[a] + h );
+			const __m128 inv = _mm_loadu_ps( p.inv_direction[a] + h );
+			const __m128 t0 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( node.lower[a] ), origin ), inv );
+			const __m128 t1 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( node.upper[a] ), origin ), inv );
+			t_min = _mm_max_ps( t_min, _mm_min_ps( t0, t1 ) );
+			t_max = _mm_min_ps( t_max, _mm_max_ps( t0, t1 ) );
+		}
+		mask |= _mm_movemask_ps( _mm_cmple_ps( t_min, _mm_mul_ps( t_max, _mm_set1_ps( kSlabExitScale ) ) ) ) << h;
+	}
+
+	return mask & active;
+}
+
+static int PacketTriangleTestSSE2( const RayCaster::TriangleRecord & r, const int record, TraversalPacket & p, const int active )
+{
+	int mask = 0;
+
+	for ( int h = 0; h < RAY_PACKET_SIZE; h += 4 )
+	{
+		const __m128 dx = _mm_loadu_ps( p.direction[0] + h );
+		const __m128 dy = _mm_loadu_ps( p.direction[1] + h );
+		const __m128 dz = _mm_loadu_ps( p.direction[2] + h );
+		const __m128 e1x = _mm_set1_ps( r.e1[0] ), e1y = _mm_set1_ps( r.e1[1] ), e1z = _mm_set1_ps( r.e1[2] );
+		const __m128 e2x = _mm_set1_ps( r.e2[0] ), e2y = _mm_set1_ps( r.e2[1] ), e2z = _mm_set1_ps( r.e2[2] );
+
+		const __m128 px = _mm_sub_ps( _mm_mul_ps( dy, e2z ), _mm_mul_ps( dz, e2y ) );
+		const __m128 py = _mm_sub_ps( _mm_mul_ps( dz, e2x ), _mm_mul_ps( dx, e2z ) );
+		const __m128 pz = _mm_sub_ps( _mm_mul_ps( dx, e2y ), _mm_mul_ps( dy, e2x ) );
+		const __m128 det = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, px ), _mm_mul_ps( e1y, py ) ), _mm_mul_ps( e1z, pz ) );
+		const __m128 inv_det = _mm_div_ps( _mm_set1_ps( 1.0f ), det );
+
+		const __m128 tx = _mm_sub_ps( _mm_loadu_ps( p.origin[0] + h ), _mm_set1_ps( r.p0[0] ) );
+		const __m128 ty = _mm_sub_ps( _mm_loadu_ps( p.origin[1] + h ), _mm_set1_ps( r.p0[1] ) );
+		const __m128 tz = _mm_sub_ps( _mm_loadu_ps( p.origin[2] + h ), _mm_set1_ps( r.p0[2] ) );
+		const __m128 u = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( tx, px ), _mm_mul_ps( ty, py ) ), _mm_mul_ps( tz, pz ) ), inv_det );
+
+		const __m128 qx = _mm_sub_ps( _mm_mul_ps( ty, e1z ), _mm_mul_ps( tz, e1y ) );
+		const __m128 qy = _mm_sub_ps( _mm_mul_ps( tz, e1x ), _mm_mul_ps( tx, e1z ) );
+		const __m128 qz = _mm_sub_ps( _mm_mul_ps( tx, e1y ), _mm_mul_ps( ty, e1x ) );
+		const __m128 v = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, qx ), _mm_mul_ps( dy, qy ) ), _mm_mul_ps( dz, qz ) ), inv_det );
+		const __m128 t = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ), _mm_mul_ps( e2z, qz ) ), inv_det );
+
+		// a zero determinant makes u a NaN, which fails the ordered comparisons
+		const __m128 t_far = _mm_loadu_ps( p.t_far + h );
+		const __m128 epsilon = _mm_set1_ps( -kBarycentricEpsilon );
+		__m128 hit = _mm_and_ps( _mm_cmpge_ps( u, epsilon ), _mm_cmpge_ps( v, epsilon ) );
+		hit = _mm_and_ps( hit, _mm_cmple_ps( _mm_add_ps( u, v ), _mm_set1_ps( 1.0f + kBarycentricEpsilon ) ) );
+		hit = _mm_and_ps( hit, _mm_and_ps( _mm_cmpge_ps( t, _mm_loadu_ps( p.t_near + h ) ), _mm_cmplt_ps( t, t_far ) ) );
+
+		const int lanes = _mm_movemask_ps( hit ) & ( active >> h ) & 0xF;
+		if ( lanes )
+		{
+			hit = _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_and_si128( _mm_set1_epi32( lanes ), _mm_setr_epi32( 1, 2, 4, 8 ) ), _mm_setzero_si128() ) );
+			_mm_storeu_ps( p.t_far + h, Select( hit, t, t_far ) );
+			_mm_storeu_ps( p.u + h, Select( hit, u, _mm_loadu_ps( p.u + h ) ) );
+			_mm_storeu_ps( p.v + h, Select( hit, v, _mm_loadu_ps( p.v + h ) ) );
+			for ( int i = 0; i < 4; ++i )
+			{
+				if ( lanes & ( 1 << i ) )
+				{
+					p.record[h + i] = record;
+				}
+			}
+			mask |= lanes << h;
+		}
+	}
+
+	return mask;
+}
+
+SIMD_TARGET( "avx2,fma" )
+static int PacketSlabTestAVX2( const BVHNode & node, const TraversalPacket & p, const int active )
+{
+	__m256 t_min = _mm256_loadu_ps( p.t_near );
+	__m256 t_max = _mm256_loadu_ps( p.t_far );
+
+	for ( int a = 0; a < 3; ++a )
+	{
+		const __m256 origin = _mm256_loadu_ps( p.origin[a] );
+		const __m256 inv = _mm256_loadu_ps( p.inv_direction[a] );
+		const __m256 t0 = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( node.lower[a] ), origin ), inv );
+		const __m256 t1 = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( node.upper[a] ), origin ), inv );
+		t_min = _mm256_max_ps( t_min, _mm256_min_ps( t0, t1 ) );
+		t_max = _mm256_min_ps( t_max, _mm256_max_ps( t0, t1 ) );
+	}
+
+	return _mm256_movemask_ps( _mm256_cmp_ps( t_min, _mm256_mul_ps( t_max, _mm256_set1_ps( kSlabExitScale ) ), _CMP_LE_OQ ) ) & active;
+}
+
+SIMD_TARGET( "avx2,fma" )
+static int PacketTriangleTestAVX2( const RayCaster::TriangleRecord & r, const int record, TraversalPacket & p, const int active )
+{
+	const __m256 dx = _mm256_loadu_ps( p.direction[0] );
+	const __m256 dy = _mm256_loadu_ps( p.direction[1] );
+	const __m256 dz = _mm256_loadu_ps( p.direction[2] );
+	const __m256 e1x = _mm256_set1_ps( r.e1[0] ), e1y = _mm256_set1_ps( r.e1[1] ), e1z = _mm256_set1_ps( r.e1[2] );
+	const __m256 e2x = _mm256_set1_ps( r.e2[0] ), e2y = _mm256_set1_ps( r.e2[1] ), e2z = _mm256_set1_ps( r.e2[2] );
+
+	const __m256 px = _mm256_fmsub_ps( dy, e2z, _mm256_mul_ps( dz, e2y ) );
+	const __m256 py = _mm256_fmsub_ps( dz, e2x, _mm256_mul_ps( dx, e2z ) );
+	const __m256 pz = _mm256_fmsub_ps( dx, e2y, _mm256_mul_ps( dy, e2x ) );
+	const __m256 det = _mm256_fmadd_ps( e1x, px, _mm256_fmadd_ps( e1y, py, _mm256_mul_ps( e1z, pz ) ) );
+	const __m256 inv_det = _mm256_div_ps( _mm256_set1_ps( 1.0f ), det );
+
+	const __m256 tx = _mm256_sub_ps( _mm256_loadu_ps( p.origin[0] ), _mm256_set1_ps( r.p0[0] ) );
+	const __m256 ty = _mm256_sub_ps( _mm256_loadu_ps( p.origin[1] ), _mm256_set1_ps( r.p0[1] ) );
+	const __m256 tz = _mm256_sub_ps( _mm256_loadu_ps( p.origin[2] ), _mm256_set1_ps( r.p0[2] ) );
+	const __m256 u = _mm256_mul_ps( _mm256_fmadd_ps( tx, px, _mm256_fmadd_ps( ty, py, _mm256_mul_ps( tz, pz ) ) ), inv_det );
+
+	const __m256 qx = _mm256_fmsub_ps( ty, e1z, _mm256_mul_ps( tz, e1y ) );
+	const __m256 qy = _mm256_fmsub_ps( tz, e1x, _mm256_mul_ps( tx, e1z ) );
+	const __m256 qz = _mm256_fmsub_ps( tx, e1y, _mm256_mul_ps( ty, e1x ) );
+	const __m256 v = _mm256_mul_ps( _mm256_fmadd_ps( dx, qx, _mm256_fmadd_ps( dy, qy, _mm256_mul_ps( dz, qz ) ) ), inv_det );
+	const __m256 t = _mm256_mul_ps( _mm256_fmadd_ps( e2x, qx, _mm256_fmadd_ps( e2y, qy, _mm256_mul_ps( e2z, qz ) ) ), inv_det );
+
+	const __m256 t_far = _mm256_loadu_ps( p.t_far );
+	const __m256 epsilon = _mm256_set1_ps( -kBarycentricEpsilon );
+	__m256 hit = _mm256_and_ps( _mm256_cmp_ps( u, epsilon, _CMP_GE_OQ ), _mm256_cmp_ps( v, epsilon, _CMP_GE_OQ ) );
+	hit = _mm256_and_ps( hit, _mm256_cmp_ps( _mm256_add_ps( u, v ), _mm256_set1_ps( 1.0f + kBarycentricEpsilon ), _CMP_LE_OQ ) );
+	hit = _mm256_and_ps( hit, _mm256_cmp_ps( t, _mm256_loadu_ps( p.t_near ), _CMP_GE_OQ ) );
+	hit = _mm256_and_ps( hit, _mm256_cmp_ps( t, t_far, _CMP_LT_OQ ) );
+
+	const int lanes = _mm256_movemask_ps( hit ) & active;
+	if ( lanes )
+	{
+		hit = _mm256_castsi256_ps( _mm256_cmpgt_epi32( _mm256_and_si256( _mm256_set1_epi32( lanes ),
+			_mm256_setr_epi32( 1, 2, 4, 8, 16, 32, 64, 128 ) ), _mm256_setzero_si256() ) );
+		_mm256_storeu_ps( p.t_far, _mm256_blendv_ps( t_far, t, hit ) );
+		_mm256_storeu_ps( p.u, _mm256_blendv_ps( _mm256_loadu_ps( p.u ), u, hit ) );
+		_mm256_storeu_ps( p.v, _mm256_blendv_ps( _mm256_loadu_ps( p.v ), v, hit ) );
+		_mm256_maskstore_epi32( p.record, _mm256_castps_si256( hit ), _mm256_set1_epi32( record ) );
+	}
+
+	return lanes;
+}
+
+struct TraversalKernels
+{
+	int ( *slab_test )( const BVH8Node &, const TraversalRay &, const float, float * );
+	int ( *packet_slab_test )( const BVHNode &, const TraversalPacket &, const int );
+	int ( *packet_triangle_test )( const RayCaster::TriangleRecord &, const int, TraversalPacket &, const int );
+	const char * isa;
+};
+
+// the widest kernels supported by the CPU, selected once
+static const TraversalKernels & SelectTraversalKernels()
+{
+	static const TraversalKernels kernels = [] ()
+	{
+		const CpuFeatures & cpu = CpuFeatures::Get();
+
+		if ( cpu.avx2 && cpu.fma )
+		{
+			return TraversalKernels{ SlabTestAVX2, PacketSlabTestAVX2, PacketTriangleTestAVX2, "AVX2" };
+		}
+
+		return TraversalKernels{ SlabTestSSE2, PacketSlabTestSSE2, PacketTriangleTestSSE2, "SSE2" };
+	}();
+
+	return kernels;
+}
+
+// closest (or with any_hit the first found) hit of a single ray in the wide tree, returns the index of the triangle record or -1,
+// root and root_count select the subtree (the child and count of its BVH8Node slot)
+static int TraverseWide( const std::vector<BVH8Node> & nodes, const std::vector<RayCaster::TriangleRecord> & records,
+	const TraversalRay & ray, const bool any_hit, float & t, float & u, float & v, const int root = 0, const int root_count = 0 )
+{
+	struct StackItem
+	{
+		int child;
+		int count;
+		float t;
+	};
+
+	if ( nodes.empty() )
+	{
+		return -1;
+	}
+
+	const TraversalKernels & kernels = SelectTraversalKernels();
+	StackItem stack[kWideStackSize];
+	int stack_size = 0;
+	stack[stack_size++] = { root, root_count, ray.t_near };
+	int record = -1;
+
+	while ( stack_size > 0 )
+	{
+		const StackItem item = stack[--stack_size];
+		if ( item.t > t )
+		{
+			continue; // a closer hit was found after the node was pushed
+		}
+
+		if ( item.count > 0 )
+		{
+			for ( int i = item.child; i < item.child + item.count; ++i )
+			{
+				if ( IntersectTriangle( records[i], ray, t, u, v ) )
+				{
+					record = i;
+					if ( any_hit )
+					{
+						return record;
+					}
+				}
+			}
+			continue;
+		}
+
+		const BVH8Node & node = nodes[item.child];
+		float t_entry[BVH_WIDTH];
+		int mask = kernels.slab_test( node, ray, t, t_entry );
+
+		// the hit children are pushed from the farthest, so the nearest one is visited first
+		const int first = stack_size;
+		while ( mask )
+		{
+			int i = 0;
+			while ( !( mask & ( 1 << i ) ) )
+			{
+				++i;
+			}
+			mask &= mask - 1;
+
+			StackItem child = { node.child[i], node.count[i], t_entry[i] };
+			if ( stack_size == kWideStackSize )
+			{
+				const int nested = TraverseWide( nodes, records, ray, any_hit, t, u, v, child.child, child.count );
+				if ( nested >= 0 )
+				{
+					record = nested;
+					if ( any_hit )
+					{
+						return record;
+					}
+				}
+				continue;
+			}
+
+			int j = stack_size++;
+			for ( ; !any_hit && j > first && stack[j - 1].t < child.t; --j )
+			{
+				stack[j] = stack[j - 1];
+			}
+			stack[j] = child;
+		}
+	}
+
+	return record;
+}
+
+// closest (or with any_hit the first found) hits of a packet in the binary tree, returns the mask of the lanes that hit
+static int TraversePacket( const std::vector<BVHNode> & nodes, const std::vector<RayCaster::TriangleRecord> & records,
+	TraversalPacket & p, const int lanes, const bool any_hit, const int root = 0 )
+{
+	if ( nodes.empty() )
+	{
+		return 0;
+	}
+
+	const TraversalKernels & kernels = SelectTraversalKernels();
+	int stack[kPacketStackSize];
+	int stack_size = 0;
+	stack[stack_size++] = root;
+	int active = lanes;
+	int hits = 0;
+
+	// the first ray decides the order of the children
+	int leader = 0;
+	while ( !( lanes & ( 1 << leader ) ) && leader < RAY_PACKET_SIZE - 1 )
+	{
+		++leader;
+	}
+
+	while ( stack_size > 0 )
+	{
+		const BVHNode & node = nodes[stack[--stack_size]];
+		if ( !kernels.packet_slab_test( node, p, active ) )
+		{
+			continue;
+		}
+
+		if ( node.leaf() )
+		{
+			for ( int i = node.offset; i < node.offset + node.count; ++i )
+			{
+				hits |= kernels.packet_triangle_test( records[i], i, p, active );
+			}
+			if ( any_hit )
+			{
+				active &= ~hits;
+				if ( !active )
+				{
+					break;
+				}
+			}
+			continue;
+		}
+
+		const BVHNode & left = nodes[node.offset];
+		const BVHNode & right = nodes[node.offset + 1];
+		float towards_right = 0.0f;
+		for ( int a = 0; a < 3; ++a )
+		{
+			towards_right += p.direction[a][leader] * ( ( right.lower[a] + right.upper[a] ) - ( left.lower[a] + left.upper[a] ) );
+		}
+		const int near_child = ( towards_right > 0.0f ) ? node.offset : node.offset + 1;
+		const int far_child = ( towards_right > 0.0f ) ? node.offset + 1 : node.offset;
+
+		if ( stack_size + 2 > kPacketStackSize )
+		{
+			for ( const int child : { near_child, far_child } )
+			{
+				hits |= TraversePacket( nodes, records, p, active, any_hit, child );
+				if ( any_hit )
+				{
+					active &= ~hits;
+				}
+			}
+			if ( !active )
+			{
+				break;
+			}
+			continue;
+		}
+
+		stack[stack_size++] = far_child;
+		stack[stack_size++] = near_child;
+	}
+
+	return hits;
+}
+
+Ray CameraRay( const Camera & camera, const float x, const float y )
+{
+	Vector3 direction = camera.M_c_w() * Vector3( x - camera.width_ * 0.5f, camera.height_ * 0.5f - y, -camera.focal_length() );
+	direction.Normalize();
+
+	Ray ray;
+	ray.origin = camera.view_from();
+	ray.direction = direction;
+
+	return ray;
+}
+
+Ray TransformRay( const Matrix4x4 & m, const Ray & ray )
+{
+	Ray result = ray;
+	for ( int r = 0; r < 3; ++r )
+	{
+		result.origin.data[r] = m.get( r, 3 );
+		result.direction.data[r] = 0.0f;
+		for ( int c = 0; c < 3; ++c )
+		{
+			result.origin.data[r] += m.get( r, c ) * ray.origin.data[c];
+			result.direction.data[r] += m.get( r, c ) * ray.direction.data[c];
+		}
+	}
+
+	return result;
+}
+
+bool RayPacket::Add( const Ray & ray )
+{
+	if ( count >= RAY_PACKET_SIZE )
+	{
+		return false;
+	}
+
+	origin_x[count] = ray.origin.x;
+	origin_y[count] = ray.origin.y;
+	origin_z[count] = ray.origin.z;
+	direction_x[count] = ray.direction.x;
+	direction_y[count] = ray.direction.y;
+	direction_z[count] = ray.direction.z;
+	t_near[count] = ray.t_near;
+	t_far[count] = ray.t_far;
+	++count;
+
+	return true;
+}
+
+RayCaster::RayCaster( const BVH & bvh, const std::vector<Surface *> & surfaces ) : bvh_( bvh )
+{
+	const std::vector<Vertex3f> & vertices = bvh.vertices();
+	const std::vector<Triangle3ui> & triangles = bvh.triangles();
+
+	records_.resize( bvh.primitives().size() );
+	for ( size_t i = 0; i < records_.size(); ++i )
+	{
+		const int triangle = bvh.primitives()[i];
+		const Vertex3f & p0 = vertices[triangles[triangle].v0];
+		const Vertex3f & p1 = vertices[triangles[triangle].v1];
+		const Vertex3f & p2 = vertices[triangles[triangle].v2];
+
+		TriangleRecord & record = records_[i];
+		record.p0[0] = p0.x;
+		record.p0[1] = p0.y;
+		record.p0[2] = p0.z;
+		record.e1[0] = p1.x - p0.x;
+		record.e1[1] = p1.y - p0.y;
+		record.e1[2] = p1.z - p0.z;
+		record.e2[0] = p2.x - p0.x;
+		record.e2[1] = p2.y - p0.y;
+		record.e2[2] = p2.z - p0.z;
+		record.triangle = triangle;
+	}
+
+	for ( Surface * surface : surfaces )
+	{
+		materials_.push_back( surface->get_material() );
+	}
+}
+
+bool RayCaster::Intersect( const Ray & ray, RayHit & hit ) const
+{
+	const TraversalRay r = MakeTraversalRay( ray );
+	float t = ray.t_far, u = 0.0f, v = 0.0f;
+	const int record = TraverseWide( bvh_.wide_nodes(), records_, r, false, t, u, v );
+
+	hit = RayHit();
+	if ( record < 0 )
+	{
+		return false;
+	}
+
+	hit.t = t;
+	hit.u = u;
+	hit.v = v;
+	Finish( records_[record].triangle, hit );
+
+	return true;
+}
+
+bool RayCaster::Occluded( const Ray & ray ) const
+{
+	const TraversalRay r = MakeTraversalRay( ray );
+	float t = ray.t_far, u, v;
+
+	return TraverseWide( bvh_.wide_nodes(), records_, r, true, t, u, v ) >= 0;
+}
+
+void RayCaster::Intersect( const RayPacket & packet, RayHit * hits ) const
+{
+	TraversalPacket p;
+	MakeTraversalPacket( packet, p );
+	TraversePacket( bvh_.nodes(), records_, p, ( 1 << packet.count ) - 1, false );
+
+	for ( int i = 0; i < packet.count; ++i )
+	{
+		hits[i] = RayHit();
+		if ( p.record[i] >= 0 )
+		{
+			hits[i].t = p.t_far[i];
+			hits[i].u = p.u[i];
+			hits[i].v = p.v[i];
+			Finish( records_[p.record[i]].triangle, hits[i] );
+		}
+	}
+}
+
+void RayCaster::Occluded( const RayPacket & packet, bool * occluded ) const
+{
+	TraversalPacket p;
+	MakeTraversalPacket( packet, p );
+	const int hits = TraversePacket( bvh_.nodes(), records_, p, ( 1 << packet.count ) - 1, true );
+
+	for ( int i = 0; i < packet.count; ++i )
+	{
+		occluded[i] = ( hits & ( 1 << i ) ) != 0;
+	}
+}
+
+void RayCaster::Intersect( const Ray * rays, const int count, RayHit * hits, ThreadPool & pool ) const
+{
+	pool.ParallelFor( 0, ( count + kBatchSize - 1 ) / kBatchSize, [&]( const int batch )
+	{
+		const int end = ( std::min )( count, ( batch + 1 ) * kBatchSize );
+		for ( int i = batch * kBatchSize; i < end; i += RAY_PACKET_SIZE )
+		{
+			RayPacket packet;
+			for ( int j = i; j < end && packet.Add( rays[j] ); ++j );
+			Intersect( packet, hits + i );
+		}
+	} );
+}
+
+void RayCaster::Occluded( const Ray * rays, const int count, bool * occluded, ThreadPool & pool ) const
+{
+	pool.ParallelFor( 0, ( count + kBatchSize - 1 ) / kBatchSize, [&]( const int batch )
+	{
+		const int end = ( std::min )( count, ( batch + 1 ) * kBatchSize );
+		for ( int i = batch * kBatchSize; i < end; i += RAY_PACKET_SIZE )
+		{
+			RayPacket packet;
+			for ( int j = i; j < end && packet.Add( rays[j] ); ++j );
+			Occluded( packet, occluded + i );
+		}
+	} );
+}
+
+const char * RayCaster::isa()
+{
+	return SelectTraversalKernels().isa;
+}
+
+void RayCaster::MeasureThroughput( const std::vector<Ray> & camera_rays, ThreadPool & pool ) const
+{
+	const int no_rays = static_cast<int>( camera_rays.size() );
+	std::vector<RayHit> hits( no_rays );
+	std::unique_ptr<bool[]> occluded( new bool[no_rays] );
+
+	// seconds of the best of a few runs
+	auto measure = [&]( const std::function<void()> & run )
+	{
+		double best = DBL_MAX;
+		for ( int r = 0; r < 3; ++r )
+		{
+			const auto t0 = std::chrono::high_resolution_clock::now();
+			run();
+			best = ( std::min )( best, std::chrono::duration<double>( std::chrono::high_resolution_clock::now() - t0 ).count() );
+		}
+		return best;
+	};
+
+	const double camera_single = measure( [&]()
+	{
+		pool.ParallelFor( 0, ( no_rays + kBatchSize - 1 ) / kBatchSize, [&]( const int batch )
+		{
+			const int end = ( std::min )( no_rays, ( batch + 1 ) * kBatchSize );
+			for ( int i = batch * kBatchSize; i < end; ++i )
+			{
+				Intersect( camera_rays[i], hits[i] );
+			}
+		} );
+	} );
+	const double camera_packets = measure( [&]() { Intersect( camera_rays.data(), no_rays, hits.data(), pool ); } );
+
+	// cosine distributed ambient occlusion rays of a tenth of the scene size from the visible points
+	const AABB bounds = bvh_.bounds();
+	const float radius = 0.1f * ( bounds.upper - bounds.lower ).L2Norm();
+	std::vector<Ray> ao_rays;
+	ao_rays.reserve( no_rays );
+	for ( int i = 0; i < no_rays; ++i )
+	{
+		if ( !hits[i].hit() )
+		{
+			continue;
+		}
+
+		Vector3 normal = GeometricNormal( hits[i] );
+		if ( normal.DotProduct( camera_rays[i].direction ) > 0.0f )
+		{
+			normal *= -1.0f;
+		}
+		Vector3 tangent, bitangent;
+		Basis( normal, tangent, bitangent );
+		const float r = sqrtf( Random() );
+		const float phi = 2.0f * float( M_PI ) * Random();
+
+		Ray ray;
+		ray.origin = camera_rays[i].origin + camera_rays[i].direction * hits[i].t + normal * ( 1e-3f * radius );
+		ray.direction = tangent * ( r * cosf( phi ) ) + bitangent * ( r * sinf( phi ) ) + normal * sqrtf( ( std::max )( 0.0f, 1.0f - r * r ) );
+		ray.t_far = radius;
+		ao_rays.push_back( ray );
+	}
+	const int no_ao_rays = static_cast<int>( ao_rays.size() );
+
+	const double ao_single = measure( [&]()
+	{
+		pool.ParallelFor( 0, ( no_ao_rays + kBatchSize - 1 ) / kBatchSize, [&]( const int batch )
+		{
+			const int end = ( std::min )( no_ao_rays, ( batch + 1 ) * kBatchSize );
+			for ( int i = batch * kBatchSize; i < end; ++i )
+			{
+				occluded[i] = Occluded( ao_rays[i] );
+			}
+		} );
+	} );
+	const double ao_packets = measure( [&]() { Occluded( ao_rays.data(), no_ao_rays, occluded.get(), pool ); } );
+
+	int no_occluded = 0;
+	for ( int i = 0; i < no_ao_rays; ++i )
+	{
+		no_occluded += occluded[i] ? 1 : 0;
+	}
+
+	printf( "Ray casting (%s, %d threads):\n", isa(), pool.no_threads() );
+	printf( "  %d camera rays: %0.1f Mrays/s single, %0.1f Mrays/s in packets\n", no_rays,
+		no_rays * 1e-6 / camera_single, no_rays * 1e-6 / camera_packets );
+	printf( "  %d ambient occlusion rays (%0.1f %% occluded): %0.1f Mrays/s single, %0.1f Mrays/s in packets\n", no_ao_rays,
+		100.0 * no_occluded / ( std::max )( no_ao_rays, 1 ), no_ao_rays * 1e-6 / ( std::max )( ao_single, 1e-9 ),
+		no_ao_rays * 1e-6 / ( std::max )( ao_packets, 1e-9 ) );
+}
+
+Vector3 RayCaster::GeometricNormal( const RayHit & hit ) const
+{
+	const Triangle3ui & triangle = bvh_.triangles()[hit.primitive];
+	const Vector3 p0 = bvh_.vertices()[triangle.v0];
+	const Vector3 p1 = bvh_.vertices()[triangle.v1];
+	const Vector3 p2 = bvh_.vertices()[triangle.v2];
+
+	Vector3 normal = ( p1 - p0 ).CrossProduct( p2 - p0 );
+	normal.Normalize();
+
+	return normal;
+}
+
+void RayCaster::Finish( const int triangle, RayHit & hit ) const
+{
+	hit.primitive = triangle;
+	bvh_.source( triangle, hit.surface, hit.triangle );
+	hit.material = materials_[hit.surface];
+}
@@ -0,0 +1,142 @@
+#ifndef RAY_CASTER_H_
+#define RAY_CASTER_H_
+
+#include "bvh.h"
+#include "camera.h"
+#include "material.h"
+
+/*! \struct Ray
+\brief Ray segment origin + t * direction, t from <t_near, t_far>, the direction need not be normalized.
+*/
+struct Ray
+{
+	Vector3 origin;
+	Vector3 direction;
+	float t_near{ 0.0f };
+	float t_far{ FLT_MAX };
+};
+
+/*! \fn Ray CameraRay( const Camera & camera, const float x, const float y )
+\brief World space ray of the pin-hole \a camera through the image point ( x, y ) in pixels, ( 0, 0 ) is the top left corner.
+*/
+Ray CameraRay( const Camera & camera, const float x, const float y );
+
+/*! \fn Ray TransformRay( const Matrix4x4 & m, const Ray & ray )
+\brief Ray transformed by the affine matrix \a m, e.g. by the inverse model matrix into the space of a BVH.
+*/
+Ray TransformRay( const Matrix4x4 & m, const Ray & ray );
+
+/*! \struct RayHit
+\brief Result of a closest hit query.
+*/
+struct RayHit
+{
+	float t{ FLT_MAX }; /*!< Ray parameter of the hit point. */
+	float u{ 0.0f }; /*!< Barycentric coordinate of the second vertex of the triangle. */
+	float v{ 0.0f }; /*!< Barycentric coordinate of the third vertex of the triangle. */
+	int surface{ -1 }; /*!< Index of the hit surface, -1 if the ray missed the scene. */
+	int triangle{ -1 }; /*!< Index of the hit triangle within the surface. */
+	int primitive{ -1 }; /*!< Index of the hit triangle in BVH::triangles. */
+	const Material * material{ nullptr };
+
+	bool hit() const
+	{
+		return surface >= 0;
+	}
+};
+
+/*! \def RAY_PACKET_SIZE
+\brief Number of rays traced together by the packet queries, one per lane of an AVX register.
+*/
+#define RAY_PACKET_SIZE 8
+
+/*! \struct RayPacket
+\brief Rays stored as separate arrays (SoA), the lanes from count up are ignored.
+*/
+struct RayPacket
+{
+	float origin_x[RAY_PACKET_SIZE];
+	float origin_y[RAY_PACKET_SIZE];
+	float origin_z[RAY_PACKET_SIZE];
+	float direction_x[RAY_PACKET_SIZE];
+	float direction_y[RAY_PACKET_SIZE];
+	float direction_z[RAY_PACKET_SIZE];
+	float t_near[RAY_PACKET_SIZE];
+	float t_far[RAY_PACKET_SIZE];
+	int count{ 0 };
+
+	//! Appends \a ray, returns false if the packet is full.
+	bool Add( const Ray & ray );
+};
+
+/*! \class RayCaster
+\brief Closest hit and any hit ray queries against the triangles of a BVH.
+
+Single rays traverse the wide tree and test all eight children of a node at once (AVX2, or twice four with SSE2),
+the nearest children are visited first. Packets of coherent rays (camera rays, shadow rays towards one light)
+traverse the binary tree together, every node and triangle is tested against the whole packet at once.
+All queries are const and may be called from any number of threads, the BVH and the materials of the surfaces
+must outlive the caster.
+
+BVH bvh;
+bvh.Build( surfaces );
+RayCaster caster( bvh, surfaces );
+RayHit hit;
+if ( caster.Intersect( ray, hit ) ) printf( "%s\n", hit.material->name().c_str() );
+*/
+class RayCaster
+{
+public:
+	//! Triangle of a leaf as its first vertex and two edges, stored in the order of BVH::primitives.
+	struct TriangleRecord
+	{
+		float p0[3];
+		float e1[3];
+		float e2[3];
+		int triangle; /*!< Index of the flattened triangle. */
+	};
+
+	RayCaster( const BVH & bvh, const std::vector<Surface *> & surfaces );
+
+	RayCaster( const RayCaster & ) = delete;
+	RayCaster & operator=( const RayCaster & ) = delete;
+
+	//! Finds the nearest triangle along \a ray, returns true if there is any.
+	bool Intersect( const Ray & ray, RayHit & hit ) const;
+
+	//! Returns true if any triangle blocks \a ray, e.g. a shadow or an ambient occlusion ray.
+	bool Occluded( const Ray & ray ) const;
+
+	//! Closest hits of the first packet.count rays, \a hits has to hold at least packet.count items.
+	void Intersect( const RayPacket & packet, RayHit * hits ) const;
+
+	//! Occlusion of the first packet.count rays.
+	void Occluded( const RayPacket & packet, bool * occluded ) const;
+
+	//! Closest hits of \a count rays, packets of consecutive rays are traced in parallel.
+	void Intersect( const Ray * rays, const int count, RayHit * hits, ThreadPool & pool = ThreadPool::Default() ) const;
+
+	//! Occlusion of \a count rays, packets of consecutive rays are traced in parallel.
+	void Occluded( const Ray * rays, const int count, bool * occluded, ThreadPool & pool = ThreadPool::Default() ) const;
+
+	//! Unit normal of the hit triangle, p1 - p0 x p2 - p0 of its vertices.
+	Vector3 GeometricNormal( const RayHit & hit ) const;
+
+	//! Name of the instruction set used by the traversal on this CPU.
+	static const char * isa();
+
+	//! Prints rays per second of the single ray and packet queries on camera and ambient occlusion rays.
+	/*!
+	\param camera_rays rays through the pixels of an image, row after row.
+	*/
+	void MeasureThroughput( const std::vector<Ray> & camera_rays, ThreadPool & pool = ThreadPool::Default() ) const;
+
+private:
+	void Finish( const int triangle, RayHit & hit ) const;
+
+	const BVH & bvh_;
+	std::vector<TriangleRecord> records_;
+	std::vector<const Material *> materials_; /*!< One per surface. */
+};
+
+#endif
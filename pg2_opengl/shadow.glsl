@@ -0,0 +1,106 @@
+// cascaded shadow maps, PCF and EVSM lookups, see BuildShadowCascades and ShadowFilter
+
+uniform sampler2DArrayShadow shadow_map; // one layer per cascade, every fetch is a bilinear depth comparison (PCF)
+uniform sampler2DArray shadow_moments; // blurred EVSM moments with mipmaps
+uniform int shadow_filter; // see ShadowFilter: 0 = single tap, 1 = Poisson disk, 2 = Poisson disk rotated per pixel, 3 = EVSM
+uniform int shadow_taps; // Poisson disk taps <1, 32>
+uniform float shadow_radius; // Poisson disk radius (texels), for EVSM the width of the prefiltered footprint
+uniform vec2 evsm_exponents; // see shadow_evsm.frag
+
+layout (std140, row_major, binding = 2) uniform ShadowCascades {
+	mat4 cascade_mlp[4]; // model space -> light clip space (orthographic)
+	vec4 cascade_splits; // view depth where each cascade ends
+	int cascade_count;
+};
+
+// progressive Poisson disk (best candidate), any prefix covers the unit disk evenly
+const vec2 poisson_disk[32] = vec2[](
+	vec2(0.0557, 0.7356), vec2(0.6045, -0.7902), vec2(-0.7775, -0.3615), vec2(0.9074, 0.1349),
+	vec2(0.0343, -0.1700), vec2(-0.7847, 0.4851), vec2(-0.0987, -0.9451), vec2(0.6995, 0.6141),
+	vec2(0.3332, 0.2583), vec2(0.5287, -0.2384), vec2(-0.2699, 0.2692), vec2(-0.4410, 0.8848),
+	vec2(-0.5168, -0.7518), vec2(-0.9957, 0.0388), vec2(0.1870, -0.5967), vec2(-0.3401, -0.3641),
+	vec2(-0.5740, 0.0124), vec2(0.9373, -0.3298), vec2(0.3982, 0.9128), vec2(0.2501, -0.9391),
+	vec2(-0.4608, 0.5701), vec2(0.0195, 0.4184), vec2(-0.2563, -0.0546), vec2(0.3852, 0.5917),
+	vec2(-0.1329, -0.6124), vec2(0.6502, 0.3042), vec2(0.3118, -0.0491), vec2(-0.1376, 0.9572),
+	vec2(0.0685, 0.1283), vec2(0.4765, -0.5183), vec2(0.6168, 0.0251), vec2(-0.5572, 0.3035)
+);
+
+// interleaved gradient noise, trades the banding of a fixed disk for fine noise
+float InterleavedGradientNoise(vec2 pixel)
+{
+	return fract(52.9829189 * fract(dot(pixel, vec2(0.06711056, 0.00583715))));
+}
+
+// one sided Chebyshev upper bound of the fraction of the light reaching the depth t
+float Chebyshev(vec2 moments, float t, float min_variance)
+{
+	if ( t <= moments.x ) {
+		return 1.0f;
+	}
+	float variance = max( moments.y - moments.x * moments.x, min_variance );
+	float d = t - moments.x;
+	float p = variance / ( variance + d * d );
+	return clamp( ( p - 0.2f ) / 0.8f, 0.0f, 1.0f ); // cuts the tail of the bound off - reduces light bleeding
+}
+
+float ShadowEVSM(vec3 position_lcs, int cascade)
+{
+	vec2 a_tc = ( position_lcs.xy + vec2( 1.0f ) ) * 0.5f;
+	float bias = log2( max( shadow_radius, 1.0f ) ); // coarser levels, wider penumbra, same cost
+	vec4 moments = texture( shadow_moments, vec3( a_tc, cascade ), bias );
+
+	float positive = exp( evsm_exponents.x * position_lcs.z );
+	float negative = -exp( -evsm_exponents.y * position_lcs.z );
+	vec2 depth_scale = 0.0001f * evsm_exponents * vec2( positive, negative ); // derivatives of the warps
+	float lit_positive = Chebyshev( moments.xy, positive, depth_scale.x * depth_scale.x );
+	float lit_negative = Chebyshev( moments.zw, negative, depth_scale.y * depth_scale.y );
+	return min( lit_positive, lit_negative );
+}
+
+// fraction of the light reaching the model space point p, the cascade is selected by its view depth
+float Shadow(vec3 p, float view_depth)
+{
+	int cascade = 0;
+	while (cascade < cascade_count && view_depth > cascade_splits[cascade]) {
+		cascade++;
+	}
+	if (cascade >= cascade_count) {
+		return 1.0; // beyond the scene
+	}
+
+	vec3 position_lcs = (cascade_mlp[cascade] * vec4(p, 1.0)).xyz; // w = 1
+
+	float bias = 0.001;
+	vec2 a_tc = ( position_lcs.xy + vec2( 1.0f ) ) * 0.5f;
+	float reference = ( position_lcs.z - bias ) * 0.5f + 0.5f; // NDC -> depth range, lit if reference <= stored depth
+
+	float lit; // fraction of the filter footprint visible from the light
+	if ( shadow_filter == 3 ) {
+		lit = ShadowEVSM( position_lcs, cascade );
+	}
+	else if ( shadow_filter == 0 ) {
+		lit = texture( shadow_map, vec4( a_tc, cascade, reference ) );
+	}
+	else {
+		vec2 shadow_texel_size = 1.0f / textureSize( shadow_map, 0 ).xy; // size of a single texel in tex coords
+		vec2 scale = shadow_radius * shadow_texel_size;
+
+		// rotation of the disk
+		vec2 cs = vec2( 1.0f, 0.0f );
+		if ( shadow_filter == 2 ) {
+			float angle = 2.0f * PI * InterleavedGradientNoise( gl_FragCoord.xy );
+			cs = vec2( cos( angle ), sin( angle ) );
+		}
+
+		int taps = clamp( shadow_taps, 1, 32 );
+		lit = 0.0f;
+		for ( int i = 0; i < taps; ++i ) {
+			vec2 o = poisson_disk[i];
+			o = vec2( o.x * cs.x - o.y * cs.y, o.x * cs.y + o.y * cs.x );
+			lit += texture( shadow_map, vec4( a_tc + o * scale, cascade, reference ) );
+		}
+		lit /= taps;
+	}
+
+	return mix( 0.25f, 1.0f, lit ); // shadowed areas keep a quarter of the light
+}
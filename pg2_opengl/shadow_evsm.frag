@@ -0,0 +1,14 @@
+#version 450 core
+// exponential variance shadow map - both exponential warps of the light space depth and their squares
+
+uniform vec2 evsm_exponents; // positive and negative warp, at most 5.54 so that the squares fit into half floats
+
+out vec4 moments;
+
+void main( void )
+{
+	float depth = gl_FragCoord.z * 2.0f - 1.0f; // NDC like position_lcs.z in pbr_shadow.frag
+	float positive = exp( evsm_exponents.x * depth );
+	float negative = -exp( -evsm_exponents.y * depth );
+	moments = vec4( positive, positive * positive, negative, negative * negative );
+}
@@ -0,0 +1,130 @@
+#include "pch.h"
+#include "shadowcascades.h"
+#include "mymath.h"
+
+void PracticalSplits( const float z_near, const float z_far, const int no_cascades, const float lambda, float * splits )
+{
+	for ( int i = 1; i <= no_cascades; ++i )
+	{
+		const float t = i / float( no_cascades );
+		const float log_split = z_near * powf( z_far / z_near, t );
+		const float uniform_split = z_near + ( z_far - z_near ) * t;
+
+		splits[i - 1] = lambda * log_split + ( 1.0f - lambda ) * uniform_split;
+	}
+
+	splits[no_cascades - 1] = z_far; // exactly, without the rounding of pow
+}
+
+// rounds the radius up to 1/8 of its power of two, small changes of the slice (e.g. the fitted far plane) keep the texel size
+static float QuantizeRadius( const float radius )
+{
+	const float step = exp2f( floorf( log2f( radius ) ) - 3.0f );
+
+	return ceilf( radius / step ) * step;
+}
+
+static Matrix4x4 Orthographic( const float left, const float right, const float bottom, const float top,
+	const float z_near, const float z_far )
+{
+	Matrix4x4 p;
+	p.set( 0, 0, 2.0f / ( right - left ) );
+	p.set( 0, 3, -( right + left ) / ( right - left ) );
+	p.set( 1, 1, 2.0f / ( top - bottom ) );
+	p.set( 1, 3, -( top + bottom ) / ( top - bottom ) );
+	p.set( 2, 2, -2.0f / ( z_far - z_near ) );
+	p.set( 2, 3, -( z_far + z_near ) / ( z_far - z_near ) );
+
+	return p;
+}
+
+int BuildShadowCascades( const Matrix4x4 & view, const float fov_y, const float aspect, const float z_near, const float z_far,
+	const Vector3 & light_direction, const AABB & scene, const int no_cascades, const int resolution,
+	ShadowCascade * cascades, const float lambda )
+{
+	assert( ( no_cascades > 0 ) && ( no_cascades <= MAX_SHADOW_CASCADES ) );
+
+	if ( scene.empty() )
+	{
+		return 0;
+	}
+
+	// depth range of the scene as seen from the camera
+	const AABB scene_vs = scene.Transformed( view );
+	const float depth_min = ( std::max )( z_near, -scene_vs.upper.z );
+	const float depth_max = ( std::min )( z_far, -scene_vs.lower.z );
+
+	if ( depth_min >= depth_max )
+	{
+		return 0; // the scene is behind the camera or beyond the far plane
+	}
+
+	float splits[MAX_SHADOW_CASCADES];
+	PracticalSplits( depth_min, depth_max, no_cascades, lambda, splits );
+
+	// camera frame in world space
+	const Matrix4x4 camera_to_world = Matrix4x4::EuclideanInverse( view );
+	const Vector3 eye = camera_to_world.tr3();
+	const Vector3 forward = -Vector3( camera_to_world.get( 0, 2 ), camera_to_world.get( 1, 2 ), camera_to_world.get( 2, 2 ) );
+
+	// fixed light frame, the snapping is done in its coordinates
+	Vector3 z_l = light_direction;
+	z_l.Normalize();
+	const Vector3 up = ( fabsf( z_l.z ) < 0.99f ) ? Vector3( 0.0f, 0.0f, 1.0f ) : Vector3( 0.0f, 1.0f, 0.0f );
+	Vector3 x_l = up.CrossProduct( z_l );
+	x_l.Normalize();
+	Vector3 y_l = z_l.CrossProduct( x_l );
+	y_l.Normalize();
+
+	Matrix4x4 light_view = Matrix4x4( x_l, y_l, z_l, Vector3( 0.0f, 0.0f, 0.0f ) );
+	light_view.EuclideanInverse();
+
+	// the light looks along -z, casters closest to the light have the largest z
+	const AABB scene_ls = scene.Transformed( light_view );
+
+	// squared distance of a slice corner from the view axis per unit of depth
+	const float tan_y = tanf( fov_y * 0.5f );
+	const float k2 = tan_y * tan_y * ( 1.0f + aspect * aspect );
+
+	float split_near = depth_min;
+
+	for ( int i = 0; i < no_cascades; ++i )
+	{
+		const float split_far = splits[i];
+
+		// minimal bounding sphere of the slice, its center lies on the view axis
+		float center_depth = 0.5f * ( split_near + split_far ) * ( 1.0f + k2 );
+		float radius;
+		if ( center_depth < split_far )
+		{
+			radius = sqrtf( sqr( center_depth - split_near ) + sqr( split_near ) * k2 );
+		}
+		else
+		{
+			center_depth = split_far;
+			radius = split_far * sqrtf( k2 );
+		}
+		radius = QuantizeRadius( radius );
+
+		const Vector3 center = eye + forward * center_depth;
+
+		// move the window by whole texels only
+		const float texel_size = 2.0f * radius / resolution;
+		const float center_x = floorf( center.DotProduct( x_l ) / texel_size ) * texel_size;
+		const float center_y = floorf( center.DotProduct( y_l ) / texel_size ) * texel_size;
+		const float center_z = center.DotProduct( z_l );
+
+		// all casters between the light and the slice, receivers only as far as the slice reaches
+		const float light_near = -scene_ls.upper.z;
+		const float light_far = ( std::max )( ( std::min )( -scene_ls.lower.z, radius - center_z ), light_near + 1e-3f );
+
+		cascades[i].light_projection = Orthographic( center_x - radius, center_x + radius,
+			center_y - radius, center_y + radius, light_near, light_far ) * light_view;
+		cascades[i].split_far = split_far;
+		cascades[i].texel_size = texel_size;
+
+		split_near = split_far;
+	}
+
+	return no_cascades;
+}
@@ -0,0 +1,47 @@
+#ifndef SHADOW_CASCADES_H_
+#define SHADOW_CASCADES_H_
+
+#include "aabb.h"
+
+/*! \def MAX_SHADOW_CASCADES
+\brief Size of the cascade arrays in the shaders (the splits are packed in a single vec4).
+*/
+#define MAX_SHADOW_CASCADES 4
+
+/*! \struct ShadowCascade
+\brief Orthographic light projection covering one slice of the view frustum.
+*/
+struct ShadowCascade
+{
+	Matrix4x4 light_projection; /*!< World space -> light clip space. */
+	float split_far{ 0.0f }; /*!< View depth where the slice ends (the next cascade starts). */
+	float texel_size{ 0.0f }; /*!< World space size of a shadow map texel. */
+};
+
+/*! \fn void PracticalSplits( const float z_near, const float z_far, const int no_cascades, const float lambda, float * splits )
+\brief Blend of the logarithmic and uniform split schemes, splits[i] is the far depth of slice i.
+
+\param lambda 1 is purely logarithmic (constant texel to pixel ratio), 0 purely uniform.
+*/
+void PracticalSplits( const float z_near, const float z_far, const int no_cascades, const float lambda, float * splits );
+
+/*! \fn int BuildShadowCascades( const Matrix4x4 & view, const float fov_y, const float aspect, const float z_near, const float z_far, const Vector3 & light_direction, const AABB & scene, const int no_cascades, const int resolution, ShadowCascade * cascades, const float lambda )
+\brief Fits directional light cascades to the view frustum and the scene.
+
+The camera depth range is first clamped to the depth range of the scene bounds, so no slice covers empty space
+in front of or behind the scene. Each slice is enclosed in its bounding sphere whose radius does not depend on the
+camera orientation, the window of the light projection is snapped to whole texels in a fixed light frame, so the
+shadow edges do not shimmer when the camera moves. The depth range of every light frustum is fitted to the scene
+bounds, so all potential casters are kept and no depth precision is wasted.
+
+\param view world -> view space matrix of the camera (looking along -z).
+\param light_direction direction towards the light (world space).
+\param scene world space bounds of all shadow casters and receivers.
+\param resolution size of the (square) shadow map of a single cascade (px).
+\return Number of cascades written to \a cascades, 0 if the scene is empty or not visible.
+*/
+int BuildShadowCascades( const Matrix4x4 & view, const float fov_y, const float aspect, const float z_near, const float z_far,
+	const Vector3 & light_direction, const AABB & scene, const int no_cascades, const int resolution,
+	ShadowCascade * cascades, const float lambda = 0.8f );
+
+#endif
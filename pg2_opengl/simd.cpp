@@ -0,0 +1,70 @@
+#include "pch.h"
+#include "simd.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+static void CpuId( const int leaf, const int subleaf, unsigned int regs[4] )
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuidex( info, leaf, subleaf );
+	for ( int i = 0; i < 4; ++i ) regs[i] = static_cast<unsigned int>( info[i] );
+#else
+	__cpuid_count( leaf, subleaf, regs[0], regs[1], regs[2], regs[3] );
+#endif
+}
+
+static unsigned long long XGetBV()
+{
+#ifdef _MSC_VER
+	return _xgetbv( 0 );
+#else
+	unsigned int eax, edx;
+	__asm__( "xgetbv" : "=a"( eax ), "=d"( edx ) : "c"( 0 ) );
+	return ( ( unsigned long long )( edx ) << 32 ) | eax;
+#endif
+}
+
+static CpuFeatures DetectCpuFeatures()
+{
+	CpuFeatures features;
+	unsigned int regs[4] = { 0 }; // eax, ebx, ecx, edx
+
+	CpuId( 0, 0, regs );
+	const unsigned int max_leaf = regs[0];
+
+	CpuId( 1, 0, regs );
+	features.sse41 = ( regs[2] & ( 1u << 19 ) ) != 0;
+	features.fma = ( regs[2] & ( 1u << 12 ) ) != 0;
+	features.f16c = ( regs[2] & ( 1u << 29 ) ) != 0;
+
+	// the OS has to save the ymm (and zmm) registers on context switches
+	const bool osxsave = ( regs[2] & ( 1u << 27 ) ) != 0;
+	const unsigned long long xcr0 = osxsave ? XGetBV() : 0;
+	const bool ymm_enabled = ( xcr0 & 0x6 ) == 0x6;
+	const bool zmm_enabled = ( xcr0 & 0xe6 ) == 0xe6;
+
+	features.avx = ( ( regs[2] & ( 1u << 28 ) ) != 0 ) && ymm_enabled;
+	features.fma = features.fma && features.avx;
+	features.f16c = features.f16c && features.avx;
+
+	if ( max_leaf >= 7 )
+	{
+		CpuId( 7, 0, regs );
+		features.avx2 = ( ( regs[1] & ( 1u << 5 ) ) != 0 ) && features.avx;
+		features.avx512f = ( ( regs[1] & ( 1u << 16 ) ) != 0 ) && zmm_enabled;
+	}
+
+	return features;
+}
+
+const CpuFeatures & CpuFeatures::Get()
+{
+	static const CpuFeatures features = DetectCpuFeatures();
+
+	return features;
+}
@@ -0,0 +1,33 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <immintrin.h>
+
+/* Functions using instructions above the compiler baseline are marked with SIMD_TARGET and may be
+called only when CpuFeatures reports the corresponding extension. MSVC accepts the intrinsics
+anywhere, GCC and Clang need the target attribute. */
+#ifdef _MSC_VER
+#define SIMD_TARGET( isa )
+#else
+#define SIMD_TARGET( isa ) __attribute__( ( target( isa ) ) )
+#endif
+
+/*! \struct CpuFeatures
+\brief Instruction set extensions available on the running CPU (and enabled by the OS).
+
+if ( CpuFeatures::Get().f16c ) ConvertF16C( ... ); else ConvertScalar( ... );
+*/
+struct CpuFeatures
+{
+	bool sse41{ false };
+	bool avx{ false };
+	bool avx2{ false };
+	bool fma{ false };
+	bool f16c{ false };
+	bool avx512f{ false };
+
+	//! Detects the features once, subsequent calls return the cached result.
+	static const CpuFeatures & Get();
+};
+
+#endif
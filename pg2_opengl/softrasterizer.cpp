@@ -0,0 +1,548 @@
+#include "pch.h"
+#include "softrasterizer.h"
+#include "envmap.h"
+#include "mymath.h"
+#include <algorithm>
+#include <emmintrin.h>
+
+// triangles per setup work item, small enough to balance, large enough to keep the bins short
+static const int kTrianglesPerChunk = 4096;
+
+// ids of the setup triangles are ( chunk << kSetupShift ) | index, a clipped triangle yields up to six
+static const int kSetupShift = 15;
+static_assert( kTrianglesPerChunk * ( MAX_CLIPPED_VERTICES - 2 ) <= ( 1 << kSetupShift ), "setup ids overflow" );
+
+SoftRasterizer::SoftRasterizer( const int width, const int height, ThreadPool & pool ) :
+	pool_( pool ), width_( width ), height_( height ), brdf_map_( 1, 1 ), color_buffer_( width, height )
+{
+	tiles_x_ = ( width_ + kTileSize - 1 ) / kTileSize;
+	tiles_y_ = ( height_ + kTileSize - 1 ) / kTileSize;
+
+	depth_.resize( size_t( no_tiles() ) * kTileSize * kTileSize );
+	ids_.resize( depth_.size() );
+}
+
+void SoftRasterizer::SetScene( const std::vector<Surface *> & surfaces )
+{
+	vertices_.clear();
+	materials_.clear();
+	for ( std::vector<float> & positions : positions_ )
+	{
+		positions.clear();
+	}
+
+	for ( Surface * surface : surfaces )
+	{
+		for ( int i = 0; i < surface->no_triangles(); ++i )
+		{
+			Triangle & triangle = surface->get_triangle( i );
+			for ( int j = 0; j < 3; ++j )
+			{
+				vertices_.push_back( triangle.vertex( j ) );
+				for ( int k = 0; k < 3; ++k )
+				{
+					positions_[k].push_back( vertices_.back().position.data[k] );
+				}
+			}
+			materials_.push_back( surface->get_material() );
+		}
+	}
+
+	const int no_triangles = static_cast<int>( materials_.size() );
+	no_chunks_ = ( std::max )( 1, ( no_triangles + kTrianglesPerChunk - 1 ) / kTrianglesPerChunk );
+
+	for ( std::vector<float> & positions : clip_positions_ )
+	{
+		positions.resize( vertices_.size() );
+	}
+	outcodes_.resize( vertices_.size() );
+	setup_.clear();
+	setup_.resize( no_chunks_ );
+	bins_.clear();
+	bins_.resize( size_t( no_chunks_ ) * no_tiles() );
+
+	printf( "Software rasterizer: %d triangles, %d setup chunks, %d tiles of %d x %d px, %d threads.\n",
+		no_triangles, no_chunks_, no_tiles(), kTileSize, kTileSize, pool_.no_threads() );
+}
+
+void SoftRasterizer::SetEnvironment( const SphericalHarmonics9 & irradiance, std::vector<Texture3f> prefiltered, Texture3f brdf_map )
+{
+	irradiance_ = irradiance;
+	prefiltered_ = std::move( prefiltered );
+	brdf_map_ = std::move( brdf_map );
+}
+
+void SoftRasterizer::SetLight( const Vector3 & position )
+{
+	light_ = position;
+}
+
+void SoftRasterizer::Render( const Camera & camera, const Matrix4x4 & model )
+{
+	const Matrix4x4 mvp = camera.projectionMatrix * camera.viewMatrix * model;
+
+	// the shading works in model space like the forward shaders
+	const Matrix4x4 world_to_model = Matrix4x4::EuclideanInverse( model );
+	const Vector3 from = camera.view_from();
+	const Vector3 eye = Vector3(
+		world_to_model.get( 0, 0 ) * from.x + world_to_model.get( 0, 1 ) * from.y + world_to_model.get( 0, 2 ) * from.z + world_to_model.get( 0, 3 ),
+		world_to_model.get( 1, 0 ) * from.x + world_to_model.get( 1, 1 ) * from.y + world_to_model.get( 1, 2 ) * from.z + world_to_model.get( 1, 3 ),
+		world_to_model.get( 2, 0 ) * from.x + world_to_model.get( 2, 1 ) * from.y + world_to_model.get( 2, 2 ) * from.z + world_to_model.get( 2, 3 ) );
+
+	pool_.ParallelFor( 0, no_chunks_, [&]( const int chunk ) { TransformVertices( chunk, mvp ); } );
+	pool_.ParallelFor( 0, no_chunks_, [&]( const int chunk ) { SetupTriangles( chunk ); } );
+	pool_.ParallelFor( 0, no_tiles(), [&]( const int tile )
+	{
+		RasterizeTile( tile );
+		ShadeTile( tile, eye );
+	} );
+}
+
+const Texture3f & SoftRasterizer::color_buffer() const
+{
+	return color_buffer_;
+}
+
+int SoftRasterizer::width() const
+{
+	return width_;
+}
+
+int SoftRasterizer::height() const
+{
+	return height_;
+}
+
+int SoftRasterizer::no_tiles() const
+{
+	return tiles_x_ * tiles_y_;
+}
+
+void SoftRasterizer::TransformVertices( const int chunk, const Matrix4x4 & mvp )
+{
+	const int no_triangles = static_cast<int>( materials_.size() );
+	const int begin = 3 * int( int64_t( no_triangles ) * chunk / no_chunks_ );
+	const int end = 3 * int( int64_t( no_triangles ) * ( chunk + 1 ) / no_chunks_ );
+
+	TransformPositions( mvp, &positions_[0][begin], &positions_[1][begin], &positions_[2][begin], end - begin,
+		&clip_positions_[0][begin], &clip_positions_[1][begin], &clip_positions_[2][begin], &clip_positions_[3][begin],
+		&outcodes_[begin] );
+}
+
+void SoftRasterizer::SetupTriangles( const int chunk )
+{
+	for ( int tile = 0; tile < no_tiles(); ++tile )
+	{
+		bins_[size_t( chunk ) * no_tiles() + tile].clear();
+	}
+	setup_[chunk].clear();
+
+	const int no_triangles = static_cast<int>( materials_.size() );
+	const int begin = int( int64_t( no_triangles ) * chunk / no_chunks_ );
+	const int end = int( int64_t( no_triangles ) * ( chunk + 1 ) / no_chunks_ );
+
+	for ( int t = begin; t < end; ++t )
+	{
+		const size_t first = size_t( t ) * 3;
+		const int kind = ClassifyTriangle( outcodes_[first], outcodes_[first + 1], outcodes_[first + 2] );
+
+		if ( kind == 0 )
+		{
+			continue; // outside the frustum
+		}
+
+		ClipVertex v[3];
+		for ( int i = 0; i < 3; ++i )
+		{
+			v[i] = { clip_positions_[0][first + i], clip_positions_[1][first + i], clip_positions_[2][first + i],
+				clip_positions_[3][first + i], { 0.0f, 0.0f, 0.0f } };
+			v[i].bary[i] = 1.0f;
+		}
+
+		if ( kind == 1 )
+		{
+			EmitTriangle( chunk, t, v );
+		}
+		else
+		{
+			ClipVertex polygon[MAX_CLIPPED_VERTICES];
+			const int n = ClipTriangle( v, polygon );
+
+			for ( int i = 2; i < n; ++i )
+			{
+				const ClipVertex fan[3] = { polygon[0], polygon[i - 1], polygon[i] };
+				EmitTriangle( chunk, t, fan );
+			}
+		}
+	}
+}
+
+void SoftRasterizer::EmitTriangle( const int chunk, const int triangle, const ClipVertex * v )
+{
+	SetupTriangle t;
+
+	// viewport transform, y grows downwards like the rows of the color buffer
+	float x[3], y[3];
+	for ( int i = 0; i < 3; ++i )
+	{
+		t.inv_w[i] = 1.0f / v[i].w;
+		x[i] = ( v[i].x * t.inv_w[i] * 0.5f + 0.5f ) * width_;
+		y[i] = ( 0.5f - v[i].y * t.inv_w[i] * 0.5f ) * height_;
+		t.z[i] = v[i].z * t.inv_w[i];
+		memcpy( t.bary[i], v[i].bary, sizeof( t.bary[i] ) );
+	}
+
+	if ( t.z[0] >= 1.0f && t.z[1] >= 1.0f && t.z[2] >= 1.0f )
+	{
+		return; // beyond the far plane
+	}
+
+	float area = ( x[1] - x[0] ) * ( y[2] - y[0] ) - ( y[1] - y[0] ) * ( x[2] - x[0] );
+	if ( area == 0.0f || !std::isfinite( area ) )
+	{
+		return;
+	}
+
+	// no culling, the back faces get the same orientation as the front faces
+	if ( area < 0.0f )
+	{
+		std::swap( x[1], x[2] );
+		std::swap( y[1], y[2] );
+		std::swap( t.z[1], t.z[2] );
+		std::swap( t.inv_w[1], t.inv_w[2] );
+		for ( int k = 0; k < 3; ++k )
+		{
+			std::swap( t.bary[1][k], t.bary[2][k] );
+		}
+		area = -area;
+	}
+
+	// pixel centers inside the bounding box
+	const float min_x = ( std::min )( x[0], ( std::min )( x[1], x[2] ) );
+	const float max_x = ( std::max )( x[0], ( std::max )( x[1], x[2] ) );
+	const float min_y = ( std::min )( y[0], ( std::min )( y[1], y[2] ) );
+	const float max_y = ( std::max )( y[0], ( std::max )( y[1], y[2] ) );
+	t.bounds[0] = int( ( std::max )( ceilf( min_x - 0.5f ), 0.0f ) );
+	t.bounds[1] = int( ( std::max )( ceilf( min_y - 0.5f ), 0.0f ) );
+	t.bounds[2] = int( ( std::min )( floorf( max_x - 0.5f ), float( width_ - 1 ) ) );
+	t.bounds[3] = int( ( std::min )( floorf( max_y - 0.5f ), float( height_ - 1 ) ) );
+
+	if ( t.bounds[0] > t.bounds[2] || t.bounds[1] > t.bounds[3] )
+	{
+		return; // off screen or between the pixel centers
+	}
+
+	for ( int i = 0; i < 3; ++i )
+	{
+		const int j = ( i + 1 ) % 3;
+		const int k = ( i + 2 ) % 3;
+		Edge & edge = t.edges[i];
+		edge.a = y[j] - y[k];
+		edge.b = x[k] - x[j];
+		// the same reference point for both directions of a shared edge, the two edge functions are then exact opposites
+		const int r = ( x[j] < x[k] || ( x[j] == x[k] && y[j] < y[k] ) ) ? j : k;
+		edge.x = x[r];
+		edge.y = y[r];
+		edge.top_left = ( edge.a > 0.0f ) || ( edge.a == 0.0f && edge.b > 0.0f ); // left or horizontal top edge
+	}
+	t.inv_area = 1.0f / area;
+	t.triangle = triangle;
+
+	const int id = ( chunk << kSetupShift ) | static_cast<int>( setup_[chunk].size() );
+	setup_[chunk].push_back( t );
+
+	std::vector<int> * bins = &bins_[size_t( chunk ) * no_tiles()];
+	for ( int ty = t.bounds[1] / kTileSize; ty <= t.bounds[3] / kTileSize; ++ty )
+	{
+		for ( int tx = t.bounds[0] / kTileSize; tx <= t.bounds[2] / kTileSize; ++tx )
+		{
+			bins[tx + ty * tiles_x_].push_back( id );
+		}
+	}
+}
+
+void SoftRasterizer::RasterizeTile( const int tile )
+{
+	float * depth = &depth_[size_t( tile ) * kTileSize * kTileSize];
+	int * ids = &ids_[size_t( tile ) * kTileSize * kTileSize];
+	std::fill( depth, depth + kTileSize * kTileSize, 1.0f );
+	std::fill( ids, ids + kTileSize * kTileSize, -1 );
+
+	const int tile_x = ( tile % tiles_x_ ) * kTileSize;
+	const int tile_y = ( tile / tiles_x_ ) * kTileSize;
+
+	// the chunks are visited in order, so the triangles keep their submission order like on the GPU
+	for ( int chunk = 0; chunk < no_chunks_; ++chunk )
+	{
+		for ( const int id : bins_[size_t( chunk ) * no_tiles() + tile] )
+		{
+			RasterizeTriangle( setup( id ), id, tile_x, tile_y, depth, ids );
+		}
+	}
+}
+
+void SoftRasterizer::RasterizeTriangle( const SetupTriangle & t, const int id, const int tile_x, const int tile_y,
+	float * depth, int * ids ) const
+{
+	const int x0 = ( std::max )( t.bounds[0], tile_x );
+	const int y0 = ( std::max )( t.bounds[1], tile_y );
+	const int x1 = ( std::min )( t.bounds[2], tile_x + kTileSize - 1 );
+	const int y1 = ( std::min )( t.bounds[3], tile_y + kTileSize - 1 );
+	const int span_x0 = tile_x + ( ( x0 - tile_x ) & ~7 ); // spans of eight pixels aligned within the tile
+
+	// pixel center offsets of the two halves of a span
+	const __m128 offsets[2] = { _mm_setr_ps( 0.5f, 1.5f, 2.5f, 3.5f ), _mm_setr_ps( 4.5f, 5.5f, 6.5f, 7.5f ) };
+	const __m128 zero = _mm_setzero_ps();
+
+	__m128 a[3], top_left[3];
+	for ( int i = 0; i < 3; ++i )
+	{
+		a[i] = _mm_set1_ps( t.edges[i].a );
+		top_left[i] = _mm_castsi128_ps( _mm_set1_epi32( t.edges[i].top_left ? -1 : 0 ) );
+	}
+
+	// the depth is linear in screen space, z = z0 + E1 * dz1 + E2 * dz2
+	const __m128 z0 = _mm_set1_ps( t.z[0] );
+	const __m128 dz1 = _mm_set1_ps( ( t.z[1] - t.z[0] ) * t.inv_area );
+	const __m128 dz2 = _mm_set1_ps( ( t.z[2] - t.z[0] ) * t.inv_area );
+	const __m128i id4 = _mm_set1_epi32( id );
+
+	for ( int y = y0; y <= y1; ++y )
+	{
+		__m128 row[3];
+		for ( int i = 0; i < 3; ++i )
+		{
+			row[i] = _mm_set1_ps( t.edges[i].b * ( y + 0.5f - t.edges[i].y ) );
+		}
+
+		float * depth_row = depth + ( y - tile_y ) * kTileSize - tile_x;
+		int * ids_row = ids + ( y - tile_y ) * kTileSize - tile_x;
+
+		for ( int x = span_x0; x <= x1; x += 8 )
+		{
+			// evaluated from scratch rather than stepped, so the functions of a shared edge stay exact opposites
+			__m128 dx[3];
+			for ( int i = 0; i < 3; ++i )
+			{
+				dx[i] = _mm_set1_ps( x - t.edges[i].x );
+			}
+
+			for ( int h = 0; h < 2; ++h )
+			{
+				__m128 e[3];
+				__m128 inside = _mm_castsi128_ps( _mm_set1_epi32( -1 ) );
+				for ( int i = 0; i < 3; ++i )
+				{
+					e[i] = _mm_add_ps( _mm_mul_ps( a[i], _mm_add_ps( dx[i], offsets[h] ) ), row[i] );
+					const __m128 covered = _mm_or_ps( _mm_cmpgt_ps( e[i], zero ), _mm_and_ps( _mm_cmpeq_ps( e[i], zero ), top_left[i] ) );
+					inside = _mm_and_ps( inside, covered );
+				}
+
+				if ( _mm_movemask_ps( inside ) == 0 )
+				{
+					continue;
+				}
+
+				float * d = depth_row + x + 4 * h;
+				int * ids4 = ids_row + x + 4 * h;
+				const __m128 z = _mm_add_ps( z0, _mm_add_ps( _mm_mul_ps( e[1], dz1 ), _mm_mul_ps( e[2], dz2 ) ) );
+				const __m128 old_z = _mm_loadu_ps( d );
+				const __m128 pass = _mm_and_ps( inside, _mm_cmplt_ps( z, old_z ) );
+
+				_mm_storeu_ps( d, _mm_or_ps( _mm_and_ps( pass, z ), _mm_andnot_ps( pass, old_z ) ) );
+				const __m128i pass_i = _mm_castps_si128( pass );
+				const __m128i old_ids = _mm_loadu_si128( reinterpret_cast<const __m128i *>( ids4 ) );
+				_mm_storeu_si128( reinterpret_cast<__m128i *>( ids4 ),
+					_mm_or_si128( _mm_and_si128( pass_i, id4 ), _mm_andnot_si128( pass_i, old_ids ) ) );
+			}
+		}
+	}
+}
+
+// bilinear lookups of a material texture for a row of fragments, the runs of fragments sharing the texture
+// are sampled by one batch, fragments of materials without the texture get white
+static void SampleMaterialTexture( const Material * const * materials, const char slot, const float * u, const float * v,
+	const int count, Color3f * texels )
+{
+	for ( int begin = 0; begin < count; )
+	{
+		const Texture3u * texture = materials[begin]->texture( slot );
+		int end = begin + 1;
+		while ( ( end < count ) && ( materials[end]->texture( slot ) == texture ) )
+		{
+			++end;
+		}
+
+		if ( texture )
+		{
+			SampleBilinear( *texture, u + begin, v + begin, end - begin, WrapMode::kRepeat, texels + begin );
+		}
+		else
+		{
+			std::fill( texels + begin, texels + end, Color3f( { 1, 1, 1 } ) );
+		}
+
+		begin = end;
+	}
+}
+
+void SoftRasterizer::ShadeTile( const int tile, const Vector3 & eye )
+{
+	const int * ids = &ids_[size_t( tile ) * kTileSize * kTileSize];
+	const int tile_x = ( tile % tiles_x_ ) * kTileSize;
+	const int tile_y = ( tile / tiles_x_ ) * kTileSize;
+	const int x_end = ( std::min )( tile_x + kTileSize, width_ );
+	const int y_end = ( std::min )( tile_y + kTileSize, height_ );
+
+	Color3f * color = color_buffer_.data();
+
+	// visible fragments of a tile row
+	int xs[kTileSize];
+	Vector3 positions[kTileSize];
+	Vector3 normals[kTileSize];
+	float u[kTileSize];
+	float v[kTileSize];
+	const Material * materials[kTileSize];
+	Color3f albedo_texels[kTileSize];
+	Color3f roughness_texels[kTileSize];
+
+	for ( int y = tile_y; y < y_end; ++y )
+	{
+		int count = 0;
+		for ( int x = tile_x; x < x_end; ++x )
+		{
+			const int id = ids[( x - tile_x ) + ( y - tile_y ) * kTileSize];
+			if ( id < 0 )
+			{
+				color[x + size_t( y ) * width_] = Color3f( { 0, 0, 0 } );
+				continue;
+			}
+
+			const SetupTriangle & t = setup( id );
+			Interpolate( t, x + 0.5f, y + 0.5f, positions[count], normals[count], u[count], v[count] );
+			materials[count] = materials_[t.triangle];
+			xs[count] = x;
+			++count;
+		}
+
+		SampleMaterialTexture( materials, Material::kDiffuseMapSlot, u, v, count, albedo_texels );
+		SampleMaterialTexture( materials, Material::kRoughnessMapSlot, u, v, count, roughness_texels );
+
+		for ( int i = 0; i < count; ++i )
+		{
+			color[xs[i] + size_t( y ) * width_] = Shade( *materials[i], positions[i], normals[i], albedo_texels[i],
+				roughness_texels[i].data[0], eye );
+		}
+	}
+}
+
+void SoftRasterizer::Interpolate( const SetupTriangle & t, const float px, const float py, Vector3 & position, Vector3 & normal,
+	float & u, float & v ) const
+{
+	// perspective correct barycentrics of the setup triangle, 1 / area cancels out in the normalization
+	float b[3];
+	float sum = 0.0f;
+	for ( int i = 0; i < 3; ++i )
+	{
+		const Edge & edge = t.edges[i];
+		b[i] = ( std::max )( edge.a * ( px - edge.x ) + edge.b * ( py - edge.y ), 0.0f ) * t.inv_w[i];
+		sum += b[i];
+	}
+
+	float w[3] = { 0, 0, 0 };
+	for ( int i = 0; i < 3; ++i )
+	{
+		for ( int j = 0; j < 3; ++j )
+		{
+			w[j] += b[i] * t.bary[i][j] / sum;
+		}
+	}
+
+	// interpolated attributes of the source triangle (model space)
+	const Vertex * vertices = &vertices_[size_t( t.triangle ) * 3];
+	position = vertices[0].position * w[0] + vertices[1].position * w[1] + vertices[2].position * w[2];
+	normal = vertices[0].normal * w[0] + vertices[1].normal * w[1] + vertices[2].normal * w[2];
+	normal.Normalize();
+	u = vertices[0].texture_coords[0].u * w[0] + vertices[1].texture_coords[0].u * w[1] + vertices[2].texture_coords[0].u * w[2];
+	v = 1.0f - ( vertices[0].texture_coords[0].v * w[0] + vertices[1].texture_coords[0].v * w[1] + vertices[2].texture_coords[0].v * w[2] ); // like pbr.vert
+}
+
+Color3f SoftRasterizer::Shade( const Material & material, const Vector3 & position, const Vector3 & n, const Color3f & albedo_texel,
+	const float roughness_texel, const Vector3 & eye ) const
+{
+	Color3f albedo = material.diffuse_;
+	for ( int c = 0; c < 3; ++c )
+	{
+		albedo.data[c] *= albedo_texel.data[c];
+	}
+
+	const float roughness = material.roughness_ * roughness_texel;
+	const float metalness = material.metallicness;
+
+	// PBRLighting of pbr_common.glsl, IOR = rma.b
+	Vector3 W0 = eye - position;
+	W0.Normalize();
+	const float n_w0 = n.DotProduct( W0 );
+	Vector3 Wi = n * ( 2.0f * n_w0 ) - W0;
+	Wi.Normalize();
+	Vector3 L = light_ - position;
+	L.Normalize();
+	Vector3 H = L + W0;
+	H.Normalize();
+	const float cos0 = ( std::max )( n_w0, 0.0f );
+
+	// Fresnel of the half vector of the eye and the sun
+	const float h_w0 = ( std::max )( H.DotProduct( W0 ), 0.0f );
+	const float ior = material.shading_ior(); // the value of rma.b
+	const float F0 = sqr( ( 1.0f - ior ) / ( 1.0f + ior ) );
+	const float kS = F0 + ( 1.0f - F0 ) * powf( 1.0f - h_w0, 5.0f );
+	const float kD = 1.0f - kS * ( 1.0f - metalness );
+
+	const Color3f irradiance = irradiance_.Evaluate( n );
+	const Color3f env = SampleEnvironment( Wi, roughness * ( int( prefiltered_.size() ) - 1 ) );
+	const Color3f brdf = SampleClamp( brdf_map_, cos0, roughness );
+
+	Color3f Lo;
+	for ( int c = 0; c < 3; ++c )
+	{
+		Lo.data[c] = kD * ( albedo.data[c] * float( M_1_PI ) ) * ( std::max )( irradiance.data[c], 0.0f ) +
+			( kS * brdf.data[0] + brdf.data[1] ) * env.data[c];
+	}
+
+	return Lo;
+}
+
+Color3f SoftRasterizer::SampleEnvironment( const Vector3 & direction, const float level ) const
+{
+	if ( prefiltered_.empty() )
+	{
+		return Color3f( { 0, 0, 0 } );
+	}
+
+	// linear blend of the two nearest roughness levels like the trilinear textureLod
+	const int last = static_cast<int>( prefiltered_.size() ) - 1;
+	const float l = clamp( level, 0.0f, float( last ) );
+	const int l0 = int( l );
+	const int l1 = ( std::min )( l0 + 1, last );
+	const float f = l - l0;
+
+	const Texture3f & map0 = prefiltered_[l0];
+	Color3f result = SampleEquirectangular( map0.data(), map0.width(), map0.height(), direction );
+
+	if ( f > 0.0f )
+	{
+		const Texture3f & map1 = prefiltered_[l1];
+		const Color3f result1 = SampleEquirectangular( map1.data(), map1.width(), map1.height(), direction );
+		for ( int c = 0; c < 3; ++c )
+		{
+			result.data[c] += f * ( result1.data[c] - result.data[c] );
+		}
+	}
+
+	return result;
+}
+
+const SoftRasterizer::SetupTriangle & SoftRasterizer::setup( const int id ) const
+{
+	return setup_[id >> kSetupShift][id & ( ( 1 << kSetupShift ) - 1 )];
+}
@@ -0,0 +1,129 @@
+#ifndef SOFT_RASTERIZER_H_
+#define SOFT_RASTERIZER_H_
+
+#include "camera.h"
+#include "surface.h"
+#include "texture.h"
+#include "iblbaker.h"
+#include "threadpool.h"
+#include "vertextransform.h"
+
+/*! \class SoftRasterizer
+\brief Multi-threaded tiled rasterizer running on the CPU only, it shades like the forward pbr shader.
+
+Renders the same surfaces, materials and camera matrices as Rasterizer without any GL context, e.g. batch
+rendering on machines without a GPU. A frame runs in three parallel phases:
+
+1. the vertices are transformed to clip space in batches (TransformPositions),
+2. the triangles are classified by their outcodes, clipped by the near plane and the guard band if needed,
+set up and binned into kTileSize x kTileSize px screen tiles,
+3. each tile rasterizes its bins with half-space edge functions, eight pixels of a row at a time (SSE2),
+and keeps the nearest triangle of every pixel. Only the visible pixels are shaded afterwards, each exactly once,
+the material textures of a tile row are fetched by batches of SampleBilinear.
+
+Tiles are handed out dynamically by ThreadPool::ParallelFor, so a thread that finishes a cheap tile picks up the next one.
+The shading is PBRLighting of pbr_common.glsl (SH9 irradiance, prefiltered environment and the BRDF integration map,
+Fresnel of the half vector between the eye and the sun), the result is linear radiance like the HDR target of the GPU path.
+The irradiance is looked up for the normal instead of the bent normal, point lights and shadows are not supported.
+
+SoftRasterizer renderer( 1920, 1080 );
+renderer.SetScene( surfaces );
+renderer.SetEnvironment( ProjectSH9( Texture3f( "irradiance.exr" ) ), std::move( prefiltered_levels ), Texture3f( "brdf.png" ) );
+renderer.SetLight( Vector3( 0, 1, 350 ) );
+renderer.Render( camera, model );
+renderer.color_buffer().Save( "frame.exr" );
+*/
+class SoftRasterizer
+{
+public:
+	//! Size of the screen tiles (px), a multiple of the SIMD span width.
+	static const int kTileSize = 64;
+
+	SoftRasterizer( const int width, const int height, ThreadPool & pool = ThreadPool::Default() );
+
+	SoftRasterizer( const SoftRasterizer & ) = delete;
+	SoftRasterizer & operator=( const SoftRasterizer & ) = delete;
+
+	//! Copies the triangles of \a surfaces, their materials (and textures) must outlive the renderer.
+	void SetScene( const std::vector<Surface *> & surfaces );
+
+	//! Sets the image based lighting.
+	/*!
+	\param irradiance SH9 of the irradiance map, evaluated like IrradianceSH9 in pbr_common.glsl.
+	\param prefiltered equirectangular maps of increasing roughness, level i belongs to roughness i / ( no_levels - 1 ).
+	\param brdf_map split sum BRDF integration map, scale in red and bias in green, indexed by ( n.v, roughness ).
+	*/
+	void SetEnvironment( const SphericalHarmonics9 & irradiance, std::vector<Texture3f> prefiltered, Texture3f brdf_map );
+
+	//! Sets the position of the sun, used in model space like lightPos of the forward shaders.
+	void SetLight( const Vector3 & position );
+
+	//! Renders the scene transformed by \a model and seen through the projection and view matrices of \a camera.
+	void Render( const Camera & camera, const Matrix4x4 & model );
+
+	//! Linear radiance of the last frame (the top row first), black where no triangle is visible.
+	const Texture3f & color_buffer() const;
+
+	int width() const;
+	int height() const;
+	int no_tiles() const;
+
+private:
+	//! E( p ) = a * ( p.x - x ) + b * ( p.y - y ), positive inside the triangle.
+	struct Edge
+	{
+		float a, b, x, y;
+		bool top_left; /*!< Pixels exactly on the edge belong to the triangle (the top-left fill rule). */
+	};
+
+	struct SetupTriangle
+	{
+		Edge edges[3]; /*!< edges[i] is opposite to vertex i, E_i / area is the screen space barycentric of vertex i. */
+		float z[3]; /*!< Normalized device depth. */
+		float inv_w[3];
+		float bary[3][3]; /*!< Barycentrics of the vertices w.r.t. the source triangle, differ from identity if clipped. */
+		float inv_area;
+		int triangle; /*!< Index of the source triangle. */
+		int bounds[4]; /*!< Covered pixels x0, y0, x1, y1 (inclusive) clamped to the screen. */
+	};
+
+	void TransformVertices( const int chunk, const Matrix4x4 & mvp );
+	void SetupTriangles( const int chunk );
+	void EmitTriangle( const int chunk, const int triangle, const ClipVertex * v );
+	void RasterizeTile( const int tile );
+	void RasterizeTriangle( const SetupTriangle & t, const int id, const int tile_x, const int tile_y, float * depth, int * ids ) const;
+	void ShadeTile( const int tile, const Vector3 & eye );
+	void Interpolate( const SetupTriangle & t, const float px, const float py, Vector3 & position, Vector3 & normal, float & u, float & v ) const;
+	Color3f Shade( const Material & material, const Vector3 & position, const Vector3 & n, const Color3f & albedo_texel,
+		const float roughness_texel, const Vector3 & eye ) const;
+	Color3f SampleEnvironment( const Vector3 & direction, const float level ) const;
+	const SetupTriangle & setup( const int id ) const;
+
+	ThreadPool & pool_;
+
+	int width_{ 0 };
+	int height_{ 0 };
+	int tiles_x_{ 0 };
+	int tiles_y_{ 0 };
+
+	std::vector<Vertex> vertices_; /*!< Three per triangle. */
+	std::vector<float> positions_[3]; /*!< x, y and z of vertices_ as separate arrays for TransformPositions. */
+	std::vector<const Material *> materials_; /*!< One per triangle. */
+	int no_chunks_{ 0 }; /*!< Vertex and triangle setup work items. */
+
+	SphericalHarmonics9 irradiance_;
+	std::vector<Texture3f> prefiltered_;
+	Texture3f brdf_map_;
+	Vector3 light_;
+
+	std::vector<float> clip_positions_[4]; /*!< x, y, z and w. */
+	std::vector<unsigned char> outcodes_;
+	std::vector<std::vector<SetupTriangle>> setup_; /*!< Per chunk, a clipped triangle becomes a fan of up to six triangles. */
+	std::vector<std::vector<int>> bins_; /*!< no_chunks_ x no_tiles(), ( chunk << kSetupShift ) | index into setup_[chunk]. */
+
+	std::vector<float> depth_; /*!< Tile after tile, kTileSize x kTileSize each. */
+	std::vector<int> ids_; /*!< Visible setup triangle of each pixel, -1 for the background. */
+	Texture3f color_buffer_;
+};
+
+#endif
@@ -0,0 +1,550 @@
+#include "pch.h"
+#include "texcompress.h"
+#include "threadpool.h"
+#include "mipchain.h"
+#include "mymath.h"
+#include "utils.h"
+#include <chrono>
+#include <climits>
+
+#ifdef _WIN32
+#include <direct.h>
+#define MKDIR( path ) _mkdir( path )
+#else
+#include <sys/stat.h>
+#define MKDIR( path ) mkdir( path, 0755 )
+#endif
+
+/* RGBA8 image used as the input of the block encoders */
+struct Image4u
+{
+	int width;
+	int height;
+	std::vector<BYTE> rgba;
+
+	const BYTE * texel( const int x, const int y ) const
+	{
+		// blocks crossing the image border repeat the last row/column
+		const int cx = ( std::min )( x, width - 1 );
+		const int cy = ( std::min )( y, height - 1 );
+
+		return &rgba[( size_t( cx ) + size_t( cy ) * size_t( width ) ) * 4];
+	}
+};
+
+// Texture3u keeps the channels in BGR order
+static Image4u ImageFromTexture( const Texture3u & texture )
+{
+	Image4u image;
+	image.width = texture.width();
+	image.height = texture.height();
+	image.rgba.resize( size_t( image.width ) * size_t( image.height ) * 4 );
+
+	for ( size_t i = 0; i < size_t( image.width ) * size_t( image.height ); ++i )
+	{
+		const Color3u & texel = texture.data()[i];
+		image.rgba[i * 4 + 0] = texel.data[2];
+		image.rgba[i * 4 + 1] = texel.data[1];
+		image.rgba[i * 4 + 2] = texel.data[0];
+		image.rgba[i * 4 + 3] = 255;
+	}
+
+	return image;
+}
+
+size_t CompressedImage::size() const
+{
+	size_t total = 0;
+
+	for ( const auto & level : levels )
+	{
+		total += level.size();
+	}
+
+	return total;
+}
+
+void EncodeBC4Block( const BYTE values[16], BYTE block[8] )
+{
+	BYTE lo = 255;
+	BYTE hi = 0;
+
+	for ( int i = 0; i < 16; ++i )
+	{
+		lo = ( std::min )( lo, values[i] );
+		hi = ( std::max )( hi, values[i] );
+	}
+
+	memset( block, 0, 8 );
+	block[0] = hi;
+	block[1] = lo;
+
+	if ( hi == lo )
+	{
+		return; // all indices point to the first endpoint
+	}
+
+	// r0 > r1 selects the 8 value palette
+	int palette[8] = { hi, lo };
+
+	for ( int i = 2; i < 8; ++i )
+	{
+		palette[i] = ( ( 8 - i ) * hi + ( i - 1 ) * lo + 3 ) / 7;
+	}
+
+	unsigned long long bits = 0;
+
+	for ( int t = 0; t < 16; ++t )
+	{
+		int best_index = 0;
+		int best_error = 256;
+
+		for ( int i = 0; i < 8; ++i )
+		{
+			const int error = abs( palette[i] - values[t] );
+
+			if ( error < best_error )
+			{
+				best_error = error;
+				best_index = i;
+			}
+		}
+
+		bits |= ( unsigned long long )( best_index ) << ( 3 * t );
+	}
+
+	for ( int b = 0; b < 6; ++b )
+	{
+		block[2 + b] = BYTE( ( bits >> ( 8 * b ) ) & 0xff );
+	}
+}
+
+void EncodeBC5Block( const BYTE x[16], const BYTE y[16], BYTE block[16] )
+{
+	EncodeBC4Block( x, block );
+	EncodeBC4Block( y, block + 8 );
+}
+
+/* BC7 mode 6 helpers */
+
+static const int kBC7Weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+struct BC7Endpoints
+{
+	int q[2][4]; // 7 bit endpoint values
+	int p[2]; // p-bits
+
+	int value( const int e, const int c ) const
+	{
+		return ( q[e][c] << 1 ) | p[e];
+	}
+};
+
+static void QuantizeEndpoint( const float e[4], int q[4], int & p )
+{
+	float best_error = FLT_MAX;
+
+	for ( int pbit = 0; pbit < 2; ++pbit )
+	{
+		int candidate[4];
+		float error = 0;
+
+		for ( int c = 0; c < 4; ++c )
+		{
+			candidate[c] = int( clamp( floorf( ( e[c] - pbit ) * 0.5f + 0.5f ), 0.0f, 127.0f ) );
+			error += sqr( ( candidate[c] << 1 ) + pbit - e[c] );
+		}
+
+		if ( error < best_error )
+		{
+			best_error = error;
+			memcpy( q, candidate, sizeof( candidate ) );
+			p = pbit;
+		}
+	}
+}
+
+static int SelectIndices( const BYTE rgba[64], const BC7Endpoints & endpoints, int indices[16] )
+{
+	int palette[16][4];
+
+	for ( int i = 0; i < 16; ++i )
+	{
+		for ( int c = 0; c < 4; ++c )
+		{
+			palette[i][c] = ( ( 64 - kBC7Weights4[i] ) * endpoints.value( 0, c ) + kBC7Weights4[i] * endpoints.value( 1, c ) + 32 ) >> 6;
+		}
+	}
+
+	int total_error = 0;
+
+	for ( int t = 0; t < 16; ++t )
+	{
+		int best_error = INT_MAX;
+
+		for ( int i = 0; i < 16; ++i )
+		{
+			int error = 0;
+
+			for ( int c = 0; c < 4; ++c )
+			{
+				error += sqr( palette[i][c] - rgba[t * 4 + c] );
+			}
+
+			if ( error < best_error )
+			{
+				best_error = error;
+				indices[t] = i;
+			}
+		}
+
+		total_error += best_error;
+	}
+
+	return total_error;
+}
+
+static void PutBits( BYTE * block, int & position, const unsigned int value, const int count )
+{
+	for ( int i = 0; i < count; ++i, ++position )
+	{
+		if ( value & ( 1u << i ) )
+		{
+			block[position >> 3] |= BYTE( 1 << ( position & 7 ) );
+		}
+	}
+}
+
+void EncodeBC7Block( const BYTE rgba[64], BYTE block[16] )
+{
+	// principal axis of the texels
+	float mean[4] = { 0, 0, 0, 0 };
+
+	for ( int t = 0; t < 16; ++t )
+	{
+		for ( int c = 0; c < 4; ++c )
+		{
+			mean[c] += rgba[t * 4 + c] * ( 1.0f / 16.0f );
+		}
+	}
+
+	float covariance[4][4] = { { 0 } };
+
+	for ( int t = 0; t < 16; ++t )
+	{
+		for ( int i = 0; i < 4; ++i )
+		{
+			for ( int j = 0; j < 4; ++j )
+			{
+				covariance[i][j] += ( rgba[t * 4 + i] - mean[i] ) * ( rgba[t * 4 + j] - mean[j] );
+			}
+		}
+	}
+
+	float axis[4] = { 1, 1, 1, 0 };
+
+	for ( int iteration = 0; iteration < 8; ++iteration ) // power iteration
+	{
+		float next[4] = { 0, 0, 0, 0 };
+		float norm = 0;
+
+		for ( int i = 0; i < 4; ++i )
+		{
+			for ( int j = 0; j < 4; ++j )
+			{
+				next[i] += covariance[i][j] * axis[j];
+			}
+
+			norm = ( std::max )( norm, fabsf( next[i] ) );
+		}
+
+		if ( norm < 1e-6f )
+		{
+			break; // uniform block
+		}
+
+		for ( int i = 0; i < 4; ++i )
+		{
+			axis[i] = next[i] / norm;
+		}
+	}
+
+	const float axis_length = sqrtf( sqr( axis[0] ) + sqr( axis[1] ) + sqr( axis[2] ) + sqr( axis[3] ) );
+
+	for ( int c = 0; c < 4; ++c )
+	{
+		axis[c] /= axis_length;
+	}
+
+	float t_min = FLT_MAX;
+	float t_max = -FLT_MAX;
+
+	for ( int t = 0; t < 16; ++t )
+	{
+		float projection = 0;
+
+		for ( int c = 0; c < 4; ++c )
+		{
+			projection += ( rgba[t * 4 + c] - mean[c] ) * axis[c];
+		}
+
+		t_min = ( std::min )( t_min, projection );
+		t_max = ( std::max )( t_max, projection );
+	}
+
+	float e[2][4];
+
+	for ( int c = 0; c < 4; ++c )
+	{
+		e[0][c] = clamp( mean[c] + axis[c] * t_min, 0.0f, 255.0f );
+		e[1][c] = clamp( mean[c] + axis[c] * t_max, 0.0f, 255.0f );
+	}
+
+	BC7Endpoints endpoints;
+	QuantizeEndpoint( e[0], endpoints.q[0], endpoints.p[0] );
+	QuantizeEndpoint( e[1], endpoints.q[1], endpoints.p[1] );
+
+	int indices[16];
+	int error = SelectIndices( rgba, endpoints, indices );
+
+	// one least squares refit of the endpoints for the selected indices
+	{
+		float a = 0, b = 0, d = 0;
+		float x0[4] = { 0, 0, 0, 0 };
+		float x1[4] = { 0, 0, 0, 0 };
+
+		for ( int t = 0; t < 16; ++t )
+		{
+			const float w = kBC7Weights4[indices[t]] / 64.0f;
+			a += sqr( 1.0f - w );
+			b += ( 1.0f - w ) * w;
+			d += sqr( w );
+
+			for ( int c = 0; c < 4; ++c )
+			{
+				x0[c] += ( 1.0f - w ) * rgba[t * 4 + c];
+				x1[c] += w * rgba[t * 4 + c];
+			}
+		}
+
+		const float det = a * d - b * b;
+
+		if ( fabsf( det ) > 1e-6f )
+		{
+			float refit[2][4];
+
+			for ( int c = 0; c < 4; ++c )
+			{
+				refit[0][c] = clamp( ( d * x0[c] - b * x1[c] ) / det, 0.0f, 255.0f );
+				refit[1][c] = clamp( ( a * x1[c] - b * x0[c] ) / det, 0.0f, 255.0f );
+			}
+
+			BC7Endpoints refined;
+			QuantizeEndpoint( refit[0], refined.q[0], refined.p[0] );
+			QuantizeEndpoint( refit[1], refined.q[1], refined.p[1] );
+
+			int refined_indices[16];
+			const int refined_error = SelectIndices( rgba, refined, refined_indices );
+
+			if ( refined_error < error )
+			{
+				error = refined_error;
+				endpoints = refined;
+				memcpy( indices, refined_indices, sizeof( indices ) );
+			}
+		}
+	}
+
+	// the msb of the anchor index is implicitly zero
+	if ( indices[0] & 8 )
+	{
+		for ( int c = 0; c < 4; ++c )
+		{
+			utils::swap( endpoints.q[0][c], endpoints.q[1][c] );
+		}
+		utils::swap( endpoints.p[0], endpoints.p[1] );
+
+		for ( int t = 0; t < 16; ++t )
+		{
+			indices[t] = 15 - indices[t];
+		}
+	}
+
+	memset( block, 0, 16 );
+	int position = 0;
+
+	PutBits( block, position, 1 << 6, 7 ); // mode 6
+
+	for ( int c = 0; c < 4; ++c )
+	{
+		PutBits( block, position, endpoints.q[0][c], 7 );
+		PutBits( block, position, endpoints.q[1][c], 7 );
+	}
+
+	PutBits( block, position, endpoints.p[0], 1 );
+	PutBits( block, position, endpoints.p[1], 1 );
+
+	for ( int t = 0; t < 16; ++t )
+	{
+		PutBits( block, position, indices[t], ( t == 0 ) ? 3 : 4 );
+	}
+
+	assert( position == 128 );
+}
+
+static void EncodeLevel( const Image4u & image, const TextureUsage usage, std::vector<BYTE> & blocks )
+{
+	const int blocks_x = ( image.width + 3 ) / 4;
+	const int blocks_y = ( image.height + 3 ) / 4;
+	const int block_size = ( usage == TextureUsage::kScalar ) ? 8 : 16;
+
+	blocks.resize( size_t( blocks_x ) * size_t( blocks_y ) * block_size );
+
+	ThreadPool::Default().ParallelFor( 0, blocks_y, [&]( const int by )
+	{
+		for ( int bx = 0; bx < blocks_x; ++bx )
+		{
+			BYTE texels[64];
+			BYTE x[16];
+			BYTE y[16];
+
+			for ( int t = 0; t < 16; ++t )
+			{
+				const BYTE * texel = image.texel( bx * 4 + ( t & 3 ), by * 4 + ( t >> 2 ) );
+				memcpy( &texels[t * 4], texel, 4 );
+				x[t] = texel[0];
+				y[t] = texel[1];
+			}
+
+			BYTE * block = &blocks[( size_t( bx ) + size_t( by ) * size_t( blocks_x ) ) * block_size];
+
+			switch ( usage )
+			{
+			case TextureUsage::kAlbedo: EncodeBC7Block( texels, block ); break;
+			case TextureUsage::kNormal: EncodeBC5Block( x, y, block ); break;
+			case TextureUsage::kScalar: EncodeBC4Block( x, block ); break;
+			}
+		}
+	} );
+}
+
+static const char kCacheMagic[4] = { 'B', 'C', 'T', '2' }; // 2 - gamma correct mip chains of the albedo
+
+bool LoadCompressedImage( const std::string & file_name, CompressedImage & image )
+{
+	FILE * file = fopen( file_name.c_str(), "rb" );
+
+	if ( file == NULL )
+	{
+		return false;
+	}
+
+	char magic[4] = { 0 };
+	int header[4] = { 0 }; // internal format, width, height, number of levels
+	bool ok = ( fread( magic, sizeof( magic ), 1, file ) == 1 ) && ( memcmp( magic, kCacheMagic, sizeof( magic ) ) == 0 ) &&
+		( fread( header, sizeof( header ), 1, file ) == 1 ) && ( header[3] > 0 ) && ( header[3] <= 32 );
+
+	if ( ok )
+	{
+		image.internal_format = GLenum( header[0] );
+		image.width = header[1];
+		image.height = header[2];
+		image.levels.resize( header[3] );
+
+		for ( auto & level : image.levels )
+		{
+			unsigned int size = 0;
+			ok = ok && ( fread( &size, sizeof( size ), 1, file ) == 1 );
+			if ( !ok ) break;
+			level.resize( size );
+			ok = ( fread( level.data(), 1, size, file ) == size );
+		}
+	}
+
+	fclose( file );
+	file = NULL;
+
+	return ok;
+}
+
+bool SaveCompressedImage( const std::string & file_name, const CompressedImage & image )
+{
+	FILE * file = fopen( file_name.c_str(), "wb" );
+
+	if ( file == NULL )
+	{
+		printf( "IO error: Unable to write '%s'.\n", file_name.c_str() );
+
+		return false;
+	}
+
+	const int header[4] = { int( image.internal_format ), image.width, image.height, image.no_levels() };
+	fwrite( kCacheMagic, sizeof( kCacheMagic ), 1, file );
+	fwrite( header, sizeof( header ), 1, file );
+
+	for ( const auto & level : image.levels )
+	{
+		const unsigned int size = static_cast<unsigned int>( level.size() );
+		fwrite( &size, sizeof( size ), 1, file );
+		fwrite( level.data(), 1, size, file );
+	}
+
+	fclose( file );
+	file = NULL;
+
+	return true;
+}
+
+CompressedImage CompressTexture( Texture3u & texture, const TextureUsage usage, const char * cache_directory )
+{
+	const GLenum formats[] = { GL_COMPRESSED_RGBA_BPTC_UNORM, GL_COMPRESSED_RG_RGTC2, GL_COMPRESSED_RED_RGTC1 };
+
+	CompressedImage image;
+	const size_t no_texels = size_t( texture.width() ) * size_t( texture.height() );
+
+	// the cache key covers the texels, their dimensions and the target format
+	unsigned long long hash = QuickHash( ( const BYTE * )texture.data(), no_texels * sizeof( Color3u ), 1 + int( usage ) );
+	hash = QuickHash( ( const BYTE * )&no_texels, sizeof( no_texels ), hash ) ^ ( unsigned long long )( texture.width() );
+
+	char cache_file[256] = { 0 };
+
+	if ( cache_directory )
+	{
+		sprintf( cache_file, "%s/%016llx.bct", cache_directory, hash );
+
+		if ( LoadCompressedImage( cache_file, image ) && ( image.width == texture.width() ) && ( image.height == texture.height() ) )
+		{
+			return image;
+		}
+	}
+
+	const auto t0 = std::chrono::high_resolution_clock::now();
+
+	// albedo is averaged in linear space, the normals and the scalar maps hold data and are averaged as they are
+	const std::vector<Texture3u> levels = BuildMipChain( texture, usage == TextureUsage::kAlbedo,
+		( usage == TextureUsage::kAlbedo ) ? MipFilter::kKaiser : MipFilter::kBox );
+
+	image.internal_format = formats[int( usage )];
+	image.width = texture.width();
+	image.height = texture.height();
+
+	for ( const Texture3u & level : levels )
+	{
+		image.levels.emplace_back();
+		EncodeLevel( ImageFromTexture( level ), usage, image.levels.back() );
+	}
+
+	const double t = std::chrono::duration<double>( std::chrono::high_resolution_clock::now() - t0 ).count();
+
+	printf( "Texture (%d x %d px) compressed to %s, %d levels, %0.1f MB -> %0.1f MB in %s.\n", image.width, image.height,
+		( usage == TextureUsage::kAlbedo ) ? "BC7" : ( ( usage == TextureUsage::kNormal ) ? "BC5" : "BC4" ), image.no_levels(),
+		no_texels * 3 * 4 / 3 / ( 1024.0f * 1024.0f ), image.size() / ( 1024.0f * 1024.0f ), TimeToString( t ).c_str() );
+
+	if ( cache_directory )
+	{
+		MKDIR( cache_directory );
+		SaveCompressedImage( cache_file, image );
+	}
+
+	return image;
+}
@@ -0,0 +1,73 @@
+#ifndef TEX_COMPRESS_H_
+#define TEX_COMPRESS_H_
+
+#include "texture.h"
+
+/*! \enum TextureUsage
+\brief Semantics of a material texture, selects the block compression format.
+*/
+enum class TextureUsage : char
+{
+	kAlbedo = 0, /*!< RGB color, BC7. */
+	kNormal = 1, /*!< Tangent space normal, BC5 stores x and y, z = sqrt( 1 - x^2 - y^2 ). */
+	kScalar = 2, /*!< Single channel (roughness, metallicness, ...), BC4. */
+};
+
+/*! \struct CompressedImage
+\brief Block compressed texture including the whole mip chain.
+*/
+struct CompressedImage
+{
+	GLenum internal_format{ 0 }; /*!< GL_COMPRESSED_RGBA_BPTC_UNORM, GL_COMPRESSED_RG_RGTC2 or GL_COMPRESSED_RED_RGTC1. */
+	int width{ 0 }; /*!< Width of the base level (px). */
+	int height{ 0 }; /*!< Height of the base level (px). */
+	std::vector<std::vector<BYTE>> levels; /*!< Encoded blocks of each mip level. */
+
+	int no_levels() const
+	{
+		return static_cast<int>( levels.size() );
+	}
+
+	int level_width( const int level ) const
+	{
+		return ( std::max )( 1, width >> level );
+	}
+
+	int level_height( const int level ) const
+	{
+		return ( std::max )( 1, height >> level );
+	}
+
+	size_t size() const;
+};
+
+/*! \fn void EncodeBC4Block( const BYTE values[16], BYTE block[8] )
+\brief Encodes 4x4 single channel texels (row-major) into one BC4 (RGTC1) block.
+*/
+void EncodeBC4Block( const BYTE values[16], BYTE block[8] );
+
+/*! \fn void EncodeBC5Block( const BYTE x[16], const BYTE y[16], BYTE block[16] )
+\brief Encodes 4x4 two channel texels into one BC5 (RGTC2) block.
+*/
+void EncodeBC5Block( const BYTE x[16], const BYTE y[16], BYTE block[16] );
+
+/*! \fn void EncodeBC7Block( const BYTE rgba[64], BYTE block[16] )
+\brief Encodes 4x4 RGBA texels into one BC7 (BPTC) block using mode 6 (single subset, 7.7.7.7 + p-bit endpoints, 4 bit indices).
+*/
+void EncodeBC7Block( const BYTE rgba[64], BYTE block[16] );
+
+/*! \fn CompressedImage CompressTexture( Texture3u & texture, const TextureUsage usage, const char * cache_directory )
+\brief Builds the mip chain of \a texture and block compresses it according to \a usage.
+
+The result is cached on disk under a hash of the texels, so the (slow) encoding runs only once per texture.
+The mip chain comes from BuildMipChain, gamma correct with the Kaiser filter for the albedo and a box filter
+for the other usages. Encoding is spread over the default thread pool.
+
+\param cache_directory directory of the cache files, nullptr disables the cache.
+*/
+CompressedImage CompressTexture( Texture3u & texture, const TextureUsage usage, const char * cache_directory = "texture_cache" );
+
+bool LoadCompressedImage( const std::string & file_name, CompressedImage & image );
+bool SaveCompressedImage( const std::string & file_name, const CompressedImage & image );
+
+#endif
@@ -1,5 +1,7 @@
 #include "pch.h"
 #include "texture.h"
+#include "simd.h"
+#include "mymath.h"
 
 FIBITMAP * BitmapFromFile( const char * file_name, int & width, int & height )
 {
@@ -481,3 +483,510 @@ FIBITMAP * Custom_FreeImage_ConvertToRGBAF( FIBITMAP * dib )
 
 	return dst;
 }
+
+size_t PackedPixelSize( const FloatPacking packing )
+{
+	switch ( packing )
+	{
+	case FloatPacking::kRGB16F: return 3 * sizeof( unsigned short );
+	case FloatPacking::kRG16F: return 2 * sizeof( unsigned short );
+	case FloatPacking::kRGB9E5: return sizeof( unsigned int );
+	default: return sizeof( Color3f );
+	}
+}
+
+unsigned short FloatToHalf( const float value )
+{
+	// round to nearest even, denormals, infinities and NaNs are preserved
+	const unsigned int f32_infinity = 255u << 23;
+	const unsigned int f16_overflow = ( 127u + 16u ) << 23;
+	const unsigned int denormal_magic = ( ( 127u - 15u ) + ( 23u - 10u ) + 1u ) << 23;
+
+	unsigned int f;
+	memcpy( &f, &value, sizeof( f ) );
+
+	const unsigned int sign = f & 0x80000000u;
+	f ^= sign;
+
+	unsigned short h;
+
+	if ( f >= f16_overflow )
+	{
+		h = ( f > f32_infinity ) ? 0x7e00 : 0x7c00;
+	}
+	else if ( f < ( 113u << 23 ) )
+	{
+		// the float addition aligns the mantissa and rounds it to the denormal half
+		float magic, x;
+		memcpy( &magic, &denormal_magic, sizeof( magic ) );
+		memcpy( &x, &f, sizeof( x ) );
+		x += magic;
+		memcpy( &f, &x, sizeof( f ) );
+		h = static_cast<unsigned short>( f - denormal_magic );
+	}
+	else
+	{
+		const unsigned int mantissa_odd = ( f >> 13 ) & 1;
+		f += ( ( 15u - 127u ) << 23 ) + 0xfff; // rebias the exponent and round
+		f += mantissa_odd;
+		h = static_cast<unsigned short>( f >> 13 );
+	}
+
+	return static_cast<unsigned short>( h | ( sign >> 16 ) );
+}
+
+float HalfToFloat( const unsigned short value )
+{
+	const unsigned int sign = unsigned( value & 0x8000 ) << 16;
+	const unsigned int exponent = ( value >> 10 ) & 0x1f;
+	const unsigned int mantissa = value & 0x3ff;
+
+	float result;
+
+	if ( exponent == 0 )
+	{
+		result = ldexpf( float( mantissa ), -24 ); // zero or denormal
+	}
+	else if ( exponent == 31 )
+	{
+		result = ( mantissa == 0 ) ? std::numeric_limits<float>::infinity() : std::numeric_limits<float>::quiet_NaN();
+	}
+	else
+	{
+		result = ldexpf( float( mantissa | 0x400 ), int( exponent ) - 25 );
+	}
+
+	return sign ? -result : result;
+}
+
+SIMD_TARGET( "avx,f16c" )
+static size_t FloatToHalfF16C( const float * src, const size_t count, unsigned short * dst )
+{
+	size_t i = 0;
+
+	for ( ; i + 8 <= count; i += 8 )
+	{
+		const __m128i h = _mm256_cvtps_ph( _mm256_loadu_ps( src + i ), _MM_FROUND_TO_NEAREST_INT );
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( dst + i ), h );
+	}
+
+	return i;
+}
+
+void FloatToHalf( const float * src, const size_t count, unsigned short * dst )
+{
+	static const bool f16c = CpuFeatures::Get().f16c;
+
+	size_t i = ( f16c ) ? FloatToHalfF16C( src, count, dst ) : 0;
+
+	for ( ; i < count; ++i )
+	{
+		dst[i] = FloatToHalf( src[i] );
+	}
+}
+
+unsigned int FloatToRGB9E5( const Color3f & color )
+{
+	const int kMantissaBits = 9;
+	const int kExponentBias = 15;
+	const float kMaxValue = ( 511.0f / 512.0f ) * 65536.0f; // ( 2^N - 1 ) / 2^N * 2^( Emax - B )
+
+	float c[3];
+	float max_c = 0.0f;
+
+	for ( int i = 0; i < 3; ++i )
+	{
+		const float value = color.data[i];
+		c[i] = ( value > 0.0f ) ? ( ( value < kMaxValue ) ? value : kMaxValue ) : 0.0f; // also flushes NaNs to zero
+		max_c = ( std::max )( max_c, c[i] );
+	}
+
+	int exponent = 0;
+	frexpf( max_c, &exponent ); // max_c = m * 2^exponent, m in <0.5, 1) hence floor( log2( max_c ) ) = exponent - 1
+
+	int shared_exponent = ( std::max )( -kExponentBias - 1, exponent - 1 ) + 1 + kExponentBias;
+	float scale = ldexpf( 1.0f, kExponentBias + kMantissaBits - shared_exponent );
+
+	if ( int( floorf( max_c * scale + 0.5f ) ) == ( 1 << kMantissaBits ) )
+	{
+		++shared_exponent; // rounding overflowed the mantissa
+		scale *= 0.5f;
+	}
+
+	unsigned int packed = unsigned( shared_exponent ) << 27;
+
+	for ( int i = 0; i < 3; ++i )
+	{
+		packed |= unsigned( floorf( c[i] * scale + 0.5f ) ) << ( kMantissaBits * i );
+	}
+
+	return packed;
+}
+
+Color3f RGB9E5ToFloat( const unsigned int value )
+{
+	const float scale = ldexpf( 1.0f, int( value >> 27 ) - 15 - 9 );
+
+	return Color3f( { ( value & 0x1ff ) * scale, ( ( value >> 9 ) & 0x1ff ) * scale, ( ( value >> 18 ) & 0x1ff ) * scale } );
+}
+
+void PackPixels( const Color3f * src, const size_t no_pixels, const FloatPacking packing, void * dst )
+{
+	switch ( packing )
+	{
+	case FloatPacking::kRGB32F:
+		memcpy( dst, src, no_pixels * sizeof( Color3f ) );
+		break;
+
+	case FloatPacking::kRGB16F:
+		FloatToHalf( reinterpret_cast<const float *>( src ), no_pixels * 3, static_cast<unsigned short *>( dst ) );
+		break;
+
+	case FloatPacking::kRG16F:
+	{
+		// drop the third channel in small chunks so the conversion itself stays vectorized
+		const size_t kChunk = 128;
+		float rg[2 * kChunk];
+		unsigned short * h = static_cast<unsigned short *>( dst );
+
+		for ( size_t i = 0; i < no_pixels; i += kChunk )
+		{
+			const size_t n = ( std::min )( kChunk, no_pixels - i );
+
+			for ( size_t j = 0; j < n; ++j )
+			{
+				rg[2 * j] = src[i + j].data[0];
+				rg[2 * j + 1] = src[i + j].data[1];
+			}
+
+			FloatToHalf( rg, 2 * n, h + 2 * i );
+		}
+
+		break;
+	}
+
+	case FloatPacking::kRGB9E5:
+	{
+		unsigned int * packed = static_cast<unsigned int *>( dst );
+
+		for ( size_t i = 0; i < no_pixels; ++i )
+		{
+			packed[i] = FloatToRGB9E5( src[i] );
+		}
+
+		break;
+	}
+	}
+}
+
+std::vector<BYTE> PackTexture( const Texture3f & texture, const FloatPacking packing )
+{
+	const size_t no_pixels = size_t( texture.width() ) * size_t( texture.height() );
+	std::vector<BYTE> packed( no_pixels * PackedPixelSize( packing ) );
+
+	PackPixels( texture.data(), no_pixels, packing, packed.data() );
+
+	return packed;
+}
+
+Color3f SampleRepeat( const Texture3u & texture, const float u, const float v )
+{
+	const Color3f bgr = texture.Bilinear( u, v, WrapMode::kRepeat );
+
+	return Color3f( { bgr.data[2], bgr.data[1], bgr.data[0] } ) * ( 1.0f / 255.0f );
+}
+
+Color3f SampleClamp( const Texture3f & texture, const float u, const float v )
+{
+	return texture.Bilinear( u, v, WrapMode::kClamp );
+}
+
+static_assert( sizeof( Color3f ) == 3 * sizeof( float ) && sizeof( Color3u ) == 3, "SampleBilinear expects tightly packed texels" );
+
+// lookups of one iteration of the widest kernel
+static const int kSamplerLanes = 8;
+
+// RGB channels of the texels at the given indices, separate arrays of kSamplerLanes values each
+static void FetchTexels( const Texture3f & texture, const int * index, float * r, float * g, float * b )
+{
+	const Color3f * data = texture.data();
+	for ( int i = 0; i < kSamplerLanes; ++i )
+	{
+		r[i] = data[index[i]].data[0];
+		g[i] = data[index[i]].data[1];
+		b[i] = data[index[i]].data[2];
+	}
+}
+
+static void FetchTexels( const Texture3u & texture, const int * index, float * r, float * g, float * b )
+{
+	const Color3u * data = texture.data();
+	for ( int i = 0; i < kSamplerLanes; ++i )
+	{
+		r[i] = data[index[i]].data[2] * ( 1.0f / 255.0f ); // BGR
+		g[i] = data[index[i]].data[1] * ( 1.0f / 255.0f );
+		b[i] = data[index[i]].data[0] * ( 1.0f / 255.0f );
+	}
+}
+
+// floor of values within the int range, SSE4.1 would have _mm_floor_ps
+static __m128 FloorSSE2( const __m128 x )
+{
+	const __m128 t = _mm_cvtepi32_ps( _mm_cvttps_epi32( x ) );
+
+	return _mm_sub_ps( t, _mm_and_ps( _mm_cmpgt_ps( t, x ), _mm_set1_ps( 1.0f ) ) );
+}
+
+// pixel coordinates of the two taps along one axis and the weight of the second one, the coordinate is first
+// folded into <0, 1> so that the mirrored repeat reduces to the clamp to edge
+static void AxisTapsSSE2( __m128 u, const int size, const WrapMode wrap, __m128i & i0, __m128i & i1, __m128 & f )
+{
+	const __m128 one = _mm_set1_ps( 1.0f );
+	const __m128 last = _mm_set1_ps( float( size - 1 ) );
+
+	if ( wrap == WrapMode::kRepeat )
+	{
+		u = _mm_sub_ps( u, FloorSSE2( u ) );
+		const __m128 x = _mm_sub_ps( _mm_mul_ps( u, _mm_set1_ps( float( size ) ) ), _mm_set1_ps( 0.5f ) );
+		__m128 x0 = FloorSSE2( x );
+		__m128 x1 = _mm_add_ps( x0, one );
+		f = _mm_sub_ps( x, x0 );
+
+		const __m128 below = _mm_cmplt_ps( x0, _mm_setzero_ps() );
+		x0 = _mm_or_ps( _mm_and_ps( below, last ), _mm_andnot_ps( below, x0 ) );
+		x1 = _mm_andnot_ps( _mm_cmpgt_ps( x1, last ), x1 );
+
+		// coordinates beyond the int range and NaNs end up in the texture too (max returns the second operand for NaN)
+		i0 = _mm_cvttps_epi32( _mm_min_ps( _mm_max_ps( x0, _mm_setzero_ps() ), last ) );
+		i1 = _mm_cvttps_epi32( _mm_min_ps( _mm_max_ps( x1, _mm_setzero_ps() ), last ) );
+		return;
+	}
+
+	if ( wrap == WrapMode::kMirror )
+	{
+		const __m128 t = _mm_sub_ps( u, _mm_mul_ps( _mm_set1_ps( 2.0f ), FloorSSE2( _mm_mul_ps( u, _mm_set1_ps( 0.5f ) ) ) ) );
+		const __m128 back = _mm_cmpgt_ps( t, one );
+		u = _mm_or_ps( _mm_and_ps( back, _mm_sub_ps( _mm_set1_ps( 2.0f ), t ) ), _mm_andnot_ps( back, t ) );
+	}
+
+	const __m128 x = _mm_min_ps( _mm_max_ps( _mm_sub_ps( _mm_mul_ps( u, _mm_set1_ps( float( size ) ) ), _mm_set1_ps( 0.5f ) ), _mm_setzero_ps() ), last );
+	const __m128 x0 = FloorSSE2( x );
+	f = _mm_sub_ps( x, x0 );
+	i0 = _mm_cvttps_epi32( x0 );
+	i1 = _mm_cvttps_epi32( _mm_min_ps( _mm_add_ps( x0, one ), last ) );
+}
+
+static __m128 LerpSSE2( const __m128 a, const __m128 b, const __m128 t )
+{
+	return _mm_add_ps( a, _mm_mul_ps( t, _mm_sub_ps( b, a ) ) );
+}
+
+template <class Tex>
+static void SampleBilinearSSE2( const Tex & texture, const float * u, const float * v, const int count, const WrapMode wrap, Color3f * result )
+{
+	const int width = texture.width();
+	const int height = texture.height();
+
+	for ( int first = 0; first < count; first += 4 )
+	{
+		const int n = ( std::min )( 4, count - first );
+		float lane_u[4] = { 0, 0, 0, 0 };
+		float lane_v[4] = { 0, 0, 0, 0 };
+		for ( int i = 0; i < n; ++i )
+		{
+			lane_u[i] = u[first + i];
+			lane_v[i] = v[first + i];
+		}
+
+		__m128i x0, x1, y0, y1;
+		__m128 fx, fy;
+		AxisTapsSSE2( _mm_loadu_ps( lane_u ), width, wrap, x0, x1, fx );
+		AxisTapsSSE2( _mm_loadu_ps( lane_v ), height, wrap, y0, y1, fy );
+
+		// no 32 bit multiplication before SSE4.1, the row offsets are computed per lane
+		int xs[2][4], ys[2][4];
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( xs[0] ), x0 );
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( xs[1] ), x1 );
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( ys[0] ), y0 );
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( ys[1] ), y1 );
+
+		// taps 00, 10, 01 and 11 of the four lanes, padded to the lane count of FetchTexels
+		int index[4][kSamplerLanes] = {};
+		for ( int i = 0; i < 4; ++i )
+		{
+			index[0][i] = xs[0][i] + ys[0][i] * width;
+			index[1][i] = xs[1][i] + ys[0][i] * width;
+			index[2][i] = xs[0][i] + ys[1][i] * width;
+			index[3][i] = xs[1][i] + ys[1][i] * width;
+		}
+
+		float channels[4][3][kSamplerLanes];
+		for ( int t = 0; t < 4; ++t )
+		{
+			FetchTexels( texture, index[t], channels[t][0], channels[t][1], channels[t][2] );
+		}
+
+		float rgb[3][4];
+		for ( int c = 0; c < 3; ++c )
+		{
+			const __m128 top = LerpSSE2( _mm_loadu_ps( channels[0][c] ), _mm_loadu_ps( channels[1][c] ), fx );
+			const __m128 bottom = LerpSSE2( _mm_loadu_ps( channels[2][c] ), _mm_loadu_ps( channels[3][c] ), fx );
+			_mm_storeu_ps( rgb[c], LerpSSE2( top, bottom, fy ) );
+		}
+
+		for ( int i = 0; i < n; ++i )
+		{
+			result[first + i] = Color3f( { rgb[0][i], rgb[1][i], rgb[2][i] } );
+		}
+	}
+}
+
+SIMD_TARGET( "avx2,fma" )
+static void AxisTapsAVX2( __m256 u, const int size, const WrapMode wrap, __m256i & i0, __m256i & i1, __m256 & f )
+{
+	const __m256 one = _mm256_set1_ps( 1.0f );
+	const __m256 last = _mm256_set1_ps( float( size - 1 ) );
+
+	if ( wrap == WrapMode::kRepeat )
+	{
+		u = _mm256_sub_ps( u, _mm256_floor_ps( u ) );
+		const __m256 x = _mm256_fmsub_ps( u, _mm256_set1_ps( float( size ) ), _mm256_set1_ps( 0.5f ) );
+		__m256 x0 = _mm256_floor_ps( x );
+		__m256 x1 = _mm256_add_ps( x0, one );
+		f = _mm256_sub_ps( x, x0 );
+
+		x0 = _mm256_blendv_ps( x0, last, _mm256_cmp_ps( x0, _mm256_setzero_ps(), _CMP_LT_OQ ) );
+		x1 = _mm256_andnot_ps( _mm256_cmp_ps( x1, last, _CMP_GT_OQ ), x1 );
+
+		i0 = _mm256_cvttps_epi32( _mm256_min_ps( _mm256_max_ps( x0, _mm256_setzero_ps() ), last ) );
+		i1 = _mm256_cvttps_epi32( _mm256_min_ps( _mm256_max_ps( x1, _mm256_setzero_ps() ), last ) );
+		return;
+	}
+
+	if ( wrap == WrapMode::kMirror )
+	{
+		const __m256 t = _mm256_fnmadd_ps( _mm256_set1_ps( 2.0f ), _mm256_floor_ps( _mm256_mul_ps( u, _mm256_set1_ps( 0.5f ) ) ), u );
+		u = _mm256_blendv_ps( t, _mm256_sub_ps( _mm256_set1_ps( 2.0f ), t ), _mm256_cmp_ps( t, one, _CMP_GT_OQ ) );
+	}
+
+	const __m256 x = _mm256_min_ps( _mm256_max_ps( _mm256_fmsub_ps( u, _mm256_set1_ps( float( size ) ), _mm256_set1_ps( 0.5f ) ),
+		_mm256_setzero_ps() ), last );
+	const __m256 x0 = _mm256_floor_ps( x );
+	f = _mm256_sub_ps( x, x0 );
+	i0 = _mm256_cvttps_epi32( x0 );
+	i1 = _mm256_cvttps_epi32( _mm256_min_ps( _mm256_add_ps( x0, one ), last ) );
+}
+
+// the float texels are gathered straight from the texture
+SIMD_TARGET( "avx2,fma" )
+static void FetchTexelsAVX2( const Texture3f & texture, const __m256i index, __m256 * rgb )
+{
+	const float * data = reinterpret_cast<const float *>( texture.data() );
+	const __m256i offset = _mm256_mullo_epi32( index, _mm256_set1_epi32( 3 ) );
+	for ( int c = 0; c < 3; ++c )
+	{
+		rgb[c] = _mm256_i32gather_ps( data + c, offset, 4 );
+	}
+}
+
+// a 32 bit gather of the 3 B texels would read past the end of the texture at the last texel, the bytes are
+// packed per lane here instead of calling FetchTexels (legacy SSE code between AVX instructions stalls)
+SIMD_TARGET( "avx2,fma" )
+static void FetchTexelsAVX2( const Texture3u & texture, const __m256i index, __m256 * rgb )
+{
+	const unsigned char * data = texture.data()->data.data();
+	int lanes[kSamplerLanes];
+	_mm256_storeu_si256( reinterpret_cast<__m256i *>( lanes ), index );
+
+	int packed[kSamplerLanes];
+	for ( int i = 0; i < kSamplerLanes; ++i )
+	{
+		const unsigned char * texel = data + 3 * size_t( lanes[i] );
+		packed[i] = texel[0] | ( texel[1] << 8 ) | ( texel[2] << 16 );
+	}
+
+	const __m256i bgr = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( packed ) );
+	const __m256i mask = _mm256_set1_epi32( 0xFF );
+	const __m256 scale = _mm256_set1_ps( 1.0f / 255.0f );
+	rgb[0] = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_and_si256( _mm256_srli_epi32( bgr, 16 ), mask ) ), scale );
+	rgb[1] = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_and_si256( _mm256_srli_epi32( bgr, 8 ), mask ) ), scale );
+	rgb[2] = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_and_si256( bgr, mask ) ), scale );
+}
+
+template <class Tex>
+SIMD_TARGET( "avx2,fma" )
+static void SampleBilinearAVX2( const Tex & texture, const float * u, const float * v, const int count, const WrapMode wrap, Color3f * result )
+{
+	const __m256i width = _mm256_set1_epi32( texture.width() );
+
+	for ( int first = 0; first < count; first += kSamplerLanes )
+	{
+		const int n = ( std::min )( kSamplerLanes, count - first );
+		float lane_u[kSamplerLanes] = {};
+		float lane_v[kSamplerLanes] = {};
+		for ( int i = 0; i < n; ++i )
+		{
+			lane_u[i] = u[first + i];
+			lane_v[i] = v[first + i];
+		}
+
+		__m256i x0, x1, y0, y1;
+		__m256 fx, fy;
+		AxisTapsAVX2( _mm256_loadu_ps( lane_u ), texture.width(), wrap, x0, x1, fx );
+		AxisTapsAVX2( _mm256_loadu_ps( lane_v ), texture.height(), wrap, y0, y1, fy );
+
+		const __m256i row0 = _mm256_mullo_epi32( y0, width );
+		const __m256i row1 = _mm256_mullo_epi32( y1, width );
+		__m256 t00[3], t10[3], t01[3], t11[3];
+		FetchTexelsAVX2( texture, _mm256_add_epi32( x0, row0 ), t00 );
+		FetchTexelsAVX2( texture, _mm256_add_epi32( x1, row0 ), t10 );
+		FetchTexelsAVX2( texture, _mm256_add_epi32( x0, row1 ), t01 );
+		FetchTexelsAVX2( texture, _mm256_add_epi32( x1, row1 ), t11 );
+
+		float rgb[3][kSamplerLanes];
+		for ( int c = 0; c < 3; ++c )
+		{
+			const __m256 top = _mm256_fmadd_ps( fx, _mm256_sub_ps( t10[c], t00[c] ), t00[c] );
+			const __m256 bottom = _mm256_fmadd_ps( fx, _mm256_sub_ps( t11[c], t01[c] ), t01[c] );
+			_mm256_storeu_ps( rgb[c], _mm256_fmadd_ps( fy, _mm256_sub_ps( bottom, top ), top ) );
+		}
+
+		for ( int i = 0; i < n; ++i )
+		{
+			result[first + i] = Color3f( { rgb[0][i], rgb[1][i], rgb[2][i] } );
+		}
+	}
+}
+
+void SampleBilinear( const Texture3f & texture, const float * u, const float * v, const int count, const WrapMode wrap, Color3f * result )
+{
+	static const bool avx2 = CpuFeatures::Get().avx2 && CpuFeatures::Get().fma;
+
+	if ( avx2 )
+	{
+		SampleBilinearAVX2( texture, u, v, count, wrap, result );
+	}
+	else
+	{
+		SampleBilinearSSE2( texture, u, v, count, wrap, result );
+	}
+}
+
+void SampleBilinear( const Texture3u & texture, const float * u, const float * v, const int count, const WrapMode wrap, Color3f * result )
+{
+	static const bool avx2 = CpuFeatures::Get().avx2 && CpuFeatures::Get().fma;
+
+	if ( avx2 )
+	{
+		SampleBilinearAVX2( texture, u, v, count, wrap, result );
+	}
+	else
+	{
+		SampleBilinearSSE2( texture, u, v, count, wrap, result );
+	}
+}
+
+const char * SampleBilinearIsa()
+{
+	return ( CpuFeatures::Get().avx2 && CpuFeatures::Get().fma ) ? "AVX2" : "SSE2";
+}
@@ -12,6 +12,16 @@ FIBITMAP * BitmapFromFile( const char * file_name, int & width, int & height );
 FIBITMAP * Custom_FreeImage_ConvertToRGBF( FIBITMAP * dib ); // this fix removes clamp from conversion of float images
 FIBITMAP * Custom_FreeImage_ConvertToRGBAF( FIBITMAP * dib );  // this fix removes clamp from conversion of float images
 
+/*! \enum WrapMode
+\brief Addressing of the texture coordinates outside <0, 1> (GL_REPEAT, GL_CLAMP_TO_EDGE, GL_MIRRORED_REPEAT).
+*/
+enum class WrapMode : char
+{
+	kRepeat = 0,
+	kClamp = 1,
+	kMirror = 2,
+};
+
 /*! \class Texture
 \brief A simple templated representation of texture.
 
@@ -39,32 +49,15 @@ public:
 	}
 
 	Texture( const std::string & file_name )
-	{		
-		FIBITMAP * dib = BitmapFromFile( file_name.c_str(), width_, height_ );
-
-		if ( dib )
-		{			
-			if ( true ) // always make sure that the loaded bitmap will fit the allocated data size
-			{
-				FIBITMAP * const dib_new = Convert( dib );
-				assert( dib_new );
-				FreeImage_Unload( dib );
-				dib = dib_new;
-			}			
-
-			data_.resize( size_t( width_ ) * size_t( height_ ) );
-
-			const int scan_width = FreeImage_GetPitch( dib ); // (bytes)
-			const int bpp = FreeImage_GetBPP( dib ); // (bites)
-
-			assert( bpp == sizeof( T ) * 8 );
-
-			FreeImage_ConvertToRawBits( ( BYTE * )( data_.data() ), dib, scan_width, bpp,
-				FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE );
-
-			FreeImage_Unload( dib );
-			dib = nullptr;
+	{
+		const bool loaded = Decode( file_name, width_, height_, [this]( const size_t no_pixels )
+		{
+			data_.resize( no_pixels );
+			return data_.data();
+		} );
 
+		if ( loaded )
+		{
 			double range[] = { ( std::numeric_limits<double>::max )( ), std::numeric_limits<double>::lowest() };
 
 			for ( const auto & pixel : data_ )
@@ -74,8 +67,8 @@ public:
 			}			
 
 			printf( "Texture '%s' (%d x %d px, %d bpp, <%0.3f, %0.3f>, %0.1f MB) loaded.\n",
-				file_name.c_str(), width_, height_, bpp, range[0], range[1],
-				scan_width * height_ / ( 1024.0f * 1024.0f ) );
+				file_name.c_str(), width_, height_, int( sizeof( T ) * 8 ), range[0], range[1],
+				width_ * height_ * sizeof( T ) / ( 1024.0f * 1024.0f ) );
 		}
 		else
 		{
@@ -83,6 +76,54 @@ public:
 		}
 	}
 
+	//! Decodes an image file into memory provided by the caller.
+	/*!
+	Lets the caller place the pixels directly where they are needed (e.g. a mapped pixel buffer object)
+	without an intermediate copy. Safe to call from any thread.
+
+	\param file_name image file.
+	\param width width of the decoded image (px).
+	\param height height of the decoded image (px).
+	\param allocate called once with the number of pixels, returns memory for width * height tightly packed pixels of type T.
+	\return True if the file was decoded.
+	*/
+	static bool Decode( const std::string & file_name, int & width, int & height,
+		const std::function<T * ( const size_t no_pixels )> & allocate )
+	{
+		FIBITMAP * dib = BitmapFromFile( file_name.c_str(), width, height );
+
+		if ( !dib )
+		{
+			return false;
+		}
+
+		if ( true ) // always make sure that the loaded bitmap will fit the allocated data size
+		{
+			FIBITMAP * const dib_new = Convert( dib );
+			assert( dib_new );
+			FreeImage_Unload( dib );
+			dib = dib_new;
+		}
+
+		const int scan_width = FreeImage_GetPitch( dib ); // (bytes)
+		const int bpp = FreeImage_GetBPP( dib ); // (bites)
+
+		assert( bpp == sizeof( T ) * 8 );
+
+		T * data = allocate( size_t( width ) * size_t( height ) );
+
+		if ( data )
+		{
+			FreeImage_ConvertToRawBits( ( BYTE * )( data ), dib, scan_width, bpp,
+				FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE );
+		}
+
+		FreeImage_Unload( dib );
+		dib = nullptr;
+
+		return data != nullptr;
+	}
+
 	T pixel( const int x, const int y ) const
 	{
 		assert( x >= 0 && x < width_ && y >= 0 && y < height_ );
@@ -90,17 +131,96 @@ public:
 		return data_[size_t( x ) + size_t( y ) * size_t( width_ )];
 	}
 
-	T texel( const float u, const float v ) const
+	//! Pixel of the integer coordinates, the coordinates outside the texture are resolved by \a wrap.
+	T pixel( const int x, const int y, const WrapMode wrap ) const
 	{
-		T value;
+		return pixel( WrapCoordinate( x, width_, wrap ), WrapCoordinate( y, height_, wrap ) );
+	}
 
+	//! Filtered lookup, ( u, v ) = ( 0, 0 ) is the top left corner of the first pixel and ( 1, 1 ) the bottom right corner of the last one.
+	/*!
+	Nearest neighbour when FAST_INTERP is defined, bilinear interpolation rounded to the type of the pixels otherwise.
+	*/
+	T texel( const float u, const float v, const WrapMode wrap = WrapMode::kRepeat ) const
+	{
 #ifdef FAST_INTERP
-		value = pixel( int( u * width_ ), int( v * height_ ) ); // nearest neighbour
+		return pixel( int( floorf( u * width_ ) ), int( floorf( v * height_ ) ), wrap ); // nearest neighbour
 #else
-		// TODO bilinear interpolation	
+		return FromFloat( Bilinear( u, v, wrap ) );
 #endif
+	}
+
+	//! Bilinear interpolation of the four pixels nearest to ( u, v ) like GL_LINEAR.
+	/*!
+	The channels are returned as they are stored without any color space conversion, e.g. BGR in <0, 255> for Texture3u.
+	*/
+	Color<T::channels, float> Bilinear( const float u, const float v, const WrapMode wrap = WrapMode::kRepeat ) const
+	{
+		const float x = u * width_ - 0.5f;
+		const float y = v * height_ - 0.5f;
+		const float x0 = floorf( x );
+		const float y0 = floorf( y );
+		const float fx = x - x0;
+		const float fy = y - y0;
+
+		const T t00 = pixel( int( x0 ), int( y0 ), wrap );
+		const T t10 = pixel( int( x0 ) + 1, int( y0 ), wrap );
+		const T t01 = pixel( int( x0 ), int( y0 ) + 1, wrap );
+		const T t11 = pixel( int( x0 ) + 1, int( y0 ) + 1, wrap );
+
+		Color<T::channels, float> result;
+		for ( int c = 0; c < T::channels; ++c )
+		{
+			const float top = float( t00.data[c] ) + fx * ( float( t10.data[c] ) - float( t00.data[c] ) );
+			const float bottom = float( t01.data[c] ) + fx * ( float( t11.data[c] ) - float( t01.data[c] ) );
+			result.data[c] = top + fy * ( bottom - top );
+		}
+
+		return result;
+	}
+
+	//! Resolves the pixel coordinate \a x of a row or column of \a size pixels.
+	static int WrapCoordinate( const int x, const int size, const WrapMode wrap )
+	{
+		switch ( wrap )
+		{
+		case WrapMode::kRepeat:
+		{
+			const int r = x % size;
+			return ( r < 0 ) ? r + size : r;
+		}
+
+		case WrapMode::kMirror:
+		{
+			int r = x % ( 2 * size );
+			r = ( r < 0 ) ? r + 2 * size : r;
+			return ( r < size ) ? r : 2 * size - 1 - r;
+		}
+
+		default:
+			return ( x < 0 ) ? 0 : ( ( x >= size ) ? size - 1 : x );
+		}
+	}
+
+	//! Rounds and saturates the channels for pixels stored as integers.
+	static T FromFloat( const Color<T::channels, float> & color )
+	{
+		typedef typename T::value_type V;
+
+		T result;
+		for ( int c = 0; c < T::channels; ++c )
+		{
+			if ( std::numeric_limits<V>::is_integer )
+			{
+				result.data[c] = V( ( std::min )( ( std::max )( color.data[c] + 0.5f, 0.0f ), float( ( std::numeric_limits<V>::max )() ) ) );
+			}
+			else
+			{
+				result.data[c] = V( color.data[c] );
+			}
+		}
 
-		return value;
+		return result;
 	}
 
 	int width() const
@@ -118,7 +238,12 @@ public:
 		return data_.data();
 	}
 
-	FIBITMAP * Convert( FIBITMAP * dib )
+	const T * data() const
+	{
+		return data_.data();
+	}
+
+	static FIBITMAP * Convert( FIBITMAP * dib )
 	{
 		throw "Convert method is defined only for particular Texture types";
 
@@ -163,6 +288,163 @@ using Texture4f = Texture<Color4f, FIT_RGBAF>;
 using Texture3u = Texture<Color3u, FIT_BITMAP>;
 using Texture4u = Texture<Color4u, FIT_BITMAP>;
 
+/*! \class MipMap
+\brief Texture together with the chain of its downsampled levels for trilinear filtering like GL_LINEAR_MIPMAP_LINEAR.
+
+Level l + 1 averages the 2 x 2 pixels of level l (the last row or column of an odd level is repeated),
+the last level is 1 x 1 px. The stored values are averaged as they are, without a color space conversion.
+BuildMipChain (mipchain.h) generates the levels in parallel, gamma correct and optionally with a sharper filter.
+
+MipMap3u albedo( Texture3u( "albedo.png" ) ); // or MipMap3u albedo( BuildMipChain( Texture3u( "albedo.png" ) ) );
+const float lod = albedo.Lod( du_dx, dv_dx, du_dy, dv_dy ); // derivatives of the texture coordinates per pixel
+const Color3f bgr = albedo.Trilinear( u, v, lod );
+*/
+template <class T, FREE_IMAGE_TYPE F>
+class MipMap
+{
+public:
+	explicit MipMap( Texture<T, F> texture )
+	{
+		levels_.push_back( std::move( texture ) );
+
+		while ( levels_.back().width() > 1 || levels_.back().height() > 1 )
+		{
+			levels_.push_back( Downsample( levels_.back() ) );
+		}
+	}
+
+	//! Builds the mip map from levels downsampled elsewhere, level l must have the size of level 0 halved l times.
+	explicit MipMap( std::vector<Texture<T, F>> levels ) : levels_( std::move( levels ) )
+	{
+		assert( !levels_.empty() );
+	}
+
+	//! Linear blend of the bilinear lookups of the two levels nearest to \a lod, the lod is clamped to the existing levels.
+	Color<T::channels, float> Trilinear( const float u, const float v, const float lod, const WrapMode wrap = WrapMode::kRepeat ) const
+	{
+		const int last = no_levels() - 1;
+		const float l = ( std::min )( ( std::max )( lod, 0.0f ), float( last ) );
+		const int l0 = int( l );
+		const float f = l - l0;
+
+		Color<T::channels, float> result = levels_[l0].Bilinear( u, v, wrap );
+
+		if ( f > 0.0f )
+		{
+			const Color<T::channels, float> next = levels_[( std::min )( l0 + 1, last )].Bilinear( u, v, wrap );
+			for ( int c = 0; c < T::channels; ++c )
+			{
+				result.data[c] += f * ( next.data[c] - result.data[c] );
+			}
+		}
+
+		return result;
+	}
+
+	//! Level of detail of a pixel footprint given by the derivatives of the texture coordinates along the screen axes.
+	float Lod( const float du_dx, const float dv_dx, const float du_dy, const float dv_dy ) const
+	{
+		const float w = float( levels_[0].width() );
+		const float h = float( levels_[0].height() );
+		const float rho_x = ( du_dx * w ) * ( du_dx * w ) + ( dv_dx * h ) * ( dv_dx * h );
+		const float rho_y = ( du_dy * w ) * ( du_dy * w ) + ( dv_dy * h ) * ( dv_dy * h );
+
+		return 0.5f * log2f( ( std::max )( ( std::max )( rho_x, rho_y ), 1e-12f ) ); // log2 of the longer axis
+	}
+
+	const Texture<T, F> & level( const int l ) const
+	{
+		return levels_[l];
+	}
+
+	int no_levels() const
+	{
+		return static_cast<int>( levels_.size() );
+	}
+
+	//! Next level of the chain, ( std::max )( 1, size / 2 ) px in each dimension.
+	static Texture<T, F> Downsample( const Texture<T, F> & src )
+	{
+		const int width = ( std::max )( 1, src.width() / 2 );
+		const int height = ( std::max )( 1, src.height() / 2 );
+		Texture<T, F> dst( width, height );
+
+		for ( int y = 0; y < height; ++y )
+		{
+			const int y0 = ( std::min )( 2 * y, src.height() - 1 );
+			const int y1 = ( std::min )( 2 * y + 1, src.height() - 1 );
+
+			for ( int x = 0; x < width; ++x )
+			{
+				const int x0 = ( std::min )( 2 * x, src.width() - 1 );
+				const int x1 = ( std::min )( 2 * x + 1, src.width() - 1 );
+				const T t[4] = { src.pixel( x0, y0 ), src.pixel( x1, y0 ), src.pixel( x0, y1 ), src.pixel( x1, y1 ) };
+
+				Color<T::channels, float> sum;
+				for ( int c = 0; c < T::channels; ++c )
+				{
+					sum.data[c] = 0.25f * ( float( t[0].data[c] ) + float( t[1].data[c] ) + float( t[2].data[c] ) + float( t[3].data[c] ) );
+				}
+				dst.data()[x + size_t( y ) * width] = Texture<T, F>::FromFloat( sum );
+			}
+		}
+
+		return dst;
+	}
+
+private:
+	std::vector<Texture<T, F>> levels_;
+};
+
+using MipMap3f = MipMap<Color3f, FIT_RGBF>;
+using MipMap3u = MipMap<Color3u, FIT_BITMAP>;
+
+/*! \enum FloatPacking
+\brief GPU storage formats of float RGB textures, smaller formats cut memory and fetch bandwidth.
+*/
+enum class FloatPacking : char
+{
+	kRGB32F = 0, /*!< No conversion, 12 B/px. */
+	kRGB16F = 1, /*!< Half floats, 6 B/px. */
+	kRG16F = 2, /*!< Half floats of the first two channels, 4 B/px (e.g. BRDF integration map). */
+	kRGB9E5 = 3, /*!< Three 9 bit mantissas with a shared 5 bit exponent, 4 B/px, non-negative values only. */
+};
+
+//! Number of bytes of one pixel stored in the given format.
+size_t PackedPixelSize( const FloatPacking packing );
+
+//! Converts tightly packed RGB float pixels into \a packing, \a dst must hold no_pixels * PackedPixelSize( packing ) bytes.
+void PackPixels( const Color3f * src, const size_t no_pixels, const FloatPacking packing, void * dst );
+
+//! Converts the texels of \a texture into \a packing.
+std::vector<BYTE> PackTexture( const Texture3f & texture, const FloatPacking packing );
+
+//! Converts an array of floats to IEEE half floats (round to nearest even), uses F16C when the CPU supports it.
+void FloatToHalf( const float * src, const size_t count, unsigned short * dst );
+
+unsigned short FloatToHalf( const float value );
+float HalfToFloat( const unsigned short value );
+
+//! Encodes a color into the GL_RGB9_E5 / GL_UNSIGNED_INT_5_9_9_9_REV layout (EXT_texture_shared_exponent).
+unsigned int FloatToRGB9E5( const Color3f & color );
+Color3f RGB9E5ToFloat( const unsigned int value );
+
+//! Bilinear lookup with the repeat wrap mode, the BGR texels of Texture3u are returned as RGB in <0, 1>.
+Color3f SampleRepeat( const Texture3u & texture, const float u, const float v );
+
+//! Bilinear lookup with the clamp to edge wrap mode.
+Color3f SampleClamp( const Texture3f & texture, const float u, const float v );
+
+//! Bilinear lookups of \a count coordinate pairs, eight at once with AVX2 (gathers) or four with SSE2.
+/*!
+Gives the same results as Texture::Bilinear, the texels of Texture3u are returned as RGB in <0, 1> like SampleRepeat.
+*/
+void SampleBilinear( const Texture3f & texture, const float * u, const float * v, const int count, const WrapMode wrap, Color3f * result );
+void SampleBilinear( const Texture3u & texture, const float * u, const float * v, const int count, const WrapMode wrap, Color3f * result );
+
+//! Name of the instruction set used by SampleBilinear on this CPU.
+const char * SampleBilinearIsa();
+
 template<>
 FIBITMAP * Texture3u::Convert( FIBITMAP * dib )
 {
@@ -0,0 +1,154 @@
+#include "pch.h"
+#include "threadpool.h"
+
+ThreadPool::ThreadPool( const int no_threads )
+{
+	int n = no_threads;
+
+	if ( n < 1 )
+	{
+		n = ( std::max )( 1, int( std::thread::hardware_concurrency() ) );
+	}
+
+	workers_.reserve( n );
+
+	for ( int i = 0; i < n; ++i )
+	{
+		workers_.emplace_back( &ThreadPool::Worker, this );
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock( mutex_ );
+		stop_ = true;
+	}
+
+	job_available_.notify_all();
+
+	for ( std::thread & worker : workers_ )
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::Enqueue( std::function<void()> job )
+{
+	{
+		std::unique_lock<std::mutex> lock( mutex_ );
+		jobs_.push_back( std::move( job ) );
+	}
+
+	job_available_.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+	std::unique_lock<std::mutex> lock( mutex_ );
+	idle_.wait( lock, [this] { return jobs_.empty() && ( running_ == 0 ); } );
+}
+
+void ThreadPool::ParallelFor( const int begin, const int end, const std::function<void( const int i )> & body )
+{
+	if ( end <= begin )
+	{
+		return;
+	}
+
+	struct Loop
+	{
+		std::atomic<int> next;
+		int end;
+		std::function<void( const int i )> body;
+
+		std::mutex mutex;
+		std::condition_variable done;
+		int active{ 0 }; // helpers currently inside the loop
+		bool finished{ false }; // the caller has left the loop, late helpers must not enter
+
+		void Run()
+		{
+			for ( int i = next++; i < end; i = next++ )
+			{
+				body( i );
+			}
+		}
+	};
+
+	std::shared_ptr<Loop> loop = std::make_shared<Loop>();
+	loop->next = begin;
+	loop->end = end;
+	loop->body = body;
+
+	const int no_helpers = ( std::min )( no_threads(), end - begin - 1 );
+
+	for ( int i = 0; i < no_helpers; ++i )
+	{
+		Enqueue( [loop] {
+			{
+				std::unique_lock<std::mutex> lock( loop->mutex );
+				if ( loop->finished ) return;
+				++loop->active;
+			}
+
+			loop->Run();
+
+			std::unique_lock<std::mutex> lock( loop->mutex );
+			--loop->active;
+			loop->done.notify_all();
+		} );
+	}
+
+	loop->Run();
+
+	std::unique_lock<std::mutex> lock( loop->mutex );
+	loop->finished = true;
+	loop->done.wait( lock, [&loop] { return loop->active == 0; } );
+}
+
+ThreadPool & ThreadPool::Default()
+{
+	static ThreadPool pool;
+
+	return pool;
+}
+
+int ThreadPool::no_threads() const
+{
+	return static_cast<int>( workers_.size() );
+}
+
+void ThreadPool::Worker()
+{
+	while ( true )
+	{
+		std::function<void()> job;
+
+		{
+			std::unique_lock<std::mutex> lock( mutex_ );
+			job_available_.wait( lock, [this] { return stop_ || !jobs_.empty(); } );
+
+			if ( jobs_.empty() )
+			{
+				return; // stop_ was requested and there is nothing left to do
+			}
+
+			job = std::move( jobs_.front() );
+			jobs_.pop_front();
+			++running_;
+		}
+
+		job();
+
+		{
+			std::unique_lock<std::mutex> lock( mutex_ );
+			--running_;
+
+			if ( jobs_.empty() && ( running_ == 0 ) )
+			{
+				idle_.notify_all();
+			}
+		}
+	}
+}
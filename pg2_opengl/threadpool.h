@@ -0,0 +1,67 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+/*! \class ThreadPool
+\brief A fixed set of worker threads consuming a FIFO queue of jobs.
+
+ThreadPool pool; // one worker per hardware thread
+pool.Enqueue( [] { DecodeSomething(); } );
+pool.Wait(); // blocks until the queue is empty and all workers are idle
+
+ThreadPool::Default().ParallelFor( 0, height, [&]( const int y ) { ProcessRow( y ); } );
+*/
+class ThreadPool
+{
+public:
+	//! Starts the workers.
+	/*!
+	\param no_threads number of worker threads, values < 1 mean one per hardware thread.
+	*/
+	explicit ThreadPool( const int no_threads = 0 );
+
+	//! Finishes all queued jobs and joins the workers.
+	~ThreadPool();
+
+	ThreadPool( const ThreadPool & ) = delete;
+	ThreadPool & operator=( const ThreadPool & ) = delete;
+
+	//! Appends a job to the queue, it will be executed by the first idle worker.
+	void Enqueue( std::function<void()> job );
+
+	//! Blocks the calling thread until there is no queued or running job.
+	void Wait();
+
+	//! Calls \a body for every index from <begin, end), the calling thread takes part in the work.
+	/*!
+	Indices are handed out dynamically one by one, so the body should represent a reasonably large
+	piece of work (a row of pixels, a tile, ...). Safe to call from a job running on the same pool,
+	helpers that could not start before the loop finished are simply skipped.
+	*/
+	void ParallelFor( const int begin, const int end, const std::function<void( const int i )> & body );
+
+	//! Process wide pool with one worker per hardware thread used by the CPU side algorithms.
+	static ThreadPool & Default();
+
+	int no_threads() const;
+
+private:
+	void Worker();
+
+	std::vector<std::thread> workers_;
+	std::deque<std::function<void()>> jobs_;
+
+	std::mutex mutex_;
+	std::condition_variable job_available_;
+	std::condition_variable idle_;
+
+	int running_{ 0 }; /*!< Number of jobs currently being executed. */
+	bool stop_{ false };
+};
+
+#endif
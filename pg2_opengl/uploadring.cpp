@@ -0,0 +1,368 @@
+#include "pch.h"
+#include "uploadring.h"
+#include "envmap.h"
+
+// offsets into the buffer must be aligned at least to the size of the pixel component,
+// keeping them on cache lines also avoids partial writes into write-combined memory
+static const size_t kAlignment = 64;
+
+UploadRing::UploadRing( const GLsizeiptr capacity )
+{
+	capacity_ = capacity;
+
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	glGenBuffers( 1, &buffer_ );
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, buffer_ );
+	glBufferStorage( GL_PIXEL_UNPACK_BUFFER, capacity_, nullptr, flags ); // immutable storage, required for persistent mapping
+	mapped_ = static_cast<BYTE *>( glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, capacity_, flags ) );
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+
+	if ( !mapped_ )
+	{
+		printf( "Upload ring: mapping of %0.1f MB failed, textures will be uploaded from host memory.\n", capacity_ / ( 1024.0f * 1024.0f ) );
+	}
+}
+
+UploadRing::~UploadRing()
+{
+	for ( Region & region : regions_ )
+	{
+		if ( region.fence )
+		{
+			glClientWaitSync( region.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64( 1000000000 ) );
+			glDeleteSync( region.fence );
+		}
+	}
+	regions_.clear();
+
+	if ( buffer_ )
+	{
+		glBindBuffer( GL_PIXEL_UNPACK_BUFFER, buffer_ );
+		glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+		glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+		glDeleteBuffers( 1, &buffer_ );
+		buffer_ = 0;
+	}
+
+	mapped_ = nullptr;
+}
+
+UploadRing::Allocation UploadRing::Reserve( const size_t size )
+{
+	Allocation allocation;
+
+	const GLsizeiptr aligned_size = GLsizeiptr( ( size + kAlignment - 1 ) & ~( kAlignment - 1 ) );
+
+	if ( !mapped_ || ( size == 0 ) || ( aligned_size > capacity_ ) )
+	{
+		return allocation;
+	}
+
+	std::unique_lock<std::mutex> lock( mutex_ );
+
+	GLintptr begin = -1;
+
+	if ( regions_.empty() )
+	{
+		begin = 0;
+	}
+	else
+	{
+		const GLintptr tail = regions_.front().begin; // oldest region still in flight
+
+		if ( head_ > tail ) // used space is [tail, head), free space wraps around the end
+		{
+			if ( head_ + aligned_size <= capacity_ )
+			{
+				begin = head_;
+			}
+			else if ( aligned_size <= tail )
+			{
+				begin = 0;
+			}
+		}
+		else if ( head_ + aligned_size <= tail ) // used space wraps around, free space is [head, tail)
+		{
+			begin = head_;
+		}
+	}
+
+	if ( begin < 0 )
+	{
+		return allocation; // the ring is full, try again after Retire() or fall back to host memory
+	}
+
+	head_ = begin + aligned_size;
+
+	allocation.data = mapped_ + begin;
+	allocation.offset = begin;
+	allocation.size = GLsizeiptr( size );
+	allocation.id = next_id_++;
+
+	regions_.push_back( Region{ begin, allocation.id, 0, false } );
+
+	return allocation;
+}
+
+// the staged texels are tightly packed, rows of BGR8 or RGB16F pixels are generally not 4 B aligned
+static void TexSubImage2DPacked( const GLenum target, const GLint level, const GLsizei width, const GLsizei height,
+	const GLenum format, const GLenum type, const void * pixels )
+{
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+	glTexSubImage2D( target, level, 0, 0, width, height, format, type, pixels );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+}
+
+void UploadRing::TexSubImage2D( const Allocation & allocation, const GLenum target, const GLint level,
+	const GLsizei width, const GLsizei height, const GLenum format, const GLenum type, const size_t offset )
+{
+	assert( allocation.valid() );
+
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, buffer_ );
+	// with a bound unpack buffer the data pointer is interpreted as an offset into the buffer
+	TexSubImage2DPacked( target, level, width, height, format, type, ( const void * )( allocation.offset + offset ) );
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+}
+
+void UploadRing::Release( Allocation & allocation )
+{
+	if ( !allocation.valid() )
+	{
+		return;
+	}
+
+	GLsync fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+
+	{
+		std::unique_lock<std::mutex> lock( mutex_ );
+
+		for ( Region & region : regions_ )
+		{
+			if ( region.id == allocation.id )
+			{
+				region.fence = fence;
+				region.released = true;
+				break;
+			}
+		}
+	}
+
+	allocation = Allocation();
+}
+
+void UploadRing::Cancel( Allocation & allocation )
+{
+	if ( !allocation.valid() )
+	{
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock( mutex_ );
+
+		for ( Region & region : regions_ )
+		{
+			if ( region.id == allocation.id )
+			{
+				region.released = true; // no fence, nothing was submitted
+				break;
+			}
+		}
+	}
+
+	allocation = Allocation();
+}
+
+void UploadRing::Retire()
+{
+	std::unique_lock<std::mutex> lock( mutex_ );
+
+	// regions are recycled strictly in reservation order, a region released out of order waits for the older ones
+	while ( !regions_.empty() && regions_.front().released )
+	{
+		Region & region = regions_.front();
+
+		if ( region.fence )
+		{
+			const GLenum status = glClientWaitSync( region.fence, 0, 0 );
+
+			if ( ( status != GL_ALREADY_SIGNALED ) && ( status != GL_CONDITION_SATISFIED ) )
+			{
+				break; // the GPU still reads from this region
+			}
+
+			glDeleteSync( region.fence );
+		}
+
+		regions_.pop_front();
+	}
+
+	if ( regions_.empty() )
+	{
+		head_ = 0;
+	}
+}
+
+bool UploadRing::Upload( const GLenum target, const GLint level, const GLsizei width, const GLsizei height,
+	const GLenum format, const GLenum type, const void * data, const size_t size )
+{
+	Retire();
+
+	Allocation staging = Reserve( size );
+
+	if ( !staging.valid() )
+	{
+		TexSubImage2DPacked( target, level, width, height, format, type, data );
+
+		return false;
+	}
+
+	memcpy( staging.data, data, size );
+	TexSubImage2D( staging, target, level, width, height, format, type );
+	Release( staging );
+
+	return true;
+}
+
+bool UploadRing::UploadCompressed( const GLenum target, const GLint level, const GLsizei width, const GLsizei height,
+	const GLenum internal_format, const void * data, const size_t size )
+{
+	Retire();
+
+	Allocation staging = Reserve( size );
+
+	if ( !staging.valid() )
+	{
+		glCompressedTexSubImage2D( target, level, 0, 0, width, height, internal_format, GLsizei( size ), data );
+
+		return false;
+	}
+
+	memcpy( staging.data, data, size );
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, buffer_ );
+	glCompressedTexSubImage2D( target, level, 0, 0, width, height, internal_format, GLsizei( size ), ( const void * )( staging.offset ) );
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+	Release( staging );
+
+	return true;
+}
+
+GLsizeiptr UploadRing::capacity() const
+{
+	return capacity_;
+}
+
+void StagedImage::Upload( UploadRing & ring, const GLenum target, const GLint level, const GLenum format, const GLenum type )
+{
+	const bool cube = ( target == GL_TEXTURE_CUBE_MAP );
+	const size_t face_size = size / faces;
+
+	for ( int face = 0; face < faces; ++face )
+	{
+		const GLenum face_target = cube ? GLenum( GL_TEXTURE_CUBE_MAP_POSITIVE_X + face ) : target;
+
+		if ( staging.valid() )
+		{
+			ring.TexSubImage2D( staging, face_target, level, width, height, format, type, face * face_size );
+		}
+		else if ( !host.empty() )
+		{
+			TexSubImage2DPacked( face_target, level, width, height, format, type, host.data() + face * face_size );
+		}
+	}
+
+	ring.Release( staging );
+	host.clear();
+	host.shrink_to_fit();
+}
+
+// packs decoded float pixels into the ring (or host memory if the ring is full)
+static void StagePixels( UploadRing & ring, StagedImage & image, const std::vector<Color3f> & pixels, const FloatPacking packing )
+{
+	image.packing = packing;
+	image.size = pixels.size() * PackedPixelSize( packing );
+	image.staging = ring.Reserve( image.size );
+
+	BYTE * dst = nullptr;
+
+	if ( image.staging.valid() )
+	{
+		dst = image.staging.data;
+	}
+	else
+	{
+		image.host.resize( image.size );
+		dst = image.host.data();
+	}
+
+	PackPixels( pixels.data(), pixels.size(), packing, dst );
+}
+
+std::shared_ptr<StagedImage> DecodeStaged( UploadRing & ring, const std::string & file_name, const FloatPacking packing )
+{
+	if ( packing == FloatPacking::kRGB32F )
+	{
+		return DecodeStaged<Color3f, FIT_RGBF>( ring, file_name ); // no conversion, decode in place
+	}
+
+	std::shared_ptr<StagedImage> image = std::make_shared<StagedImage>();
+
+	std::vector<Color3f> pixels;
+	const bool loaded = Texture3f::Decode( file_name, image->width, image->height, [&pixels]( const size_t no_pixels )
+	{
+		pixels.resize( no_pixels );
+		return pixels.data();
+	} );
+
+	if ( !loaded )
+	{
+		printf( "Texture '%s' not loaded.\n", file_name.c_str() );
+
+		return image;
+	}
+
+	StagePixels( ring, *image, pixels, packing );
+
+	printf( "Texture '%s' (%d x %d px) packed from %0.1f MB to %0.1f MB of %s memory.\n", file_name.c_str(),
+		image->width, image->height, pixels.size() * sizeof( Color3f ) / ( 1024.0f * 1024.0f ), image->size / ( 1024.0f * 1024.0f ),
+		image->staging.valid() ? "staging" : "host" );
+
+	return image;
+}
+
+std::shared_ptr<StagedImage> DecodeStagedCube( UploadRing & ring, const std::string & file_name, const FloatPacking packing )
+{
+	std::shared_ptr<StagedImage> image = std::make_shared<StagedImage>();
+
+	int width = 0;
+	int height = 0;
+	std::vector<Color3f> pixels;
+	const bool loaded = Texture3f::Decode( file_name, width, height, [&pixels]( const size_t no_pixels )
+	{
+		pixels.resize( no_pixels );
+		return pixels.data();
+	} );
+
+	if ( !loaded )
+	{
+		printf( "Texture '%s' not loaded.\n", file_name.c_str() );
+
+		return image;
+	}
+
+	// a face covers 90 degrees, a quarter of the longitude range
+	const int face_size = ( std::max )( 1, width / 4 );
+	std::vector<Color3f> faces( size_t( face_size ) * size_t( face_size ) * 6 );
+	EquirectangularToCube( pixels.data(), width, height, face_size, faces.data() );
+
+	image->width = face_size;
+	image->height = face_size;
+	image->faces = 6;
+	StagePixels( ring, *image, faces, packing );
+
+	printf( "Texture '%s' (%d x %d px) resampled to a %d px cube map, %0.1f MB of %s memory.\n", file_name.c_str(),
+		width, height, face_size, image->size / ( 1024.0f * 1024.0f ), image->staging.valid() ? "staging" : "host" );
+
+	return image;
+}
@@ -0,0 +1,168 @@
+#ifndef UPLOAD_RING_H_
+#define UPLOAD_RING_H_
+
+#include <mutex>
+#include <deque>
+#include "texture.h"
+
+/*! \class UploadRing
+\brief Persistently mapped pixel buffer object used as a ring of staging memory for texture uploads.
+
+Space is reserved from any thread (e.g. an image decoder writes straight into the mapped memory),
+the copy to the texture is recorded on the GL thread with glTexSubImage2D sourcing the bound
+GL_PIXEL_UNPACK_BUFFER and each region is protected by a fence until the GPU has consumed it.
+
+UploadRing ring( 64 << 20 ); // GL thread
+UploadRing::Allocation staging = ring.Reserve( bytes ); // any thread
+memcpy( staging.data, pixels, bytes ); // any thread
+ring.TexSubImage2D( staging, GL_TEXTURE_2D, 0, width, height, GL_RGB, GL_FLOAT ); // GL thread
+ring.Release( staging ); // GL thread, fences the region
+*/
+class UploadRing
+{
+public:
+	struct Allocation
+	{
+		BYTE * data{ nullptr }; /*!< Mapped memory, write only (it is usually write-combined). */
+		GLintptr offset{ 0 }; /*!< Offset of the region within the buffer object. */
+		GLsizeiptr size{ 0 };
+		long long id{ -1 };
+
+		bool valid() const
+		{
+			return data != nullptr;
+		}
+	};
+
+	//! Creates and maps the buffer (GL thread).
+	explicit UploadRing( const GLsizeiptr capacity = GLsizeiptr( 64 ) << 20 );
+
+	//! Waits for all pending transfers and deletes the buffer (GL thread).
+	~UploadRing();
+
+	UploadRing( const UploadRing & ) = delete;
+	UploadRing & operator=( const UploadRing & ) = delete;
+
+	//! Reserves a contiguous region of the ring, no GL calls are made so it is safe on any thread.
+	/*!
+	\param size number of bytes.
+	\return Invalid allocation if there is not enough free space right now.
+	*/
+	Allocation Reserve( const size_t size );
+
+	//! Copies a part of the allocation to a texture level (GL thread, the texture must be bound to \a target).
+	/*!
+	\param offset byte offset of the pixels within the allocation.
+	*/
+	void TexSubImage2D( const Allocation & allocation, const GLenum target, const GLint level,
+		const GLsizei width, const GLsizei height, const GLenum format, const GLenum type, const size_t offset = 0 );
+
+	//! Fences the region after the last TexSubImage2D call, it is recycled once the GPU signals the fence (GL thread).
+	void Release( Allocation & allocation );
+
+	//! Returns a region that has never been used by a GL command back to the ring (any thread).
+	void Cancel( Allocation & allocation );
+
+	//! Recycles regions whose fences have been signaled, call it regularly, e.g. once per frame (GL thread).
+	void Retire();
+
+	//! Convenience path for data already in host memory: reserve, copy, upload and release (GL thread).
+	/*!
+	\return False if the data did not fit into the ring and was uploaded directly from host memory.
+	*/
+	bool Upload( const GLenum target, const GLint level, const GLsizei width, const GLsizei height,
+		const GLenum format, const GLenum type, const void * data, const size_t size );
+
+	//! The same as Upload for block compressed data, the level is written with glCompressedTexSubImage2D (GL thread).
+	bool UploadCompressed( const GLenum target, const GLint level, const GLsizei width, const GLsizei height,
+		const GLenum internal_format, const void * data, const size_t size );
+
+	GLsizeiptr capacity() const;
+
+private:
+	struct Region
+	{
+		GLintptr begin;
+		long long id;
+		GLsync fence; /*!< Zero until released. */
+		bool released;
+	};
+
+	GLuint buffer_{ 0 };
+	BYTE * mapped_{ nullptr };
+	GLsizeiptr capacity_{ 0 };
+
+	std::mutex mutex_;
+	std::deque<Region> regions_; /*!< Regions in flight ordered by reservation. */
+	GLintptr head_{ 0 }; /*!< Next free byte. */
+	long long next_id_{ 0 };
+};
+
+/*! \struct StagedImage
+\brief Pixels of a decoded image, either already in the upload ring or in host memory as a fallback.
+*/
+struct StagedImage
+{
+	UploadRing::Allocation staging;
+	std::vector<BYTE> host; /*!< Used when the ring was full at decode time. */
+	int width{ 0 };
+	int height{ 0 };
+	int faces{ 1 }; /*!< 6 for cube maps, faces are stored one after another. */
+	size_t size{ 0 }; /*!< Number of bytes. */
+	FloatPacking packing{ FloatPacking::kRGB32F }; /*!< Layout of float images, see DecodeStaged( ring, file_name, packing ). */
+
+	//! Uploads the pixels to the texture bound to \a target and releases the staging memory (GL thread).
+	/*!
+	Pass GL_TEXTURE_CUBE_MAP as \a target to upload all six faces of a cube map.
+	*/
+	void Upload( UploadRing & ring, const GLenum target, const GLint level, const GLenum format, const GLenum type );
+};
+
+/*! \fn std::shared_ptr<StagedImage> DecodeStaged( UploadRing & ring, const std::string & file_name )
+\brief Decodes an image file straight into the mapped staging memory (safe to call on a worker thread).
+*/
+template <class T, FREE_IMAGE_TYPE F>
+std::shared_ptr<StagedImage> DecodeStaged( UploadRing & ring, const std::string & file_name )
+{
+	std::shared_ptr<StagedImage> image = std::make_shared<StagedImage>();
+
+	const bool loaded = Texture<T, F>::Decode( file_name, image->width, image->height, [&]( const size_t no_pixels )
+	{
+		image->size = no_pixels * sizeof( T );
+		image->staging = ring.Reserve( image->size );
+
+		if ( image->staging.valid() )
+		{
+			return reinterpret_cast<T *>( image->staging.data );
+		}
+
+		image->host.resize( image->size );
+		return reinterpret_cast<T *>( image->host.data() );
+	} );
+
+	if ( loaded )
+	{
+		printf( "Texture '%s' (%d x %d px, %0.1f MB) decoded into %s memory.\n", file_name.c_str(),
+			image->width, image->height, image->size / ( 1024.0f * 1024.0f ), image->staging.valid() ? "staging" : "host" );
+	}
+	else
+	{
+		printf( "Texture '%s' not loaded.\n", file_name.c_str() );
+		ring.Cancel( image->staging );
+		image->size = 0;
+	}
+
+	return image;
+}
+
+/*! \fn std::shared_ptr<StagedImage> DecodeStaged( UploadRing & ring, const std::string & file_name, const FloatPacking packing )
+\brief Decodes a float RGB image and converts it to \a packing on the way to the staging memory (safe to call on a worker thread).
+*/
+std::shared_ptr<StagedImage> DecodeStaged( UploadRing & ring, const std::string & file_name, const FloatPacking packing );
+
+/*! \fn std::shared_ptr<StagedImage> DecodeStagedCube( UploadRing & ring, const std::string & file_name, const FloatPacking packing )
+\brief Decodes a latitude-longitude float image and resamples it into six cube faces of width / 4 px (safe to call on a worker thread).
+*/
+std::shared_ptr<StagedImage> DecodeStagedCube( UploadRing & ring, const std::string & file_name, const FloatPacking packing );
+
+#endif
@@ -1,4 +1,5 @@
 #include "pch.h"
+#include <atomic>
 
 using std::mt19937;
 using std::uniform_real_distribution;
@@ -6,7 +7,9 @@ using std::uniform_real_distribution;
 typedef mt19937                                     Engine;
 typedef uniform_real_distribution<float>            Distribution;
 
-auto uniform_generator = std::bind( Distribution( 0.0f, 1.0f ), Engine( 1 ) );
+// every thread draws from its own engine (the first one gets the original seed 1), so Random can be called from worker threads
+static std::atomic<unsigned int> next_seed{ 1 };
+static thread_local auto uniform_generator = std::bind( Distribution( 0.0f, 1.0f ), Engine( next_seed++ ) );
 
 
 float Random( const float range_min, const float range_max )
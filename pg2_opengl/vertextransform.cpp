@@ -0,0 +1,361 @@
+#include "pch.h"
+#include "vertextransform.h"
+#include "simd.h"
+#include "utils.h"
+#include <chrono>
+
+static unsigned char OutCode( const float x, const float y, const float z, const float w, const float guard_band )
+{
+	const float gw = guard_band * w;
+
+	return ( ( x < -w ) ? kClipLeft : 0 ) | ( ( x > w ) ? kClipRight : 0 ) |
+		( ( y < -w ) ? kClipBottom : 0 ) | ( ( y > w ) ? kClipTop : 0 ) |
+		( ( z < -w ) ? kClipNear : 0 ) | ( ( z > w ) ? kClipFar : 0 ) |
+		( ( x < -gw || x > gw || y < -gw || y > gw ) ? kClipGuardBand : 0 );
+}
+
+// every kernel processes whole vectors and returns the number of positions done, the rest is left to the scalar loop
+
+static int TransformPositionsSSE2( const float ( &m )[4][4], const float * x, const float * y, const float * z, const int count,
+	float * clip_x, float * clip_y, float * clip_z, float * clip_w, unsigned char * outcodes, const float guard_band )
+{
+	__m128 r[4][4];
+	for ( int i = 0; i < 4; ++i )
+	{
+		for ( int j = 0; j < 4; ++j )
+		{
+			r[i][j] = _mm_set1_ps( m[i][j] );
+		}
+	}
+	const __m128 g = _mm_set1_ps( guard_band );
+	__m128 bits[7];
+	for ( int b = 0; b < 7; ++b )
+	{
+		bits[b] = _mm_castsi128_ps( _mm_set1_epi32( 1 << b ) );
+	}
+
+	int i = 0;
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		const __m128 px = _mm_loadu_ps( x + i );
+		const __m128 py = _mm_loadu_ps( y + i );
+		const __m128 pz = _mm_loadu_ps( z + i );
+
+		__m128 c[4];
+		for ( int k = 0; k < 4; ++k )
+		{
+			c[k] = _mm_add_ps( _mm_add_ps( _mm_mul_ps( r[k][0], px ), _mm_mul_ps( r[k][1], py ) ),
+				_mm_add_ps( _mm_mul_ps( r[k][2], pz ), r[k][3] ) );
+		}
+		_mm_storeu_ps( clip_x + i, c[0] );
+		_mm_storeu_ps( clip_y + i, c[1] );
+		_mm_storeu_ps( clip_z + i, c[2] );
+		_mm_storeu_ps( clip_w + i, c[3] );
+
+		const __m128 nw = _mm_sub_ps( _mm_setzero_ps(), c[3] );
+		const __m128 gw = _mm_mul_ps( g, c[3] );
+		const __m128 ngw = _mm_sub_ps( _mm_setzero_ps(), gw );
+		__m128 code = _mm_and_ps( _mm_cmplt_ps( c[0], nw ), bits[0] );
+		code = _mm_or_ps( code, _mm_and_ps( _mm_cmpgt_ps( c[0], c[3] ), bits[1] ) );
+		code = _mm_or_ps( code, _mm_and_ps( _mm_cmplt_ps( c[1], nw ), bits[2] ) );
+		code = _mm_or_ps( code, _mm_and_ps( _mm_cmpgt_ps( c[1], c[3] ), bits[3] ) );
+		code = _mm_or_ps( code, _mm_and_ps( _mm_cmplt_ps( c[2], nw ), bits[4] ) );
+		code = _mm_or_ps( code, _mm_and_ps( _mm_cmpgt_ps( c[2], c[3] ), bits[5] ) );
+		const __m128 outside_band = _mm_or_ps( _mm_or_ps( _mm_cmplt_ps( c[0], ngw ), _mm_cmpgt_ps( c[0], gw ) ),
+			_mm_or_ps( _mm_cmplt_ps( c[1], ngw ), _mm_cmpgt_ps( c[1], gw ) ) );
+		code = _mm_or_ps( code, _mm_and_ps( outside_band, bits[6] ) );
+
+		// 32 bit lanes -> bytes
+		__m128i code8 = _mm_packs_epi32( _mm_castps_si128( code ), _mm_castps_si128( code ) );
+		code8 = _mm_packus_epi16( code8, code8 );
+		const int packed = _mm_cvtsi128_si32( code8 );
+		memcpy( outcodes + i, &packed, 4 );
+	}
+
+	return i;
+}
+
+SIMD_TARGET( "avx2,fma" )
+static int TransformPositionsAVX2( const float ( &m )[4][4], const float * x, const float * y, const float * z, const int count,
+	float * clip_x, float * clip_y, float * clip_z, float * clip_w, unsigned char * outcodes, const float guard_band )
+{
+	__m256 r[4][4];
+	for ( int i = 0; i < 4; ++i )
+	{
+		for ( int j = 0; j < 4; ++j )
+		{
+			r[i][j] = _mm256_set1_ps( m[i][j] );
+		}
+	}
+	const __m256 g = _mm256_set1_ps( guard_band );
+	__m256 bits[7];
+	for ( int b = 0; b < 7; ++b )
+	{
+		bits[b] = _mm256_castsi256_ps( _mm256_set1_epi32( 1 << b ) );
+	}
+
+	int i = 0;
+	for ( ; i + 8 <= count; i += 8 )
+	{
+		const __m256 px = _mm256_loadu_ps( x + i );
+		const __m256 py = _mm256_loadu_ps( y + i );
+		const __m256 pz = _mm256_loadu_ps( z + i );
+
+		__m256 c[4];
+		for ( int k = 0; k < 4; ++k )
+		{
+			c[k] = _mm256_fmadd_ps( r[k][0], px, _mm256_fmadd_ps( r[k][1], py, _mm256_fmadd_ps( r[k][2], pz, r[k][3] ) ) );
+		}
+		_mm256_storeu_ps( clip_x + i, c[0] );
+		_mm256_storeu_ps( clip_y + i, c[1] );
+		_mm256_storeu_ps( clip_z + i, c[2] );
+		_mm256_storeu_ps( clip_w + i, c[3] );
+
+		const __m256 nw = _mm256_sub_ps( _mm256_setzero_ps(), c[3] );
+		const __m256 gw = _mm256_mul_ps( g, c[3] );
+		const __m256 ngw = _mm256_sub_ps( _mm256_setzero_ps(), gw );
+		__m256 code = _mm256_and_ps( _mm256_cmp_ps( c[0], nw, _CMP_LT_OQ ), bits[0] );
+		code = _mm256_or_ps( code, _mm256_and_ps( _mm256_cmp_ps( c[0], c[3], _CMP_GT_OQ ), bits[1] ) );
+		code = _mm256_or_ps( code, _mm256_and_ps( _mm256_cmp_ps( c[1], nw, _CMP_LT_OQ ), bits[2] ) );
+		code = _mm256_or_ps( code, _mm256_and_ps( _mm256_cmp_ps( c[1], c[3], _CMP_GT_OQ ), bits[3] ) );
+		code = _mm256_or_ps( code, _mm256_and_ps( _mm256_cmp_ps( c[2], nw, _CMP_LT_OQ ), bits[4] ) );
+		code = _mm256_or_ps( code, _mm256_and_ps( _mm256_cmp_ps( c[2], c[3], _CMP_GT_OQ ), bits[5] ) );
+		const __m256 outside_band = _mm256_or_ps(
+			_mm256_or_ps( _mm256_cmp_ps( c[0], ngw, _CMP_LT_OQ ), _mm256_cmp_ps( c[0], gw, _CMP_GT_OQ ) ),
+			_mm256_or_ps( _mm256_cmp_ps( c[1], ngw, _CMP_LT_OQ ), _mm256_cmp_ps( c[1], gw, _CMP_GT_OQ ) ) );
+		code = _mm256_or_ps( code, _mm256_and_ps( outside_band, bits[6] ) );
+
+		// 32 bit lanes -> bytes, the pack instructions work within 128 bit halves
+		const __m256i code32 = _mm256_castps_si256( code );
+		__m128i code8 = _mm_packs_epi32( _mm256_castsi256_si128( code32 ), _mm256_extracti128_si256( code32, 1 ) );
+		code8 = _mm_packus_epi16( code8, code8 );
+		_mm_storel_epi64( reinterpret_cast<__m128i *>( outcodes + i ), code8 );
+	}
+
+	return i;
+}
+
+SIMD_TARGET( "avx512f" )
+static int TransformPositionsAVX512( const float ( &m )[4][4], const float * x, const float * y, const float * z, const int count,
+	float * clip_x, float * clip_y, float * clip_z, float * clip_w, unsigned char * outcodes, const float guard_band )
+{
+	__m512 r[4][4];
+	for ( int i = 0; i < 4; ++i )
+	{
+		for ( int j = 0; j < 4; ++j )
+		{
+			r[i][j] = _mm512_set1_ps( m[i][j] );
+		}
+	}
+	const __m512 g = _mm512_set1_ps( guard_band );
+
+	int i = 0;
+	for ( ; i + 16 <= count; i += 16 )
+	{
+		const __m512 px = _mm512_loadu_ps( x + i );
+		const __m512 py = _mm512_loadu_ps( y + i );
+		const __m512 pz = _mm512_loadu_ps( z + i );
+
+		__m512 c[4];
+		for ( int k = 0; k < 4; ++k )
+		{
+			c[k] = _mm512_fmadd_ps( r[k][0], px, _mm512_fmadd_ps( r[k][1], py, _mm512_fmadd_ps( r[k][2], pz, r[k][3] ) ) );
+		}
+		_mm512_storeu_ps( clip_x + i, c[0] );
+		_mm512_storeu_ps( clip_y + i, c[1] );
+		_mm512_storeu_ps( clip_z + i, c[2] );
+		_mm512_storeu_ps( clip_w + i, c[3] );
+
+		const __m512 nw = _mm512_sub_ps( _mm512_setzero_ps(), c[3] );
+		const __m512 gw = _mm512_mul_ps( g, c[3] );
+		const __m512 ngw = _mm512_sub_ps( _mm512_setzero_ps(), gw );
+		const __mmask16 planes[7] = {
+			_mm512_cmp_ps_mask( c[0], nw, _CMP_LT_OQ ),
+			_mm512_cmp_ps_mask( c[0], c[3], _CMP_GT_OQ ),
+			_mm512_cmp_ps_mask( c[1], nw, _CMP_LT_OQ ),
+			_mm512_cmp_ps_mask( c[1], c[3], _CMP_GT_OQ ),
+			_mm512_cmp_ps_mask( c[2], nw, _CMP_LT_OQ ),
+			_mm512_cmp_ps_mask( c[2], c[3], _CMP_GT_OQ ),
+			__mmask16( _mm512_cmp_ps_mask( c[0], ngw, _CMP_LT_OQ ) | _mm512_cmp_ps_mask( c[0], gw, _CMP_GT_OQ ) |
+				_mm512_cmp_ps_mask( c[1], ngw, _CMP_LT_OQ ) | _mm512_cmp_ps_mask( c[1], gw, _CMP_GT_OQ ) ) };
+
+		__m512i code = _mm512_setzero_si512();
+		for ( int b = 0; b < 7; ++b )
+		{
+			code = _mm512_mask_or_epi32( code, planes[b], code, _mm512_set1_epi32( 1 << b ) );
+		}
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( outcodes + i ), _mm512_cvtepi32_epi8( code ) );
+	}
+
+	return i;
+}
+
+using TransformKernel = int ( * )( const float ( &m )[4][4], const float *, const float *, const float *, const int,
+	float *, float *, float *, float *, unsigned char *, const float );
+
+// the widest kernel supported by the CPU, selected once
+static TransformKernel SelectTransformKernel( const char ** isa_name = nullptr )
+{
+	static const char * isa = nullptr;
+	static const TransformKernel kernel = [] ()
+	{
+		const CpuFeatures & cpu = CpuFeatures::Get();
+
+		if ( cpu.avx512f )
+		{
+			isa = "AVX-512";
+			return TransformKernel( TransformPositionsAVX512 );
+		}
+
+		if ( cpu.avx2 && cpu.fma )
+		{
+			isa = "AVX2";
+			return TransformKernel( TransformPositionsAVX2 );
+		}
+
+		isa = "SSE2";
+		return TransformKernel( TransformPositionsSSE2 );
+	}();
+
+	if ( isa_name )
+	{
+		*isa_name = isa;
+	}
+
+	return kernel;
+}
+
+void TransformPositions( const Matrix4x4 & m, const float * x, const float * y, const float * z, const int count,
+	float * clip_x, float * clip_y, float * clip_z, float * clip_w, unsigned char * outcodes, const float guard_band )
+{
+	float rows[4][4];
+	for ( int r = 0; r < 4; ++r )
+	{
+		for ( int c = 0; c < 4; ++c )
+		{
+			rows[r][c] = m.get( r, c );
+		}
+	}
+
+	int i = SelectTransformKernel()( rows, x, y, z, count, clip_x, clip_y, clip_z, clip_w, outcodes, guard_band );
+
+	for ( ; i < count; ++i )
+	{
+		clip_x[i] = rows[0][0] * x[i] + rows[0][1] * y[i] + rows[0][2] * z[i] + rows[0][3];
+		clip_y[i] = rows[1][0] * x[i] + rows[1][1] * y[i] + rows[1][2] * z[i] + rows[1][3];
+		clip_z[i] = rows[2][0] * x[i] + rows[2][1] * y[i] + rows[2][2] * z[i] + rows[2][3];
+		clip_w[i] = rows[3][0] * x[i] + rows[3][1] * y[i] + rows[3][2] * z[i] + rows[3][3];
+		outcodes[i] = OutCode( clip_x[i], clip_y[i], clip_z[i], clip_w[i], guard_band );
+	}
+}
+
+const char * TransformPositionsIsa()
+{
+	const char * isa = nullptr;
+	SelectTransformKernel( &isa );
+
+	return isa;
+}
+
+double MeasureTransformThroughput( const int count )
+{
+	std::vector<float> in( size_t( count ) * 3 );
+	for ( float & value : in )
+	{
+		value = Random( -100.0f, 100.0f );
+	}
+	std::vector<float> out( size_t( count ) * 4 );
+	std::vector<unsigned char> outcodes( count );
+
+	// 90 deg perspective projection ( near 1, far 1000 ) looking down -z from ( 0, 0, 150 ), so all the outcodes occur
+	Matrix4x4 m;
+	m.set( 2, 2, -1.002f );
+	m.set( 2, 3, 150.0f * 1.002f - 2.002f );
+	m.set( 3, 2, -1.0f );
+	m.set( 3, 3, 150.0f );
+
+	const float * x = &in[0];
+	const float * y = &in[count];
+	const float * z = &in[size_t( count ) * 2];
+
+	const int repetitions = 16;
+	const auto t0 = std::chrono::high_resolution_clock::now();
+	for ( int r = 0; r < repetitions; ++r )
+	{
+		TransformPositions( m, x, y, z, count, &out[0], &out[count], &out[size_t( count ) * 2], &out[size_t( count ) * 3], outcodes.data() );
+	}
+	const double seconds = std::chrono::duration<double>( std::chrono::high_resolution_clock::now() - t0 ).count();
+
+	return double( count ) * repetitions / seconds;
+}
+
+int ClipTriangle( const ClipVertex * triangle, ClipVertex * polygon, const float guard_band )
+{
+	ClipVertex buffer[2][MAX_CLIPPED_VERTICES];
+	ClipVertex * src = buffer[0];
+	ClipVertex * dst = buffer[1];
+	memcpy( src, triangle, 3 * sizeof( ClipVertex ) );
+	int n = 3;
+
+	// near, left, right, bottom and top plane (the last four at the guard band), d >= 0 is inside
+	for ( int plane = 0; plane < 5 && n > 0; ++plane )
+	{
+		float d[MAX_CLIPPED_VERTICES];
+		int no_inside = 0;
+		for ( int i = 0; i < n; ++i )
+		{
+			const ClipVertex & v = src[i];
+			const float gw = guard_band * v.w;
+			switch ( plane )
+			{
+			case 0: d[i] = v.z + v.w; break;
+			case 1: d[i] = gw + v.x; break;
+			case 2: d[i] = gw - v.x; break;
+			case 3: d[i] = gw + v.y; break;
+			default: d[i] = gw - v.y; break;
+			}
+			no_inside += ( d[i] >= 0.0f );
+		}
+
+		if ( no_inside == n )
+		{
+			continue;
+		}
+
+		int m = 0;
+		for ( int i = 0; i < n; ++i )
+		{
+			const int j = ( i + 1 ) % n;
+
+			if ( d[i] >= 0.0f )
+			{
+				dst[m++] = src[i];
+			}
+
+			if ( ( d[i] >= 0.0f ) != ( d[j] >= 0.0f ) )
+			{
+				// always from the inside vertex, so the neighbour sharing the edge gets exactly the same point
+				const int a = ( d[i] >= 0.0f ) ? i : j;
+				const int b = i + j - a;
+				const float s = d[a] / ( d[a] - d[b] );
+				const float * va = &src[a].x;
+				const float * vb = &src[b].x;
+				float * v = &dst[m++].x;
+				for ( int k = 0; k < 7; ++k )
+				{
+					v[k] = va[k] + s * ( vb[k] - va[k] );
+				}
+			}
+		}
+
+		std::swap( src, dst );
+		n = m;
+	}
+
+	if ( n > 0 )
+	{
+		memcpy( polygon, src, n * sizeof( ClipVertex ) );
+	}
+
+	return n;
+}
@@ -0,0 +1,93 @@
+#ifndef VERTEX_TRANSFORM_H_
+#define VERTEX_TRANSFORM_H_
+
+#include "matrix4x4.h"
+
+/*! \enum ClipCode
+\brief Outcode bits of a clip space position, see TransformPositions.
+*/
+enum ClipCode : unsigned char
+{
+	kClipLeft = 1 << 0, /*!< x < -w */
+	kClipRight = 1 << 1, /*!< x > w */
+	kClipBottom = 1 << 2, /*!< y < -w */
+	kClipTop = 1 << 3, /*!< y > w */
+	kClipNear = 1 << 4, /*!< z < -w */
+	kClipFar = 1 << 5, /*!< z > w */
+	kClipGuardBand = 1 << 6, /*!< |x| or |y| > guard_band * w, the rasterizer cannot take the vertex as it is */
+	kClipFrustum = kClipLeft | kClipRight | kClipBottom | kClipTop | kClipNear | kClipFar,
+};
+
+/*! \def DEFAULT_GUARD_BAND
+\brief Extent of the guard band in units of the viewport half size, triangles inside need no x and y clipping.
+*/
+#define DEFAULT_GUARD_BAND 4.0f
+
+/*! \fn void TransformPositions( const Matrix4x4 & m, const float * x, const float * y, const float * z, const int count, float * clip_x, float * clip_y, float * clip_z, float * clip_w, unsigned char * outcodes, const float guard_band )
+\brief Transforms a batch of positions stored as separate arrays (SoA) and computes their outcodes.
+
+Picks the widest kernel the CPU supports (AVX-512, AVX2 with FMA, SSE2), so the same code runs on
+every machine. The arrays need no particular alignment, output arrays may not alias the input.
+
+std::vector<float> cx( n ), cy( n ), cz( n ), cw( n );
+std::vector<unsigned char> codes( n );
+TransformPositions( mvp, px.data(), py.data(), pz.data(), n, cx.data(), cy.data(), cz.data(), cw.data(), codes.data() );
+
+\param m row major matrix applied to the column vectors ( x, y, z, 1 ).
+\param outcodes bitwise combination of ClipCode for every position.
+*/
+void TransformPositions( const Matrix4x4 & m, const float * x, const float * y, const float * z, const int count,
+	float * clip_x, float * clip_y, float * clip_z, float * clip_w, unsigned char * outcodes,
+	const float guard_band = DEFAULT_GUARD_BAND );
+
+//! Name of the instruction set used by TransformPositions on this CPU.
+const char * TransformPositionsIsa();
+
+/*! \fn double MeasureTransformThroughput( const int count )
+\brief Single-threaded throughput of TransformPositions on \a count random positions (vertices per second of one core).
+*/
+double MeasureTransformThroughput( const int count = 1 << 20 );
+
+/*! \struct ClipVertex
+\brief Clip space position with its barycentric coordinates w.r.t. the source triangle.
+*/
+struct ClipVertex
+{
+	float x, y, z, w;
+	float bary[3];
+};
+
+/*! \fn int ClassifyTriangle( const unsigned char c0, const unsigned char c1, const unsigned char c2 )
+\brief Trivial accept and reject test of a triangle from the outcodes of its vertices.
+
+\return 0 if the triangle lies completely outside one of the frustum planes, 1 if it can be rasterized as it is
+(in front of the near plane and inside the guard band), 2 if it has to go through ClipTriangle.
+*/
+inline int ClassifyTriangle( const unsigned char c0, const unsigned char c1, const unsigned char c2 )
+{
+	if ( c0 & c1 & c2 & kClipFrustum )
+	{
+		return 0;
+	}
+
+	return ( ( c0 | c1 | c2 ) & ( kClipNear | kClipGuardBand ) ) ? 2 : 1;
+}
+
+/*! \def MAX_CLIPPED_VERTICES
+\brief Vertex count limit of a triangle clipped by the near plane and the four guard band planes.
+*/
+#define MAX_CLIPPED_VERTICES 8
+
+/*! \fn int ClipTriangle( const ClipVertex * triangle, ClipVertex * polygon, const float guard_band )
+\brief Clips a triangle against the near plane and the guard band planes (Sutherland-Hodgman).
+
+The new vertices are always interpolated from the inside vertex of an edge, so two triangles sharing an edge
+get bitwise equal vertices on it and stay watertight.
+
+\param triangle three vertices.
+\param polygon at least MAX_CLIPPED_VERTICES vertices of the resulting convex polygon (a triangle fan around polygon[0]).
+\return Number of vertices written to \a polygon, 0 or 3 to MAX_CLIPPED_VERTICES.
+*/
+int ClipTriangle( const ClipVertex * triangle, ClipVertex * polygon, const float guard_band = DEFAULT_GUARD_BAND );
+
+#endif